@@ -0,0 +1,135 @@
+/* Cost of awaiting PIDs in C++ coroutines rather than handling callbacks.
+ *
+ * 32 ECUs are read PID 0xc over and over, one request outstanding to each at a
+ * time, and every request is answered by a single frame straight away. First
+ * the C API: an array of handles, each frame passed to the handle it matches
+ * and a completed handle's request started again. Then a uds::Executor with a
+ * coroutine per ECU looping on co_await read_pid(...). Reports the CPU time
+ * per response of each.
+ */
+#include <uds/uds.h>
+#include <uds/coroutine.hpp>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ECU_COUNT 32
+#define FIRST_ECU_ID 0x100
+// far enough apart that no ECU's response ID is another's request ID
+#define ECU_ID_SPACING 0x10
+#define RESPONSE_OFFSET 0x8
+#define RPM_PID 0xc
+#define ROUNDS 100000
+
+static DiagnosticShims shims;
+static uint32_t response_count;
+static double rpm_total;
+
+static bool send_can(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    return true;
+}
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint32_t ecu_id(int ecu) {
+    return FIRST_ECU_ID + ecu * ECU_ID_SPACING;
+}
+
+static void rpm_frame(int ecu, uint8_t frame[8]) {
+    const uint8_t response[] = {0x4, 0x41, RPM_PID, (uint8_t) ecu, 0x40, 0, 0,
+        0};
+    memcpy(frame, response, sizeof(response));
+}
+
+static void rpm_received(const DiagnosticResponse* response) {
+    ++response_count;
+    rpm_total += diagnostic_decode_obd2_pid(response);
+}
+
+static double run_callbacks() {
+    static DiagnosticRequestHandle handles[ECU_COUNT];
+    DiagnosticRequest requests[ECU_COUNT];
+    for(int i = 0; i < ECU_COUNT; i++) {
+        memset(&requests[i], 0, sizeof(DiagnosticRequest));
+        requests[i].arbitration_id = ecu_id(i);
+        requests[i].mode = OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST;
+        requests[i].has_pid = true;
+        requests[i].pid = RPM_PID;
+        handles[i] = diagnostic_request(&shims, &requests[i], rpm_received);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint8_t frame[8];
+    for(int round = 0; round < ROUNDS; round++) {
+        for(int ecu = 0; ecu < ECU_COUNT; ecu++) {
+            rpm_frame(ecu, frame);
+            uint32_t arbitration_id = ecu_id(ecu) + RESPONSE_OFFSET;
+            for(int i = 0; i < ECU_COUNT; i++) {
+                if(!handles[i].completed && diagnostic_response_id_matches(
+                            &handles[i], arbitration_id)) {
+                    diagnostic_receive_can_frame(&shims, &handles[i],
+                            arbitration_id, frame, sizeof(frame));
+                    if(handles[i].completed) {
+                        handles[i] = diagnostic_request(&shims, &requests[i],
+                                rpm_received);
+                    }
+                }
+            }
+        }
+    }
+    return elapsed_seconds(&start);
+}
+
+static uds::Task<> poll_rpm(uds::Executor& executor, int ecu) {
+    for(;;) {
+        uds::PidResult rpm = co_await executor.read_pid(ecu_id(ecu), RPM_PID);
+        if(rpm) {
+            ++response_count;
+            rpm_total += rpm.value;
+        }
+    }
+}
+
+static double run_coroutines() {
+    static uds::Executor executor(&shims);
+    static uds::Task<> tasks[ECU_COUNT];
+    for(int i = 0; i < ECU_COUNT; i++) {
+        tasks[i] = poll_rpm(executor, i);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint8_t frame[8];
+    for(int round = 0; round < ROUNDS; round++) {
+        for(int ecu = 0; ecu < ECU_COUNT; ecu++) {
+            rpm_frame(ecu, frame);
+            executor.receive_can_frame(ecu_id(ecu) + RESPONSE_OFFSET, frame,
+                    sizeof(frame));
+        }
+    }
+    return elapsed_seconds(&start);
+}
+
+static void report(const char* name, double seconds) {
+    printf("%-12s %9u responses  %6.0f ns/response  (rpm sum %.0f)\n", name,
+            response_count, seconds * 1e9 / response_count, rpm_total);
+    response_count = 0;
+    rpm_total = 0;
+}
+
+int main(void) {
+    shims = diagnostic_init_shims(NULL, send_can, NULL);
+
+    printf("%d ECUs, %d rounds of responses\n", ECU_COUNT, ROUNDS);
+    report("callbacks", run_callbacks());
+    report("coroutines", run_coroutines());
+    return 0;
+}
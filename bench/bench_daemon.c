@@ -0,0 +1,270 @@
+/* Round trip through the daemon's shared memory rings.
+ *
+ * A client sends a DID request through a DiagnosticIpcSegment, the
+ * DiagnosticDaemon sends it to a loopback ECU that answers at once, and the
+ * client reads the response out of its ring. Reports the round trip of
+ * sending the request straight to a DiagnosticRequestScheduler, of the same
+ * through the rings with the client and daemon taking turns in one thread, and
+ * with each spinning in a thread of its own - skipped on a single CPU, where
+ * the two would take turns by the scheduler's time slice instead. The
+ * difference is the cost of the rings.
+ *
+ * Then 4 clients poll the same DID from an ECU that takes 1ms to answer, each
+ * sending its next request as soon as it has a response, for 10 simulated
+ * seconds, and reports how many of their requests went on the bus.
+ */
+#include <uds/uds.h>
+#include <uds/daemon.h>
+#include <uds/ipc.h>
+#include <uds/scheduler.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUND_TRIPS 200000
+#define READ_DID 0xf40d
+#define CLIENT_COUNT 4
+#define ECU_DELAY_US 1000
+#define STEP_US 50
+#define DURATION_US 10000000
+
+static DiagnosticShims shims;
+static DiagnosticIpcSegment segment;
+static DiagnosticDaemon daemon_state;
+static DiagnosticRequestScheduler scheduler;
+static uint32_t latencies_ns[ROUND_TRIPS];
+static uint8_t request_frame[8];
+static bool request_pending;
+static uint32_t request_sent_us;
+static uint64_t bus_request_count;
+static uint32_t simulated_time_us;
+static bool simulated;
+static bool stopping;
+static bool direct_response_received;
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static uint32_t get_time(void) {
+    return simulated ? simulated_time_us : (uint32_t) (now_ns() / 1000);
+}
+
+static bool loopback_send(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    memcpy(request_frame, data, size);
+    request_pending = true;
+    request_sent_us = get_time();
+    ++bus_request_count;
+    return true;
+}
+
+/* The ECU answers the last request, once it's taken ECU_DELAY_US in the
+ * simulated runs.
+ */
+static void answer(void) {
+    if(!request_pending || (simulated &&
+                simulated_time_us - request_sent_us < ECU_DELAY_US)) {
+        return;
+    }
+    request_pending = false;
+    const uint8_t response[8] = {0x5, 0x62, request_frame[2],
+            request_frame[3], 0x12, 0x34};
+    diagnostic_daemon_receive_can_frame(&shims, &daemon_state, 0x7e8,
+            response, sizeof(response));
+}
+
+static void init(void) {
+    shims = diagnostic_init_shims(NULL, loopback_send, NULL);
+    shims.get_time_us = get_time;
+    request_pending = false;
+    bus_request_count = 0;
+    diagnostic_ipc_init_segment(&segment);
+    diagnostic_init_daemon(&daemon_state, &segment);
+}
+
+static DiagnosticRequest did_request(void) {
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x22,
+        has_pid: true,
+        pid: READ_DID,
+        pid_length: 2
+    };
+    return request;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(const char* name, double seconds) {
+    qsort(latencies_ns, ROUND_TRIPS, sizeof(uint32_t), compare_latencies);
+    uint64_t total_ns = 0;
+    for(uint32_t i = 0; i < ROUND_TRIPS; i++) {
+        total_ns += latencies_ns[i];
+    }
+    printf("  %-20s round trip avg %6.2f us, median %6.2f us, p99 %6.2f us, "
+            "%.3f s\n", name, total_ns / 1000.0 / ROUND_TRIPS,
+            latencies_ns[ROUND_TRIPS / 2] / 1000.0,
+            latencies_ns[ROUND_TRIPS * 99 / 100] / 1000.0, seconds);
+}
+
+static void direct_received(const DiagnosticResponse* response) {
+    direct_response_received = true;
+}
+
+static void run_direct(void) {
+    init();
+    diagnostic_init_request_scheduler(&scheduler);
+    DiagnosticRequest request = did_request();
+    const uint8_t response[8] = {0x5, 0x62, READ_DID >> 8, READ_DID & 0xff,
+            0x12, 0x34};
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t i = 0; i < ROUND_TRIPS; i++) {
+        uint64_t sent_ns = now_ns();
+        direct_response_received = false;
+        diagnostic_schedule_request(&shims, &scheduler, &request,
+                DIAGNOSTIC_PRIORITY_NORMAL, direct_received);
+        diagnostic_scheduler_poll(&shims, &scheduler);
+        request_pending = false;
+        diagnostic_scheduler_receive_can_frame(&shims, &scheduler, 0x7e8,
+                response, sizeof(response));
+        if(!direct_response_received) {
+            printf("  direct request got no response\n");
+            return;
+        }
+        latencies_ns[i] = now_ns() - sent_ns;
+    }
+    report("direct:", elapsed_seconds(&start));
+}
+
+static bool read_response(DiagnosticIpcClient* client) {
+    const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+            client);
+    if(response == NULL) {
+        return false;
+    }
+    diagnostic_ipc_release_response(client);
+    return true;
+}
+
+static void run_one_thread(void) {
+    init();
+    DiagnosticIpcClient client;
+    diagnostic_ipc_attach(&client, &segment);
+    DiagnosticRequest request = did_request();
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t i = 0; i < ROUND_TRIPS; i++) {
+        uint64_t sent_ns = now_ns();
+        diagnostic_ipc_submit(&client, &request, DIAGNOSTIC_PRIORITY_NORMAL);
+        do {
+            diagnostic_daemon_poll(&shims, &daemon_state);
+            answer();
+        } while(!read_response(&client));
+        latencies_ns[i] = now_ns() - sent_ns;
+    }
+    report("rings, one thread:", elapsed_seconds(&start));
+}
+
+static void* run_daemon(void* unused) {
+    while(!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        diagnostic_daemon_poll(&shims, &daemon_state);
+        answer();
+    }
+    return NULL;
+}
+
+static void run_two_threads(void) {
+    if(sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        printf("  %-20s skipped, only one CPU\n", "rings, two threads:");
+        return;
+    }
+
+    init();
+    DiagnosticIpcClient client;
+    diagnostic_ipc_attach(&client, &segment);
+    DiagnosticRequest request = did_request();
+    __atomic_store_n(&stopping, false, __ATOMIC_RELEASE);
+    pthread_t daemon_thread;
+    pthread_create(&daemon_thread, NULL, run_daemon, NULL);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t i = 0; i < ROUND_TRIPS; i++) {
+        uint64_t sent_ns = now_ns();
+        diagnostic_ipc_submit(&client, &request, DIAGNOSTIC_PRIORITY_NORMAL);
+        while(!read_response(&client)) {
+        }
+        latencies_ns[i] = now_ns() - sent_ns;
+    }
+    double seconds = elapsed_seconds(&start);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(daemon_thread, NULL);
+    report("rings, two threads:", seconds);
+}
+
+static void run_shared_polls(void) {
+    init();
+    simulated = true;
+    simulated_time_us = 0;
+    DiagnosticIpcClient clients[CLIENT_COUNT];
+    bool outstanding[CLIENT_COUNT] = {false};
+    uint64_t response_count = 0;
+    DiagnosticRequest request = did_request();
+    for(uint8_t i = 0; i < CLIENT_COUNT; i++) {
+        diagnostic_ipc_attach(&clients[i], &segment);
+    }
+
+    for(; simulated_time_us < DURATION_US; simulated_time_us += STEP_US) {
+        for(uint8_t i = 0; i < CLIENT_COUNT; i++) {
+            if(read_response(&clients[i])) {
+                outstanding[i] = false;
+                ++response_count;
+            }
+            if(!outstanding[i]) {
+                outstanding[i] = diagnostic_ipc_submit(&clients[i], &request,
+                        DIAGNOSTIC_PRIORITY_NORMAL) != 0;
+            }
+        }
+        diagnostic_daemon_poll(&shims, &daemon_state);
+        answer();
+    }
+    simulated = false;
+
+    printf("  %u clients polling one DID: %llu responses, %llu requests on "
+            "the bus, %u deduplicated\n", CLIENT_COUNT,
+            (unsigned long long) response_count,
+            (unsigned long long) bus_request_count,
+            daemon_state.deduplicated_count);
+}
+
+int main(void) {
+    printf("daemon: %u round trips to a loopback ECU, and %u clients polling "
+            "an ECU that answers in %u ms\n", ROUND_TRIPS, CLIENT_COUNT,
+            ECU_DELAY_US / 1000);
+    run_direct();
+    run_one_thread();
+    run_two_threads();
+    run_shared_polls();
+    return 0;
+}
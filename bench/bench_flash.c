@@ -0,0 +1,182 @@
+/* A 1 MB flash download on a simulated bus.
+ *
+ * Every frame moves a virtual clock forward by the time it takes on the bus,
+ * so the achieved throughput shows what the RequestDownload / TransferData /
+ * RequestTransferExit sequence loses to flow control, responses and block
+ * turnaround compared to the theoretical limit of back-to-back consecutive
+ * frames. The ECU answers instantly; the host CPU time is reported separately.
+ */
+#include <uds/uds.h>
+#include <uds/flash.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define IMAGE_SIZE (1024 * 1024)
+#define ECU_ID 0x7e0
+#define MAX_PENDING_FRAMES 4
+
+typedef struct {
+    uint8_t data[CAN_FD_MESSAGE_BYTE_SIZE];
+    uint8_t size;
+} Frame;
+
+static Frame pending_frames[MAX_PENDING_FRAMES];
+static int pending_frame_count;
+static uint8_t ecu_message[MAX_DIAGNOSTIC_REQUEST_SIZE];
+static uint16_t ecu_expected_size;
+static uint16_t ecu_received_size;
+static uint32_t ecu_bytes_flashed;
+static bool can_fd;
+static uint32_t bitrate;
+static uint32_t data_bitrate;
+static double bus_time_us;
+
+static uint32_t bus_time(void) {
+    return bus_time_us;
+}
+
+/* The time a frame with an 11-bit ID and the interframe space after it takes
+ * on the bus, ignoring stuff bits.
+ */
+static void advance_bus_time(uint8_t size) {
+    if(!can_fd) {
+        bus_time_us += (47.0 + size * 8) * 1e6 / bitrate;
+    } else {
+        double data_bits = 5 + size * 8 + 4 + (size > 16 ? 21 : 17);
+        bus_time_us += 30.0 * 1e6 / bitrate + data_bits * 1e6 / data_bitrate;
+    }
+}
+
+static void ecu_send(const uint8_t payload[], uint8_t size) {
+    Frame* frame = &pending_frames[pending_frame_count++];
+    memset(frame->data, 0, sizeof(frame->data));
+    frame->data[0] = size;
+    memcpy(&frame->data[1], payload, size);
+    frame->size = 8;
+}
+
+static void ecu_handle_message() {
+    uint8_t response[4] = {ecu_message[0] + 0x40};
+    switch(ecu_message[0]) {
+        case DIAGNOSTIC_REQUEST_DOWNLOAD_MODE:
+            response[1] = 0x20;
+            response[2] = MAX_DIAGNOSTIC_REQUEST_SIZE >> 8;
+            response[3] = MAX_DIAGNOSTIC_REQUEST_SIZE & 0xff;
+            ecu_send(response, 4);
+            break;
+        case DIAGNOSTIC_TRANSFER_DATA_MODE:
+            ecu_bytes_flashed += ecu_expected_size - 2;
+            response[1] = ecu_message[1];
+            ecu_send(response, 2);
+            break;
+        case DIAGNOSTIC_REQUEST_TRANSFER_EXIT_MODE:
+            ecu_send(response, 1);
+            break;
+    }
+}
+
+static bool ecu_receive(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    advance_bus_time(size);
+    uint16_t length;
+    switch(data[0] >> 4) {
+        case 0x0:
+            ecu_expected_size = data[0] & 0xf;
+            if(ecu_expected_size == 0) {
+                // a CAN FD single frame longer than 7 bytes
+                ecu_expected_size = data[1];
+                memcpy(ecu_message, &data[2], ecu_expected_size);
+            } else {
+                memcpy(ecu_message, &data[1], ecu_expected_size);
+            }
+            ecu_handle_message();
+            break;
+        case 0x1:
+            ecu_expected_size = ((data[0] & 0xf) << 8) | data[1];
+            ecu_received_size = size - 2;
+            memcpy(ecu_message, &data[2], ecu_received_size);
+            const uint8_t flow_control[] = {0x30, 0, 0};
+            Frame* frame = &pending_frames[pending_frame_count++];
+            memset(frame->data, 0, sizeof(frame->data));
+            memcpy(frame->data, flow_control, sizeof(flow_control));
+            frame->size = 8;
+            break;
+        case 0x2:
+            length = ecu_expected_size - ecu_received_size;
+            if(length > size - 1) {
+                length = size - 1;
+            }
+            memcpy(&ecu_message[ecu_received_size], &data[1], length);
+            ecu_received_size += length;
+            if(ecu_received_size == ecu_expected_size) {
+                ecu_handle_message();
+            }
+            break;
+    }
+    return true;
+}
+
+static void run(const uint8_t* image) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, ecu_receive, NULL);
+    shims.get_time_us = bus_time;
+    bus_time_us = 0;
+    ecu_bytes_flashed = 0;
+
+    DiagnosticFlashTransfer transfer;
+    diagnostic_init_flash(&transfer, ECU_ID, image, IMAGE_SIZE, 0);
+    transfer.can_fd = can_fd;
+    transfer.bitrate = bitrate;
+    transfer.data_bitrate = data_bitrate;
+
+    clock_t cpu_start = clock();
+    diagnostic_flash_start(&shims, &transfer);
+    while(pending_frame_count > 0 && !diagnostic_flash_completed(&transfer)) {
+        Frame frame = pending_frames[0];
+        memmove(pending_frames, &pending_frames[1],
+                --pending_frame_count * sizeof(Frame));
+        advance_bus_time(frame.size);
+        diagnostic_flash_receive_can_frame(&shims, &transfer, ECU_ID + 0x8,
+                frame.data, frame.size);
+    }
+    double cpu_seconds = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+
+    if(transfer.state != DIAGNOSTIC_FLASH_COMPLETED ||
+            ecu_bytes_flashed != IMAGE_SIZE) {
+        fprintf(stderr, "Download failed\n");
+        exit(1);
+    }
+
+    DiagnosticFlashStatistics statistics = diagnostic_flash_statistics(&shims,
+            &transfer);
+    printf("%-7s %4u/%-4u kbit/s %7u B/s of %7u B/s (%4.1f%%) "
+            "%5.2f s on the bus %6.3f s CPU\n",
+            can_fd ? "CAN FD" : "classic", bitrate / 1000,
+            (data_bitrate != 0 ? data_bitrate : bitrate) / 1000,
+            statistics.bytes_per_second,
+            statistics.theoretical_bytes_per_second,
+            100.0 * statistics.bytes_per_second /
+                statistics.theoretical_bytes_per_second,
+            statistics.elapsed_us / 1e6, cpu_seconds);
+}
+
+int main(void) {
+    uint8_t* image = malloc(IMAGE_SIZE);
+    if(image == NULL) {
+        return 1;
+    }
+    memset(image, 0xa5, IMAGE_SIZE);
+
+    printf("1 MB flash download, simulated bus:\n");
+    can_fd = false;
+    bitrate = 500000;
+    data_bitrate = 0;
+    run(image);
+    can_fd = true;
+    data_bitrate = 2000000;
+    run(image);
+    free(image);
+    return 0;
+}
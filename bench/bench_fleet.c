@@ -0,0 +1,307 @@
+/* A load generator for a fleet of virtual ECUs on a simulated bus.
+ *
+ * The tester keeps one ReadDataByIdentifier request outstanding to every ECU,
+ * so a fleet of thousands means thousands of concurrent requests, and reports
+ * the request rate the library sustains on the host CPU, the latency
+ * percentiles on the simulated bus and the CPU time. Without arguments it runs
+ * a bus-limited and a CPU-limited preset; otherwise:
+ *
+ *     bench_fleet [-e ECUs] [-n requests] [-d response delay us]
+ *         [-r negative response rate] [-l drop rate] [-s DID size]
+ *         [-b bitrate, 0 for an infinitely fast bus] [-t timeout us] [-f]
+ */
+#include <uds/uds.h>
+#include <uds/simulator.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define REQUEST_ID_BASE 0x18000000
+#define READ_DID 0xf190
+// the 0x62 and the DID in front of the value
+#define RESPONSE_HEADER_SIZE 3
+
+typedef struct {
+    const char* name;
+    uint16_t ecu_count;
+    uint32_t request_count;
+    uint32_t response_delay_us;
+    float negative_response_rate;
+    float drop_rate;
+    uint16_t did_size;
+    uint32_t bitrate;
+    uint32_t timeout_us;
+    bool can_fd;
+} FleetConfig;
+
+typedef struct {
+    DiagnosticRequestHandle handle;
+    uint8_t* receive_buffer;
+    uint64_t started_us;
+    bool outstanding;
+    bool timer_pending;
+} Client;
+
+static FleetConfig config;
+static DiagnosticShims shims;
+static Client* clients;
+static uint32_t* latencies_us;
+static uint32_t issued_count;
+static uint32_t response_count;
+static uint32_t success_count;
+static uint32_t timeout_count;
+
+static DiagnosticNegativeResponseCode read_did(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    if(destination_length < config.did_size) {
+        return NRC_RESPONSE_TOO_LONG;
+    }
+    memset(destination, 0xa5, config.did_size);
+    *size = config.did_size;
+    return NRC_SUCCESS;
+}
+
+static const DiagnosticServerDid DIDS[] = {
+    {READ_DID, read_did, NULL, 0}
+};
+
+static void start_next_request(DiagnosticSimulator* simulator,
+        uint16_t index) {
+    Client* client = &clients[index];
+    if(issued_count >= config.request_count) {
+        return;
+    }
+    ++issued_count;
+
+    DiagnosticRequest request = {
+        arbitration_id: REQUEST_ID_BASE + 2 * index,
+        response_arbitration_id: REQUEST_ID_BASE + 2 * index + 1,
+        mode: OBD2_MODE_ENHANCED_DIAGNOSTIC_REQUEST,
+        has_pid: true,
+        pid: READ_DID,
+        pid_length: 2,
+        can_fd: config.can_fd
+    };
+    client->handle = generate_diagnostic_request(&shims, &request, NULL);
+    client->handle.receive_buffer = client->receive_buffer;
+    client->handle.receive_buffer_size = config.did_size +
+            RESPONSE_HEADER_SIZE;
+    client->started_us = diagnostic_simulator_time_us(simulator);
+    client->outstanding = true;
+    start_diagnostic_request(&shims, &client->handle);
+
+    // one timer per client, re-armed when it expires early
+    if(!client->timer_pending) {
+        client->timer_pending = true;
+        diagnostic_simulator_start_timer(simulator, index, config.timeout_us);
+    }
+}
+
+static void tester_received(DiagnosticSimulator* simulator,
+        const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    uint32_t index = (arbitration_id - REQUEST_ID_BASE - 1) / 2;
+    if(arbitration_id <= REQUEST_ID_BASE || index >= config.ecu_count ||
+            !clients[index].outstanding) {
+        return;
+    }
+
+    Client* client = &clients[index];
+    DiagnosticResponse response = diagnostic_receive_can_frame(&shims,
+            &client->handle, arbitration_id, data, size);
+    if(response.completed || client->handle.completed) {
+        client->outstanding = false;
+        latencies_us[response_count++] = diagnostic_simulator_time_us(
+                simulator) - client->started_us;
+        if(response.success) {
+            ++success_count;
+        }
+        start_next_request(simulator, index);
+    }
+}
+
+static void timer_expired(DiagnosticSimulator* simulator, uint32_t index) {
+    Client* client = &clients[index];
+    client->timer_pending = false;
+    if(!client->outstanding) {
+        return;
+    }
+
+    uint64_t elapsed_us = diagnostic_simulator_time_us(simulator) -
+            client->started_us;
+    if(elapsed_us >= config.timeout_us) {
+        client->outstanding = false;
+        ++timeout_count;
+        start_next_request(simulator, index);
+    } else {
+        client->timer_pending = true;
+        diagnostic_simulator_start_timer(simulator, index,
+                config.timeout_us - elapsed_us);
+    }
+}
+
+static int compare_latencies(const void* a, const void* b) {
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return left < right ? -1 : left > right;
+}
+
+static double percentile_ms(double percentile) {
+    if(response_count == 0) {
+        return 0;
+    }
+    uint32_t index = percentile * (response_count - 1) / 100;
+    return latencies_us[index] / 1000.0;
+}
+
+static int run(void) {
+    uint16_t response_size = config.did_size + RESPONSE_HEADER_SIZE;
+    uint16_t transmit_buffer_size = DIAGNOSTIC_TRANSPORT_HEADROOM +
+            response_size + CAN_FD_MESSAGE_BYTE_SIZE;
+    // a whole response can be queued on a busy bus, next to a timer and a
+    // flow control frame
+    uint32_t event_capacity = config.ecu_count * (response_size / 7 + 4);
+    DiagnosticVirtualEcu* ecus = calloc(config.ecu_count,
+            sizeof(DiagnosticVirtualEcu));
+    uint8_t* transmit_buffers = malloc((size_t) config.ecu_count *
+            transmit_buffer_size);
+    uint8_t* receive_buffers = malloc((size_t) config.ecu_count *
+            response_size);
+    DiagnosticSimulatorEvent* events = malloc(event_capacity *
+            sizeof(DiagnosticSimulatorEvent));
+    clients = calloc(config.ecu_count, sizeof(Client));
+    latencies_us = malloc(config.request_count * sizeof(uint32_t));
+    if(ecus == NULL || transmit_buffers == NULL || receive_buffers == NULL ||
+            events == NULL || clients == NULL || latencies_us == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    uint16_t i;
+    for(i = 0; i < config.ecu_count; i++) {
+        DiagnosticVirtualEcu* ecu = &ecus[i];
+        diagnostic_init_virtual_ecu(ecu, REQUEST_ID_BASE + 2 * i,
+                REQUEST_ID_BASE + 2 * i + 1);
+        ecu->response_delay_us = config.response_delay_us;
+        ecu->negative_response_rate = config.negative_response_rate;
+        ecu->drop_rate = config.drop_rate;
+        ecu->server.can_fd = config.can_fd;
+        ecu->server.dids = DIDS;
+        ecu->server.did_count = 1;
+        ecu->server.transmit_buffer = &transmit_buffers[(size_t) i *
+                transmit_buffer_size];
+        ecu->server.transmit_buffer_size = transmit_buffer_size;
+        clients[i].receive_buffer = &receive_buffers[(size_t) i *
+                response_size];
+    }
+
+    DiagnosticSimulator simulator;
+    diagnostic_init_simulator(&simulator, ecus, config.ecu_count, events,
+            event_capacity, 1);
+    simulator.bitrate = config.bitrate;
+    simulator.data_bitrate = config.can_fd && config.bitrate != 0 ?
+            config.bitrate * 4 : 0;
+    simulator.tester = tester_received;
+    simulator.timer_expired = timer_expired;
+    shims = diagnostic_simulator_shims(&simulator, NULL);
+    issued_count = response_count = success_count = timeout_count = 0;
+
+    clock_t cpu_start = clock();
+    for(i = 0; i < config.ecu_count; i++) {
+        start_next_request(&simulator, i);
+    }
+    while(diagnostic_simulator_step(&shims, &simulator));
+    double cpu_seconds = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+    double bus_seconds = diagnostic_simulator_time_us(&simulator) / 1e6;
+
+    uint32_t negative_response_count = 0;
+    for(i = 0; i < config.ecu_count; i++) {
+        negative_response_count += ecus[i].negative_response_count;
+    }
+    qsort(latencies_us, response_count, sizeof(uint32_t), compare_latencies);
+
+    printf("%s: %u ECUs, %u requests, %u byte responses, %s at %u kbit/s\n",
+            config.name, config.ecu_count, config.request_count,
+            response_size, config.can_fd ? "CAN FD" : "classic",
+            config.bitrate / 1000);
+    printf("  %u responses (%u positive, %u injected NRCs), %u timeouts, "
+            "%llu frames, %llu dropped, %llu events overflowed\n",
+            response_count, success_count, negative_response_count,
+            timeout_count,
+            (unsigned long long) simulator.delivered_frame_count,
+            (unsigned long long) simulator.dropped_frame_count,
+            (unsigned long long) simulator.overflowed_event_count);
+    printf("  CPU: %.3f s, %.0f requests/s, %.0f frames/s\n", cpu_seconds,
+            config.request_count / cpu_seconds,
+            simulator.delivered_frame_count / cpu_seconds);
+    if(config.bitrate != 0) {
+        printf("  bus: %.2f s, %.0f requests/s, %.1f%% load\n", bus_seconds,
+                response_count / bus_seconds,
+                100.0 * simulator.bus_busy_us / 1e6 / bus_seconds);
+    }
+    printf("  latency ms: p50 %.2f p90 %.2f p99 %.2f p99.9 %.2f max %.2f\n",
+            percentile_ms(50), percentile_ms(90), percentile_ms(99),
+            percentile_ms(99.9), percentile_ms(100));
+
+    free(ecus);
+    free(transmit_buffers);
+    free(receive_buffers);
+    free(events);
+    free(clients);
+    free(latencies_us);
+    return timeout_count + response_count == config.request_count ? 0 : 1;
+}
+
+int main(int argc, char** argv) {
+    const FleetConfig presets[] = {
+        {"bus-limited", 100, 20000, 1000, 0.01, 0.001, 64, 500000, 2000000,
+            false},
+        {"CPU-limited", 5000, 500000, 1000, 0.01, 0.001, 64, 0, 2000000,
+            false}
+    };
+
+    if(argc == 1) {
+        unsigned int i;
+        for(i = 0; i < sizeof(presets) / sizeof(presets[0]); i++) {
+            config = presets[i];
+            if(run() != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    config = presets[0];
+    config.name = "fleet";
+    int option;
+    while((option = getopt(argc, argv, "e:n:d:r:l:s:b:t:f")) != -1) {
+        switch(option) {
+            case 'e': config.ecu_count = atoi(optarg); break;
+            case 'n': config.request_count = atoi(optarg); break;
+            case 'd': config.response_delay_us = atoi(optarg); break;
+            case 'r': config.negative_response_rate = atof(optarg); break;
+            case 'l': config.drop_rate = atof(optarg); break;
+            case 's': config.did_size = atoi(optarg); break;
+            case 'b': config.bitrate = atoi(optarg); break;
+            case 't': config.timeout_us = atoi(optarg); break;
+            case 'f': config.can_fd = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-e ECUs] [-n requests] "
+                        "[-d response delay us] [-r negative response rate] "
+                        "[-l drop rate] [-s DID size] [-b bitrate] "
+                        "[-t timeout us] [-f]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(config.ecu_count == 0 || config.request_count == 0 ||
+            config.did_size + RESPONSE_HEADER_SIZE >
+                MAX_DIAGNOSTIC_REQUEST_SIZE) {
+        fprintf(stderr, "Invalid configuration\n");
+        return 1;
+    }
+    return run();
+}
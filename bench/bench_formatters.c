@@ -0,0 +1,160 @@
+/* Cost of formatting responses and requests for logging.
+ *
+ * Formats the same responses - OBD-II PIDs, negative responses and a VIN - and
+ * requests with diagnostic_response_to_string(...) and
+ * diagnostic_request_to_string(...), and with the chained snprintf(...) calls
+ * they used to be, and reports the nanoseconds per string of each.
+ */
+#include <uds/uds.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define STRING_COUNT 5000000
+#define RESPONSE_KINDS 16
+
+static DiagnosticResponse responses[RESPONSE_KINDS];
+static const uint8_t VIN[] = "WBA12345678901234";
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* The response formatter as it was, always writing 7 payload bytes.
+ */
+static void snprintf_response_to_string(const DiagnosticResponse* response,
+        char* destination, size_t destination_length) {
+    int bytes_used = snprintf(destination, destination_length,
+            "arb_id: 0x%lx, mode: 0x%x, ",
+            (unsigned long) response->arbitration_id,
+            response->mode);
+    if(response->has_pid) {
+        bytes_used += snprintf(destination + bytes_used,
+                destination_length - bytes_used, "pid: 0x%x, ",
+                response->pid);
+    }
+    if(!response->success) {
+        bytes_used += snprintf(destination + bytes_used,
+                destination_length - bytes_used, "nrc: 0x%x, ",
+                response->negative_response_code);
+    }
+    if(response->payload_length > 0) {
+        snprintf(destination + bytes_used, destination_length - bytes_used,
+                "payload: 0x%02x%02x%02x%02x%02x%02x%02x",
+                response->payload[0], response->payload[1],
+                response->payload[2], response->payload[3],
+                response->payload[4], response->payload[5],
+                response->payload[6]);
+    } else {
+        snprintf(destination + bytes_used, destination_length - bytes_used,
+                "no payload");
+    }
+}
+
+static void snprintf_request_to_string(const DiagnosticRequest* request,
+        char* destination, size_t destination_length) {
+    int bytes_used = snprintf(destination, destination_length,
+            "arb_id: 0x%lx, mode: 0x%x, ",
+            (unsigned long) request->arbitration_id, request->mode);
+    if(request->has_pid) {
+        bytes_used += snprintf(destination + bytes_used,
+                destination_length - bytes_used, "pid: 0x%x, ", request->pid);
+    }
+    if(request->payload_length > 0) {
+        snprintf(destination + bytes_used, destination_length - bytes_used,
+                "payload: 0x%02x%02x%02x%02x%02x%02x%02x",
+                request->payload[0], request->payload[1],
+                request->payload[2], request->payload[3],
+                request->payload[4], request->payload[5],
+                request->payload[6]);
+    } else {
+        snprintf(destination + bytes_used, destination_length - bytes_used,
+                "no payload");
+    }
+}
+
+static void build_responses(void) {
+    unsigned int i;
+    for(i = 0; i < RESPONSE_KINDS; i++) {
+        DiagnosticResponse* response = &responses[i];
+        response->completed = true;
+        response->success = i % 8 != 7;
+        response->has_pid = true;
+        response->arbitration_id = 0x7e8 + i % 3;
+        response->mode = 0x1;
+        response->pid = 0xc + i % 4;
+        if(!response->success) {
+            response->negative_response_code = NRC_REQUEST_OUT_OF_RANGE;
+        } else if(i == RESPONSE_KINDS - 2) {
+            response->arbitration_id = 0x18daf110;
+            response->mode = 0x22;
+            response->pid = 0xf190;
+            response->payload_length = MAX_UDS_RESPONSE_PAYLOAD_LENGTH;
+            memcpy(response->payload, VIN, response->payload_length);
+        } else {
+            response->payload[0] = i;
+            response->payload[1] = i * 7;
+            response->payload_length = 2;
+        }
+    }
+}
+
+int main(void) {
+    build_responses();
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf40c
+    };
+    char line[128];
+    uint64_t checksum = 0;
+    uint32_t i;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < STRING_COUNT; i++) {
+        snprintf_response_to_string(&responses[i % RESPONSE_KINDS], line,
+                sizeof(line));
+        checksum += line[20];
+    }
+    double old_response_seconds = elapsed_seconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < STRING_COUNT; i++) {
+        checksum += diagnostic_response_to_string(
+                &responses[i % RESPONSE_KINDS], line, sizeof(line));
+    }
+    double response_seconds = elapsed_seconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < STRING_COUNT; i++) {
+        request.pid = 0xf400 + i % 64;
+        snprintf_request_to_string(&request, line, sizeof(line));
+        checksum += line[20];
+    }
+    double old_request_seconds = elapsed_seconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < STRING_COUNT; i++) {
+        request.pid = 0xf400 + i % 64;
+        checksum += diagnostic_request_to_string(&request, line, sizeof(line));
+    }
+    double request_seconds = elapsed_seconds(&start);
+
+    printf("formatters: %u strings each (checksum %llu)\n", STRING_COUNT,
+            (unsigned long long) checksum);
+    printf("  response: snprintf %5.1f ns, hand written %5.1f ns "
+            "(%.1fx faster)\n", old_response_seconds * 1e9 / STRING_COUNT,
+            response_seconds * 1e9 / STRING_COUNT,
+            old_response_seconds / response_seconds);
+    printf("  request:  snprintf %5.1f ns, hand written %5.1f ns "
+            "(%.1fx faster)\n", old_request_seconds * 1e9 / STRING_COUNT,
+            request_seconds * 1e9 / STRING_COUNT,
+            old_request_seconds / request_seconds);
+    return 0;
+}
@@ -0,0 +1,111 @@
+/* Round trips and bus frames to read a set of DIDs one at a time compared to
+ * several per ReadDataByIdentifier request.
+ *
+ * Reads 24 DIDs of 1 to 4 bytes from one ECU on classic CAN, first with one
+ * request per DID and then with requests from
+ * diagnostic_multi_did_request(...), counting the request/response round
+ * trips and the ISO-TP frames each puts on the bus. Then reports the
+ * nanoseconds to split and decode one whole response with
+ * diagnostic_parse_multi_did_response(...).
+ */
+#include <uds/uds.h>
+#include <uds/did.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define DID_COUNT 24
+#define DIDS_PER_REQUEST 8
+#define PARSE_COUNT 5000000
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* The classic CAN frames to send a PDU of 'size' bytes, including the flow
+ * control frame from the receiver if it takes more than one.
+ */
+static uint32_t frame_count(uint16_t size) {
+    if(size <= 7) {
+        return 1;
+    }
+    return 2 + (size - 6 + 6) / 7;
+}
+
+int main(void) {
+    DiagnosticDidRegistry registry;
+    diagnostic_init_did_registry(&registry, DIDS_PER_REQUEST, 4095);
+    uint16_t dids[DID_COUNT];
+    uint8_t i;
+    for(i = 0; i < DID_COUNT; i++) {
+        dids[i] = 0xf400 + i;
+        diagnostic_register_did(&registry, dids[i], 1 + i % 4, NULL);
+    }
+
+    uint32_t single_round_trips = 0;
+    uint32_t single_frames = 0;
+    for(i = 0; i < DID_COUNT; i++) {
+        single_round_trips++;
+        single_frames += frame_count(3) +
+                frame_count(3 + diagnostic_lookup_did(&registry,
+                            dids[i])->length);
+    }
+
+    uint32_t multi_round_trips = 0;
+    uint32_t multi_frames = 0;
+    DiagnosticMultiDidPayload payload;
+    DiagnosticRequest request;
+    uint8_t response_pdu[4095];
+    uint16_t response_size = 0;
+    uint8_t start = 0;
+    while(start < DID_COUNT) {
+        uint8_t count = diagnostic_multi_did_request(&registry, 0x7e0,
+                &dids[start], DID_COUNT - start, &payload, &request);
+        response_size = 1;
+        response_pdu[0] = 0x62;
+        for(i = start; i < start + count; i++) {
+            uint8_t j;
+            response_pdu[response_size++] = dids[i] >> 8;
+            response_pdu[response_size++] = dids[i];
+            for(j = 0; j < diagnostic_lookup_did(&registry, dids[i])->length;
+                    j++) {
+                response_pdu[response_size++] = i + j;
+            }
+        }
+        multi_round_trips++;
+        multi_frames += frame_count(1 + count * 2) +
+                frame_count(response_size);
+        start += count;
+    }
+
+    // parse the last response, of the last DIDS_PER_REQUEST DIDs
+    DiagnosticShims shims = diagnostic_init_shims(NULL, NULL, NULL);
+    DiagnosticRequestHandle handle = generate_diagnostic_request(&shims,
+            &request, NULL);
+    DiagnosticResponse response = diagnostic_receive_pdu(&shims, &handle,
+            0x7e8, response_pdu, response_size);
+    DiagnosticDidValue values[DIDS_PER_REQUEST];
+    double sum = 0;
+    uint32_t k;
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for(k = 0; k < PARSE_COUNT; k++) {
+        uint8_t count = diagnostic_parse_multi_did_response(&registry,
+                &response, values, DIDS_PER_REQUEST);
+        sum += values[k % count].value;
+    }
+    double parse_seconds = elapsed_seconds(&start_time);
+
+    printf("multi DID: %u DIDs, up to %u per request (checksum %.0f)\n",
+            DID_COUNT, DIDS_PER_REQUEST, sum);
+    printf("  one per request: %3u round trips, %3u frames\n",
+            single_round_trips, single_frames);
+    printf("  multi DID:       %3u round trips, %3u frames\n",
+            multi_round_trips, multi_frames);
+    printf("  parse: %5.1f ns per response of %u DIDs\n",
+            parse_seconds * 1e9 / PARSE_COUNT, DIDS_PER_REQUEST);
+    return 0;
+}
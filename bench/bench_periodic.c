@@ -0,0 +1,132 @@
+/* Bus load of polling a telemetry set compared to periodic subscriptions.
+ *
+ * Reads the same set of DIDs for one simulated minute, once by polling each
+ * of them with ReadDataByIdentifier and once by subscribing to them with
+ * ReadDataByPeriodicIdentifier, and counts the CAN frames and bits each puts
+ * on the bus. Then reports the nanoseconds to demultiplex one periodic frame
+ * with diagnostic_periodic_receive_can_frame(...).
+ */
+#include <uds/uds.h>
+#include <uds/periodic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define DID_COUNT 12
+#define SAMPLES_PER_SECOND 10
+#define SECONDS 60
+#define DISPATCH_COUNT 20000000
+
+// an 11-bit classic frame with 8 data bytes, without stuff bits
+#define FRAME_BITS 111
+
+static uint64_t bus_frames;
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool count_frame(const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    ++bus_frames;
+    return true;
+}
+
+static void sample_received(DiagnosticPeriodicReceiver* receiver,
+        uint16_t did, const uint8_t data[], uint8_t size) {
+    *(uint64_t*)receiver->context += data[0];
+}
+
+static uint64_t poll(void) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, count_frame, NULL);
+    uint8_t response[8] = {0x5, 0x62, 0xf4, 0x00, 0x12, 0x34, 0x0, 0x0};
+    uint32_t sample;
+    uint8_t i;
+    bus_frames = 0;
+    for(sample = 0; sample < SAMPLES_PER_SECOND * SECONDS; sample++) {
+        for(i = 0; i < DID_COUNT; i++) {
+            DiagnosticRequest request = {
+                arbitration_id: 0x7e0,
+                mode: 0x22,
+                has_pid: true,
+                pid: 0xf400 + i
+            };
+            DiagnosticRequestHandle handle = diagnostic_request(&shims,
+                    &request, NULL);
+            response[3] = i;
+            diagnostic_receive_can_frame(&shims, &handle, 0x7e8, response,
+                    sizeof(response));
+            ++bus_frames;
+        }
+    }
+    return bus_frames;
+}
+
+static uint64_t subscribe(DiagnosticPeriodicReceiver* receiver) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, count_frame, NULL);
+    uint8_t frame[8] = {0x00, 0x12, 0x34};
+    uint32_t sample;
+    uint8_t i;
+    bus_frames = 0;
+
+    DiagnosticRequest request;
+    diagnostic_periodic_request(receiver, 0x7e0, DIAGNOSTIC_PERIODIC_RATE_FAST,
+            &request);
+    diagnostic_request(&shims, &request, NULL);
+    ++bus_frames;
+    for(sample = 0; sample < SAMPLES_PER_SECOND * SECONDS; sample++) {
+        for(i = 0; i < DID_COUNT; i++) {
+            frame[0] = i;
+            diagnostic_periodic_receive_can_frame(receiver, 0x5e8, frame,
+                    sizeof(frame));
+            ++bus_frames;
+        }
+    }
+    diagnostic_periodic_stop_request(0x7e0, 0, &request);
+    diagnostic_request(&shims, &request, NULL);
+    ++bus_frames;
+    return bus_frames;
+}
+
+int main(void) {
+    uint64_t checksum = 0;
+    DiagnosticPeriodicReceiver receiver;
+    diagnostic_init_periodic_receiver(&receiver, 0x7e8, 0x5e8);
+    receiver.context = &checksum;
+    uint8_t i;
+    for(i = 0; i < DID_COUNT; i++) {
+        diagnostic_periodic_subscribe(&receiver,
+                DIAGNOSTIC_PERIODIC_DID_BASE + i, DIAGNOSTIC_PERIODIC_RATE_FAST,
+                sample_received);
+    }
+
+    uint64_t polled_frames = poll();
+    uint64_t periodic_frames = subscribe(&receiver);
+
+    uint8_t frame[8] = {0x00, 0x12, 0x34};
+    uint32_t j;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(j = 0; j < DISPATCH_COUNT; j++) {
+        frame[0] = j % DID_COUNT;
+        diagnostic_periodic_receive_can_frame(&receiver, 0x5e8, frame,
+                sizeof(frame));
+    }
+    double dispatch_seconds = elapsed_seconds(&start);
+
+    printf("periodic: %u DIDs at %u Hz for %u s (checksum %llu)\n", DID_COUNT,
+            SAMPLES_PER_SECOND, SECONDS, (unsigned long long) checksum);
+    printf("  polling:  %7llu frames, %5.1f kbit/s\n",
+            (unsigned long long) polled_frames,
+            polled_frames * FRAME_BITS / 1e3 / SECONDS);
+    printf("  periodic: %7llu frames, %5.1f kbit/s (%.0f%% of polling)\n",
+            (unsigned long long) periodic_frames,
+            periodic_frames * FRAME_BITS / 1e3 / SECONDS,
+            100.0 * periodic_frames / polled_frames);
+    printf("  dispatch: %5.1f ns per periodic frame\n",
+            dispatch_seconds * 1e9 / DISPATCH_COUNT);
+    return 0;
+}
@@ -0,0 +1,145 @@
+/* Responses recovered when every ECU answers a functional request at once.
+ *
+ * 8 ECUs answer a 29-bit functional ReadDataByIdentifier with 200 byte
+ * responses whose consecutive frames interleave at random on the bus, 10000
+ * times. Compares a handle with a single receive buffer, which can only
+ * reassemble one node's message at a time, with a handle given a
+ * DiagnosticReassembler, and reports the responses received and nanoseconds
+ * per frame of each.
+ */
+#include <uds/uds.h>
+#include <uds/reassembly.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ECU_COUNT 8
+#define ROUND_COUNT 10000
+#define RESPONSE_SIZE 200
+#define MAX_FRAMES 32
+#define STREAM_BUFFER_SIZE 256
+
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t frames[MAX_FRAMES][8];
+    uint8_t frame_count;
+} Ecu;
+
+static Ecu ecus[ECU_COUNT];
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool drop_frame(const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    return true;
+}
+
+static void prepare_responses(void) {
+    uint8_t message[RESPONSE_SIZE] = {0x62, 0xf1, 0x90};
+    for(uint16_t i = 3; i < RESPONSE_SIZE; i++) {
+        message[i] = i;
+    }
+    for(uint8_t ecu = 0; ecu < ECU_COUNT; ecu++) {
+        Ecu* responder = &ecus[ecu];
+        responder->arbitration_id = DIAGNOSTIC_NORMAL_FIXED_ID(0xf1,
+                0x10 + ecu);
+        memset(responder->frames, 0, sizeof(responder->frames));
+        responder->frames[0][0] = 0x10 | (RESPONSE_SIZE >> 8);
+        responder->frames[0][1] = RESPONSE_SIZE & 0xff;
+        memcpy(&responder->frames[0][2], message, 6);
+        uint16_t sent = 6;
+        uint8_t count = 1;
+        while(sent < RESPONSE_SIZE) {
+            uint16_t chunk = RESPONSE_SIZE - sent > 7 ? 7 :
+                    RESPONSE_SIZE - sent;
+            responder->frames[count][0] = 0x20 | (count & 0xf);
+            memcpy(&responder->frames[count][1], &message[sent], chunk);
+            sent += chunk;
+            ++count;
+        }
+        responder->frame_count = count;
+    }
+}
+
+/* Feed the same random interleavings of every ECU's frames to the handle,
+ * returning the number of complete responses.
+ */
+static uint32_t run(DiagnosticShims* shims, DiagnosticRequestHandle* handle,
+        uint64_t* frame_count) {
+    uint32_t responses = 0;
+    srand(1);
+    for(uint32_t round = 0; round < ROUND_COUNT; round++) {
+        uint8_t next_frame[ECU_COUNT] = {0};
+        uint8_t remaining = ECU_COUNT;
+        while(remaining > 0) {
+            uint8_t ecu = rand() % ECU_COUNT;
+            if(next_frame[ecu] == ecus[ecu].frame_count) {
+                continue;
+            }
+            DiagnosticResponse response = diagnostic_receive_can_frame(shims,
+                    handle, ecus[ecu].arbitration_id,
+                    ecus[ecu].frames[next_frame[ecu]++], 8);
+            ++*frame_count;
+            if(response.completed && response.success) {
+                ++responses;
+            }
+            if(next_frame[ecu] == ecus[ecu].frame_count) {
+                --remaining;
+            }
+        }
+    }
+    return responses;
+}
+
+int main(void) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, drop_frame, NULL);
+    DiagnosticRequest request = {
+        arbitration_id: OBD2_FUNCTIONAL_BROADCAST_EXTENDED_ID,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        pid_length: 2,
+        addressing: DIAGNOSTIC_ADDRESSING_NORMAL_FIXED
+    };
+    prepare_responses();
+
+    static uint8_t receive_buffer[4095];
+    DiagnosticRequestHandle handle = diagnostic_request(&shims, &request,
+            NULL);
+    handle.receive_buffer = receive_buffer;
+    handle.receive_buffer_size = sizeof(receive_buffer);
+    uint64_t single_frames = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t single_responses = run(&shims, &handle, &single_frames);
+    double single_seconds = elapsed_seconds(&start);
+
+    static uint8_t stream_buffers[ECU_COUNT * STREAM_BUFFER_SIZE];
+    DiagnosticReassembler reassembler;
+    diagnostic_init_reassembler(&reassembler, stream_buffers,
+            sizeof(stream_buffers), ECU_COUNT);
+    handle = diagnostic_request(&shims, &request, NULL);
+    handle.reassembler = &reassembler;
+    uint64_t reassembler_frames = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t reassembler_responses = run(&shims, &handle,
+            &reassembler_frames);
+    double reassembler_seconds = elapsed_seconds(&start);
+
+    printf("reassembly: %u ECUs answering %u functional requests with %u "
+            "byte responses\n", ECU_COUNT, ROUND_COUNT, RESPONSE_SIZE);
+    printf("  single receiver: %6u of %u responses, %5.1f ns/frame\n",
+            single_responses, ECU_COUNT * ROUND_COUNT,
+            single_seconds * 1e9 / single_frames);
+    printf("  reassembler:     %6u of %u responses, %5.1f ns/frame\n",
+            reassembler_responses, ECU_COUNT * ROUND_COUNT,
+            reassembler_seconds * 1e9 / reassembler_frames);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/* Offline throughput of the trace replay engine.
+ *
+ * Writes a synthetic candump log of OBD-II and UDS traffic mixed with
+ * unrelated frames, maps it and replays it as fast as the CPU allows,
+ * reporting the throughput in MB/s, frames/s and transactions/s. Without
+ * arguments the trace is generated in /tmp and removed afterwards; otherwise:
+ *
+ *     bench_replay [candump log]
+ */
+#include <uds/uds.h>
+#include <uds/replay.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRANSACTION_COUNT 500000
+// the 0x62 and the DID in front of the value
+#define RESPONSE_HEADER_SIZE 3
+#define DID_SIZE 17
+
+static uint64_t checksum;
+
+static void transaction_completed(DiagnosticReplay* replay,
+        const DiagnosticSnifferTransaction* transaction) {
+    // use the decoded response so none of the work can be skipped
+    checksum += transaction->response.pid +
+            transaction->response.full_payload_length;
+}
+
+static void print_frame(FILE* file, uint64_t timestamp_us, uint32_t id,
+        const uint8_t data[], int size) {
+    fprintf(file, "(%llu.%06u) can0 %0*X#",
+            (unsigned long long) (timestamp_us / 1000000),
+            (unsigned) (timestamp_us % 1000000), id > 0x7ff ? 8 : 3, id);
+    int i;
+    for(i = 0; i < size; i++) {
+        fprintf(file, "%02X", data[i]);
+    }
+    fputc('\n', file);
+}
+
+static bool write_trace(const char* path) {
+    FILE* file = fopen(path, "w");
+    if(file == NULL) {
+        return false;
+    }
+
+    uint64_t timestamp_us = 1436509052000000ULL;
+    uint32_t i;
+    for(i = 0; i < TRANSACTION_COUNT; i++) {
+        uint8_t ecu = i % 8;
+        uint8_t other[8] = {i, i >> 8, i >> 16, 0, 0, 0, 0, 0};
+        print_frame(file, timestamp_us, 0x123, other, 8);
+        timestamp_us += 250;
+
+        if(i % 2 == 0) {
+            // an OBD-II PID in single frames
+            uint8_t request[8] = {0x2, 0x1, 0xc};
+            uint8_t response[8] = {0x4, 0x41, 0xc, i, i >> 8};
+            print_frame(file, timestamp_us, 0x7e0 + ecu, request, 8);
+            timestamp_us += 2000;
+            print_frame(file, timestamp_us, 0x7e8 + ecu, response, 8);
+        } else {
+            // a UDS DID in a first frame and two consecutive frames
+            uint8_t request[8] = {0x3, 0x22, 0xf1, 0x90};
+            uint8_t flow_control[8] = {0x30};
+            uint8_t first[8] = {0x10, RESPONSE_HEADER_SIZE + DID_SIZE, 0x62,
+                0xf1, 0x90, 'W', 'B', 'A'};
+            uint8_t second[8] = {0x21, '1', '2', '3', '4', '5', '6', '7'};
+            uint8_t third[8] = {0x22, '8', '9', '0', '1', '2', '3', '4'};
+            print_frame(file, timestamp_us, 0x18da00f1 | (ecu << 8), request,
+                    8);
+            timestamp_us += 2000;
+            print_frame(file, timestamp_us, 0x18daf100 | ecu, first, 8);
+            timestamp_us += 500;
+            print_frame(file, timestamp_us, 0x18da00f1 | (ecu << 8),
+                    flow_control, 3);
+            timestamp_us += 500;
+            print_frame(file, timestamp_us, 0x18daf100 | ecu, second, 8);
+            timestamp_us += 500;
+            print_frame(file, timestamp_us, 0x18daf100 | ecu, third, 8);
+        }
+        timestamp_us += 250;
+    }
+    return fclose(file) == 0;
+}
+
+int main(int argc, char** argv) {
+    char generated_path[] = "/tmp/uds-c-bench-trace-XXXXXX";
+    const char* path = argc > 1 ? argv[1] : generated_path;
+    if(argc == 1) {
+        int fd = mkstemp(generated_path);
+        if(fd < 0 || close(fd) != 0 || !write_trace(generated_path)) {
+            fprintf(stderr, "Unable to write a trace to /tmp\n");
+            return 1;
+        }
+    }
+
+    size_t size;
+    const char* trace = diagnostic_replay_map_trace(path, &size);
+    if(trace == NULL) {
+        fprintf(stderr, "Unable to map %s\n", path);
+        return 1;
+    }
+
+    DiagnosticReplay replay;
+    diagnostic_init_replay(&replay, trace, size);
+    replay.transaction_completed = transaction_completed;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    diagnostic_replay_run(&replay);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("replay: %.1f MB, %llu frames, %llu requests, %llu transactions, "
+            "%llu malformed lines\n", size / 1e6,
+            (unsigned long long) replay.frame_count,
+            (unsigned long long) replay.sniffer.request_count,
+            (unsigned long long) replay.sniffer.transaction_count,
+            (unsigned long long) replay.malformed_line_count);
+    printf("  %.3f s, %.0f MB/s, %.0f frames/s, %.0f transactions/s "
+            "(checksum %llu)\n", seconds, size / 1e6 / seconds,
+            replay.frame_count / seconds,
+            replay.sniffer.transaction_count / seconds,
+            (unsigned long long) checksum);
+
+    diagnostic_replay_unmap_trace(trace, size);
+    if(argc == 1) {
+        remove(generated_path);
+        return replay.sniffer.transaction_count == TRANSACTION_COUNT ? 0 : 1;
+    }
+    return 0;
+}
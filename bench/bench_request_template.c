@@ -0,0 +1,101 @@
+/* Cost of issuing polled requests with and without precompiled templates.
+ *
+ * Polls a fixed set of OBD-II and enhanced PIDs the usual way, with
+ * diagnostic_request_pid(...) building, encoding and setting up a new request
+ * every time, by restarting a generated handle with
+ * start_diagnostic_request(...), and with
+ * diagnostic_start_request_template(...), and reports the nanoseconds per
+ * request of each.
+ */
+#include <uds/uds.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define REQUEST_COUNT 5000000
+#define PID_COUNT 8
+
+static const struct {
+    DiagnosticPidRequestType type;
+    uint32_t arbitration_id;
+    uint16_t pid;
+} POLLED_PIDS[PID_COUNT] = {
+    {DIAGNOSTIC_STANDARD_PID, 0x7e0, 0xc},
+    {DIAGNOSTIC_STANDARD_PID, 0x7e0, 0xd},
+    {DIAGNOSTIC_STANDARD_PID, 0x7e0, 0x5},
+    {DIAGNOSTIC_STANDARD_PID, 0x7e0, 0x11},
+    {DIAGNOSTIC_STANDARD_PID, OBD2_FUNCTIONAL_BROADCAST_ID, 0x2f},
+    {DIAGNOSTIC_ENHANCED_PID, 0x7e0, 0xf40c},
+    {DIAGNOSTIC_ENHANCED_PID, 0x7e1, 0x1940},
+    {DIAGNOSTIC_ENHANCED_PID, 0x7e1, 0x221e}
+};
+
+static uint64_t frame_count;
+static uint64_t checksum;
+
+static bool count_frame(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    ++frame_count;
+    checksum += arbitration_id + data[1] + size;
+    return true;
+}
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, count_frame, NULL);
+    static DiagnosticRequestHandle handles[PID_COUNT];
+    static DiagnosticRequestTemplate templates[PID_COUNT];
+    uint32_t i;
+    for(i = 0; i < PID_COUNT; i++) {
+        DiagnosticRequest request = {
+            arbitration_id: POLLED_PIDS[i].arbitration_id,
+            mode: POLLED_PIDS[i].type == DIAGNOSTIC_STANDARD_PID ? 0x1 : 0x22,
+            has_pid: true,
+            pid: POLLED_PIDS[i].pid
+        };
+        handles[i] = generate_diagnostic_request(&shims, &request, NULL);
+        diagnostic_init_request_template(&templates[i], &handles[i]);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < REQUEST_COUNT; i++) {
+        uint32_t index = i % PID_COUNT;
+        handles[index] = diagnostic_request_pid(&shims,
+                POLLED_PIDS[index].type, POLLED_PIDS[index].arbitration_id,
+                POLLED_PIDS[index].pid, NULL);
+    }
+    double request_seconds = elapsed_seconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < REQUEST_COUNT; i++) {
+        start_diagnostic_request(&shims, &handles[i % PID_COUNT]);
+    }
+    double restart_seconds = elapsed_seconds(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < REQUEST_COUNT; i++) {
+        diagnostic_start_request_template(&shims, &templates[i % PID_COUNT],
+                &handles[i % PID_COUNT]);
+    }
+    double template_seconds = elapsed_seconds(&start);
+
+    printf("request templates: %u requests of %u PIDs, %llu frames "
+            "(checksum %llu)\n", REQUEST_COUNT, PID_COUNT,
+            (unsigned long long) frame_count, (unsigned long long) checksum);
+    printf("  diagnostic_request_pid:            %6.1f ns/request\n",
+            request_seconds * 1e9 / REQUEST_COUNT);
+    printf("  start_diagnostic_request:          %6.1f ns/request\n",
+            restart_seconds * 1e9 / REQUEST_COUNT);
+    printf("  diagnostic_start_request_template: %6.1f ns/request "
+            "(%.1fx faster)\n", template_seconds * 1e9 / REQUEST_COUNT,
+            request_seconds / template_seconds);
+    return 0;
+}
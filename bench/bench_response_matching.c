@@ -0,0 +1,98 @@
+/* Cost of extracting PIDs and numeric payloads from responses.
+ *
+ * Extracts a 2 byte PID and 1 to 4 byte payloads from response payloads with
+ * the generic get_bitfield(...) and with the byte aligned loads the library
+ * now uses, then reports the cost of matching and parsing a whole enhanced PID
+ * response with diagnostic_receive_pdu(...) and
+ * diagnostic_payload_to_integer(...).
+ */
+#include <uds/uds.h>
+#include <uds/extract.h>
+#include <bitfield/bitfield.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ITERATIONS 20000000
+#define PAYLOAD_KINDS 16
+
+static uint8_t payloads[PAYLOAD_KINDS][8];
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(void) {
+    uint32_t i;
+    for(i = 0; i < PAYLOAD_KINDS; i++) {
+        payloads[i][0] = 0x62;
+        payloads[i][1] = 0xf4;
+        payloads[i][2] = i;
+        payloads[i][3] = i * 3;
+        payloads[i][4] = i * 5;
+        payloads[i][5] = i * 7;
+        payloads[i][6] = i * 11;
+    }
+
+    // the volatile sums keep the extractions from being optimized away
+    volatile uint64_t checksum = 0;
+    uint64_t sum = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ITERATIONS; i++) {
+        const uint8_t* payload = payloads[i % PAYLOAD_KINDS];
+        uint8_t byte_count = 1 + i % 4;
+        sum += get_bitfield(payload, 7, 8, 16);
+        sum += get_bitfield(&payload[3], 4, 0, byte_count * 8);
+    }
+    checksum += sum;
+    double bitfield_seconds = elapsed_seconds(&start);
+
+    sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ITERATIONS; i++) {
+        const uint8_t* payload = payloads[i % PAYLOAD_KINDS];
+        uint8_t byte_count = 1 + i % 4;
+        sum += diagnostic_extract_field(payload, 7, 8, 16);
+        sum += diagnostic_extract_field(&payload[3], 4, 0, byte_count * 8);
+    }
+    checksum += sum;
+    double aligned_seconds = elapsed_seconds(&start);
+
+    DiagnosticShims shims = diagnostic_init_shims(NULL, NULL, NULL);
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf400,
+        pid_length: 2
+    };
+    DiagnosticRequestHandle handle = generate_diagnostic_request(&shims,
+            &request, NULL);
+    sum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < ITERATIONS; i++) {
+        const uint8_t* payload = payloads[i % PAYLOAD_KINDS];
+        handle.completed = false;
+        handle.request.pid = 0xf400 | payload[2];
+        DiagnosticResponse response = diagnostic_receive_pdu(&shims, &handle,
+                0x7e8, payload, 4 + i % 4);
+        sum += diagnostic_payload_to_integer(&response);
+    }
+    checksum += sum;
+    double response_seconds = elapsed_seconds(&start);
+
+    printf("response matching: %u iterations (checksum %llu)\n", ITERATIONS,
+            (unsigned long long) checksum);
+    printf("  PID and payload, get_bitfield: %5.1f ns\n",
+            bitfield_seconds * 1e9 / ITERATIONS);
+    printf("  PID and payload, aligned:      %5.1f ns (%.1fx faster)\n",
+            aligned_seconds * 1e9 / ITERATIONS,
+            bitfield_seconds / aligned_seconds);
+    printf("  whole enhanced PID response:   %5.1f ns\n",
+            response_seconds * 1e9 / ITERATIONS);
+    return 0;
+}
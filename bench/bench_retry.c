@@ -0,0 +1,188 @@
+/* Bus time wasted on ECUs that are asleep or busy.
+ *
+ * On a simulated 500 kbit/s bus, a tester polls 16 ECUs for a DID every 100ms
+ * for 60 simulated seconds. Two of the ECUs are asleep and never answer, and
+ * two are busy for 2 seconds out of every 4, answering "busy, repeat request"
+ * (NRC 0x21). Compares resending a failed request at once with a
+ * DiagnosticRequestScheduler with the default retry policy and circuit
+ * breakers, and reports the requests sent, those that got no positive
+ * response, the polls answered, the bus load and the CPU time of each.
+ */
+#include <uds/uds.h>
+#include <uds/retry.h>
+#include <uds/scheduler.h>
+#include <uds/simulator.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ECU_COUNT 16
+#define ASLEEP_ECUS 2
+#define BUSY_ECUS 2
+#define READ_DID 0xf190
+#define POLL_INTERVAL_US 100000
+#define BUSY_PERIOD_US 2000000
+#define DURATION_US 60000000
+#define BITRATE 500000
+#define EVENT_CAPACITY 256
+#define BUSY_TIMER ECU_COUNT
+
+static DiagnosticShims shims;
+static DiagnosticSimulator simulator;
+static DiagnosticVirtualEcu ecus[ECU_COUNT];
+static DiagnosticRequestScheduler scheduler;
+static DiagnosticRetryPolicy policy;
+static DiagnosticCircuitBreakers breakers;
+static bool resend_at_once;
+static bool outstanding[ECU_COUNT];
+static bool busy;
+static uint64_t request_count;
+static uint32_t answered_count;
+static SendCanMessageShim send_to_bus;
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static DiagnosticNegativeResponseCode read_did(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    memset(destination, 0xa5, 4);
+    *size = 4;
+    return NRC_SUCCESS;
+}
+
+static const DiagnosticServerDid DIDS[] = {
+    {READ_DID, read_did, NULL, 0}
+};
+
+static bool count_request(const uint32_t arbitration_id,
+        const uint8_t* data, const uint8_t size) {
+    ++request_count;
+    return send_to_bus(arbitration_id, data, size);
+}
+
+static void response_received(const DiagnosticResponse* response);
+
+static void poll_ecu(uint16_t index) {
+    DiagnosticRequest request = {
+        arbitration_id: 0x700 + index,
+        response_arbitration_id: 0x780 + index,
+        mode: 0x22,
+        has_pid: true,
+        pid: READ_DID,
+        pid_length: 2
+    };
+    outstanding[index] = diagnostic_schedule_request(&shims, &scheduler,
+            &request, DIAGNOSTIC_PRIORITY_NORMAL, response_received) != NULL;
+}
+
+static void response_received(const DiagnosticResponse* response) {
+    uint16_t index = response->arbitration_id >= 0x780 ?
+            response->arbitration_id - 0x780 :
+            response->arbitration_id - 0x700;
+    outstanding[index] = false;
+    if(response->success) {
+        ++answered_count;
+    } else if(resend_at_once &&
+            diagnostic_simulator_time_us(&simulator) < DURATION_US) {
+        poll_ecu(index);
+    }
+}
+
+static void tester_received(DiagnosticSimulator* simulator,
+        const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    diagnostic_scheduler_receive_can_frame(&shims, &scheduler, arbitration_id,
+            data, size);
+}
+
+static void timer_expired(DiagnosticSimulator* simulator, uint32_t timer_id) {
+    if(diagnostic_simulator_time_us(simulator) >= DURATION_US) {
+        return;
+    }
+
+    if(timer_id == BUSY_TIMER) {
+        busy = !busy;
+        for(uint16_t i = ASLEEP_ECUS; i < ASLEEP_ECUS + BUSY_ECUS; i++) {
+            ecus[i].negative_response_rate = busy ? 1 : 0;
+        }
+        diagnostic_simulator_start_timer(simulator, BUSY_TIMER,
+                BUSY_PERIOD_US);
+        return;
+    }
+
+    if(!outstanding[timer_id]) {
+        poll_ecu(timer_id);
+    }
+    diagnostic_scheduler_poll(&shims, &scheduler);
+    diagnostic_simulator_start_timer(simulator, timer_id, POLL_INTERVAL_US);
+}
+
+static void run(bool at_once, const char* name) {
+    static DiagnosticSimulatorEvent events[EVENT_CAPACITY];
+    for(uint16_t i = 0; i < ECU_COUNT; i++) {
+        diagnostic_init_virtual_ecu(&ecus[i], 0x700 + i, 0x780 + i);
+        ecus[i].response_delay_us = 1000;
+        ecus[i].server.dids = DIDS;
+        ecus[i].server.did_count = 1;
+        ecus[i].drop_rate = i < ASLEEP_ECUS ? 1 : 0;
+    }
+
+    diagnostic_init_simulator(&simulator, ecus, ECU_COUNT, events,
+            EVENT_CAPACITY, 1);
+    simulator.bitrate = BITRATE;
+    simulator.tester = tester_received;
+    simulator.timer_expired = timer_expired;
+    shims = diagnostic_simulator_shims(&simulator, NULL);
+    send_to_bus = shims.send_can_message;
+    shims.send_can_message = count_request;
+
+    resend_at_once = at_once;
+    memset(outstanding, 0, sizeof(outstanding));
+    busy = false;
+    request_count = answered_count = 0;
+    diagnostic_init_request_scheduler(&scheduler);
+    if(!at_once) {
+        diagnostic_init_retry_policy(&policy);
+        diagnostic_init_circuit_breakers(&breakers);
+        scheduler.retry_policy = &policy;
+        scheduler.circuit_breakers = &breakers;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint16_t i = 0; i < ECU_COUNT; i++) {
+        // spread the polls out over the interval
+        diagnostic_simulator_start_timer(&simulator, i,
+                POLL_INTERVAL_US * i / ECU_COUNT + 1);
+    }
+    diagnostic_simulator_start_timer(&simulator, BUSY_TIMER, BUSY_PERIOD_US);
+    while(diagnostic_simulator_step(&shims, &simulator)) {
+        diagnostic_scheduler_poll(&shims, &scheduler);
+    }
+    double seconds = elapsed_seconds(&start);
+
+    uint32_t poll_count = ECU_COUNT * (DURATION_US / POLL_INTERVAL_US);
+    printf("  %-16s %7llu requests, %6llu unanswered, %5u of %u polls "
+            "answered, %4.1f%% bus load, %.3f s CPU\n", name,
+            (unsigned long long) request_count,
+            (unsigned long long) (request_count - answered_count),
+            answered_count, poll_count,
+            100.0 * simulator.bus_busy_us / diagnostic_simulator_time_us(
+                &simulator), seconds);
+}
+
+int main(void) {
+    printf("retry: %u ECUs polled every %u ms for %u s at %u kbit/s, %u "
+            "asleep and %u busy half the time\n", ECU_COUNT,
+            POLL_INTERVAL_US / 1000, DURATION_US / 1000000, BITRATE / 1000,
+            ASLEEP_ECUS, BUSY_ECUS);
+    run(true, "resend at once:");
+    run(false, "retry policy:");
+    return 0;
+}
@@ -0,0 +1,322 @@
+/* Latency of urgent requests sharing the bus with a bulk transfer.
+ *
+ * On a simulated 500 kbit/s bus, one ECU is read a 4000 byte DID over and over
+ * - a DTC dump, say - while another is polled for a 2 byte DID every 10ms, for
+ * 10 simulated seconds. Compares a single first come, first served queue with
+ * a DiagnosticRequestScheduler that sends the poll at high priority, first
+ * without preemption and then pausing the dump between blocks of 8 frames, and
+ * reports the polls answered and their latency, the dumps completed and the
+ * CPU time of each. Polls are skipped while the queue is full.
+ *
+ * The simulated bus sends frames in the order they were ready, like an ECU with
+ * a deep transmit queue, so an ECU sending a block of consecutive frames holds
+ * up every frame behind it - and without preemption, a block is the rest of
+ * the dump.
+ *
+ * That makes priorities alone worse than the FIFO queue: about 170 of 999
+ * polls answered, at about 925ms. The scheduler sends each poll beside the
+ * dump instead of after it, so the poll's response waits out the rest of the
+ * dump's 127ms burst, about 60ms on average. With one request in flight per
+ * ECU, that's one poll every 60ms. The scheduler fills up with polls, the
+ * rest are skipped, and the queued ones wait for 16 round trips. The FIFO
+ * queue waits for each dump to finish and then answers every queued poll on
+ * a quiet bus. Preemption breaks the burst into blocks, so a poll only waits
+ * for the current block.
+ */
+#include <uds/uds.h>
+#include <uds/scheduler.h>
+#include <uds/simulator.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define DUMP_ECU_ID 0x7e0
+#define POLL_ECU_ID 0x7e1
+#define RESPONSE_OFFSET 0x8
+#define DUMP_DID 0x1900
+#define POLL_DID 0xf40c
+#define DUMP_SIZE 4000
+// the 0x62 and the DID in front of the value
+#define RESPONSE_HEADER_SIZE 3
+#define POLL_INTERVAL_US 10000
+#define DURATION_US 10000000
+#define BITRATE 500000
+#define MAX_QUEUED 64
+#define EVENT_CAPACITY 1024
+#define POLL_TIMER 0
+
+typedef enum {
+    MODE_FIFO,
+    MODE_PRIORITY,
+    MODE_PREEMPTION
+} Mode;
+
+typedef struct {
+    uint32_t arbitration_id;
+    uint16_t did;
+} QueuedRequest;
+
+typedef struct {
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+} Latency;
+
+static Mode mode;
+static DiagnosticShims shims;
+static DiagnosticSimulator simulator;
+static uint8_t receive_buffer[DUMP_SIZE + RESPONSE_HEADER_SIZE];
+static bool dump_outstanding;
+static uint32_t dump_count;
+// when each poll in flight was due, oldest first - the polls of the one ECU
+// are answered in order
+static uint64_t poll_due_us[MAX_QUEUED];
+static uint8_t poll_due_head;
+static uint8_t poll_due_count;
+static uint64_t next_poll_due_us;
+static Latency poll_latency;
+
+// the first come, first served queue, one request at a time
+static QueuedRequest queue[MAX_QUEUED];
+static uint8_t queue_head;
+static uint8_t queue_length;
+static DiagnosticRequestHandle fifo_handle;
+static bool fifo_outstanding;
+
+static DiagnosticRequestScheduler scheduler;
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static DiagnosticNegativeResponseCode read_did(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    uint16_t value_size = did == DUMP_DID ? DUMP_SIZE : 2;
+    if(destination_length < value_size) {
+        return NRC_RESPONSE_TOO_LONG;
+    }
+    memset(destination, 0xa5, value_size);
+    *size = value_size;
+    return NRC_SUCCESS;
+}
+
+static const DiagnosticServerDid DIDS[] = {
+    {DUMP_DID, read_did, NULL, 0},
+    {POLL_DID, read_did, NULL, 0}
+};
+
+static DiagnosticRequest did_request(uint32_t arbitration_id, uint16_t did) {
+    DiagnosticRequest request = {
+        arbitration_id: arbitration_id,
+        mode: 0x22,
+        has_pid: true,
+        pid: did,
+        pid_length: 2
+    };
+    return request;
+}
+
+static void add_latency(Latency* latency, uint32_t latency_us) {
+    ++latency->count;
+    latency->total_us += latency_us;
+    if(latency_us > latency->max_us) {
+        latency->max_us = latency_us;
+    }
+}
+
+static void start_next_fifo_request(void) {
+    if(fifo_outstanding || queue_length == 0) {
+        return;
+    }
+    QueuedRequest* next = &queue[queue_head];
+    DiagnosticRequest request = did_request(next->arbitration_id, next->did);
+    fifo_handle = generate_diagnostic_request(&shims, &request, NULL);
+    if(next->did == DUMP_DID) {
+        fifo_handle.receive_buffer = receive_buffer;
+        fifo_handle.receive_buffer_size = sizeof(receive_buffer);
+    }
+    fifo_outstanding = true;
+    start_diagnostic_request(&shims, &fifo_handle);
+}
+
+static void dump_received(const DiagnosticResponse* response) {
+    dump_outstanding = false;
+    if(response->success) {
+        ++dump_count;
+    }
+}
+
+static void poll_received(const DiagnosticResponse* response) {
+    if(poll_due_count == 0) {
+        return;
+    }
+    uint64_t due_us = poll_due_us[poll_due_head];
+    poll_due_head = (poll_due_head + 1) % MAX_QUEUED;
+    --poll_due_count;
+    if(response->success) {
+        add_latency(&poll_latency,
+                diagnostic_simulator_time_us(&simulator) - due_us);
+    }
+}
+
+static bool queue_request(uint32_t arbitration_id, uint16_t did) {
+    if(mode == MODE_FIFO) {
+        if(queue_length == MAX_QUEUED) {
+            return false;
+        }
+        QueuedRequest* request = &queue[(queue_head + queue_length++) %
+                MAX_QUEUED];
+        request->arbitration_id = arbitration_id;
+        request->did = did;
+        start_next_fifo_request();
+        return true;
+    }
+
+    DiagnosticRequest request = did_request(arbitration_id, did);
+    DiagnosticRequestHandle* handle = diagnostic_schedule_request(&shims,
+            &scheduler, &request, did == DUMP_DID ?
+                DIAGNOSTIC_PRIORITY_LOW : DIAGNOSTIC_PRIORITY_HIGH,
+            did == DUMP_DID ? dump_received : poll_received);
+    if(handle != NULL && did == DUMP_DID) {
+        handle->receive_buffer = receive_buffer;
+        handle->receive_buffer_size = sizeof(receive_buffer);
+    }
+    diagnostic_scheduler_poll(&shims, &scheduler);
+    return handle != NULL;
+}
+
+static void queue_dump(void) {
+    if(!dump_outstanding &&
+            diagnostic_simulator_time_us(&simulator) < DURATION_US) {
+        dump_outstanding = queue_request(DUMP_ECU_ID, DUMP_DID);
+    }
+}
+
+static void tester_received(DiagnosticSimulator* simulator,
+        const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    if(mode != MODE_FIFO) {
+        diagnostic_scheduler_receive_can_frame(&shims, &scheduler,
+                arbitration_id, data, size);
+        queue_dump();
+        return;
+    }
+
+    if(!fifo_outstanding) {
+        return;
+    }
+    DiagnosticResponse response = diagnostic_receive_can_frame(&shims,
+            &fifo_handle, arbitration_id, data, size);
+    if(!fifo_handle.completed) {
+        return;
+    }
+
+    QueuedRequest* request = &queue[queue_head];
+    queue_head = (queue_head + 1) % MAX_QUEUED;
+    --queue_length;
+    fifo_outstanding = false;
+    if(request->did == DUMP_DID) {
+        dump_received(&response);
+    } else {
+        poll_received(&response);
+    }
+    queue_dump();
+    start_next_fifo_request();
+}
+
+/* Queue every poll that's due. The simulated bus sends frames in the order
+ * they were ready, so the timer fires late behind a burst of consecutive
+ * frames, and latency is counted from when the poll was due.
+ */
+static void timer_expired(DiagnosticSimulator* simulator, uint32_t timer_id) {
+    uint64_t now = diagnostic_simulator_time_us(simulator);
+    while(next_poll_due_us <= now && next_poll_due_us < DURATION_US) {
+        // a poll is skipped if the queue is full
+        poll_due_us[(poll_due_head + poll_due_count) % MAX_QUEUED] =
+                next_poll_due_us;
+        next_poll_due_us += POLL_INTERVAL_US;
+        if(poll_due_count < MAX_QUEUED &&
+                queue_request(POLL_ECU_ID, POLL_DID)) {
+            ++poll_due_count;
+        }
+    }
+    if(next_poll_due_us < DURATION_US) {
+        diagnostic_simulator_start_timer(simulator, POLL_TIMER,
+                next_poll_due_us > now ? next_poll_due_us - now : 1);
+    }
+}
+
+static uint32_t get_time(void) {
+    return diagnostic_simulator_time_us(&simulator);
+}
+
+static void run(Mode run_mode, const char* name) {
+    static DiagnosticVirtualEcu ecus[2];
+    static uint8_t transmit_buffer[DIAGNOSTIC_TRANSPORT_HEADROOM +
+            DUMP_SIZE + RESPONSE_HEADER_SIZE + CAN_FD_MESSAGE_BYTE_SIZE];
+    static DiagnosticSimulatorEvent events[EVENT_CAPACITY];
+    diagnostic_init_virtual_ecu(&ecus[0], DUMP_ECU_ID,
+            DUMP_ECU_ID + RESPONSE_OFFSET);
+    diagnostic_init_virtual_ecu(&ecus[1], POLL_ECU_ID,
+            POLL_ECU_ID + RESPONSE_OFFSET);
+    for(uint8_t i = 0; i < 2; i++) {
+        ecus[i].response_delay_us = 1000;
+        ecus[i].server.dids = DIDS;
+        ecus[i].server.did_count = 2;
+    }
+    ecus[0].server.transmit_buffer = transmit_buffer;
+    ecus[0].server.transmit_buffer_size = sizeof(transmit_buffer);
+
+    diagnostic_init_simulator(&simulator, ecus, 2, events, EVENT_CAPACITY, 1);
+    simulator.bitrate = BITRATE;
+    simulator.tester = tester_received;
+    simulator.timer_expired = timer_expired;
+    shims = diagnostic_simulator_shims(&simulator, NULL);
+    shims.get_time_us = get_time;
+
+    mode = run_mode;
+    dump_outstanding = false;
+    dump_count = 0;
+    queue_head = queue_length = 0;
+    fifo_outstanding = false;
+    poll_due_head = poll_due_count = 0;
+    next_poll_due_us = POLL_INTERVAL_US;
+    memset(&poll_latency, 0, sizeof(poll_latency));
+    diagnostic_init_request_scheduler(&scheduler);
+    if(mode == MODE_PRIORITY) {
+        scheduler.preemption_block_size = 0;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    queue_dump();
+    diagnostic_simulator_start_timer(&simulator, POLL_TIMER, POLL_INTERVAL_US);
+    while(diagnostic_simulator_step(&shims, &simulator)) {
+        if(mode != MODE_FIFO) {
+            diagnostic_scheduler_poll(&shims, &scheduler);
+        }
+    }
+    double seconds = elapsed_seconds(&start);
+
+    printf("  %-12s %4u of %u polls answered, latency avg %7.2f ms, "
+            "max %7.2f ms, %3u dumps, %.3f s CPU\n", name, poll_latency.count,
+            DURATION_US / POLL_INTERVAL_US - 1,
+            poll_latency.count == 0 ? 0 :
+                poll_latency.total_us / 1000.0 / poll_latency.count,
+            poll_latency.max_us / 1000.0, dump_count, seconds);
+}
+
+int main(void) {
+    printf("scheduler: a %u byte DID dump from one ECU and a poll of another "
+            "every %u ms, %u s at %u kbit/s\n", DUMP_SIZE,
+            POLL_INTERVAL_US / 1000, DURATION_US / 1000000, BITRATE / 1000);
+    run(MODE_FIFO, "FIFO queue:");
+    run(MODE_PRIORITY, "priority:");
+    run(MODE_PREEMPTION, "preemption:");
+    return 0;
+}
@@ -0,0 +1,205 @@
+/* Round trips and key computations to unlock an ECU on every reconnect.
+ *
+ * A tester reconnects to an ECU 1000 times and unlocks it each time. The ECU
+ * (an in-process DiagnosticServer with a fixed seed) keeps its unlock across
+ * most reconnects and is reset before every 4th. Compares the hand-sequenced
+ * exchange - always requestSeed, compute the key and sendKey - with a
+ * DiagnosticSecurityAccess, which skips the key for the zero seed of an
+ * unlocked ECU and reuses the key for a seed it has seen, and reports the
+ * exchanges, key computations and CPU time of each.
+ */
+#include <uds/uds.h>
+#include <uds/security.h>
+#include <uds/server.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RECONNECT_COUNT 1000
+#define RESET_INTERVAL 4
+// rounds of the stand-in for an expensive OEM key algorithm
+#define KEY_ROUNDS 200000
+#define KEY_SIZE 4
+#define QUEUE_SIZE 16
+
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t data[CAN_FD_MESSAGE_BYTE_SIZE];
+    uint8_t size;
+} Frame;
+
+static Frame queue[QUEUE_SIZE];
+static uint8_t queue_length;
+static uint32_t key_computations;
+static uint8_t expected_key[KEY_SIZE];
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Queue sent frames instead of delivering them right away, so neither side
+ * receives a frame while it is still sending.
+ */
+static bool queue_frame(const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    if(queue_length == QUEUE_SIZE) {
+        return false;
+    }
+    Frame* frame = &queue[queue_length++];
+    frame->arbitration_id = arbitration_id;
+    memcpy(frame->data, data, size);
+    frame->size = size;
+    return true;
+}
+
+static void compute_key(const uint8_t seed[], uint8_t key[]) {
+    uint32_t state = (seed[0] << 24) | (seed[1] << 16) | (seed[2] << 8) |
+            seed[3];
+    for(uint32_t i = 0; i < KEY_ROUNDS; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+    }
+    key[0] = state >> 24;
+    key[1] = state >> 16;
+    key[2] = state >> 8;
+    key[3] = state;
+    ++key_computations;
+}
+
+static bool generate_seed(DiagnosticServer* server, uint8_t level,
+        uint8_t seed[], uint8_t* size) {
+    const uint8_t fixed_seed[] = {0x12, 0x34, 0x56, 0x78};
+    memcpy(seed, fixed_seed, sizeof(fixed_seed));
+    *size = sizeof(fixed_seed);
+    return true;
+}
+
+static bool validate_key(DiagnosticServer* server, uint8_t level,
+        const uint8_t seed[], uint8_t seed_size, const uint8_t key[],
+        uint16_t key_size) {
+    return key_size == KEY_SIZE && !memcmp(key, expected_key, KEY_SIZE);
+}
+
+static bool algorithm(DiagnosticSecurityAccess* access, uint8_t level,
+        const uint8_t seed[], uint8_t seed_size, uint8_t key[],
+        uint8_t* key_size) {
+    compute_key(seed, key);
+    *key_size = KEY_SIZE;
+    return true;
+}
+
+/* Deliver queued frames until the bus is quiet, returning the last response
+ * the tester received.
+ */
+static DiagnosticResponse deliver(DiagnosticShims* shims,
+        DiagnosticServer* server, DiagnosticRequestHandle* handle,
+        DiagnosticSecurityAccess* access) {
+    DiagnosticResponse response = {0};
+    while(queue_length > 0) {
+        Frame frame = queue[0];
+        memmove(queue, &queue[1], --queue_length * sizeof(Frame));
+        if(frame.arbitration_id == server->request_arbitration_id) {
+            diagnostic_server_receive_can_frame(shims, server,
+                    frame.arbitration_id, frame.data, frame.size);
+        } else if(handle != NULL) {
+            response = diagnostic_receive_can_frame(shims, handle,
+                    frame.arbitration_id, frame.data, frame.size);
+        } else {
+            diagnostic_security_receive_can_frame(shims, access,
+                    frame.arbitration_id, frame.data, frame.size);
+        }
+    }
+    return response;
+}
+
+static uint32_t hand_sequenced(DiagnosticShims* shims,
+        DiagnosticServer* server) {
+    uint32_t exchanges = 0;
+    for(uint32_t i = 0; i < RECONNECT_COUNT; i++) {
+        if(i % RESET_INTERVAL == 0) {
+            server->security_level = 0;
+        }
+        DiagnosticRequest seed_request = {
+            arbitration_id: 0x7e0,
+            mode: DIAGNOSTIC_SECURITY_ACCESS_MODE,
+            has_pid: true,
+            pid: 0x1,
+            pid_length: 1
+        };
+        DiagnosticRequestHandle handle = diagnostic_request(shims,
+                &seed_request, NULL);
+        DiagnosticResponse response = deliver(shims, server, &handle, NULL);
+        ++exchanges;
+
+        DiagnosticRequest key_request = {
+            arbitration_id: 0x7e0,
+            mode: DIAGNOSTIC_SECURITY_ACCESS_MODE,
+            has_pid: true,
+            pid: 0x2,
+            pid_length: 1,
+            payload_length: KEY_SIZE
+        };
+        compute_key(response.payload, key_request.payload);
+        handle = diagnostic_request(shims, &key_request, NULL);
+        deliver(shims, server, &handle, NULL);
+        ++exchanges;
+    }
+    return exchanges;
+}
+
+static uint32_t managed(DiagnosticShims* shims, DiagnosticServer* server) {
+    DiagnosticSecurityAccess access;
+    diagnostic_init_security_access(&access, 0x7e0);
+    diagnostic_security_register_algorithm(&access, 1, algorithm);
+    for(uint32_t i = 0; i < RECONNECT_COUNT; i++) {
+        if(i % RESET_INTERVAL == 0) {
+            server->security_level = 0;
+        }
+        // a reconnecting tester doesn't know if the ECU is still unlocked
+        diagnostic_security_lock(&access);
+        diagnostic_security_unlock(shims, &access, 1);
+        deliver(shims, server, NULL, &access);
+        if(access.state != DIAGNOSTIC_SECURITY_UNLOCKED) {
+            printf("  unlock %u failed\n", i);
+        }
+    }
+    return access.exchange_count;
+}
+
+int main(void) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, queue_frame, NULL);
+    DiagnosticServer server;
+    diagnostic_init_server(&server, 0x7e0, 0x7e8);
+    server.seed_generator = generate_seed;
+    server.key_validator = validate_key;
+    server.session = DIAGNOSTIC_EXTENDED_SESSION;
+    uint8_t seed[MAX_DIAGNOSTIC_SECURITY_SEED_SIZE];
+    uint8_t seed_size;
+    generate_seed(&server, 1, seed, &seed_size);
+    compute_key(seed, expected_key);
+    key_computations = 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t hand_exchanges = hand_sequenced(&shims, &server);
+    double hand_seconds = elapsed_seconds(&start);
+    uint32_t hand_computations = key_computations;
+
+    key_computations = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t managed_exchanges = managed(&shims, &server);
+    double managed_seconds = elapsed_seconds(&start);
+
+    printf("security access: %u reconnects, ECU reset every %u\n",
+            RECONNECT_COUNT, RESET_INTERVAL);
+    printf("  hand sequenced: %5u exchanges, %5u keys computed, %6.1f ms\n",
+            hand_exchanges, hand_computations, hand_seconds * 1e3);
+    printf("  security access: %4u exchanges, %5u keys computed, %6.1f ms\n",
+            managed_exchanges, key_computations, managed_seconds * 1e3);
+    return 0;
+}
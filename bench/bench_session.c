@@ -0,0 +1,138 @@
+/* Keep-alive frames and cost of keeping diagnostic sessions open.
+ *
+ * Keeps an extended session open with 8 ECUs for 10 simulated minutes while
+ * the application talks to each of them at a different rate, from every
+ * 750ms to every 6s. Compares a timer sending TesterPresent (with a response)
+ * every 2 seconds through diagnostic_request(...), as a separate keep-alive
+ * thread would, with the session manager, which only sends suppressed
+ * TesterPresent requests to ECUs that had no other traffic. Then reports the
+ * nanoseconds per keep-alive sent each way.
+ */
+#include <uds/uds.h>
+#include <uds/session.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ECU_COUNT 8
+#define STEP_US 10000
+#define DURATION_US 600000000u
+#define KEEP_ALIVE_INTERVAL_US 2000000
+#define SEND_COUNT 5000000
+
+static uint32_t current_time_us;
+static uint64_t sent_frames;
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool count_frame(const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    ++sent_frames;
+    return true;
+}
+
+static uint32_t get_time(void) {
+    return current_time_us;
+}
+
+static uint32_t application_period_us(uint8_t ecu) {
+    return (ecu + 1) * 750000;
+}
+
+static uint64_t timer_keep_alive_frames(void) {
+    // every request and its response
+    return (uint64_t) ECU_COUNT * 2 * (DURATION_US / KEEP_ALIVE_INTERVAL_US);
+}
+
+static uint64_t managed_keep_alive_frames(DiagnosticShims* shims) {
+    DiagnosticSessionManager manager;
+    diagnostic_init_session_manager(&manager);
+    const uint8_t session_response[] = {0x06, 0x50, 0x03, 0x00, 0x32, 0x01,
+        0xf4, 0x00};
+    const uint8_t application_response[] = {0x05, 0x62, 0xf1, 0x90, 0x01,
+        0x02, 0x00, 0x00};
+    uint8_t i;
+    current_time_us = 0;
+    for(i = 0; i < ECU_COUNT; i++) {
+        diagnostic_session_start(shims, &manager, 0x7e0 + i,
+                DIAGNOSTIC_EXTENDED_SESSION);
+        diagnostic_session_receive_can_frame(shims, &manager, 0x7e8 + i,
+                session_response, sizeof(session_response));
+    }
+
+    sent_frames = 0;
+    for(current_time_us = 0; current_time_us < DURATION_US;
+            current_time_us += STEP_US) {
+        for(i = 0; i < ECU_COUNT; i++) {
+            if(current_time_us % application_period_us(i) == 0) {
+                diagnostic_session_receive_can_frame(shims, &manager,
+                        0x7e8 + i, application_response,
+                        sizeof(application_response));
+            }
+        }
+        diagnostic_session_poll(shims, &manager);
+    }
+    for(i = 0; i < ECU_COUNT; i++) {
+        if(diagnostic_session_find(&manager, 0x7e0 + i)->state !=
+                DIAGNOSTIC_SESSION_ACTIVE) {
+            printf("  session with 0x%x was lost\n", 0x7e0 + i);
+        }
+    }
+    return sent_frames;
+}
+
+int main(void) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, count_frame, NULL);
+    shims.get_time_us = get_time;
+
+    uint64_t timer_frames = timer_keep_alive_frames();
+    uint64_t managed_frames = managed_keep_alive_frames(&shims);
+
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: DIAGNOSTIC_TESTER_PRESENT_MODE,
+        has_pid: true,
+        pid: 0x0
+    };
+    uint32_t i;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < SEND_COUNT; i++) {
+        request.arbitration_id = 0x7e0 + i % ECU_COUNT;
+        DiagnosticRequestHandle handle = diagnostic_request(&shims, &request,
+                NULL);
+        sent_frames += handle.completed;
+    }
+    double request_seconds = elapsed_seconds(&start);
+
+    DiagnosticSessionManager manager;
+    diagnostic_init_session_manager(&manager);
+    manager.keep_alive_interval_us = 0;
+    for(i = 0; i < ECU_COUNT; i++) {
+        diagnostic_session_start(&shims, &manager, 0x7e0 + i,
+                DIAGNOSTIC_EXTENDED_SESSION);
+        diagnostic_session_receive_can_frame(&shims, &manager, 0x7e8 + i,
+                (const uint8_t[]) {0x02, 0x50, 0x03}, 3);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < SEND_COUNT / ECU_COUNT; i++) {
+        diagnostic_session_poll(&shims, &manager);
+    }
+    double managed_seconds = elapsed_seconds(&start);
+
+    printf("sessions: %u ECUs for %u s\n", ECU_COUNT, DURATION_US / 1000000);
+    printf("  keep-alive timer: %6llu frames\n",
+            (unsigned long long) timer_frames);
+    printf("  session manager:  %6llu frames (%.0f%% of the timer's)\n",
+            (unsigned long long) managed_frames,
+            100.0 * managed_frames / timer_frames);
+    printf("  per keep-alive: diagnostic_request %5.1f ns, manager %5.1f ns\n",
+            request_seconds * 1e9 / SEND_COUNT,
+            managed_seconds * 1e9 / SEND_COUNT);
+    return 0;
+}
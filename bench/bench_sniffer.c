@@ -0,0 +1,86 @@
+/* Throughput of the passive sniffer against a saturated 500 kbit/s bus.
+ *
+ * Feeds the sniffer a mix of OBD-II single frame transactions, multi-frame
+ * UDS transactions with flow control, functional requests and unrelated
+ * frames, and compares the frame rate it sustains on one core with the most
+ * frames a 500 kbit/s bus can carry - 8 byte frames at 100% load.
+ */
+#include <uds/uds.h>
+#include <uds/sniffer.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ROUND_COUNT 1000000
+#define BITRATE 500000
+// an 8 byte frame with an 11-bit ID, worst case stuffing and the interframe
+// space
+#define FRAME_BITS 135
+
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t data[8];
+} Frame;
+
+static const Frame ROUND[] = {
+    {0x123, {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88}},
+    {0x7e0, {0x2, 0x1, 0xc, 0, 0, 0, 0, 0}},
+    {0x7e8, {0x4, 0x41, 0xc, 0x1a, 0xf8, 0, 0, 0}},
+    {0x7df, {0x2, 0x1, 0xd, 0, 0, 0, 0, 0}},
+    {0x7e8, {0x3, 0x41, 0xd, 0x32, 0, 0, 0, 0}},
+    {0x7e9, {0x3, 0x41, 0xd, 0x32, 0, 0, 0, 0}},
+    {0x18da10f1, {0x3, 0x22, 0xf1, 0x90, 0, 0, 0, 0}},
+    {0x18daf110, {0x10, 0x14, 0x62, 0xf1, 0x90, 'W', 'B', 'A'}},
+    {0x18da10f1, {0x30, 0, 0, 0, 0, 0, 0, 0}},
+    {0x18daf110, {0x21, '1', '2', '3', '4', '5', '6', '7'}},
+    {0x18daf110, {0x22, '8', '9', '0', '1', '2', '3', '4'}},
+    {0x456, {0, 0, 0, 0, 0, 0, 0, 0}}
+};
+
+static DiagnosticSniffer sniffer;
+static uint64_t checksum;
+
+static void transaction_completed(DiagnosticSniffer* sniffer,
+        const DiagnosticSnifferTransaction* transaction) {
+    checksum += transaction->response.pid +
+            transaction->response.full_payload_length;
+}
+
+int main(void) {
+    diagnostic_init_sniffer(&sniffer);
+    sniffer.transaction_completed = transaction_completed;
+    const uint32_t frames_per_round = sizeof(ROUND) / sizeof(ROUND[0]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t timestamp_us = 0;
+    uint32_t round, i;
+    for(round = 0; round < ROUND_COUNT; round++) {
+        for(i = 0; i < frames_per_round; i++) {
+            diagnostic_sniffer_receive_can_frame(&sniffer,
+                    ROUND[i].arbitration_id, ROUND[i].data, 8,
+                    timestamp_us);
+            timestamp_us += 270;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) +
+            (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    uint64_t frame_count = (uint64_t) ROUND_COUNT * frames_per_round;
+    double frames_per_second = frame_count / seconds;
+    double bus_frames_per_second = (double) BITRATE / FRAME_BITS;
+    printf("sniffer: %llu frames, %llu requests, %llu transactions, "
+            "%llu unsolicited, %llu errors\n",
+            (unsigned long long) frame_count,
+            (unsigned long long) sniffer.request_count,
+            (unsigned long long) sniffer.transaction_count,
+            (unsigned long long) sniffer.unsolicited_response_count,
+            (unsigned long long) sniffer.error_count);
+    printf("  %.3f s, %.0f frames/s, %.0fx a fully loaded %u kbit/s bus "
+            "(checksum %llu)\n", seconds, frames_per_second,
+            frames_per_second / bus_frames_per_second, BITRATE / 1000,
+            (unsigned long long) checksum);
+    return sniffer.error_count == 0 && sniffer.unsolicited_response_count ==
+            0 ? 0 : 1;
+}
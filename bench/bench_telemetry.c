@@ -0,0 +1,126 @@
+/* Size and CPU cost of the binary telemetry encoding against text.
+ *
+ * Encodes the same polled responses - OBD-II PIDs from a few ECUs and a VIN
+ * read over 29-bit IDs - as diagnostic_response_to_string(...) lines and as
+ * telemetry batches, and reports the bytes and nanoseconds per response of
+ * each, and the decoding speed of the batches.
+ */
+#include <uds/uds.h>
+#include <uds/telemetry.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define RESPONSE_COUNT 2000000
+#define BATCH_SIZE 65536
+#define TEXT_LINE_SIZE 128
+
+static DiagnosticResponse responses[64];
+static uint8_t batch[BATCH_SIZE];
+static const uint8_t VIN[] = "WBA12345678901234";
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void build_responses(void) {
+    unsigned int i;
+    for(i = 0; i < sizeof(responses) / sizeof(responses[0]); i++) {
+        DiagnosticResponse* response = &responses[i];
+        response->completed = true;
+        response->success = true;
+        response->has_pid = true;
+        if(i % 16 == 15) {
+            response->arbitration_id = 0x18daf110;
+            response->mode = 0x22;
+            response->pid = 0xf190;
+            response->multi_frame = true;
+            response->full_payload = VIN;
+            response->full_payload_length = sizeof(VIN) - 1;
+            response->payload_length = MAX_UDS_RESPONSE_PAYLOAD_LENGTH;
+            memcpy(response->payload, VIN, response->payload_length);
+        } else {
+            response->arbitration_id = 0x7e8 + i % 3;
+            response->mode = 0x1;
+            response->pid = 0xc + i % 4;
+            response->payload[0] = i;
+            response->payload[1] = i * 7;
+            response->payload_length = 2;
+        }
+    }
+}
+
+int main(void) {
+    build_responses();
+    const uint32_t response_kinds = sizeof(responses) / sizeof(responses[0]);
+    uint64_t text_bytes = 0;
+    uint32_t i;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char line[TEXT_LINE_SIZE];
+    for(i = 0; i < RESPONSE_COUNT; i++) {
+        diagnostic_response_to_string(&responses[i % response_kinds], line,
+                sizeof(line));
+        // and the newline and timestamp a log line would have
+        text_bytes += strlen(line) + 1 + 18;
+    }
+    double text_seconds = elapsed_seconds(&start);
+
+    uint64_t binary_bytes = 0;
+    uint32_t batch_count = 0;
+    uint64_t timestamp_us = 1436509052000000ULL;
+    DiagnosticTelemetryEncoder encoder;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    diagnostic_telemetry_start_batch(&encoder, batch, sizeof(batch));
+    for(i = 0; i < RESPONSE_COUNT; i++) {
+        timestamp_us += 1000 + i % 7;
+        if(!diagnostic_telemetry_encode(&encoder,
+                    &responses[i % response_kinds], timestamp_us)) {
+            binary_bytes += diagnostic_telemetry_finish_batch(&encoder);
+            ++batch_count;
+            diagnostic_telemetry_start_batch(&encoder, batch, sizeof(batch));
+            diagnostic_telemetry_encode(&encoder,
+                    &responses[i % response_kinds], timestamp_us);
+        }
+    }
+    uint32_t last_length = diagnostic_telemetry_finish_batch(&encoder);
+    binary_bytes += last_length;
+    ++batch_count;
+    double binary_seconds = elapsed_seconds(&start);
+
+    // decode the last batch over and over for the decoding speed
+    DiagnosticTelemetryDecoder decoder;
+    DiagnosticResponse response;
+    uint64_t decoded_count = 0, checksum = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(decoded_count < RESPONSE_COUNT) {
+        diagnostic_telemetry_start_decoding(&decoder, batch, last_length);
+        while(diagnostic_telemetry_decode(&decoder, &response,
+                    &timestamp_us)) {
+            checksum += response.pid + response.full_payload_length;
+            ++decoded_count;
+        }
+    }
+    double decode_seconds = elapsed_seconds(&start);
+
+    printf("telemetry: %u responses, %u batches\n", RESPONSE_COUNT,
+            batch_count);
+    printf("  text:   %5.1f bytes/response, %5.1f ns/response\n",
+            (double) text_bytes / RESPONSE_COUNT,
+            text_seconds * 1e9 / RESPONSE_COUNT);
+    printf("  binary: %5.1f bytes/response, %5.1f ns/response "
+            "(%.1fx smaller, %.1fx faster)\n",
+            (double) binary_bytes / RESPONSE_COUNT,
+            binary_seconds * 1e9 / RESPONSE_COUNT,
+            (double) text_bytes / binary_bytes,
+            text_seconds / binary_seconds);
+    printf("  decode: %5.1f ns/response (checksum %llu)\n",
+            decode_seconds * 1e9 / decoded_count,
+            (unsigned long long) checksum);
+    return 0;
+}
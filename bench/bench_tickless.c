@@ -0,0 +1,157 @@
+/* Wakeups of an idle event loop driving the library's timers.
+ *
+ * Keeps an extended session open with 4 ECUs, started a quarter second apart,
+ * for 10 simulated minutes while an unlock of a 5th ECU waits out its
+ * SecurityAccess delay. Compares polling on a fixed 10ms tick with sleeping
+ * until the next deadline of the session manager and the security access, and
+ * reports the wakeups, keep-alives sent and CPU time of each, and the
+ * nanoseconds to collect a deadline.
+ */
+#include <uds/uds.h>
+#include <uds/session.h>
+#include <uds/security.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define ECU_COUNT 4
+#define START_INTERVAL_US 250000
+#define TICK_US 10000
+#define DURATION_US 600000000u
+#define QUERY_COUNT 10000000
+
+typedef struct {
+    DiagnosticSessionManager manager;
+    DiagnosticSecurityAccess access;
+} Timers;
+
+static uint32_t current_time_us;
+
+static double elapsed_seconds(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) +
+            (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static bool drop_frame(const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    return true;
+}
+
+static uint32_t get_time(void) {
+    return current_time_us;
+}
+
+static bool invert_seed(DiagnosticSecurityAccess* access, uint8_t level,
+        const uint8_t seed[], uint8_t seed_size, uint8_t key[],
+        uint8_t* key_size) {
+    for(uint8_t i = 0; i < seed_size; i++) {
+        key[i] = ~seed[i];
+    }
+    *key_size = seed_size;
+    return true;
+}
+
+static void start(DiagnosticShims* shims, Timers* timers) {
+    const uint8_t session_response[] = {0x06, 0x50, 0x03, 0x00, 0x32, 0x01,
+        0xf4, 0x00};
+    current_time_us = 0;
+    diagnostic_init_session_manager(&timers->manager);
+    for(uint8_t i = 0; i < ECU_COUNT; i++) {
+        diagnostic_session_start(shims, &timers->manager, 0x7e0 + i,
+                DIAGNOSTIC_EXTENDED_SESSION);
+        diagnostic_session_receive_can_frame(shims, &timers->manager,
+                0x7e8 + i, session_response, sizeof(session_response));
+        current_time_us += START_INTERVAL_US;
+    }
+
+    // the ECU stays in its delay, so the unlock never gets further
+    const uint8_t delayed[] = {0x03, 0x7f, 0x27, 0x37};
+    diagnostic_init_security_access(&timers->access, 0x7e0 + ECU_COUNT);
+    timers->access.response_timeout_us = DURATION_US;
+    diagnostic_security_register_algorithm(&timers->access, 1, invert_seed);
+    diagnostic_security_unlock(shims, &timers->access, 1);
+    diagnostic_security_receive_can_frame(shims, &timers->access,
+            0x7e8 + ECU_COUNT, delayed, sizeof(delayed));
+}
+
+static void poll_timers(DiagnosticShims* shims, Timers* timers) {
+    diagnostic_session_poll(shims, &timers->manager);
+    diagnostic_security_poll(shims, &timers->access);
+}
+
+static uint32_t keep_alives(const Timers* timers) {
+    uint32_t count = 0;
+    for(uint8_t i = 0; i < ECU_COUNT; i++) {
+        count += timers->manager.sessions[i].keep_alive_count;
+    }
+    return count;
+}
+
+static uint32_t fixed_tick(DiagnosticShims* shims, Timers* timers) {
+    start(shims, timers);
+    uint32_t wakeups = 0;
+    for(; current_time_us < DURATION_US; current_time_us += TICK_US) {
+        poll_timers(shims, timers);
+        ++wakeups;
+    }
+    return wakeups;
+}
+
+static uint32_t tickless(DiagnosticShims* shims, Timers* timers) {
+    start(shims, timers);
+    uint32_t wakeups = 0;
+    while(true) {
+        DiagnosticDeadline deadline = {0};
+        diagnostic_session_next_deadline(shims, &timers->manager, &deadline);
+        diagnostic_security_next_deadline(shims, &timers->access, &deadline);
+        uint32_t sleep_us = diagnostic_deadline_remaining_us(&deadline,
+                current_time_us);
+        if(sleep_us >= DURATION_US - current_time_us) {
+            break;
+        }
+        current_time_us += sleep_us;
+        poll_timers(shims, timers);
+        ++wakeups;
+    }
+    return wakeups;
+}
+
+int main(void) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, drop_frame, NULL);
+    shims.get_time_us = get_time;
+    Timers timers;
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    uint32_t tick_wakeups = fixed_tick(&shims, &timers);
+    double tick_seconds = elapsed_seconds(&start_time);
+    uint32_t tick_keep_alives = keep_alives(&timers);
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    uint32_t tickless_wakeups = tickless(&shims, &timers);
+    double tickless_seconds = elapsed_seconds(&start_time);
+
+    DiagnosticDeadline deadline;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for(uint32_t i = 0; i < QUERY_COUNT; i++) {
+        memset(&deadline, 0, sizeof(deadline));
+        current_time_us = i;
+        diagnostic_session_next_deadline(&shims, &timers.manager, &deadline);
+        diagnostic_security_next_deadline(&shims, &timers.access, &deadline);
+    }
+    double query_seconds = elapsed_seconds(&start_time);
+
+    printf("tickless: %u ECU sessions and a delayed unlock for %u s\n",
+            ECU_COUNT, DURATION_US / 1000000);
+    printf("  %u ms tick: %6u wakeups, %4u keep-alives, %6.2f ms\n",
+            TICK_US / 1000, tick_wakeups, tick_keep_alives,
+            tick_seconds * 1e3);
+    printf("  deadlines: %6u wakeups, %4u keep-alives, %6.2f ms\n",
+            tickless_wakeups, keep_alives(&timers), tickless_seconds * 1e3);
+    printf("  next deadline query: %.1f ns (pending %d)\n",
+            query_seconds * 1e9 / QUERY_COUNT, deadline.pending);
+    return 0;
+}
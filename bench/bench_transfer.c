@@ -0,0 +1,165 @@
+/* Throughput of a 1 MB simulated TransferData download.
+ *
+ * The tester sends 0x36 requests with the largest payload an ISO-TP message
+ * can carry to a loopback ECU, which reassembles them, answers the first frame
+ * with a flow control allowing the whole message at once and replies with a
+ * positive response. Nothing waits on a real bus, so this measures the
+ * library's own cost per frame.
+ */
+#include <uds/uds.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TRANSFER_SIZE (1024 * 1024)
+#define TESTER_ID 0x7e0
+#define ECU_ID 0x7e8
+#define TRANSFER_DATA_SERVICE 0x36
+#define MAX_PENDING_FRAMES 4
+
+typedef struct {
+    uint8_t data[CAN_FD_MESSAGE_BYTE_SIZE];
+    uint8_t size;
+} Frame;
+
+static Frame pending_frames[MAX_PENDING_FRAMES];
+static int pending_frame_count;
+static uint8_t ecu_buffer[MAX_DIAGNOSTIC_REQUEST_SIZE];
+static uint16_t ecu_expected_size;
+static uint16_t ecu_received_size;
+static uint64_t frames_sent;
+static uint64_t bytes_verified;
+static const uint8_t* expected_block;
+static bool can_fd;
+static bool response_received;
+
+static void queue_frame(const uint8_t data[], uint8_t size) {
+    if(pending_frame_count < MAX_PENDING_FRAMES) {
+        Frame* frame = &pending_frames[pending_frame_count++];
+        memcpy(frame->data, data, size);
+        frame->size = size;
+    }
+}
+
+static void ecu_message_received() {
+    if(memcmp(ecu_buffer + 2, expected_block, ecu_received_size - 2) != 0) {
+        fprintf(stderr, "ECU received corrupted data\n");
+        exit(1);
+    }
+    bytes_verified += ecu_received_size - 2;
+    const uint8_t response[] = {0x2, TRANSFER_DATA_SERVICE + 0x40,
+        ecu_buffer[1]};
+    queue_frame(response, sizeof(response));
+}
+
+/* The loopback ECU: the tester's frames arrive here through the send shim. */
+static bool ecu_receive(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    ++frames_sent;
+    uint8_t capacity;
+    switch(data[0] >> 4) {
+        case 0x1:
+            ecu_expected_size = ((data[0] & 0xf) << 8) | data[1];
+            ecu_received_size = size - 2;
+            memcpy(ecu_buffer, &data[2], ecu_received_size);
+            const uint8_t flow_control[] = {0x30, 0, 0};
+            queue_frame(flow_control, sizeof(flow_control));
+            break;
+        case 0x2:
+            capacity = size - 1;
+            if(capacity > ecu_expected_size - ecu_received_size) {
+                capacity = ecu_expected_size - ecu_received_size;
+            }
+            memcpy(&ecu_buffer[ecu_received_size], &data[1], capacity);
+            ecu_received_size += capacity;
+            if(ecu_received_size == ecu_expected_size) {
+                ecu_message_received();
+            }
+            break;
+    }
+    return true;
+}
+
+static void response_received_handler(const DiagnosticResponse* response) {
+    response_received = response->success;
+}
+
+static double elapsed_seconds(const struct timespec* start,
+        const struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) +
+        (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run(const uint8_t* image) {
+    DiagnosticShims shims = diagnostic_init_shims(NULL, ecu_receive, NULL);
+    uint16_t block_size = MAX_DIAGNOSTIC_REQUEST_SIZE - 2;
+    uint8_t sequence = 1;
+    frames_sent = 0;
+    bytes_verified = 0;
+
+    struct timespec start, end;
+    clock_t cpu_start = clock();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t offset = 0; offset < TRANSFER_SIZE; offset += block_size) {
+        uint16_t length = TRANSFER_SIZE - offset < block_size ?
+            TRANSFER_SIZE - offset : block_size;
+        DiagnosticRequest request = {
+            arbitration_id: TESTER_ID,
+            mode: TRANSFER_DATA_SERVICE,
+            payload: {sequence++},
+            payload_length: 1,
+            large_payload: &image[offset],
+            large_payload_length: length,
+            can_fd: can_fd
+        };
+        expected_block = &image[offset];
+        response_received = false;
+        DiagnosticRequestHandle handle = diagnostic_request(&shims, &request,
+                response_received_handler);
+        while(pending_frame_count > 0) {
+            Frame frame = pending_frames[0];
+            memmove(pending_frames, &pending_frames[1],
+                    --pending_frame_count * sizeof(Frame));
+            diagnostic_receive_can_frame(&shims, &handle, ECU_ID, frame.data,
+                    frame.size);
+        }
+
+        if(!response_received) {
+            fprintf(stderr, "Block at offset %u failed\n", offset);
+            exit(1);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double cpu_seconds = (double)(clock() - cpu_start) / CLOCKS_PER_SEC;
+    double seconds = elapsed_seconds(&start, &end);
+
+    if(bytes_verified != TRANSFER_SIZE) {
+        fprintf(stderr, "ECU only received %llu bytes\n",
+                (unsigned long long) bytes_verified);
+        exit(1);
+    }
+    printf("%-9s %8.1f MB/s %12.0f frames/s %8.1f ns/frame %7.3f s CPU\n",
+            can_fd ? "CAN FD" : "classic", TRANSFER_SIZE / seconds / 1e6,
+            frames_sent / seconds, seconds * 1e9 / frames_sent, cpu_seconds);
+}
+
+int main(void) {
+    uint8_t* image = malloc(TRANSFER_SIZE);
+    if(image == NULL) {
+        return 1;
+    }
+    srand(1);
+    for(uint32_t i = 0; i < TRANSFER_SIZE; i++) {
+        image[i] = rand();
+    }
+
+    printf("1 MB TransferData download through a loopback ECU:\n");
+    can_fd = false;
+    run(image);
+    can_fd = true;
+    run(image);
+    free(image);
+    return 0;
+}
@@ -0,0 +1,569 @@
+#ifndef __UDS_COROUTINE_HPP__
+#define __UDS_COROUTINE_HPP__
+
+#include <uds/uds.h>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+// The largest coroutine frame the pool holds. A coroutine whose frame is
+// larger can't start; see uds::Task.
+#ifndef UDS_COROUTINE_FRAME_SIZE
+#define UDS_COROUTINE_FRAME_SIZE 1024
+#endif
+
+// The number of coroutine frames in the pool - coroutines alive at once.
+#ifndef UDS_COROUTINE_FRAME_COUNT
+#define UDS_COROUTINE_FRAME_COUNT 32
+#endif
+
+// The number of requests one executor has outstanding at once.
+#ifndef UDS_MAX_PENDING_REQUESTS
+#define UDS_MAX_PENDING_REQUESTS 32
+#endif
+
+/* C++20 coroutines over the callback API, for C++ callers that would rather
+ * write
+ *
+ *     uds::Task<> poll_engine(uds::Executor& uds) {
+ *         uds::PidResult rpm = co_await uds.read_pid(0x7e0, 0xc);
+ *         ...
+ *     }
+ *
+ * than a state machine around DiagnosticResponseReceived callbacks. An
+ * Executor sends the requests and resumes the coroutines waiting for them as
+ * the frames passed to it complete their responses. Requests start when
+ * they're made, so a coroutine can make several and then wait for each, and
+ * any number of coroutines can wait at once.
+ *
+ * Nothing is allocated per request: the requests live in the executor, and
+ * coroutine frames come from a fixed pool. Everything runs on the thread
+ * that drives the executor.
+ */
+
+namespace uds {
+
+/* Public: The fixed pool coroutine frames are allocated from, holding
+ * UDS_COROUTINE_FRAME_COUNT frames of up to UDS_COROUTINE_FRAME_SIZE bytes.
+ */
+class FramePool {
+public:
+    /* Public: Returns a frame of at least 'size' bytes, or nullptr if the pool
+     * is empty or the frame is too large.
+     */
+    static void* allocate(std::size_t size) noexcept {
+        if(size > UDS_COROUTINE_FRAME_SIZE) {
+            return nullptr;
+        }
+        if(free_list != nullptr) {
+            Frame* frame = free_list;
+            free_list = frame->next;
+            return frame->storage;
+        }
+        if(unused_count > 0) {
+            return frames[UDS_COROUTINE_FRAME_COUNT - unused_count--].storage;
+        }
+        return nullptr;
+    }
+
+    /* Public: Give a frame from allocate(...) back to the pool.
+     */
+    static void release(void* storage) noexcept {
+        Frame* frame = static_cast<Frame*>(storage);
+        frame->next = free_list;
+        free_list = frame;
+    }
+
+private:
+    union Frame {
+        Frame* next;
+        alignas(std::max_align_t) unsigned char storage[
+                UDS_COROUTINE_FRAME_SIZE];
+    };
+
+    static inline Frame frames[UDS_COROUTINE_FRAME_COUNT];
+    static inline Frame* free_list = nullptr;
+    static inline std::size_t unused_count = UDS_COROUTINE_FRAME_COUNT;
+};
+
+template<typename T = void> class Task;
+
+namespace detail {
+
+template<typename T>
+struct TaskResult {
+    std::optional<T> value;
+
+    void return_value(T result) noexcept {
+        value = std::move(result);
+    }
+};
+
+template<>
+struct TaskResult<void> {
+    void return_void() noexcept {}
+};
+
+template<typename T>
+struct TaskPromise : TaskResult<T> {
+    std::coroutine_handle<> continuation;
+
+    Task<T> get_return_object() noexcept {
+        return Task<T>(
+                std::coroutine_handle<TaskPromise>::from_promise(*this));
+    }
+
+    // the frame pool is empty: the task is returned empty instead
+    static Task<T> get_return_object_on_allocation_failure() noexcept {
+        return Task<T>();
+    }
+
+    std::suspend_never initial_suspend() noexcept {
+        return {};
+    }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<TaskPromise> finished) noexcept {
+            std::coroutine_handle<> continuation =
+                    finished.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    FinalAwaiter final_suspend() noexcept {
+        return {};
+    }
+
+    void unhandled_exception() noexcept {
+        std::terminate();
+    }
+
+    static void* operator new(std::size_t size) noexcept {
+        return FramePool::allocate(size);
+    }
+
+    static void operator delete(void* frame) noexcept {
+        FramePool::release(frame);
+    }
+};
+
+} // namespace detail
+
+/* Public: A coroutine, started as soon as it's called and running until its
+ * first co_await on something that isn't ready. Its frame comes from the
+ * FramePool and goes back when the Task is destroyed, so keep the Task until
+ * done() - destroying it early stops the coroutine where it is.
+ *
+ * Another coroutine can co_await a Task for its co_return value. A Task that
+ * couldn't get a frame is empty: false, and never runs.
+ */
+template<typename T>
+class Task {
+public:
+    using promise_type = detail::TaskPromise<T>;
+
+    Task() noexcept = default;
+
+    Task(Task&& other) noexcept :
+            coroutine(std::exchange(other.coroutine, nullptr)) {}
+
+    Task& operator=(Task&& other) noexcept {
+        if(this != &other) {
+            destroy();
+            coroutine = std::exchange(other.coroutine, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+        destroy();
+    }
+
+    /* Public: Returns false if the task couldn't get a coroutine frame.
+     */
+    explicit operator bool() const noexcept {
+        return static_cast<bool>(coroutine);
+    }
+
+    /* Public: Returns true once the coroutine has returned, or if it never
+     * started.
+     */
+    bool done() const noexcept {
+        return !coroutine || coroutine.done();
+    }
+
+    /* Public: Returns the value the coroutine returned. Only valid once
+     * done(), and not for Task<void>.
+     */
+    template<typename U = T> requires (!std::is_void_v<U>)
+    const U& result() const noexcept {
+        return *coroutine.promise().value;
+    }
+
+    bool await_ready() const noexcept {
+        return done();
+    }
+
+    void await_suspend(std::coroutine_handle<> waiter) noexcept {
+        coroutine.promise().continuation = waiter;
+    }
+
+    T await_resume() noexcept {
+        if constexpr (!std::is_void_v<T>) {
+            return std::move(*coroutine.promise().value);
+        }
+    }
+
+private:
+    friend struct detail::TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept :
+            coroutine(handle) {}
+
+    void destroy() noexcept {
+        if(coroutine) {
+            coroutine.destroy();
+            coroutine = nullptr;
+        }
+    }
+
+    std::coroutine_handle<promise_type> coroutine;
+};
+
+/* Public: The outcome of reading a PID.
+ *
+ * success - true if the ECU answered positively. Otherwise the request failed,
+ *      timed out or was answered with negative_response_code.
+ * negative_response_code - the ECU's reason for a negative response.
+ * value - the value, decoded with diagnostic_decode_obd2_pid(...).
+ */
+struct PidResult {
+    bool success;
+    DiagnosticNegativeResponseCode negative_response_code;
+    float value;
+
+    explicit operator bool() const noexcept {
+        return success;
+    }
+};
+
+class Executor;
+
+namespace detail {
+
+/* Private: One outstanding request of an executor.
+ */
+struct PendingRequest {
+    DiagnosticRequestHandle handle;
+    DiagnosticResponse response;
+    std::coroutine_handle<> waiter;
+    // when it was sent or last got a frame
+    uint32_t last_activity_us;
+    bool in_use;
+    bool in_flight;
+    bool completed;
+    // the awaiter was destroyed without waiting for the response
+    bool abandoned;
+
+    static void response_received(const DiagnosticResponse* response,
+            void* context) noexcept {
+        PendingRequest* request = static_cast<PendingRequest*>(context);
+        request->response = *response;
+        if(request->handle.receive_buffer == nullptr) {
+            // it pointed into a buffer that's only valid in the callback
+            request->response.full_payload = nullptr;
+            request->response.full_payload_length = 0;
+        }
+        request->in_flight = false;
+        request->completed = true;
+    }
+};
+
+inline DiagnosticResponse failed_response(const DiagnosticRequest& request) {
+    DiagnosticResponse response = {};
+    response.completed = true;
+    response.success = false;
+    response.arbitration_id = request.arbitration_id;
+    response.mode = request.mode;
+    return response;
+}
+
+inline PidResult decode(const DiagnosticResponse& response, PidResult*) {
+    PidResult result = {
+        response.success,
+        response.negative_response_code,
+        response.success ? diagnostic_decode_obd2_pid(&response) : 0
+    };
+    return result;
+}
+
+inline DiagnosticResponse decode(const DiagnosticResponse& response,
+        DiagnosticResponse*) {
+    return response;
+}
+
+} // namespace detail
+
+/* Public: The awaitable of one request - co_await it for the Result. The
+ * request is already sent; destroying it without awaiting forgets the
+ * response.
+ */
+template<typename Result>
+class Pending {
+public:
+    Pending(Pending&& other) noexcept :
+            request(std::exchange(other.request, nullptr)),
+            failed(other.failed) {}
+
+    Pending(const Pending&) = delete;
+    Pending& operator=(const Pending&) = delete;
+    Pending& operator=(Pending&&) = delete;
+
+    ~Pending() {
+        if(request != nullptr) {
+            if(request->completed) {
+                request->in_use = false;
+            } else {
+                request->abandoned = true;
+            }
+        }
+    }
+
+    /* Public: Returns true if the response is in.
+     */
+    bool await_ready() const noexcept {
+        return request == nullptr || request->completed;
+    }
+
+    void await_suspend(std::coroutine_handle<> waiter) noexcept {
+        request->waiter = waiter;
+    }
+
+    Result await_resume() noexcept {
+        if(request == nullptr) {
+            return detail::decode(failed, static_cast<Result*>(nullptr));
+        }
+        Result result = detail::decode(request->response,
+                static_cast<Result*>(nullptr));
+        request->in_use = false;
+        request = nullptr;
+        return result;
+    }
+
+private:
+    friend class Executor;
+
+    Pending(detail::PendingRequest* pending,
+            const DiagnosticRequest& original) noexcept :
+            request(pending),
+            failed(detail::failed_response(original)) {}
+
+    detail::PendingRequest* request;
+    // the response if the executor had no room for the request
+    DiagnosticResponse failed;
+};
+
+/* Public: Sends requests for coroutines and resumes them with the responses.
+ * Pass it every CAN frame received and call poll() regularly, e.g. from the
+ * same loop.
+ *
+ * response_timeout_us - How long a request may go without a frame of its
+ *      response before it fails (P2). The default is 1s. Only enforced with
+ *      the get_time_us shim.
+ * extended_timeout_us - How long a request may go without a frame once the
+ *      ECU said the response is pending with NRC 0x78 (P2*). The default is
+ *      5s.
+ */
+class Executor {
+public:
+    uint32_t response_timeout_us = 1000000;
+    uint32_t extended_timeout_us = 5000000;
+
+    explicit Executor(DiagnosticShims* shims) noexcept : shims(shims) {}
+
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    /* Public: Send a request. Returns its Pending, which resumes a
+     * coroutine with the DiagnosticResponse. A request that can't be sent,
+     * times out or finds all UDS_MAX_PENDING_REQUESTS in use gets a response
+     * whose 'success' is false and no negative response code.
+     *
+     * receive_buffer - (optional) storage for a multi-frame response, which
+     *      the response's full_payload then points into. Without one the
+     *      response only has its 'payload'.
+     */
+    Pending<DiagnosticResponse> request(DiagnosticRequest request,
+            uint8_t* receive_buffer = nullptr,
+            uint16_t receive_buffer_size = 0) noexcept {
+        return Pending<DiagnosticResponse>(start(request, receive_buffer,
+                receive_buffer_size), request);
+    }
+
+    /* Public: Read a PID. Returns its Pending, which resumes a coroutine with
+     * a PidResult.
+     *
+     * arbitration_id - the ECU to ask.
+     * pid - the PID.
+     * pid_request_type - DIAGNOSTIC_STANDARD_PID (mode 0x1) by default, or
+     *      DIAGNOSTIC_ENHANCED_PID (mode 0x22).
+     */
+    Pending<PidResult> read_pid(uint32_t arbitration_id, uint16_t pid,
+            DiagnosticPidRequestType pid_request_type =
+                DIAGNOSTIC_STANDARD_PID) noexcept {
+        DiagnosticRequest request = {};
+        request.arbitration_id = arbitration_id;
+        request.mode = pid_request_type == DIAGNOSTIC_STANDARD_PID ?
+                OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST :
+                OBD2_MODE_ENHANCED_DIAGNOSTIC_REQUEST;
+        request.has_pid = true;
+        request.pid = pid;
+        return Pending<PidResult>(start(request, nullptr, 0), request);
+    }
+
+    /* Public: Continue the requests in flight with a received CAN frame, and
+     * resume the coroutines whose responses it completed.
+     */
+    void receive_can_frame(uint32_t arbitration_id, const uint8_t data[],
+            uint8_t size) noexcept {
+        uint32_t now = now_us();
+        for(detail::PendingRequest& request : requests) {
+            if(request.in_flight && diagnostic_response_id_matches(
+                        &request.handle, arbitration_id)) {
+                request.last_activity_us = now;
+                diagnostic_receive_can_frame(shims, &request.handle,
+                        arbitration_id, data, size);
+                if(request.handle.completed && !request.completed) {
+                    fail(request);
+                }
+            }
+        }
+        resume_completed();
+    }
+
+    /* Public: Send consecutive frames that are due and fail requests that
+     * timed out, resuming their coroutines. A request times out once it goes
+     * response_timeout_us without a frame of its response, or
+     * extended_timeout_us after the ECU said it's pending.
+     */
+    void poll() noexcept {
+        uint32_t now = now_us();
+        for(detail::PendingRequest& request : requests) {
+            if(!request.in_flight) {
+                continue;
+            }
+            diagnostic_poll_request(shims, &request.handle);
+            if(request.handle.completed && !request.completed) {
+                fail(request);
+                continue;
+            }
+
+            if(request.handle.transport_receiver.holding) {
+                // the ECU is waiting for us, not the other way around
+                request.last_activity_us = now;
+            }
+            uint32_t timeout_us = request.handle.response_pending_count > 0 ?
+                    extended_timeout_us : response_timeout_us;
+            if(shims->get_time_us != nullptr &&
+                    now - request.last_activity_us >= timeout_us) {
+                if(shims->log != nullptr) {
+                    shims->log("Request to 0x%x timed out",
+                            request.handle.request.arbitration_id);
+                }
+                fail(request);
+            }
+        }
+        resume_completed();
+    }
+
+    /* Public: Returns the number of requests not yet answered.
+     */
+    std::size_t pending_count() const noexcept {
+        std::size_t count = 0;
+        for(const detail::PendingRequest& request : requests) {
+            if(request.in_flight) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+private:
+    uint32_t now_us() const noexcept {
+        return shims->get_time_us != nullptr ? shims->get_time_us() : 0;
+    }
+
+    detail::PendingRequest* start(DiagnosticRequest& request,
+            uint8_t* receive_buffer, uint16_t receive_buffer_size) noexcept {
+        for(detail::PendingRequest& pending : requests) {
+            if(pending.in_use) {
+                continue;
+            }
+
+            pending.in_use = true;
+            pending.completed = false;
+            pending.abandoned = false;
+            pending.waiter = nullptr;
+            pending.handle = generate_diagnostic_request(shims, &request,
+                    nullptr);
+            pending.handle.receive_buffer = receive_buffer;
+            pending.handle.receive_buffer_size = receive_buffer_size;
+            pending.handle.context_callback =
+                    detail::PendingRequest::response_received;
+            pending.handle.context = &pending;
+            pending.last_activity_us = now_us();
+            pending.in_flight = true;
+            start_diagnostic_request(shims, &pending.handle);
+            if(pending.handle.completed) {
+                fail(pending);
+            }
+            return &pending;
+        }
+        return nullptr;
+    }
+
+    static void fail(detail::PendingRequest& request) noexcept {
+        request.response = detail::failed_response(request.handle.request);
+        request.in_flight = false;
+        request.completed = true;
+    }
+
+    /* Private: Resume the coroutines waiting for completed requests, and free
+     * the requests nobody waits for. A resumed coroutine may start new
+     * requests, or finish and resume another.
+     */
+    void resume_completed() noexcept {
+        for(detail::PendingRequest& request : requests) {
+            if(!request.in_use || !request.completed) {
+                continue;
+            }
+            if(request.abandoned) {
+                request.in_use = false;
+            } else if(request.waiter) {
+                std::exchange(request.waiter, nullptr).resume();
+            }
+        }
+    }
+
+    DiagnosticShims* shims;
+    detail::PendingRequest requests[UDS_MAX_PENDING_REQUESTS] = {};
+};
+
+} // namespace uds
+
+#endif // __UDS_COROUTINE_HPP__
@@ -0,0 +1,188 @@
+#include <uds/daemon.h>
+#include <uds/uds.h>
+#include <string.h>
+
+void diagnostic_init_daemon(DiagnosticDaemon* daemon,
+        DiagnosticIpcSegment* segment) {
+    memset(daemon, 0, sizeof(DiagnosticDaemon));
+    daemon->segment = segment;
+    diagnostic_init_request_scheduler(&daemon->scheduler);
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        daemon->requests[i].daemon = daemon;
+    }
+}
+
+/* Private: Returns true if one request on the bus answers both.
+ */
+static bool same_request(const DiagnosticRequest* a,
+        const DiagnosticRequest* b) {
+    return a->arbitration_id == b->arbitration_id &&
+            a->mode == b->mode &&
+            a->has_pid == b->has_pid &&
+            (!a->has_pid || (a->pid == b->pid &&
+                a->pid_length == b->pid_length)) &&
+            a->payload_length == b->payload_length &&
+            memcmp(a->payload, b->payload, a->payload_length) == 0 &&
+            a->no_frame_padding == b->no_frame_padding &&
+            a->can_fd == b->can_fd &&
+            a->addressing == b->addressing &&
+            a->address_extension == b->address_extension &&
+            a->response_address_extension == b->response_address_extension &&
+            a->response_arbitration_id == b->response_arbitration_id;
+}
+
+static void response_received(const DiagnosticResponse* response,
+        void* context) {
+    DiagnosticDaemonRequest* request = (DiagnosticDaemonRequest*) context;
+    DiagnosticDaemon* daemon = request->daemon;
+    for(uint8_t i = 0; i < request->subscriber_count; i++) {
+        const DiagnosticDaemonSubscriber* subscriber = &request->subscribers[i];
+        if(diagnostic_ipc_post_response(daemon->segment, subscriber->channel,
+                    subscriber->generation, subscriber->tag, response)) {
+            ++daemon->delivered_count;
+        } else {
+            ++daemon->dropped_count;
+        }
+    }
+    request->handle = NULL;
+}
+
+/* Private: Add a client to an outstanding identical request.
+ *
+ * Returns false if there is none it can wait for.
+ */
+static bool subscribe(DiagnosticDaemon* daemon,
+        const DiagnosticIpcRequest* ipc_request,
+        const DiagnosticDaemonSubscriber* subscriber) {
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        DiagnosticDaemonRequest* request = &daemon->requests[i];
+        // a more urgent request doesn't wait for a less urgent one to be sent
+        if(request->handle != NULL &&
+                request->subscriber_count < MAX_DAEMON_SUBSCRIBERS &&
+                ipc_request->priority >= request->priority &&
+                same_request(&request->request, &ipc_request->request)) {
+            request->subscribers[request->subscriber_count++] = *subscriber;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Private: Queue a client's request with the scheduler.
+ *
+ * Returns false if the scheduler is full.
+ */
+static bool schedule(DiagnosticShims* shims, DiagnosticDaemon* daemon,
+        const DiagnosticIpcRequest* ipc_request,
+        const DiagnosticDaemonSubscriber* subscriber) {
+    DiagnosticDaemonRequest* request = NULL;
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS && request == NULL; i++) {
+        if(daemon->requests[i].handle == NULL) {
+            request = &daemon->requests[i];
+        }
+    }
+    if(request == NULL) {
+        return false;
+    }
+
+    request->request = ipc_request->request;
+    request->priority = ipc_request->priority;
+    DiagnosticRequestHandle* handle = diagnostic_schedule_request_with_context(
+            shims, &daemon->scheduler, &request->request, request->priority,
+            response_received, request);
+    if(handle == NULL) {
+        return false;
+    }
+    handle->receive_buffer = request->receive_buffer;
+    handle->receive_buffer_size = sizeof(request->receive_buffer);
+    request->handle = handle;
+    request->subscribers[0] = *subscriber;
+    request->subscriber_count = 1;
+    return true;
+}
+
+/* Private: Returns true if a request read from a client's ring can be
+ * scheduled. The client can write anything into the ring, so the fields the
+ * daemon indexes or copies by aren't trusted.
+ */
+static bool valid_request(const DiagnosticIpcRequest* ipc_request) {
+    return ipc_request->priority < DIAGNOSTIC_PRIORITY_CLASS_COUNT &&
+            ipc_request->request.payload_length <=
+                MAX_UDS_REQUEST_PAYLOAD_LENGTH;
+}
+
+/* Private: Answer a request that can't be scheduled with a failed response,
+ * so its client doesn't wait for it.
+ */
+static void reject(DiagnosticDaemon* daemon,
+        const DiagnosticIpcRequest* ipc_request,
+        const DiagnosticDaemonSubscriber* subscriber) {
+    DiagnosticResponse response = {
+        arbitration_id: ipc_request->request.arbitration_id,
+        mode: ipc_request->request.mode,
+        completed: true,
+        success: false
+    };
+    ++daemon->rejected_count;
+    diagnostic_ipc_post_response(daemon->segment, subscriber->channel,
+            subscriber->generation, subscriber->tag, &response);
+}
+
+/* Private: Read the new requests of one client.
+ *
+ * Returns false if the scheduler filled up.
+ */
+static bool read_requests(DiagnosticShims* shims, DiagnosticDaemon* daemon,
+        uint8_t channel) {
+    const DiagnosticIpcRequest* next;
+    while((next = diagnostic_ipc_next_request(daemon->segment,
+                    channel)) != NULL) {
+        // the client can still write to the ring, so check and use a copy
+        DiagnosticIpcRequest ipc_request = *next;
+        ipc_request.request.large_payload = NULL;
+        ipc_request.request.large_payload_length = 0;
+        DiagnosticDaemonSubscriber subscriber = {
+            channel: channel,
+            generation: diagnostic_ipc_channel_generation(daemon->segment,
+                    channel),
+            tag: ipc_request.tag
+        };
+        if(!valid_request(&ipc_request)) {
+            reject(daemon, &ipc_request, &subscriber);
+        } else if(subscribe(daemon, &ipc_request, &subscriber)) {
+            ++daemon->deduplicated_count;
+        } else if(!schedule(shims, daemon, &ipc_request, &subscriber)) {
+            return false;
+        }
+        ++daemon->received_count;
+        diagnostic_ipc_consume_request(daemon->segment, channel);
+    }
+    return true;
+}
+
+void diagnostic_daemon_poll(DiagnosticShims* shims, DiagnosticDaemon* daemon) {
+    diagnostic_ipc_reclaim_channels(daemon->segment);
+
+    // start with a different client each time, so none gets the scheduler
+    // to itself when it's nearly full
+    for(uint8_t i = 0; i < MAX_IPC_CLIENTS; i++) {
+        if(!read_requests(shims, daemon,
+                    (daemon->next_channel + i) % MAX_IPC_CLIENTS)) {
+            break;
+        }
+    }
+    daemon->next_channel = (daemon->next_channel + 1) % MAX_IPC_CLIENTS;
+
+    diagnostic_scheduler_poll(shims, &daemon->scheduler);
+}
+
+void diagnostic_daemon_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticDaemon* daemon, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    diagnostic_scheduler_receive_can_frame(shims, &daemon->scheduler,
+            arbitration_id, data, size);
+}
+
+uint8_t diagnostic_daemon_request_count(const DiagnosticDaemon* daemon) {
+    return diagnostic_scheduled_request_count(&daemon->scheduler);
+}
@@ -0,0 +1,111 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <uds/uds_types.h>
+#include <uds/scheduler.h>
+#include <uds/ipc.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of client requests answered by one request on the bus.
+#ifndef MAX_DAEMON_SUBSCRIBERS
+#define MAX_DAEMON_SUBSCRIBERS 8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A daemon that owns the CAN bus and sends it the requests of other processes,
+ * which attach to its shared memory segment as clients (see uds/ipc.h). Their
+ * requests go through a DiagnosticRequestScheduler, so the clients can't step
+ * on each other's handles, and a request that's identical to one already
+ * outstanding is answered by that one's response instead of going on the bus
+ * again.
+ */
+
+/* Private: A client waiting for the response to a request on the bus.
+ */
+typedef struct {
+    uint8_t channel;
+    uint32_t generation;
+    uint32_t tag;
+} DiagnosticDaemonSubscriber;
+
+typedef struct DiagnosticDaemon DiagnosticDaemon;
+
+/* Private: A request the daemon sent to the scheduler, and the clients waiting
+ * for its response.
+ */
+typedef struct {
+    DiagnosticDaemon* daemon;
+    const DiagnosticRequestHandle* handle;
+    DiagnosticRequest request;
+    DiagnosticPriority priority;
+    DiagnosticDaemonSubscriber subscribers[MAX_DAEMON_SUBSCRIBERS];
+    uint8_t subscriber_count;
+    uint8_t receive_buffer[MAX_IPC_RESPONSE_SIZE];
+} DiagnosticDaemonRequest;
+
+/* Public: The daemon. Initialize it with diagnostic_init_daemon(...).
+ *
+ * segment - The shared memory the clients attach to.
+ * scheduler - The scheduler the requests are sent through. Give it a retry
+ *      policy or circuit breakers, or change its timeout, after
+ *      diagnostic_init_daemon(...).
+ * received_count - The number of requests read from the clients.
+ * deduplicated_count - The number of them answered by an identical request
+ *      already outstanding.
+ * rejected_count - The number of them answered with a failed response
+ *      without being sent, because the client wrote a priority or payload
+ *      length that's out of range into its ring.
+ * delivered_count - The number of responses written to the clients.
+ * dropped_count - The number of responses thrown away because their client
+ *      had detached or its response ring was full.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticDaemon {
+    DiagnosticIpcSegment* segment;
+    DiagnosticRequestScheduler scheduler;
+    uint32_t received_count;
+    uint32_t deduplicated_count;
+    uint32_t rejected_count;
+    uint32_t delivered_count;
+    uint32_t dropped_count;
+
+    // Private
+    DiagnosticDaemonRequest requests[MAX_SCHEDULED_REQUESTS];
+    uint8_t next_channel;
+};
+
+/* Public: Initialize a daemon serving the clients of an initialized segment.
+ */
+void diagnostic_init_daemon(DiagnosticDaemon* daemon,
+        DiagnosticIpcSegment* segment);
+
+/* Public: Read the clients' new requests and send what's due. A request is
+ * answered by an outstanding identical one - same ECU, addressing, service,
+ * PID and payload - unless it's more urgent. Requests are left in their rings
+ * while the scheduler is full. Call this regularly from the daemon's main
+ * loop; clients' requests wait for it.
+ */
+void diagnostic_daemon_poll(DiagnosticShims* shims, DiagnosticDaemon* daemon);
+
+/* Public: Continue the requests in flight with a received CAN frame, and write
+ * the responses that complete to every client waiting for them. Pass every
+ * frame received.
+ */
+void diagnostic_daemon_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticDaemon* daemon, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size);
+
+/* Public: Returns the number of requests on the bus or queued for it.
+ */
+uint8_t diagnostic_daemon_request_count(const DiagnosticDaemon* daemon);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __DAEMON_H__
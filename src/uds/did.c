@@ -0,0 +1,164 @@
+#include <uds/did.h>
+#include <uds/extract.h>
+#include <string.h>
+
+#define DID_SIZE 2
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+void diagnostic_init_did_registry(DiagnosticDidRegistry* registry,
+        uint8_t max_dids_per_request, uint16_t max_response_size) {
+    memset(registry, 0, sizeof(DiagnosticDidRegistry));
+    registry->max_dids_per_request = MIN(max_dids_per_request,
+            MAX_MULTI_DID_COUNT);
+    registry->max_response_size = max_response_size;
+}
+
+/* Private: Returns the index of the first definition with a DID not less than
+ * 'did'.
+ */
+static uint8_t lower_bound(const DiagnosticDidRegistry* registry,
+        uint16_t did) {
+    uint8_t low = 0;
+    uint8_t high = registry->definition_count;
+    while(low < high) {
+        uint8_t middle = low + (high - low) / 2;
+        if(registry->definitions[middle].did < did) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+bool diagnostic_register_did(DiagnosticDidRegistry* registry, uint16_t did,
+        uint8_t length, DiagnosticDidDecoder decoder) {
+    if(length == 0) {
+        return false;
+    }
+
+    uint8_t index = lower_bound(registry, did);
+    DiagnosticDidDefinition* definition = &registry->definitions[index];
+    if(index == registry->definition_count || definition->did != did) {
+        if(registry->definition_count == MAX_REGISTERED_DIDS) {
+            return false;
+        }
+        memmove(definition + 1, definition,
+                (registry->definition_count - index) *
+                sizeof(DiagnosticDidDefinition));
+        ++registry->definition_count;
+    }
+
+    definition->did = did;
+    definition->length = length;
+    definition->decoder = decoder;
+    return true;
+}
+
+const DiagnosticDidDefinition* diagnostic_lookup_did(
+        const DiagnosticDidRegistry* registry, uint16_t did) {
+    uint8_t index = lower_bound(registry, did);
+    if(index < registry->definition_count &&
+            registry->definitions[index].did == did) {
+        return &registry->definitions[index];
+    }
+    return NULL;
+}
+
+uint8_t diagnostic_multi_did_request(const DiagnosticDidRegistry* registry,
+        uint32_t arbitration_id, const uint16_t dids[], uint8_t did_count,
+        DiagnosticMultiDidPayload* payload, DiagnosticRequest* request) {
+    uint8_t count = 0;
+    // the 0x62 service ID
+    uint32_t response_size = 1;
+    uint8_t limit = MIN(did_count, registry->max_dids_per_request);
+    while(count < limit) {
+        const DiagnosticDidDefinition* definition = diagnostic_lookup_did(
+                registry, dids[count]);
+        if(definition == NULL || response_size + DID_SIZE +
+                definition->length > registry->max_response_size) {
+            break;
+        }
+        response_size += DID_SIZE + definition->length;
+        if(count > 0) {
+            payload->data[(count - 1) * DID_SIZE] = dids[count] >> 8;
+            payload->data[(count - 1) * DID_SIZE + 1] = dids[count];
+        }
+        ++count;
+    }
+
+    if(count == 0) {
+        return 0;
+    }
+
+    memset(request, 0, sizeof(DiagnosticRequest));
+    request->arbitration_id = arbitration_id;
+    request->mode = DIAGNOSTIC_READ_DATA_BY_IDENTIFIER_MODE;
+    request->has_pid = true;
+    request->pid = dids[0];
+    request->pid_length = DID_SIZE;
+    uint16_t payload_length = (count - 1) * DID_SIZE;
+    if(payload_length <= MAX_UDS_REQUEST_PAYLOAD_LENGTH) {
+        memcpy(request->payload, payload->data, payload_length);
+        request->payload_length = payload_length;
+    } else {
+        request->large_payload = payload->data;
+        request->large_payload_length = payload_length;
+    }
+    return count;
+}
+
+/* Private: Decode a record with its definition's decoder, or as a big endian
+ * integer without one.
+ */
+static float decode_record(const DiagnosticDidDefinition* definition,
+        const uint8_t data[]) {
+    if(definition->decoder != NULL) {
+        return definition->decoder(definition->did, data, definition->length);
+    } else if(definition->length <= sizeof(uint32_t)) {
+        return diagnostic_load_big_endian(data, definition->length);
+    }
+    return 0;
+}
+
+uint8_t diagnostic_parse_multi_did_response(
+        const DiagnosticDidRegistry* registry,
+        const DiagnosticResponse* response, DiagnosticDidValue values[],
+        uint8_t value_count) {
+    if(!response->completed || !response->success || !response->has_pid) {
+        return 0;
+    }
+
+    // the first DID was already split off as the response's PID
+    const uint8_t* payload = response->full_payload != NULL ?
+            response->full_payload : response->payload;
+    uint16_t size = response->full_payload != NULL ?
+            response->full_payload_length : response->payload_length;
+    uint16_t did = response->pid;
+    uint16_t offset = 0;
+    uint8_t count = 0;
+    while(count < value_count) {
+        const DiagnosticDidDefinition* definition = diagnostic_lookup_did(
+                registry, did);
+        if(definition == NULL || offset + definition->length > size) {
+            break;
+        }
+
+        DiagnosticDidValue* value = &values[count++];
+        value->did = did;
+        value->data = &payload[offset];
+        value->size = definition->length;
+        value->value = decode_record(definition, value->data);
+        offset += definition->length;
+
+        if(offset + DID_SIZE > size) {
+            break;
+        }
+        did = diagnostic_load_big_endian(&payload[offset], DID_SIZE);
+        offset += DID_SIZE;
+    }
+    return count;
+}
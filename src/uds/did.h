@@ -0,0 +1,155 @@
+#ifndef __DID_H__
+#define __DID_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIAGNOSTIC_READ_DATA_BY_IDENTIFIER_MODE 0x22
+
+// The number of DIDs one registry can hold.
+#ifndef MAX_REGISTERED_DIDS
+#define MAX_REGISTERED_DIDS 64
+#endif
+
+// The most DIDs requested together in one ReadDataByIdentifier request.
+#ifndef MAX_MULTI_DID_COUNT
+#define MAX_MULTI_DID_COUNT 32
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: The signature for a function that decodes the record of one DID
+ * into a number.
+ *
+ * data - the record of the DID, exactly as long as it was registered.
+ */
+typedef float (*DiagnosticDidDecoder)(uint16_t did, const uint8_t data[],
+        uint8_t size);
+
+/* Public: A DID an ECU can return, with the fixed length of its record.
+ *
+ * did - The data identifier.
+ * length - The length of its record in bytes, not including the DID echo.
+ * decoder - (optional) The function to decode the record with. Without one,
+ *      records of up to 4 bytes decode as a big endian integer and longer
+ *      ones as 0.
+ */
+typedef struct {
+    uint16_t did;
+    uint8_t length;
+    DiagnosticDidDecoder decoder;
+} DiagnosticDidDefinition;
+
+/* Public: The DIDs of one ECU, and how many of them it answers in one
+ * ReadDataByIdentifier (0x22) request. A response to several DIDs is their
+ * records back to back, each after its DID, so it can only be split knowing
+ * the length of every record. Initialize it with
+ * diagnostic_init_did_registry(...).
+ *
+ * max_dids_per_request - The most DIDs the ECU accepts in one request.
+ * max_response_size - The most bytes in one response the ECU sends, or the
+ *      receiver can buffer, including the 0x62 service ID.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint8_t max_dids_per_request;
+    uint16_t max_response_size;
+
+    // Private
+    // sorted by DID
+    DiagnosticDidDefinition definitions[MAX_REGISTERED_DIDS];
+    uint8_t definition_count;
+} DiagnosticDidRegistry;
+
+/* Public: The payload of a request for several DIDs, which must stay valid
+ * until the request is sent.
+ */
+typedef struct {
+    uint8_t data[(MAX_MULTI_DID_COUNT - 1) * 2];
+} DiagnosticMultiDidPayload;
+
+/* Public: The record of one DID split out of a response.
+ *
+ * did - The data identifier.
+ * data - The record, pointing into the response's payload.
+ * size - The length of the record.
+ * value - The record decoded with its definition's decoder.
+ */
+typedef struct {
+    uint16_t did;
+    const uint8_t* data;
+    uint8_t size;
+    float value;
+} DiagnosticDidValue;
+
+/* Public: Initialize a registry with no DIDs.
+ *
+ * max_dids_per_request - the most DIDs the ECU accepts in one request, at
+ *      most MAX_MULTI_DID_COUNT.
+ * max_response_size - the longest response to accept, e.g. 4095 for classic
+ *      ISO-TP or the size of the handle's receive buffer.
+ */
+void diagnostic_init_did_registry(DiagnosticDidRegistry* registry,
+        uint8_t max_dids_per_request, uint16_t max_response_size);
+
+/* Public: Add a DID to the registry, or replace its definition.
+ *
+ * Returns false if the record length is 0 or MAX_REGISTERED_DIDS DIDs are
+ * already registered.
+ */
+bool diagnostic_register_did(DiagnosticDidRegistry* registry, uint16_t did,
+        uint8_t length, DiagnosticDidDecoder decoder);
+
+/* Public: Returns the definition of a DID, or NULL if it isn't registered.
+ */
+const DiagnosticDidDefinition* diagnostic_lookup_did(
+        const DiagnosticDidRegistry* registry, uint16_t did);
+
+/* Public: Build one ReadDataByIdentifier request for as many of the DIDs, in
+ * order, as fit the ECU's limits. Request the rest with another call starting
+ * after them.
+ *
+ * The first DID is sent as the request's PID, so diagnostic_request(...)
+ * matches the response as usual. Responses longer than a single frame need a
+ * receive buffer on the handle if the request uses the library's transport,
+ * e.g. for CAN FD or more than 3 DIDs.
+ *
+ * dids - the DIDs to read, all registered.
+ * did_count - the number of DIDs.
+ * payload - storage for the request's payload, which must stay valid until
+ *      the request is sent.
+ * request - the request to build, to 'arbitration_id'.
+ *
+ * Returns the number of DIDs in the request - 0 if the first DID isn't
+ * registered or its response alone would be too long. Stops early at a DID
+ * that isn't registered.
+ */
+uint8_t diagnostic_multi_did_request(const DiagnosticDidRegistry* registry,
+        uint32_t arbitration_id, const uint16_t dids[], uint8_t did_count,
+        DiagnosticMultiDidPayload* payload, DiagnosticRequest* request);
+
+/* Public: Split a completed positive response to a request from
+ * diagnostic_multi_did_request(...) into the records of its DIDs and decode
+ * them, in one pass. The records point into the response's payload, so they
+ * are only valid as long as the response's full_payload.
+ *
+ * values - where to store the records, in the order of the response.
+ * value_count - the size of 'values'.
+ *
+ * Returns the number of records stored. Parsing stops at a DID that isn't
+ * registered or a record cut short, since nothing after it can be found.
+ */
+uint8_t diagnostic_parse_multi_did_response(
+        const DiagnosticDidRegistry* registry,
+        const DiagnosticResponse* response, DiagnosticDidValue values[],
+        uint8_t value_count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __DID_H__
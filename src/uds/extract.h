@@ -0,0 +1,64 @@
+#ifndef __EXTRACT_H__
+#define __EXTRACT_H__
+
+#include <bitfield/bitfield.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Private: Field extraction for response parsing. Almost every field in a
+ * diagnostic response - PIDs, DIDs and numeric payloads - is a whole number of
+ * bytes at a byte offset, which a big endian load reads directly. The generic
+ * get_bitfield(...) is only needed for fields that aren't byte aligned.
+ */
+
+/* Private: Load a 1 to 4 byte big endian integer. With a constant byte_count
+ * this compiles down to the loads and shifts for that size.
+ */
+static inline uint32_t diagnostic_load_big_endian(const uint8_t source[],
+        uint8_t byte_count) {
+    switch(byte_count) {
+        case 1:
+            return source[0];
+        case 2:
+            return ((uint32_t) source[0] << 8) | source[1];
+        case 3:
+            return ((uint32_t) source[0] << 16) |
+                ((uint32_t) source[1] << 8) | source[2];
+        case 4:
+            return ((uint32_t) source[0] << 24) |
+                ((uint32_t) source[1] << 16) |
+                ((uint32_t) source[2] << 8) | source[3];
+        default:
+            return 0;
+    }
+}
+
+/* Private: Extract a big endian field of up to 64 bits, with a byte aligned
+ * load when the field is whole bytes of at most 32 bits at a byte offset, and
+ * get_bitfield(...) otherwise.
+ *
+ * Returns the field, or 0 if it doesn't fit in the source.
+ */
+static inline uint64_t diagnostic_extract_field(const uint8_t source[],
+        uint16_t source_length, uint16_t bit_offset, uint16_t bit_count) {
+    if(bit_offset % 8 == 0 && bit_count % 8 == 0 && bit_count > 0 &&
+            bit_count <= 32) {
+        if(bit_offset / 8 + bit_count / 8 > source_length) {
+            return 0;
+        }
+        return diagnostic_load_big_endian(&source[bit_offset / 8],
+                bit_count / 8);
+    }
+    return get_bitfield(source, source_length > UINT8_MAX ? UINT8_MAX :
+            source_length, bit_offset, bit_count);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __EXTRACT_H__
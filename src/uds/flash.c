@@ -0,0 +1,385 @@
+#include <uds/flash.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define DEFAULT_RESPONSE_TIMEOUT_US 50000
+#define DEFAULT_EXTENDED_TIMEOUT_US 5000000
+// 4 byte memory size and 4 byte memory address
+#define ADDRESS_AND_LENGTH_FORMAT 0x44
+// the service ID and block sequence counter before the data in TransferData
+#define TRANSFER_DATA_HEADER_SIZE 2
+#define PREFETCH_STRIDE 4096
+
+// a classic frame with an 11-bit ID and 8 data bytes, and the interframe space
+#define CLASSIC_FRAME_BITS 111
+#define CLASSIC_FRAME_DATA_BYTES 7
+// the bits of a 64 byte CAN FD frame with an 11-bit ID sent at the nominal
+// bitrate, and those sent at the data bitrate if it's switched
+#define FD_FRAME_NOMINAL_BITS 30
+#define FD_FRAME_DATA_PHASE_BITS 542
+#define FD_FRAME_DATA_BYTES 63
+
+void diagnostic_init_flash(DiagnosticFlashTransfer* transfer,
+        uint32_t arbitration_id, const uint8_t* image, uint32_t image_size,
+        uint32_t memory_address) {
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->arbitration_id = arbitration_id;
+    transfer->image = image;
+    transfer->image_size = image_size;
+    transfer->memory_address = memory_address;
+    transfer->state = DIAGNOSTIC_FLASH_IDLE;
+}
+
+static void fail(DiagnosticShims* shims, DiagnosticFlashTransfer* transfer,
+        const char* reason) {
+    transfer->state = DIAGNOSTIC_FLASH_FAILED;
+    if(shims->get_time_us != NULL) {
+        transfer->end_time_us = shims->get_time_us();
+    }
+    if(shims->log != NULL) {
+        shims->log("Flash download to 0x%x failed at offset %u: %s",
+                transfer->arbitration_id, transfer->offset, reason);
+    }
+}
+
+static void send_request(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer, DiagnosticRequest* request) {
+    request->arbitration_id = transfer->arbitration_id;
+    request->can_fd = transfer->can_fd;
+    transfer->handle = diagnostic_request(shims, request, NULL);
+    transfer->response_pending_count = 0;
+    transfer->deadline_armed = false;
+    if(transfer->handle.completed) {
+        fail(shims, transfer, "request could not be sent");
+    }
+}
+
+/* Private: Get the next block ready while the current one is on the bus -
+ * the request only needs its place in the image, since the data is sent
+ * without being copied, but touching it now takes any page faults on a mapped
+ * image off the critical path.
+ */
+static void prepare_block(DiagnosticFlashTransfer* transfer, uint32_t offset,
+        uint8_t block_sequence_counter) {
+    uint32_t remaining = transfer->image_size - offset;
+    uint16_t capacity = transfer->block_length - TRANSFER_DATA_HEADER_SIZE;
+    transfer->next_offset = offset;
+    transfer->next_length = remaining < capacity ? remaining : capacity;
+    transfer->next_block_sequence_counter = block_sequence_counter;
+
+    volatile const uint8_t* data = &transfer->image[offset];
+    for(uint32_t i = 0; i < transfer->next_length; i += PREFETCH_STRIDE) {
+        (void) data[i];
+    }
+}
+
+static void send_transfer_exit(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer) {
+    transfer->state = DIAGNOSTIC_FLASH_TRANSFER_EXIT;
+    DiagnosticRequest request = {
+        mode: DIAGNOSTIC_REQUEST_TRANSFER_EXIT_MODE
+    };
+    send_request(shims, transfer, &request);
+}
+
+static void send_next_block(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer) {
+    transfer->offset = transfer->next_offset;
+    transfer->block_sequence_counter = transfer->next_block_sequence_counter;
+    if(transfer->offset >= transfer->image_size) {
+        send_transfer_exit(shims, transfer);
+        return;
+    }
+
+    transfer->state = DIAGNOSTIC_FLASH_TRANSFER_DATA;
+    // the ECU echoes the counter, so it's checked like a PID
+    DiagnosticRequest request = {
+        mode: DIAGNOSTIC_TRANSFER_DATA_MODE,
+        has_pid: true,
+        pid: transfer->block_sequence_counter,
+        pid_length: 1,
+        large_payload: &transfer->image[transfer->offset],
+        large_payload_length: transfer->next_length
+    };
+    uint16_t length = transfer->next_length;
+    send_request(shims, transfer, &request);
+    if(transfer->state == DIAGNOSTIC_FLASH_TRANSFER_DATA) {
+        // the counter wraps from 0xff to 0
+        prepare_block(transfer, transfer->offset + length,
+                transfer->block_sequence_counter + 1);
+    }
+}
+
+bool diagnostic_flash_start(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer) {
+    transfer->state = DIAGNOSTIC_FLASH_REQUEST_DOWNLOAD;
+    transfer->offset = 0;
+    transfer->bytes_transferred = 0;
+    transfer->blocks_transferred = 0;
+    transfer->response_pending_total = 0;
+    if(shims->get_time_us != NULL) {
+        transfer->start_time_us = shims->get_time_us();
+    }
+
+    uint8_t* payload = transfer->download_request;
+    payload[0] = transfer->data_format;
+    payload[1] = ADDRESS_AND_LENGTH_FORMAT;
+    for(int i = 0; i < 4; i++) {
+        payload[2 + i] = transfer->memory_address >> (24 - i * 8);
+        payload[6 + i] = transfer->image_size >> (24 - i * 8);
+    }
+
+    DiagnosticRequest request = {
+        mode: DIAGNOSTIC_REQUEST_DOWNLOAD_MODE,
+        large_payload: transfer->download_request,
+        large_payload_length: sizeof(transfer->download_request)
+    };
+    send_request(shims, transfer, &request);
+    return transfer->state != DIAGNOSTIC_FLASH_FAILED;
+}
+
+/* Private: Read maxNumberOfBlockLength from a RequestDownload response. It
+ * counts the service ID and block sequence counter, so the usable part of each
+ * block is 2 bytes shorter.
+ */
+static bool handle_download_response(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer, const DiagnosticResponse* response) {
+    uint8_t length_size = response->payload_length > 0 ?
+            response->payload[0] >> 4 : 0;
+    if(length_size == 0 || length_size > 4 ||
+            response->payload_length < 1 + length_size) {
+        fail(shims, transfer, "malformed RequestDownload response");
+        return false;
+    }
+
+    uint32_t block_length = 0;
+    for(uint8_t i = 0; i < length_size; i++) {
+        block_length = (block_length << 8) | response->payload[1 + i];
+    }
+
+    if(block_length > MAX_DIAGNOSTIC_REQUEST_SIZE) {
+        block_length = MAX_DIAGNOSTIC_REQUEST_SIZE;
+    }
+    if(block_length <= TRANSFER_DATA_HEADER_SIZE) {
+        fail(shims, transfer, "ECU accepts no data per block");
+        return false;
+    }
+    transfer->block_length = block_length;
+    return true;
+}
+
+static void handle_response(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer, const DiagnosticResponse* response) {
+    if(!response->completed) {
+        fail(shims, transfer, "request could not be sent");
+        return;
+    }
+
+    if(!response->success) {
+        transfer->negative_response_code = response->negative_response_code;
+        fail(shims, transfer, "ECU refused the request");
+        return;
+    }
+
+    switch(transfer->state) {
+        case DIAGNOSTIC_FLASH_REQUEST_DOWNLOAD:
+            if(handle_download_response(shims, transfer, response)) {
+                prepare_block(transfer, 0, 1);
+                send_next_block(shims, transfer);
+            }
+            break;
+        case DIAGNOSTIC_FLASH_TRANSFER_DATA:
+            transfer->bytes_transferred += transfer->next_offset -
+                    transfer->offset;
+            ++transfer->blocks_transferred;
+            send_next_block(shims, transfer);
+            break;
+        case DIAGNOSTIC_FLASH_TRANSFER_EXIT:
+            transfer->state = DIAGNOSTIC_FLASH_COMPLETED;
+            if(shims->get_time_us != NULL) {
+                transfer->end_time_us = shims->get_time_us();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Private: Count the ECU's "response pending" waits for the current request,
+ * returning true if there are new ones.
+ */
+static bool update_response_pending(DiagnosticFlashTransfer* transfer) {
+    uint16_t count = transfer->handle.response_pending_count;
+    if(count == transfer->response_pending_count) {
+        return false;
+    }
+
+    transfer->response_pending_total += count -
+            transfer->response_pending_count;
+    transfer->response_pending_count = count;
+    return true;
+}
+
+/* Private: Arm the response timeout once the request is sent, restart it with
+ * the extended timeout each time the ECU says the response is pending, and
+ * fail the download if it expires.
+ */
+static void update_timeout(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer) {
+    bool response_pending = update_response_pending(transfer);
+    if(shims->get_time_us == NULL || diagnostic_flash_completed(transfer) ||
+            !diagnostic_request_sent(&transfer->handle)) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    if(response_pending) {
+        transfer->deadline_us = now + (transfer->extended_timeout_us != 0 ?
+                transfer->extended_timeout_us : DEFAULT_EXTENDED_TIMEOUT_US);
+        transfer->deadline_armed = true;
+    } else if(!transfer->deadline_armed) {
+        transfer->deadline_us = now + (transfer->response_timeout_us != 0 ?
+                transfer->response_timeout_us : DEFAULT_RESPONSE_TIMEOUT_US);
+        transfer->deadline_armed = true;
+    } else if((int32_t)(now - transfer->deadline_us) >= 0) {
+        fail(shims, transfer, "timed out waiting for a response");
+    }
+}
+
+void diagnostic_flash_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    if(diagnostic_flash_completed(transfer) ||
+            transfer->state == DIAGNOSTIC_FLASH_IDLE) {
+        return;
+    }
+
+    DiagnosticResponse response = diagnostic_receive_can_frame(shims,
+            &transfer->handle, arbitration_id, data, size);
+    if(transfer->handle.completed) {
+        handle_response(shims, transfer, &response);
+    }
+    update_timeout(shims, transfer);
+}
+
+void diagnostic_flash_poll(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer) {
+    if(diagnostic_flash_completed(transfer) ||
+            transfer->state == DIAGNOSTIC_FLASH_IDLE) {
+        return;
+    }
+
+    diagnostic_poll_request(shims, &transfer->handle);
+    if(transfer->handle.completed) {
+        fail(shims, transfer, "request could not be sent");
+        return;
+    }
+    update_timeout(shims, transfer);
+}
+
+void diagnostic_flash_next_deadline(DiagnosticShims* shims,
+        const DiagnosticFlashTransfer* transfer, DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL || diagnostic_flash_completed(transfer) ||
+            transfer->state == DIAGNOSTIC_FLASH_IDLE) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    diagnostic_request_next_deadline(shims, &transfer->handle, deadline);
+    if(transfer->deadline_armed) {
+        int32_t remaining_us = (int32_t)(transfer->deadline_us - now);
+        diagnostic_add_deadline(deadline, now, now,
+                remaining_us > 0 ? remaining_us : 0);
+    } else if(diagnostic_request_sent(&transfer->handle)) {
+        // the timeout is armed by the next poll
+        diagnostic_add_deadline(deadline, now, now, 0);
+    }
+}
+
+bool diagnostic_flash_completed(const DiagnosticFlashTransfer* transfer) {
+    return transfer->state == DIAGNOSTIC_FLASH_COMPLETED ||
+        transfer->state == DIAGNOSTIC_FLASH_FAILED;
+}
+
+uint32_t diagnostic_flash_theoretical_throughput(uint32_t bitrate,
+        uint32_t data_bitrate, bool can_fd) {
+    if(bitrate == 0) {
+        return 0;
+    }
+
+    if(!can_fd) {
+        return (uint64_t) bitrate * CLASSIC_FRAME_DATA_BYTES /
+            CLASSIC_FRAME_BITS;
+    }
+
+    if(data_bitrate == 0) {
+        data_bitrate = bitrate;
+    }
+    // the time for one frame is nominal bits / bitrate + data bits /
+    // data_bitrate, kept in integers by scaling both by both bitrates
+    return (uint64_t) FD_FRAME_DATA_BYTES * bitrate * data_bitrate /
+        ((uint64_t) FD_FRAME_NOMINAL_BITS * data_bitrate +
+            (uint64_t) FD_FRAME_DATA_PHASE_BITS * bitrate);
+}
+
+DiagnosticFlashStatistics diagnostic_flash_statistics(DiagnosticShims* shims,
+        const DiagnosticFlashTransfer* transfer) {
+    DiagnosticFlashStatistics statistics = {
+        bytes_transferred: transfer->bytes_transferred,
+        blocks_transferred: transfer->blocks_transferred,
+        response_pending_count: transfer->response_pending_total,
+        theoretical_bytes_per_second: diagnostic_flash_theoretical_throughput(
+                transfer->bitrate, transfer->data_bitrate, transfer->can_fd)
+    };
+
+    if(shims->get_time_us != NULL &&
+            transfer->state != DIAGNOSTIC_FLASH_IDLE) {
+        uint32_t end = diagnostic_flash_completed(transfer) ?
+                transfer->end_time_us : shims->get_time_us();
+        statistics.elapsed_us = end - transfer->start_time_us;
+    }
+
+    if(statistics.elapsed_us > 0) {
+        statistics.bytes_per_second = (uint64_t) transfer->bytes_transferred *
+                1000000 / statistics.elapsed_us;
+    }
+    return statistics;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+const uint8_t* diagnostic_flash_map_image(const char* path, uint32_t* size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct stat status;
+    void* image = MAP_FAILED;
+    if(fstat(fd, &status) == 0 && status.st_size > 0 &&
+            status.st_size <= UINT32_MAX) {
+        image = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if(image == MAP_FAILED) {
+        return NULL;
+    }
+    // read ahead aggressively, the image is read once from start to end
+    madvise(image, status.st_size, MADV_SEQUENTIAL);
+    *size = status.st_size;
+    return image;
+}
+
+void diagnostic_flash_unmap_image(const uint8_t* image, uint32_t size) {
+    munmap((void*) image, size);
+}
+
+#endif // defined(__unix__) || defined(__APPLE__)
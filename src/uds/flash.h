@@ -0,0 +1,198 @@
+#ifndef __FLASH_H__
+#define __FLASH_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIAGNOSTIC_REQUEST_DOWNLOAD_MODE 0x34
+#define DIAGNOSTIC_TRANSFER_DATA_MODE 0x36
+#define DIAGNOSTIC_REQUEST_TRANSFER_EXIT_MODE 0x37
+
+// RequestDownload with a 4 byte address and a 4 byte size
+#define DIAGNOSTIC_REQUEST_DOWNLOAD_SIZE 10
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: The steps of a flash download.
+ */
+typedef enum {
+    DIAGNOSTIC_FLASH_IDLE,
+    DIAGNOSTIC_FLASH_REQUEST_DOWNLOAD,
+    DIAGNOSTIC_FLASH_TRANSFER_DATA,
+    DIAGNOSTIC_FLASH_TRANSFER_EXIT,
+    DIAGNOSTIC_FLASH_COMPLETED,
+    DIAGNOSTIC_FLASH_FAILED
+} DiagnosticFlashState;
+
+/* Public: A firmware download to one ECU: RequestDownload (0x34), then one
+ * TransferData (0x36) per block of the image, then RequestTransferExit (0x37).
+ *
+ * Initialize it with diagnostic_init_flash(...), then set any optional fields
+ * before calling diagnostic_flash_start(...).
+ *
+ * arbitration_id - The arbitration ID of the ECU.
+ * can_fd - true if the download should use CAN FD frames.
+ * image - The image to download, e.g. mapped with diagnostic_flash_map_image.
+ *      It is sent straight from this buffer, so it must stay valid until the
+ *      download is completed.
+ * image_size - The size of the image.
+ * memory_address - The address the ECU should write the image to.
+ * data_format - The dataFormatIdentifier for RequestDownload, 0 for an
+ *      uncompressed and unencrypted image.
+ * response_timeout_us - (optional) How long to wait for a response (P2). The
+ *      default is 50ms. Timeouts are only enforced with the get_time_us shim.
+ * extended_timeout_us - (optional) How long to wait after the ECU says a
+ *      response is pending (P2*). The default is 5s.
+ * bitrate - (optional) The bus bitrate, used to calculate the theoretical limit
+ *      for the statistics.
+ * data_bitrate - (optional) The CAN FD data phase bitrate, if it's switched.
+ * state - The current step of the download.
+ * negative_response_code - If the ECU refused a request, the reason.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    bool can_fd;
+    const uint8_t* image;
+    uint32_t image_size;
+    uint32_t memory_address;
+    uint8_t data_format;
+    uint32_t response_timeout_us;
+    uint32_t extended_timeout_us;
+    uint32_t bitrate;
+    uint32_t data_bitrate;
+    DiagnosticFlashState state;
+    DiagnosticNegativeResponseCode negative_response_code;
+
+    // Private
+    DiagnosticRequestHandle handle;
+    uint8_t download_request[DIAGNOSTIC_REQUEST_DOWNLOAD_SIZE];
+    uint16_t block_length;
+    uint32_t offset;
+    uint8_t block_sequence_counter;
+    uint32_t next_offset;
+    uint16_t next_length;
+    uint8_t next_block_sequence_counter;
+    uint32_t bytes_transferred;
+    uint32_t blocks_transferred;
+    uint32_t response_pending_total;
+    uint16_t response_pending_count;
+    bool deadline_armed;
+    uint32_t deadline_us;
+    uint32_t start_time_us;
+    uint32_t end_time_us;
+} DiagnosticFlashTransfer;
+
+/* Public: How fast a download went, compared to what the bus could carry.
+ *
+ * bytes_transferred - The number of image bytes the ECU acknowledged.
+ * blocks_transferred - The number of TransferData requests acknowledged.
+ * response_pending_count - The number of NRC 0x78 waits absorbed.
+ * elapsed_us - The time from the start of the download to its completion (or
+ *      now, if it's still in progress). 0 without the get_time_us shim.
+ * bytes_per_second - The achieved throughput of image data.
+ * theoretical_bytes_per_second - The most image data per second the bus could
+ *      carry in consecutive frames, ignoring stuff bits. 0 if the bitrate isn't
+ *      known.
+ */
+typedef struct {
+    uint32_t bytes_transferred;
+    uint32_t blocks_transferred;
+    uint32_t response_pending_count;
+    uint32_t elapsed_us;
+    uint32_t bytes_per_second;
+    uint32_t theoretical_bytes_per_second;
+} DiagnosticFlashStatistics;
+
+/* Public: Initialize a download of an image to an ECU.
+ *
+ * transfer - the download to initialize.
+ * arbitration_id - the arbitration ID of the ECU.
+ * image - the image to download.
+ * image_size - the size of the image.
+ * memory_address - the address the ECU should write the image to.
+ */
+void diagnostic_init_flash(DiagnosticFlashTransfer* transfer,
+        uint32_t arbitration_id, const uint8_t* image, uint32_t image_size,
+        uint32_t memory_address);
+
+/* Public: Start the download by sending RequestDownload.
+ *
+ * Returns false if the request could not be sent.
+ */
+bool diagnostic_flash_start(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer);
+
+/* Public: Continue the download with a received CAN frame. Pass every frame
+ * received while the download is in progress.
+ *
+ * When the ECU acknowledges a block the next one is sent right away - its
+ * request was prepared, and its part of the image paged in, while the previous
+ * block was on the bus.
+ */
+void diagnostic_flash_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size);
+
+/* Public: Send consecutive frames that are due and check for response
+ * timeouts. Call this regularly from your main loop.
+ */
+void diagnostic_flash_poll(DiagnosticShims* shims,
+        DiagnosticFlashTransfer* transfer);
+
+/* Public: Add the next time the download needs diagnostic_flash_poll(...) -
+ * a consecutive frame or a response timeout - to a deadline. Does nothing
+ * without the get_time_us shim.
+ */
+void diagnostic_flash_next_deadline(DiagnosticShims* shims,
+        const DiagnosticFlashTransfer* transfer, DiagnosticDeadline* deadline);
+
+/* Public: Returns true if the download is finished, successfully or not -
+ * check 'state' to see which.
+ */
+bool diagnostic_flash_completed(const DiagnosticFlashTransfer* transfer);
+
+/* Public: Returns statistics for the download so far.
+ *
+ * shims - Low-level shims, only get_time_us is used.
+ */
+DiagnosticFlashStatistics diagnostic_flash_statistics(DiagnosticShims* shims,
+        const DiagnosticFlashTransfer* transfer);
+
+/* Public: Returns the most image bytes per second a bus could carry in
+ * consecutive frames with 11-bit IDs, ignoring stuff bits.
+ *
+ * bitrate - the (arbitration phase) bitrate.
+ * data_bitrate - the CAN FD data phase bitrate, or 0 if it isn't switched.
+ * can_fd - true for 64 byte CAN FD frames.
+ */
+uint32_t diagnostic_flash_theoretical_throughput(uint32_t bitrate,
+        uint32_t data_bitrate, bool can_fd);
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/* Public: Map a firmware image file read-only into memory, to download without
+ * reading it into a buffer first.
+ *
+ * path - the path of the image file.
+ * size - set to the size of the image.
+ *
+ * Returns the mapped image, or NULL if the file could not be mapped.
+ */
+const uint8_t* diagnostic_flash_map_image(const char* path, uint32_t* size);
+
+/* Public: Unmap an image mapped with diagnostic_flash_map_image.
+ */
+void diagnostic_flash_unmap_image(const uint8_t* image, uint32_t size);
+
+#endif // defined(__unix__) || defined(__APPLE__)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FLASH_H__
@@ -0,0 +1,150 @@
+#include <uds/flow_control.h>
+#include <stddef.h>
+
+#define MAX_SEPARATION_TIME_MS 0x7f
+#define MAX_SEPARATION_TIME_US (MAX_SEPARATION_TIME_MS * 1000)
+#define SEPARATION_TIME_US_BASE 0xf0
+#define SEPARATION_TIME_US_STEP 100
+#define MIN_SEPARATION_TIME_US 100
+#define MAX_SUB_MS_SEPARATION_TIME_US 900
+
+// The measured frame cadence has to improve by at least this many percent for
+// tuning to keep lowering the separation time.
+#define MIN_CADENCE_IMPROVEMENT_PERCENT 10
+
+void diagnostic_init_flow_control_profile(DiagnosticFlowControlProfile* profile,
+        uint32_t arbitration_id, uint8_t block_size,
+        uint32_t separation_time_us, bool auto_tune) {
+    DiagnosticFlowControlProfile initialized = {
+        arbitration_id: arbitration_id,
+        flow_control: {
+            block_size: block_size,
+            separation_time_us: separation_time_us
+        },
+        auto_tune: auto_tune,
+        tuned: {
+            block_size: block_size,
+            separation_time_us: separation_time_us
+        },
+        good_separation_time_us: separation_time_us
+    };
+    *profile = initialized;
+}
+
+DiagnosticFlowControlProfile* diagnostic_find_flow_control_profile(
+        DiagnosticFlowControlProfile profiles[], uint8_t profile_count,
+        uint32_t arbitration_id) {
+    uint8_t i;
+    for(i = 0; profiles != NULL && i < profile_count; ++i) {
+        if(profiles[i].arbitration_id == arbitration_id) {
+            return &profiles[i];
+        }
+    }
+    return NULL;
+}
+
+/* Private: Round a separation time to one that can be sent in a flow control
+ * frame.
+ */
+static uint32_t representable_separation_time(uint32_t separation_time_us) {
+    return diagnostic_decode_separation_time(
+            diagnostic_encode_separation_time(separation_time_us));
+}
+
+static uint32_t next_separation_time(DiagnosticFlowControlProfile* profile) {
+    uint32_t current = profile->tuned.separation_time_us;
+    uint32_t next = current / 2;
+    if(next < MIN_SEPARATION_TIME_US) {
+        next = 0;
+    }
+
+    if(profile->has_failed && next <= profile->failed_separation_time_us) {
+        // bisect between what failed and what works
+        next = profile->failed_separation_time_us +
+                (current - profile->failed_separation_time_us) / 2;
+    }
+    return representable_separation_time(next);
+}
+
+void diagnostic_tune_flow_control(DiagnosticFlowControlProfile* profile,
+        bool overrun, uint32_t frame_interval_us,
+        uint16_t frame_interval_count) {
+    if(!profile->auto_tune) {
+        return;
+    }
+
+    uint32_t current = profile->tuned.separation_time_us;
+    if(overrun) {
+        if(!profile->has_failed ||
+                current > profile->failed_separation_time_us) {
+            profile->failed_separation_time_us = current;
+        }
+        profile->has_failed = true;
+        profile->converged = true;
+
+        uint32_t backoff = profile->good_separation_time_us;
+        if(backoff <= profile->failed_separation_time_us) {
+            // nothing is known to work - back off further
+            backoff = profile->failed_separation_time_us * 2 +
+                    MIN_SEPARATION_TIME_US;
+        }
+        // the configured setting is the most conservative one used
+        if(backoff > profile->flow_control.separation_time_us) {
+            backoff = profile->flow_control.separation_time_us;
+        }
+        profile->tuned.separation_time_us =
+                representable_separation_time(backoff);
+        return;
+    }
+
+    profile->good_separation_time_us = current;
+    if(frame_interval_count == 0) {
+        return;
+    }
+
+    uint32_t previous_interval = profile->frame_interval_us;
+    profile->frame_interval_us = frame_interval_us;
+    if(profile->converged || current == 0) {
+        return;
+    }
+
+    if(previous_interval != 0 && frame_interval_us * 100 >= previous_interval *
+            (100 - MIN_CADENCE_IMPROVEMENT_PERCENT)) {
+        // asking for less didn't make the node send faster, so this is as
+        // fast as it goes
+        profile->converged = true;
+        return;
+    }
+
+    uint32_t next = next_separation_time(profile);
+    if(next >= current) {
+        profile->converged = true;
+    } else {
+        profile->tuned.separation_time_us = next;
+    }
+}
+
+uint8_t diagnostic_encode_separation_time(uint32_t separation_time_us) {
+    if(separation_time_us == 0) {
+        return 0;
+    } else if(separation_time_us <= MAX_SUB_MS_SEPARATION_TIME_US) {
+        return SEPARATION_TIME_US_BASE + (separation_time_us +
+                SEPARATION_TIME_US_STEP - 1) / SEPARATION_TIME_US_STEP;
+    }
+
+    uint32_t separation_time_ms = (separation_time_us + 999) / 1000;
+    return separation_time_ms > MAX_SEPARATION_TIME_MS ?
+            MAX_SEPARATION_TIME_MS : separation_time_ms;
+}
+
+uint32_t diagnostic_decode_separation_time(uint8_t separation_time) {
+    if(separation_time <= MAX_SEPARATION_TIME_MS) {
+        return separation_time * 1000;
+    } else if(separation_time > SEPARATION_TIME_US_BASE &&
+            separation_time <= SEPARATION_TIME_US_BASE +
+                MAX_SUB_MS_SEPARATION_TIME_US / SEPARATION_TIME_US_STEP) {
+        return (separation_time - SEPARATION_TIME_US_BASE) *
+                SEPARATION_TIME_US_STEP;
+    }
+    return MAX_SEPARATION_TIME_US;
+}
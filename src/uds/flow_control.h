@@ -0,0 +1,60 @@
+#ifndef __FLOW_CONTROL_H__
+#define __FLOW_CONTROL_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: Initialize the flow control settings for one responding node.
+ *
+ * profile - the profile to initialize.
+ * arbitration_id - the arbitration ID the node responds on.
+ * block_size - the block size to send in flow control frames, 0 for no limit.
+ * separation_time_us - the separation time to send in flow control frames.
+ *      With auto_tune, tuning starts here and never goes above it.
+ * auto_tune - true to tune the separation time down to what the node
+ *      actually sustains. Requires the get_time_us shim.
+ */
+void diagnostic_init_flow_control_profile(DiagnosticFlowControlProfile* profile,
+        uint32_t arbitration_id, uint8_t block_size,
+        uint32_t separation_time_us, bool auto_tune);
+
+/* Public: Returns the profile for the given responding arbitration ID, or NULL
+ * if there is none.
+ */
+DiagnosticFlowControlProfile* diagnostic_find_flow_control_profile(
+        DiagnosticFlowControlProfile profiles[], uint8_t profile_count,
+        uint32_t arbitration_id);
+
+/* Private: Update an auto-tuned profile after a multi-frame response.
+ *
+ * overrun - true if consecutive frames were lost, i.e. the separation time was
+ *      too aggressive.
+ * frame_interval_us - the average measured gap between consecutive frames.
+ * frame_interval_count - the number of gaps the average was taken over, or 0
+ *      if they weren't measured.
+ */
+void diagnostic_tune_flow_control(DiagnosticFlowControlProfile* profile,
+        bool overrun, uint32_t frame_interval_us,
+        uint16_t frame_interval_count);
+
+/* Public: Encode a separation time in microseconds as an ISO-TP STmin byte,
+ * rounding up to the next value it can represent (100us steps up to 900us,
+ * then 1ms steps up to 127ms).
+ */
+uint8_t diagnostic_encode_separation_time(uint32_t separation_time_us);
+
+/* Public: Decode an ISO-TP STmin byte to microseconds. Reserved values are
+ * treated as the longest separation time, 127ms.
+ */
+uint32_t diagnostic_decode_separation_time(uint8_t separation_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __FLOW_CONTROL_H__
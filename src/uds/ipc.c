@@ -0,0 +1,239 @@
+#include <uds/ipc.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define RING_MASK (IPC_RING_SIZE - 1)
+
+#if (IPC_RING_SIZE & (IPC_RING_SIZE - 1)) != 0
+#error "IPC_RING_SIZE must be a power of 2"
+#endif
+
+// Each ring index is written by one side and read by the other: the writer
+// publishes a slot with a release store of its index once the slot is filled
+// (or emptied), and the reader loads the index with acquire before touching the
+// slot.
+#define LOAD(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define STORE(index, value) \
+        __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+
+void diagnostic_ipc_init_segment(DiagnosticIpcSegment* segment) {
+    memset(segment, 0, sizeof(DiagnosticIpcSegment));
+    segment->size = sizeof(DiagnosticIpcSegment);
+    STORE(segment->magic, DIAGNOSTIC_IPC_MAGIC);
+}
+
+bool diagnostic_ipc_attach(DiagnosticIpcClient* client,
+        DiagnosticIpcSegment* segment) {
+    client->channel = NULL;
+    if(LOAD(segment->magic) != DIAGNOSTIC_IPC_MAGIC ||
+            segment->size != sizeof(DiagnosticIpcSegment)) {
+        return false;
+    }
+
+    for(uint8_t i = 0; i < MAX_IPC_CLIENTS; i++) {
+        DiagnosticIpcChannel* channel = &segment->channels[i];
+        uint32_t expected = DIAGNOSTIC_IPC_CHANNEL_FREE;
+        if(__atomic_compare_exchange_n(&channel->state, &expected,
+                    DIAGNOSTIC_IPC_CHANNEL_ATTACHED, false, __ATOMIC_ACQ_REL,
+                    __ATOMIC_ACQUIRE)) {
+            client->channel = channel;
+            client->next_tag = 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+void diagnostic_ipc_detach(DiagnosticIpcClient* client) {
+    if(client->channel != NULL) {
+        STORE(client->channel->state, DIAGNOSTIC_IPC_CHANNEL_DETACHED);
+        client->channel = NULL;
+    }
+}
+
+uint32_t diagnostic_ipc_submit(DiagnosticIpcClient* client,
+        const DiagnosticRequest* request, DiagnosticPriority priority) {
+    DiagnosticIpcChannel* channel = client->channel;
+    if(channel == NULL || request->large_payload_length > 0) {
+        return 0;
+    }
+
+    uint32_t head = channel->request_head;
+    if(head - LOAD(channel->request_tail) >= IPC_RING_SIZE) {
+        return 0;
+    }
+
+    DiagnosticIpcRequest* slot = &channel->requests[head & RING_MASK];
+    slot->tag = client->next_tag++;
+    if(client->next_tag == 0) {
+        client->next_tag = 1;
+    }
+    slot->priority = priority;
+    slot->request = *request;
+    slot->request.large_payload = NULL;
+    STORE(channel->request_head, head + 1);
+    return slot->tag;
+}
+
+const DiagnosticIpcResponse* diagnostic_ipc_peek_response(
+        DiagnosticIpcClient* client) {
+    DiagnosticIpcChannel* channel = client->channel;
+    if(channel == NULL) {
+        return NULL;
+    }
+
+    uint32_t tail = channel->response_tail;
+    if(LOAD(channel->response_head) == tail) {
+        return NULL;
+    }
+
+    DiagnosticIpcResponse* slot = &channel->responses[tail & RING_MASK];
+    // the daemon's pointer means nothing in this process
+    slot->response.full_payload = slot->response.full_payload_length > 0 ?
+            slot->payload : NULL;
+    return slot;
+}
+
+void diagnostic_ipc_release_response(DiagnosticIpcClient* client) {
+    DiagnosticIpcChannel* channel = client->channel;
+    if(channel != NULL &&
+            LOAD(channel->response_head) != channel->response_tail) {
+        STORE(channel->response_tail, channel->response_tail + 1);
+    }
+}
+
+uint32_t diagnostic_ipc_dropped_response_count(
+        const DiagnosticIpcClient* client) {
+    return client->channel == NULL ? 0 :
+            __atomic_load_n(&client->channel->dropped_response_count,
+                __ATOMIC_RELAXED);
+}
+
+const DiagnosticIpcRequest* diagnostic_ipc_next_request(
+        DiagnosticIpcSegment* segment, uint8_t channel_index) {
+    DiagnosticIpcChannel* channel = &segment->channels[channel_index];
+    if(LOAD(channel->state) != DIAGNOSTIC_IPC_CHANNEL_ATTACHED) {
+        return NULL;
+    }
+
+    uint32_t tail = channel->request_tail;
+    if(LOAD(channel->request_head) == tail) {
+        return NULL;
+    }
+    return &channel->requests[tail & RING_MASK];
+}
+
+void diagnostic_ipc_consume_request(DiagnosticIpcSegment* segment,
+        uint8_t channel_index) {
+    DiagnosticIpcChannel* channel = &segment->channels[channel_index];
+    if(LOAD(channel->request_head) != channel->request_tail) {
+        STORE(channel->request_tail, channel->request_tail + 1);
+    }
+}
+
+uint32_t diagnostic_ipc_channel_generation(const DiagnosticIpcSegment* segment,
+        uint8_t channel_index) {
+    return segment->channels[channel_index].generation;
+}
+
+bool diagnostic_ipc_post_response(DiagnosticIpcSegment* segment,
+        uint8_t channel_index, uint32_t generation, uint32_t tag,
+        const DiagnosticResponse* response) {
+    DiagnosticIpcChannel* channel = &segment->channels[channel_index];
+    if(LOAD(channel->state) != DIAGNOSTIC_IPC_CHANNEL_ATTACHED ||
+            channel->generation != generation) {
+        return false;
+    }
+
+    uint32_t head = channel->response_head;
+    if(head - LOAD(channel->response_tail) >= IPC_RING_SIZE ||
+            response->full_payload_length > MAX_IPC_RESPONSE_SIZE) {
+        __atomic_add_fetch(&channel->dropped_response_count, 1,
+                __ATOMIC_RELAXED);
+        return false;
+    }
+
+    DiagnosticIpcResponse* slot = &channel->responses[head & RING_MASK];
+    slot->tag = tag;
+    slot->response = *response;
+    slot->response.full_payload = NULL;
+    if(response->full_payload != NULL) {
+        memcpy(slot->payload, response->full_payload,
+                response->full_payload_length);
+    } else {
+        slot->response.full_payload_length = 0;
+    }
+    STORE(channel->response_head, head + 1);
+    return true;
+}
+
+void diagnostic_ipc_reclaim_channels(DiagnosticIpcSegment* segment) {
+    for(uint8_t i = 0; i < MAX_IPC_CLIENTS; i++) {
+        DiagnosticIpcChannel* channel = &segment->channels[i];
+        if(LOAD(channel->state) != DIAGNOSTIC_IPC_CHANNEL_DETACHED) {
+            continue;
+        }
+
+        // the client is gone, so the daemon empties both rings
+        channel->request_tail = LOAD(channel->request_head);
+        channel->response_tail = channel->response_head;
+        channel->dropped_response_count = 0;
+        ++channel->generation;
+        STORE(channel->state, DIAGNOSTIC_IPC_CHANNEL_FREE);
+    }
+}
+
+#ifdef __linux__
+
+DiagnosticIpcSegment* diagnostic_ipc_open_segment(const char* name,
+        bool create) {
+    int fd;
+    if(create) {
+        shm_unlink(name);
+        fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0660);
+        if(fd >= 0 && ftruncate(fd, sizeof(DiagnosticIpcSegment)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = shm_open(name, O_RDWR, 0);
+    }
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct stat status;
+    void* memory = MAP_FAILED;
+    if(fstat(fd, &status) == 0 &&
+            status.st_size == sizeof(DiagnosticIpcSegment)) {
+        memory = mmap(NULL, sizeof(DiagnosticIpcSegment),
+                PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if(memory == MAP_FAILED) {
+        return NULL;
+    }
+
+    DiagnosticIpcSegment* segment = (DiagnosticIpcSegment*) memory;
+    if(create) {
+        diagnostic_ipc_init_segment(segment);
+    } else if(LOAD(segment->magic) != DIAGNOSTIC_IPC_MAGIC) {
+        diagnostic_ipc_close_segment(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+void diagnostic_ipc_close_segment(DiagnosticIpcSegment* segment) {
+    if(segment != NULL) {
+        munmap(segment, sizeof(DiagnosticIpcSegment));
+    }
+}
+
+#endif // __linux__
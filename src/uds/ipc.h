@@ -0,0 +1,240 @@
+#ifndef __IPC_H__
+#define __IPC_H__
+
+#include <uds/uds_types.h>
+#include <uds/scheduler.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of client processes attached to one segment at a time.
+#ifndef MAX_IPC_CLIENTS
+#define MAX_IPC_CLIENTS 8
+#endif
+
+// The number of requests and of responses each client can have waiting in its
+// rings. Must be a power of 2.
+#ifndef IPC_RING_SIZE
+#define IPC_RING_SIZE 32
+#endif
+
+// The longest response payload a client receives - the largest ISO-TP message.
+#ifndef MAX_IPC_RESPONSE_SIZE
+#define MAX_IPC_RESPONSE_SIZE 4095
+#endif
+
+#define DIAGNOSTIC_IPC_MAGIC 0x55445331
+// keeps the indices written by the daemon and by a client apart, so they don't
+// bounce one cache line between the two processes
+#define DIAGNOSTIC_IPC_CACHE_LINE 64
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Shared memory between a DiagnosticDaemon (see uds/daemon.h), which owns the
+ * CAN bus, and the processes that want to send it requests. Each client
+ * attaches to a channel of its own, with two single producer, single consumer
+ * lock-free rings: requests from the client to the daemon, and responses back.
+ * Responses are written into the ring once, payload and all, and read where
+ * they lie, with no system call or copy on either side.
+ *
+ * Nothing wakes the other side up: the daemon and the clients poll the rings
+ * from their own loops.
+ */
+
+typedef enum {
+    DIAGNOSTIC_IPC_CHANNEL_FREE,
+    DIAGNOSTIC_IPC_CHANNEL_ATTACHED,
+    // the client has detached, and the daemon hasn't emptied the rings yet
+    DIAGNOSTIC_IPC_CHANNEL_DETACHED
+} DiagnosticIpcChannelState;
+
+/* Public: A request in a client's ring.
+ *
+ * tag - Identifies the response to it, unique to the client.
+ * priority - How urgent the request is, as for diagnostic_schedule_request.
+ * request - The request. Its large_payload is never used.
+ */
+typedef struct {
+    uint32_t tag;
+    DiagnosticPriority priority;
+    DiagnosticRequest request;
+} DiagnosticIpcRequest;
+
+/* Public: A response in a client's ring.
+ *
+ * tag - The tag of the request it answers.
+ * response - The response. Its full_payload points at 'payload' once it's
+ *      returned by diagnostic_ipc_peek_response(...).
+ * payload - The complete payload of the response.
+ */
+typedef struct {
+    uint32_t tag;
+    DiagnosticResponse response;
+    uint8_t payload[MAX_IPC_RESPONSE_SIZE];
+} DiagnosticIpcResponse;
+
+/* Private: The rings of one client. The indices count up forever and are
+ * masked into the rings; each is only written by one side.
+ */
+typedef struct {
+    uint32_t state;
+    uint32_t generation;
+    uint32_t dropped_response_count;
+
+    // written by the client
+    uint32_t request_head __attribute__((aligned(DIAGNOSTIC_IPC_CACHE_LINE)));
+    uint32_t response_tail;
+    // written by the daemon
+    uint32_t request_tail __attribute__((aligned(DIAGNOSTIC_IPC_CACHE_LINE)));
+    uint32_t response_head;
+
+    DiagnosticIpcRequest requests[IPC_RING_SIZE];
+    DiagnosticIpcResponse responses[IPC_RING_SIZE];
+} DiagnosticIpcChannel;
+
+/* Public: The shared memory segment. Map it with diagnostic_ipc_open_segment,
+ * or initialize any other memory the daemon and clients share with
+ * diagnostic_ipc_init_segment - e.g. a static buffer, for a daemon and clients
+ * in one process.
+ *
+ * magic, size - Identify the segment, and catch a daemon and clients built
+ *      with different limits.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+
+    // Private
+    DiagnosticIpcChannel channels[MAX_IPC_CLIENTS];
+} DiagnosticIpcSegment;
+
+/* Public: One client's end of a segment. Attach it with diagnostic_ipc_attach.
+ *
+ * The fields are private.
+ */
+typedef struct {
+    DiagnosticIpcChannel* channel;
+    uint32_t next_tag;
+} DiagnosticIpcClient;
+
+/* Public: Initialize a segment with every channel free. Only the daemon does
+ * this, before any client attaches.
+ */
+void diagnostic_ipc_init_segment(DiagnosticIpcSegment* segment);
+
+/* Public: Attach a client to the first free channel of a segment.
+ *
+ * Returns false if the segment isn't initialized or every channel is in use.
+ */
+bool diagnostic_ipc_attach(DiagnosticIpcClient* client,
+        DiagnosticIpcSegment* segment);
+
+/* Public: Give the client's channel back. Requests still in its ring are
+ * dropped, and responses to those in flight are thrown away. A client that
+ * exits without detaching keeps its channel until the segment is initialized
+ * again.
+ */
+void diagnostic_ipc_detach(DiagnosticIpcClient* client);
+
+/* Public: Send a request to the daemon. Identical requests from several
+ * clients - same ECU, addressing, service, PID and payload - may be sent on
+ * the bus only once, and every client gets the response.
+ *
+ * request - the request. It's copied into the ring; a large_payload can't be
+ *      sent.
+ * priority - how urgent the request is.
+ *
+ * Returns the tag its response will have, or 0 if the client's request ring
+ * is full or the request has a large_payload.
+ */
+uint32_t diagnostic_ipc_submit(DiagnosticIpcClient* client,
+        const DiagnosticRequest* request, DiagnosticPriority priority);
+
+/* Public: Returns the oldest response in the client's ring, or NULL if there
+ * is none. It stays in the ring, and its payload valid, until
+ * diagnostic_ipc_release_response(...) is called. A request that couldn't be
+ * sent or timed out gets a response whose 'success' is false and no negative
+ * response code.
+ */
+const DiagnosticIpcResponse* diagnostic_ipc_peek_response(
+        DiagnosticIpcClient* client);
+
+/* Public: Remove the response returned by diagnostic_ipc_peek_response(...)
+ * from the ring, making room for the next.
+ */
+void diagnostic_ipc_release_response(DiagnosticIpcClient* client);
+
+/* Public: Returns the number of responses to the client thrown away because
+ * its response ring was full.
+ */
+uint32_t diagnostic_ipc_dropped_response_count(
+        const DiagnosticIpcClient* client);
+
+/* Public: Returns the oldest request from the client on a channel, or NULL if
+ * there is none or no client is attached. The daemon's end of the request
+ * ring; the request stays in the ring until
+ * diagnostic_ipc_consume_request(...).
+ */
+const DiagnosticIpcRequest* diagnostic_ipc_next_request(
+        DiagnosticIpcSegment* segment, uint8_t channel);
+
+/* Public: Remove the request returned by diagnostic_ipc_next_request(...)
+ * from a channel's ring.
+ */
+void diagnostic_ipc_consume_request(DiagnosticIpcSegment* segment,
+        uint8_t channel);
+
+/* Public: Returns the generation of a channel, which changes each time it's
+ * freed, to tell a client that attached to it later from the one that sent a
+ * request.
+ */
+uint32_t diagnostic_ipc_channel_generation(const DiagnosticIpcSegment* segment,
+        uint8_t channel);
+
+/* Public: Write a response into a channel's response ring, with a copy of its
+ * full payload. The daemon's end of the response ring.
+ *
+ * generation - the generation of the channel when the request was read. The
+ *      response is thrown away if the client has detached since.
+ * tag - the tag of the request.
+ *
+ * Returns false if the response was thrown away: the client detached, the
+ * ring was full or the payload was longer than MAX_IPC_RESPONSE_SIZE.
+ */
+bool diagnostic_ipc_post_response(DiagnosticIpcSegment* segment,
+        uint8_t channel, uint32_t generation, uint32_t tag,
+        const DiagnosticResponse* response);
+
+/* Public: Empty and free the channels of clients that detached. The daemon
+ * calls this regularly.
+ */
+void diagnostic_ipc_reclaim_channels(DiagnosticIpcSegment* segment);
+
+#ifdef __linux__
+
+/* Public: Map a POSIX shared memory segment.
+ *
+ * name - the name of the segment, e.g. "/uds".
+ * create - true for the daemon, to create the segment (replacing any left over)
+ *      and initialize it, false for a client, to map the daemon's.
+ *
+ * Returns the segment, or NULL if it couldn't be created or mapped, or was
+ * created by a daemon built with different limits.
+ */
+DiagnosticIpcSegment* diagnostic_ipc_open_segment(const char* name,
+        bool create);
+
+/* Public: Unmap a segment returned by diagnostic_ipc_open_segment(...).
+ */
+void diagnostic_ipc_close_segment(DiagnosticIpcSegment* segment);
+
+#endif // __linux__
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __IPC_H__
@@ -0,0 +1,116 @@
+#include <uds/isotp_socket.h>
+
+#ifdef __linux__
+
+#include <uds/uds.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/isotp.h>
+
+
+int diagnostic_isotp_socket_open(const char* interface, uint32_t tx_id,
+        uint32_t rx_id, bool frame_padding) {
+    int fd = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP);
+    if(fd < 0) {
+        return -1;
+    }
+
+    struct can_isotp_options options = {
+        flags: frame_padding ? CAN_ISOTP_TX_PADDING : 0,
+        frame_txtime: CAN_ISOTP_DEFAULT_FRAME_TXTIME,
+        txpad_content: 0
+    };
+    if(setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &options,
+                sizeof(options)) < 0) {
+        // without the options the padding would silently differ
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_can address = {0};
+    address.can_family = AF_CAN;
+    address.can_ifindex = if_nametoindex(interface);
+    address.can_addr.tp.tx_id = tx_id > CAN_SFF_MASK ?
+            (tx_id | CAN_EFF_FLAG) : tx_id;
+    address.can_addr.tp.rx_id = rx_id > CAN_SFF_MASK ?
+            (rx_id | CAN_EFF_FLAG) : rx_id;
+
+    if(address.can_ifindex == 0 ||
+            bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void diagnostic_isotp_socket_close(int socket) {
+    if(socket >= 0) {
+        close(socket);
+    }
+}
+
+DiagnosticRequestHandle diagnostic_request_isotp_socket(DiagnosticShims* shims,
+        int socket, DiagnosticRequest* request,
+        DiagnosticResponseReceived callback) {
+    DiagnosticRequestHandle handle = {
+        request: *request,
+        callback: callback,
+        success: false,
+        completed: false,
+        isotp_socket_bound: true,
+        isotp_socket: socket
+    };
+
+    struct sockaddr_can address = {0};
+    socklen_t address_length = sizeof(address);
+    if(getsockname(socket, (struct sockaddr*)&address, &address_length) == 0) {
+        handle.isotp_socket_rx_id = address.can_addr.tp.rx_id & CAN_EFF_MASK;
+    }
+
+    uint8_t payload[MAX_DIAGNOSTIC_REQUEST_SIZE];
+    uint16_t size = diagnostic_encode_request(&handle.request, payload,
+            sizeof(payload));
+    if(size == 0 || write(socket, payload, size) != size) {
+        handle.completed = true;
+        if(shims->log != NULL) {
+            shims->log("%s", "Diagnostic request not sent");
+        }
+    } else {
+        handle.isotp_send_handle.completed = true;
+        handle.isotp_send_handle.success = true;
+        if(shims->log != NULL) {
+            char request_string[128] = {0};
+            diagnostic_request_to_string(&handle.request, request_string,
+                    sizeof(request_string));
+            shims->log("Sending diagnostic request: %s", request_string);
+        }
+    }
+    return handle;
+}
+
+DiagnosticResponse diagnostic_receive_isotp_socket(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, uint8_t buffer[],
+        uint16_t buffer_size) {
+    DiagnosticResponse response = {
+        arbitration_id: handle->isotp_socket_rx_id,
+        success: false,
+        completed: false
+    };
+
+    if(!handle->isotp_socket_bound || handle->completed) {
+        return response;
+    }
+
+    ssize_t received = read(handle->isotp_socket, buffer, buffer_size);
+    if(received <= 0) {
+        return response;
+    }
+
+    return diagnostic_receive_pdu(shims, handle, handle->isotp_socket_rx_id,
+            buffer, received);
+}
+
+#endif // __linux__
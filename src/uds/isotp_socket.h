@@ -0,0 +1,78 @@
+#ifndef __ISOTP_SOCKET_H__
+#define __ISOTP_SOCKET_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __linux__
+
+/* Public: Open a Linux CAN_ISOTP socket to a single node. The kernel handles
+ * segmentation, flow control and STmin, so a whole response PDU can be read
+ * with one call instead of passing every CAN frame to
+ * diagnostic_receive_can_frame.
+ *
+ * interface - the name of the CAN network interface, e.g. "can0".
+ * tx_id - the arbitration ID to send requests to.
+ * rx_id - the arbitration ID responses are received on, normally tx_id + 0x8.
+ * frame_padding - true if sent CAN frames should be padded out to a full 8
+ *      bytes.
+ *
+ * Returns the socket file descriptor, or -1 if it could not be opened (the
+ * kernel may be missing the can-isotp module) or rejected its options.
+ */
+int diagnostic_isotp_socket_open(const char* interface, uint32_t tx_id,
+        uint32_t rx_id, bool frame_padding);
+
+/* Public: Close a socket previously opened with
+ * diagnostic_isotp_socket_open(...).
+ */
+void diagnostic_isotp_socket_close(int socket);
+
+/* Public: Generate a new diagnostic request bound to an ISO-TP socket and
+ * write it to the socket in a single call.
+ *
+ * shims - Low-level shims, only the log shim is used.
+ * socket - a socket returned by diagnostic_isotp_socket_open(...).
+ * request - the request to send. The arbitration_id should match the socket's
+ *      tx_id.
+ * callback - an optional function to be called when the response is receved
+ *      (use NULL if no callback is required).
+ *
+ * Returns a handle to be used with diagnostic_receive_isotp_socket. As with
+ * diagnostic_request, if 'completed' is already true the request could not be
+ * sent.
+ */
+DiagnosticRequestHandle diagnostic_request_isotp_socket(DiagnosticShims* shims,
+        int socket, DiagnosticRequest* request,
+        DiagnosticResponseReceived callback);
+
+/* Public: Read one complete response PDU from the handle's socket and
+ * continue the request with it. This blocks unless the socket was made
+ * non-blocking by the caller.
+ *
+ * shims - Low-level shims, only the log shim is used.
+ * handle - a handle returned by diagnostic_request_isotp_socket(...).
+ * buffer - storage for the received PDU, at least 4095 bytes to hold the
+ *      largest ISO-TP message. The response's full_payload points into it.
+ * buffer_size - the size of buffer.
+ *
+ * Returns a DiagnosticResponse with the same semantics as
+ * diagnostic_receive_can_frame. If nothing could be read, 'completed' is
+ * false.
+ */
+DiagnosticResponse diagnostic_receive_isotp_socket(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, uint8_t buffer[],
+        uint16_t buffer_size);
+
+#endif // __linux__
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ISOTP_SOCKET_H__
@@ -0,0 +1,206 @@
+#include <uds/periodic.h>
+#include <string.h>
+
+#define PERIODIC_RESPONSE_MODE (DIAGNOSTIC_READ_PERIODIC_MODE + 0x40)
+#define DEFINE_BY_IDENTIFIER 0x1
+#define CLEAR_DYNAMICALLY_DEFINED_DID 0x3
+#define SINGLE_FRAME_PCI 0x0
+#define CLASSIC_FRAME_LENGTH 8
+
+void diagnostic_init_periodic_receiver(DiagnosticPeriodicReceiver* receiver,
+        uint32_t response_arbitration_id, uint32_t periodic_arbitration_id) {
+    memset(receiver, 0, sizeof(DiagnosticPeriodicReceiver));
+    receiver->response_arbitration_id = response_arbitration_id;
+    receiver->periodic_arbitration_id = periodic_arbitration_id;
+}
+
+static bool is_periodic_did(uint16_t did) {
+    return (did & 0xff00) == DIAGNOSTIC_PERIODIC_DID_BASE;
+}
+
+bool diagnostic_periodic_subscribe(DiagnosticPeriodicReceiver* receiver,
+        uint16_t did, DiagnosticPeriodicRate rate,
+        DiagnosticPeriodicDataReceived callback) {
+    if(!is_periodic_did(did) || rate == DIAGNOSTIC_PERIODIC_RATE_STOP) {
+        return false;
+    }
+
+    uint8_t periodic_identifier = did;
+    DiagnosticPeriodicSubscription* subscription;
+    if(receiver->subscription_index[periodic_identifier] != 0) {
+        subscription = &receiver->subscriptions[
+                receiver->subscription_index[periodic_identifier] - 1];
+    } else if(receiver->subscription_count < MAX_PERIODIC_SUBSCRIPTIONS) {
+        subscription = &receiver->subscriptions[
+                receiver->subscription_count++];
+        receiver->subscription_index[periodic_identifier] =
+                receiver->subscription_count;
+    } else {
+        return false;
+    }
+
+    subscription->periodic_identifier = periodic_identifier;
+    subscription->rate = rate;
+    subscription->callback = callback;
+    return true;
+}
+
+bool diagnostic_periodic_unsubscribe(DiagnosticPeriodicReceiver* receiver,
+        uint16_t did) {
+    uint8_t periodic_identifier = did;
+    uint8_t index = receiver->subscription_index[periodic_identifier];
+    if(!is_periodic_did(did) || index == 0) {
+        return false;
+    }
+
+    // move the last subscription into the gap
+    DiagnosticPeriodicSubscription* last =
+            &receiver->subscriptions[--receiver->subscription_count];
+    receiver->subscriptions[index - 1] = *last;
+    receiver->subscription_index[last->periodic_identifier] = index;
+    receiver->subscription_index[periodic_identifier] = 0;
+    return true;
+}
+
+/* Private: Set the payload of a request, in the request itself if it fits and
+ * pointing to 'payload' otherwise.
+ */
+static void set_request_payload(DiagnosticRequest* request,
+        const uint8_t payload[], uint16_t size) {
+    if(size <= MAX_UDS_REQUEST_PAYLOAD_LENGTH) {
+        memcpy(request->payload, payload, size);
+        request->payload_length = size;
+    } else {
+        request->large_payload = payload;
+        request->large_payload_length = size;
+    }
+}
+
+bool diagnostic_periodic_request(DiagnosticPeriodicReceiver* receiver,
+        uint32_t arbitration_id, DiagnosticPeriodicRate rate,
+        DiagnosticRequest* request) {
+    uint8_t size = 0;
+    uint8_t i;
+    receiver->request_payload[size++] = rate;
+    for(i = 0; i < receiver->subscription_count; i++) {
+        if(receiver->subscriptions[i].rate == rate) {
+            receiver->request_payload[size++] =
+                    receiver->subscriptions[i].periodic_identifier;
+        }
+    }
+    if(size == 1) {
+        return false;
+    }
+
+    memset(request, 0, sizeof(DiagnosticRequest));
+    request->arbitration_id = arbitration_id;
+    request->mode = DIAGNOSTIC_READ_PERIODIC_MODE;
+    set_request_payload(request, receiver->request_payload, size);
+    return true;
+}
+
+void diagnostic_periodic_stop_request(uint32_t arbitration_id, uint16_t did,
+        DiagnosticRequest* request) {
+    memset(request, 0, sizeof(DiagnosticRequest));
+    request->arbitration_id = arbitration_id;
+    request->mode = DIAGNOSTIC_READ_PERIODIC_MODE;
+    request->payload[request->payload_length++] =
+            DIAGNOSTIC_PERIODIC_RATE_STOP;
+    if(did != 0) {
+        // without identifiers, every periodic DID stops
+        request->payload[request->payload_length++] = did;
+    }
+}
+
+bool diagnostic_periodic_receive_can_frame(
+        DiagnosticPeriodicReceiver* receiver, uint32_t arbitration_id,
+        const uint8_t data[], uint8_t size) {
+    const uint8_t* sample;
+    uint8_t sample_size;
+    if(receiver->periodic_arbitration_id != 0 &&
+            arbitration_id == receiver->periodic_arbitration_id) {
+        // type 1: the periodic identifier and the data, no ISO-TP header
+        if(size < 1) {
+            return false;
+        }
+        sample = data;
+        sample_size = size;
+    } else if(arbitration_id == receiver->response_arbitration_id &&
+            size > 0 && (data[0] >> 4) == SINGLE_FRAME_PCI) {
+        // type 2: a single frame response with the periodic identifier
+        uint8_t header_size = 1;
+        uint8_t length = data[0] & 0xf;
+        if(length == 0 && size > CLASSIC_FRAME_LENGTH) {
+            // CAN FD escape sequence
+            header_size = 2;
+            length = data[1];
+        }
+        // the response to the request itself has no periodic identifier
+        if(length < 2 || header_size + length > size ||
+                data[header_size] != PERIODIC_RESPONSE_MODE) {
+            return false;
+        }
+        sample = &data[header_size + 1];
+        sample_size = length - 1;
+    } else {
+        return false;
+    }
+
+    uint8_t index = receiver->subscription_index[sample[0]];
+    if(index == 0) {
+        ++receiver->unknown_sample_count;
+    } else {
+        ++receiver->sample_count;
+        DiagnosticPeriodicSubscription* subscription =
+                &receiver->subscriptions[index - 1];
+        if(subscription->callback != NULL) {
+            subscription->callback(receiver,
+                    DIAGNOSTIC_PERIODIC_DID_BASE | sample[0], &sample[1],
+                    sample_size - 1);
+        }
+    }
+    return true;
+}
+
+bool diagnostic_define_dynamic_did_request(uint32_t arbitration_id,
+        uint16_t did, const DiagnosticDynamicDidSource sources[],
+        uint8_t source_count, DiagnosticDynamicDidPayload* payload,
+        DiagnosticRequest* request) {
+    if(source_count == 0 || source_count > MAX_DYNAMIC_DID_SOURCES) {
+        return false;
+    }
+
+    uint16_t size = 0;
+    uint8_t i;
+    payload->data[size++] = did >> 8;
+    payload->data[size++] = did;
+    for(i = 0; i < source_count; i++) {
+        payload->data[size++] = sources[i].source_did >> 8;
+        payload->data[size++] = sources[i].source_did;
+        payload->data[size++] = sources[i].position;
+        payload->data[size++] = sources[i].size;
+    }
+
+    memset(request, 0, sizeof(DiagnosticRequest));
+    request->arbitration_id = arbitration_id;
+    request->mode = DIAGNOSTIC_DYNAMICALLY_DEFINE_MODE;
+    // the sub-function is echoed like a PID
+    request->has_pid = true;
+    request->pid = DEFINE_BY_IDENTIFIER;
+    request->pid_length = 1;
+    set_request_payload(request, payload->data, size);
+    return true;
+}
+
+void diagnostic_clear_dynamic_did_request(uint32_t arbitration_id,
+        uint16_t did, DiagnosticRequest* request) {
+    memset(request, 0, sizeof(DiagnosticRequest));
+    request->arbitration_id = arbitration_id;
+    request->mode = DIAGNOSTIC_DYNAMICALLY_DEFINE_MODE;
+    request->has_pid = true;
+    request->pid = CLEAR_DYNAMICALLY_DEFINED_DID;
+    request->pid_length = 1;
+    request->payload[0] = did >> 8;
+    request->payload[1] = did;
+    request->payload_length = 2;
+}
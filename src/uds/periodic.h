@@ -0,0 +1,201 @@
+#ifndef __PERIODIC_H__
+#define __PERIODIC_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIAGNOSTIC_READ_PERIODIC_MODE 0x2a
+#define DIAGNOSTIC_DYNAMICALLY_DEFINE_MODE 0x2c
+
+// Periodic data identifiers are the low byte of the DIDs 0xf200 - 0xf2ff
+#define DIAGNOSTIC_PERIODIC_DID_BASE 0xf200
+
+// The number of periodic DIDs one ECU can be subscribed to at once.
+#ifndef MAX_PERIODIC_SUBSCRIPTIONS
+#define MAX_PERIODIC_SUBSCRIPTIONS 16
+#endif
+
+// The number of source DIDs in one dynamically defined DID.
+#ifndef MAX_DYNAMIC_DID_SOURCES
+#define MAX_DYNAMIC_DID_SOURCES 8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: The transmission modes of ReadDataByPeriodicIdentifier (0x2A). The
+ * ECU picks the actual period for each rate.
+ */
+typedef enum {
+    DIAGNOSTIC_PERIODIC_RATE_SLOW = 0x1,
+    DIAGNOSTIC_PERIODIC_RATE_MEDIUM = 0x2,
+    DIAGNOSTIC_PERIODIC_RATE_FAST = 0x3,
+    DIAGNOSTIC_PERIODIC_RATE_STOP = 0x4
+} DiagnosticPeriodicRate;
+
+typedef struct DiagnosticPeriodicReceiver DiagnosticPeriodicReceiver;
+
+/* Public: The signature for a function called with each periodic sample of a
+ * subscribed DID.
+ *
+ * did - the DID, 0xf200 - 0xf2ff.
+ * data - the data of the sample. Frames without an ISO-TP header (type 1
+ *      periodic messages) carry no length, so this includes any padding.
+ * size - the size of the data.
+ */
+typedef void (*DiagnosticPeriodicDataReceived)(
+        DiagnosticPeriodicReceiver* receiver, uint16_t did,
+        const uint8_t data[], uint8_t size);
+
+/* Private: One subscribed periodic DID.
+ */
+typedef struct {
+    uint8_t periodic_identifier;
+    DiagnosticPeriodicRate rate;
+    DiagnosticPeriodicDataReceived callback;
+} DiagnosticPeriodicSubscription;
+
+/* Public: The periodic DIDs subscribed from one ECU with
+ * ReadDataByPeriodicIdentifier (0x2A), and the demultiplexing of the samples
+ * it sends on its own to one callback per DID. Samples arrive in single
+ * frames, either on a dedicated periodic response ID as the periodic
+ * identifier followed by the data (type 1), or on the usual response ID as a
+ * single frame response with the 0x6a service ID (type 2). Initialize it with
+ * diagnostic_init_periodic_receiver(...).
+ *
+ * response_arbitration_id - The arbitration ID the ECU's responses arrive on.
+ * periodic_arbitration_id - (optional) The arbitration ID of type 1 periodic
+ *      frames, or 0 if the ECU only sends type 2.
+ * context - (optional) Anything the callbacks need.
+ * sample_count - The number of samples passed to callbacks.
+ * unknown_sample_count - The number of samples for DIDs with no subscription,
+ *      e.g. ones still arriving after unsubscribing.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticPeriodicReceiver {
+    uint32_t response_arbitration_id;
+    uint32_t periodic_arbitration_id;
+    void* context;
+    uint32_t sample_count;
+    uint32_t unknown_sample_count;
+
+    // Private
+    uint8_t subscription_count;
+    // subscription indexes + 1 by periodic identifier, 0 if not subscribed
+    uint8_t subscription_index[256];
+    DiagnosticPeriodicSubscription subscriptions[MAX_PERIODIC_SUBSCRIPTIONS];
+    uint8_t request_payload[1 + MAX_PERIODIC_SUBSCRIPTIONS];
+};
+
+/* Public: One piece of a dynamically defined DID: 'size' bytes of the source
+ * DID's record, starting at the 1-based 'position'.
+ */
+typedef struct {
+    uint16_t source_did;
+    uint8_t position;
+    uint8_t size;
+} DiagnosticDynamicDidSource;
+
+/* Public: The payload of a DynamicallyDefineDataIdentifier (0x2C) request,
+ * which must stay valid until the request is sent.
+ */
+typedef struct {
+    uint8_t data[2 + MAX_DYNAMIC_DID_SOURCES * 4];
+} DiagnosticDynamicDidPayload;
+
+/* Public: Initialize a receiver with no subscriptions.
+ *
+ * response_arbitration_id - the arbitration ID the ECU responds on, e.g.
+ *      0x7e8.
+ * periodic_arbitration_id - the arbitration ID of type 1 periodic frames, or
+ *      0 if the ECU only sends type 2.
+ */
+void diagnostic_init_periodic_receiver(DiagnosticPeriodicReceiver* receiver,
+        uint32_t response_arbitration_id, uint32_t periodic_arbitration_id);
+
+/* Public: Add a subscription to a periodic DID, or change its rate and
+ * callback. The ECU isn't asked for it until a request from
+ * diagnostic_periodic_request(...) for its rate is sent.
+ *
+ * did - the DID, 0xf200 - 0xf2ff, e.g. one defined with
+ *      diagnostic_define_dynamic_did_request(...).
+ * rate - how often the ECU should send it.
+ * callback - the function to call with every sample.
+ *
+ * Returns false if the DID isn't a periodic DID or MAX_PERIODIC_SUBSCRIPTIONS
+ * DIDs are already subscribed.
+ */
+bool diagnostic_periodic_subscribe(DiagnosticPeriodicReceiver* receiver,
+        uint16_t did, DiagnosticPeriodicRate rate,
+        DiagnosticPeriodicDataReceived callback);
+
+/* Public: Remove the subscription to a periodic DID. Stop it on the ECU first
+ * with a diagnostic_periodic_stop_request(...).
+ *
+ * Returns false if the DID wasn't subscribed.
+ */
+bool diagnostic_periodic_unsubscribe(DiagnosticPeriodicReceiver* receiver,
+        uint16_t did);
+
+/* Public: Build the ReadDataByPeriodicIdentifier request that starts every
+ * subscribed DID with the given rate, to send with diagnostic_request(...).
+ * The ECU's response only acknowledges the request - the samples follow on
+ * their own.
+ *
+ * request - the request to build, to 'arbitration_id'. With more than 6 DIDs
+ *      its payload points into the receiver, so it must be sent before the
+ *      receiver changes.
+ *
+ * Returns false if no DID is subscribed with that rate.
+ */
+bool diagnostic_periodic_request(DiagnosticPeriodicReceiver* receiver,
+        uint32_t arbitration_id, DiagnosticPeriodicRate rate,
+        DiagnosticRequest* request);
+
+/* Public: Build the ReadDataByPeriodicIdentifier request that stops one
+ * periodic DID, or all of them if 'did' is 0.
+ */
+void diagnostic_periodic_stop_request(uint32_t arbitration_id, uint16_t did,
+        DiagnosticRequest* request);
+
+/* Public: Pass a received CAN frame to the receiver. Periodic samples are
+ * passed to the callback of their DID.
+ *
+ * Returns true if the frame was a periodic sample from the receiver's ECU -
+ * otherwise it may still be a response to a request to it.
+ */
+bool diagnostic_periodic_receive_can_frame(
+        DiagnosticPeriodicReceiver* receiver, uint32_t arbitration_id,
+        const uint8_t data[], uint8_t size);
+
+/* Public: Build a DynamicallyDefineDataIdentifier request (defineByIdentifier)
+ * that defines 'did' as the concatenation of pieces of other DIDs, e.g. to read
+ * several values as one periodic DID.
+ *
+ * payload - storage for the request's payload, which must stay valid until the
+ *      request is sent.
+ * did - the DID to define, e.g. 0xf201 to read it periodically.
+ * sources - the pieces of other DIDs, in order.
+ * source_count - the number of pieces, at most MAX_DYNAMIC_DID_SOURCES.
+ *
+ * Returns false if there are no sources or too many.
+ */
+bool diagnostic_define_dynamic_did_request(uint32_t arbitration_id,
+        uint16_t did, const DiagnosticDynamicDidSource sources[],
+        uint8_t source_count, DiagnosticDynamicDidPayload* payload,
+        DiagnosticRequest* request);
+
+/* Public: Build a DynamicallyDefineDataIdentifier request
+ * (clearDynamicallyDefinedDataIdentifier) that clears the definition of 'did'.
+ */
+void diagnostic_clear_dynamic_did_request(uint32_t arbitration_id,
+        uint16_t did, DiagnosticRequest* request);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __PERIODIC_H__
@@ -0,0 +1,138 @@
+#include <uds/reassembly.h>
+#include <string.h>
+
+#define SINGLE_FRAME_PCI 0x0
+#define FIRST_FRAME_PCI 0x1
+// N_Cr, the longest a receiver waits for the next consecutive frame
+#define STREAM_TIMEOUT_US 1000000
+
+bool diagnostic_init_reassembler(DiagnosticReassembler* reassembler,
+        uint8_t buffer[], uint32_t buffer_size, uint8_t stream_count) {
+    memset(reassembler, 0, sizeof(DiagnosticReassembler));
+    if(stream_count == 0 || stream_count > MAX_REASSEMBLY_STREAMS ||
+            buffer_size / stream_count == 0) {
+        return false;
+    }
+
+    uint32_t stream_buffer_size = buffer_size / stream_count;
+    reassembler->stream_buffer_size = stream_buffer_size > UINT16_MAX ?
+            UINT16_MAX : stream_buffer_size;
+    reassembler->stream_count = stream_count;
+    for(uint8_t i = 0; i < stream_count; i++) {
+        reassembler->streams[i].buffer = &buffer[i * stream_buffer_size];
+    }
+    return true;
+}
+
+void diagnostic_reset_reassembler(DiagnosticReassembler* reassembler) {
+    for(uint8_t i = 0; i < reassembler->stream_count; i++) {
+        reassembler->streams[i].receiver.active = false;
+    }
+}
+
+static DiagnosticReassemblyStream* find_stream(
+        DiagnosticReassembler* reassembler, uint32_t arbitration_id) {
+    for(uint8_t i = 0; i < reassembler->stream_count; i++) {
+        DiagnosticReassemblyStream* stream = &reassembler->streams[i];
+        if(stream->receiver.active &&
+                stream->receiver.arbitration_id == arbitration_id) {
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+/* Private: Returns an idle stream for a new message, abandoning one that has
+ * gone quiet for longer than N_Cr if there is no other, or NULL.
+ */
+static DiagnosticReassemblyStream* free_stream(DiagnosticShims* shims,
+        DiagnosticReassembler* reassembler) {
+    for(uint8_t i = 0; i < reassembler->stream_count; i++) {
+        if(!reassembler->streams[i].receiver.active) {
+            return &reassembler->streams[i];
+        }
+    }
+
+    if(shims->get_time_us == NULL) {
+        return NULL;
+    }
+    uint32_t now = shims->get_time_us();
+    for(uint8_t i = 0; i < reassembler->stream_count; i++) {
+        DiagnosticReassemblyStream* stream = &reassembler->streams[i];
+        if(now - stream->last_frame_time_us >= STREAM_TIMEOUT_US) {
+            if(shims->log != NULL) {
+                shims->log("Abandoning the message from 0x%x, no consecutive "
+                        "frame for too long", stream->receiver.arbitration_id);
+            }
+            stream->receiver.active = false;
+            ++reassembler->aborted_count;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+DiagnosticTransportStatus diagnostic_reassembler_receive(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticReassembler* reassembler, uint32_t flow_control_id,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        const uint8_t** payload, uint16_t* payload_size,
+        DiagnosticTransportReceiver** receiver) {
+    *receiver = NULL;
+    uint8_t pci_index = config->has_address_extension ? 1 : 0;
+    if(size <= pci_index) {
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    uint8_t pci = data[pci_index] >> 4;
+    DiagnosticReassemblyStream* stream = find_stream(reassembler,
+            arbitration_id);
+    if(pci == FIRST_FRAME_PCI && stream == NULL) {
+        stream = free_stream(shims, reassembler);
+    } else if(pci != SINGLE_FRAME_PCI && stream == NULL) {
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    // single frames, and first frames without a stream, never need one - the
+    // missing buffer makes the transport refuse a first frame with an
+    // overflow flow control frame
+    DiagnosticTransportReceiver unused = {0};
+    bool was_active = stream != NULL && stream->receiver.active;
+    DiagnosticTransportStatus status = diagnostic_transport_receive(shims,
+            config, stream != NULL ? &stream->receiver : &unused,
+            stream != NULL ? stream->buffer : NULL,
+            reassembler->stream_buffer_size, flow_control_id, arbitration_id,
+            data, size, payload, payload_size);
+    if(stream == NULL) {
+        if(status == DIAGNOSTIC_TRANSPORT_ERROR && pci == FIRST_FRAME_PCI) {
+            ++reassembler->dropped_count;
+        }
+        return status;
+    }
+
+    if(shims->get_time_us != NULL) {
+        stream->last_frame_time_us = shims->get_time_us();
+    }
+    if(pci == SINGLE_FRAME_PCI) {
+        // a new message from the node replaced the one in progress
+        if(was_active && !stream->receiver.active) {
+            ++reassembler->aborted_count;
+        }
+        return status;
+    }
+
+    *receiver = &stream->receiver;
+    if(status == DIAGNOSTIC_TRANSPORT_COMPLETED) {
+        ++reassembler->completed_count;
+    } else if(status == DIAGNOSTIC_TRANSPORT_ERROR) {
+        // a first frame too big for the stream, or a sequence number gap
+        if(pci == FIRST_FRAME_PCI) {
+            ++reassembler->dropped_count;
+        } else {
+            ++reassembler->aborted_count;
+        }
+    } else if(pci == FIRST_FRAME_PCI && was_active) {
+        ++reassembler->aborted_count;
+    }
+    return status;
+}
@@ -0,0 +1,57 @@
+#ifndef __REASSEMBLY_H__
+#define __REASSEMBLY_H__
+
+#include <uds/uds_types.h>
+#include <uds/transport.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: Initialize a reassembler, splitting a buffer evenly between its
+ * streams.
+ *
+ * buffer - storage for the messages being reassembled, owned by the caller.
+ * buffer_size - the size of the buffer. Each stream can reassemble messages of
+ *      up to buffer_size / stream_count bytes (at most 65535).
+ * stream_count - the number of nodes to receive from at the same time, up to
+ *      MAX_REASSEMBLY_STREAMS.
+ *
+ * Returns false if the stream count is out of range or the buffer is too
+ * small to give every stream a byte.
+ */
+bool diagnostic_init_reassembler(DiagnosticReassembler* reassembler,
+        uint8_t buffer[], uint32_t buffer_size, uint8_t stream_count);
+
+/* Public: Abandon every message being reassembled, e.g. before sending the
+ * next functional request. The counters are kept.
+ */
+void diagnostic_reset_reassembler(DiagnosticReassembler* reassembler);
+
+/* Private: Continue reassembling with a received CAN frame, in the stream of
+ * the node that sent it. A first frame from a node without a stream takes a
+ * free one - or the stream of a node that has gone quiet for longer than N_Cr,
+ * if the get_time_us shim is set - and is refused with an overflow flow
+ * control frame if there is none.
+ *
+ * payload - set to the complete message when it's completed. Single frames
+ *      point into 'data', multi-frame messages into the node's stream.
+ * receiver - set to the receiver of the node's stream for first and
+ *      consecutive frames, or NULL.
+ *
+ * Returns the same as diagnostic_transport_receive.
+ */
+DiagnosticTransportStatus diagnostic_reassembler_receive(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticReassembler* reassembler, uint32_t flow_control_id,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        const uint8_t** payload, uint16_t* payload_size,
+        DiagnosticTransportReceiver** receiver);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __REASSEMBLY_H__
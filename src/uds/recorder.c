@@ -0,0 +1,423 @@
+#include <uds/recorder.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#if MAX_RECORDER_SERIES > 255
+#error "MAX_RECORDER_SERIES must be at most 255"
+#endif
+
+#define MAGIC_0 0x55
+#define MAGIC_1 0x43
+#define MAX_CHUNK_SAMPLES 0xffff
+#define VALUE_BITS 32
+// the longest timestamp and value encodings
+#define MAX_SAMPLE_BITS (4 + 64 + 2 + 5 + 5 + VALUE_BITS)
+#define NO_WINDOW 0xff
+#define SERIES_TABLE_SIZE (MAX_RECORDER_SERIES * 2)
+
+/* Private: The encodings of a timestamp's delta of delta after a 0 bit for 0:
+ * a prefix of 1s and the bits of the signed value.
+ */
+static const struct {
+    uint8_t prefix;
+    uint8_t prefix_bits;
+    uint8_t bits;
+} TIMESTAMP_BUCKETS[] = {
+    {0x2, 2, 7},
+    {0x6, 3, 12},
+    {0xe, 4, 20},
+    {0xf, 4, 64}
+};
+#define TIMESTAMP_BUCKET_COUNT 4
+
+static void put_big_endian(uint8_t destination[], uint64_t value,
+        uint8_t size) {
+    while(size-- > 0) {
+        destination[size] = value;
+        value >>= 8;
+    }
+}
+
+static uint64_t get_big_endian(const uint8_t source[], uint8_t size) {
+    uint64_t value = 0;
+    uint8_t i;
+    for(i = 0; i < size; i++) {
+        value = (value << 8) | source[i];
+    }
+    return value;
+}
+
+void diagnostic_init_recorder(DiagnosticRecorder* recorder,
+        DiagnosticRecorderWriteShim write, void* context) {
+    memset(recorder, 0, sizeof(DiagnosticRecorder));
+    recorder->write = write;
+    recorder->context = context;
+}
+
+static DiagnosticRecorderSeries* find_series(DiagnosticRecorder* recorder,
+        uint32_t arbitration_id, uint8_t mode, uint16_t pid) {
+    uint32_t hash = (arbitration_id ^ ((uint32_t) mode << 24) ^
+            ((uint32_t) pid << 8)) * 2654435761u;
+    uint16_t slot = hash % SERIES_TABLE_SIZE;
+    // the table is never more than half full, so there's always an empty slot
+    while(recorder->series_table[slot] != 0) {
+        DiagnosticRecorderSeries* series =
+                &recorder->series[recorder->series_table[slot] - 1];
+        if(series->arbitration_id == arbitration_id && series->mode == mode &&
+                series->pid == pid) {
+            return series;
+        }
+        slot = (slot + 1) % SERIES_TABLE_SIZE;
+    }
+
+    if(recorder->series_count == MAX_RECORDER_SERIES) {
+        return NULL;
+    }
+    DiagnosticRecorderSeries* series =
+            &recorder->series[recorder->series_count++];
+    series->arbitration_id = arbitration_id;
+    series->mode = mode;
+    series->pid = pid;
+    series->sample_count = 0;
+    series->bit_count = 0;
+    recorder->series_table[slot] = recorder->series_count;
+    return series;
+}
+
+static void write_bits(DiagnosticRecorderSeries* series, uint64_t value,
+        uint8_t count) {
+    uint8_t* data = &series->chunk[DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE];
+    while(count > 0) {
+        uint8_t used_bits = series->bit_count & 7;
+        uint8_t written = 8 - used_bits;
+        if(written > count) {
+            written = count;
+        }
+        uint8_t bits = (value >> (count - written)) & ((1 << written) - 1);
+        if(used_bits == 0) {
+            data[series->bit_count >> 3] = 0;
+        }
+        data[series->bit_count >> 3] |= bits << (8 - used_bits - written);
+        series->bit_count += written;
+        count -= written;
+    }
+}
+
+static void write_timestamp(DiagnosticRecorderSeries* series,
+        uint64_t timestamp_us) {
+    DiagnosticRecorderColumn* column = &series->column;
+    int64_t delta_us = timestamp_us - column->timestamp_us;
+    int64_t delta_of_delta = delta_us - column->delta_us;
+    column->timestamp_us = timestamp_us;
+    column->delta_us = delta_us;
+    if(delta_of_delta == 0) {
+        write_bits(series, 0, 1);
+        return;
+    }
+
+    int i;
+    for(i = 0; i < TIMESTAMP_BUCKET_COUNT - 1; i++) {
+        int64_t limit = (int64_t) 1 << (TIMESTAMP_BUCKETS[i].bits - 1);
+        if(delta_of_delta >= -limit && delta_of_delta < limit) {
+            break;
+        }
+    }
+    write_bits(series, TIMESTAMP_BUCKETS[i].prefix,
+            TIMESTAMP_BUCKETS[i].prefix_bits);
+    write_bits(series, (uint64_t) delta_of_delta, TIMESTAMP_BUCKETS[i].bits);
+}
+
+static void write_value(DiagnosticRecorderSeries* series, uint32_t bits) {
+    DiagnosticRecorderColumn* column = &series->column;
+    uint32_t xor = bits ^ column->value_bits;
+    column->value_bits = bits;
+    if(xor == 0) {
+        write_bits(series, 0, 1);
+        return;
+    }
+
+    uint8_t leading_zeros = __builtin_clz(xor);
+    uint8_t trailing_zeros = __builtin_ctz(xor);
+    if(column->leading_zeros != NO_WINDOW &&
+            leading_zeros >= column->leading_zeros &&
+            trailing_zeros >= column->trailing_zeros) {
+        // the changed bits fit in the previous window
+        write_bits(series, 0x2, 2);
+        write_bits(series, xor >> column->trailing_zeros,
+                VALUE_BITS - column->leading_zeros - column->trailing_zeros);
+    } else {
+        uint8_t meaningful_bits = VALUE_BITS - leading_zeros - trailing_zeros;
+        write_bits(series, 0x3, 2);
+        write_bits(series, leading_zeros, 5);
+        write_bits(series, meaningful_bits - 1, 5);
+        write_bits(series, xor >> trailing_zeros, meaningful_bits);
+        column->leading_zeros = leading_zeros;
+        column->trailing_zeros = trailing_zeros;
+    }
+}
+
+static void write_chunk(DiagnosticRecorder* recorder,
+        DiagnosticRecorderSeries* series) {
+    if(series->sample_count == 0) {
+        return;
+    }
+
+    uint16_t data_length = (series->bit_count + 7) / 8;
+    uint8_t* header = series->chunk;
+    header[0] = MAGIC_0;
+    header[1] = MAGIC_1;
+    header[2] = DIAGNOSTIC_RECORDER_VERSION;
+    header[3] = series->mode;
+    put_big_endian(&header[4], series->arbitration_id, 4);
+    put_big_endian(&header[8], series->pid, 2);
+    put_big_endian(&header[10], series->sample_count, 2);
+    put_big_endian(&header[12], data_length, 2);
+    put_big_endian(&header[14], 0, 2);
+    put_big_endian(&header[16], series->first_timestamp_us, 8);
+    put_big_endian(&header[24], series->column.timestamp_us, 8);
+
+    if(recorder->write != NULL && recorder->write(recorder, series->chunk,
+                DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE + data_length)) {
+        ++recorder->chunk_count;
+    } else {
+        ++recorder->dropped_chunk_count;
+    }
+    series->sample_count = 0;
+    series->bit_count = 0;
+}
+
+bool diagnostic_recorder_record(DiagnosticRecorder* recorder,
+        const DiagnosticResponse* response, uint64_t timestamp_us) {
+    if(!response->completed || !response->success || !response->has_pid) {
+        return false;
+    }
+
+    DiagnosticRecorderSeries* series = find_series(recorder,
+            response->arbitration_id, response->mode, response->pid);
+    if(series == NULL) {
+        return false;
+    }
+
+    if(series->sample_count == MAX_CHUNK_SAMPLES || series->bit_count +
+            MAX_SAMPLE_BITS > DIAGNOSTIC_RECORDER_CHUNK_SIZE * 8) {
+        write_chunk(recorder, series);
+    }
+
+    float value = diagnostic_decode_obd2_pid(response);
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if(series->sample_count == 0) {
+        // the first timestamp is in the header, the first value is whole
+        series->first_timestamp_us = timestamp_us;
+        series->column.timestamp_us = timestamp_us;
+        series->column.delta_us = 0;
+        series->column.value_bits = bits;
+        series->column.leading_zeros = NO_WINDOW;
+        write_bits(series, bits, VALUE_BITS);
+    } else {
+        write_timestamp(series, timestamp_us);
+        write_value(series, bits);
+    }
+    ++series->sample_count;
+    ++recorder->sample_count;
+    return true;
+}
+
+bool diagnostic_recorder_flush(DiagnosticRecorder* recorder) {
+    uint64_t dropped_chunk_count = recorder->dropped_chunk_count;
+    uint8_t i;
+    for(i = 0; i < recorder->series_count; i++) {
+        write_chunk(recorder, &recorder->series[i]);
+    }
+    return recorder->dropped_chunk_count == dropped_chunk_count;
+}
+
+void diagnostic_recorder_start_scan(DiagnosticRecorderScan* scan,
+        const uint8_t log[], size_t log_size, uint32_t arbitration_id,
+        uint8_t mode, uint16_t pid, uint64_t start_us, uint64_t end_us) {
+    memset(scan, 0, sizeof(DiagnosticRecorderScan));
+    scan->log = log;
+    scan->log_size = log_size;
+    scan->arbitration_id = arbitration_id;
+    scan->mode = mode;
+    scan->pid = pid;
+    scan->start_us = start_us;
+    scan->end_us = end_us;
+}
+
+static bool read_bits(DiagnosticRecorderScan* scan, uint8_t count,
+        uint64_t* value) {
+    if(scan->bit + count > scan->chunk_bit_count) {
+        return false;
+    }
+
+    uint64_t result = 0;
+    while(count > 0) {
+        uint8_t used_bits = scan->bit & 7;
+        uint8_t read = 8 - used_bits;
+        if(read > count) {
+            read = count;
+        }
+        uint8_t byte = scan->chunk[scan->bit >> 3];
+        result = (result << read) |
+                ((byte >> (8 - used_bits - read)) & ((1 << read) - 1));
+        scan->bit += read;
+        count -= read;
+    }
+    *value = result;
+    return true;
+}
+
+static bool read_timestamp(DiagnosticRecorderScan* scan) {
+    DiagnosticRecorderColumn* column = &scan->column;
+    uint8_t ones = 0;
+    uint64_t bit = 1;
+    while(ones < TIMESTAMP_BUCKET_COUNT) {
+        if(!read_bits(scan, 1, &bit)) {
+            return false;
+        } else if(bit == 0) {
+            break;
+        }
+        ++ones;
+    }
+
+    int64_t delta_of_delta = 0;
+    if(ones > 0) {
+        uint8_t bits = TIMESTAMP_BUCKETS[ones - 1].bits;
+        uint64_t value;
+        if(!read_bits(scan, bits, &value)) {
+            return false;
+        }
+        // sign extend
+        delta_of_delta = bits == 64 ? (int64_t) value :
+                (int64_t)(value << (64 - bits)) >> (64 - bits);
+    }
+    column->delta_us += delta_of_delta;
+    column->timestamp_us += column->delta_us;
+    return true;
+}
+
+static bool read_value(DiagnosticRecorderScan* scan) {
+    DiagnosticRecorderColumn* column = &scan->column;
+    uint64_t control, xor;
+    if(!read_bits(scan, 1, &control)) {
+        return false;
+    } else if(control == 0) {
+        return true;
+    } else if(!read_bits(scan, 1, &control)) {
+        return false;
+    }
+
+    if(control == 0) {
+        if(column->leading_zeros == NO_WINDOW) {
+            return false;
+        }
+    } else {
+        uint64_t leading_zeros, meaningful_bits;
+        if(!read_bits(scan, 5, &leading_zeros) ||
+                !read_bits(scan, 5, &meaningful_bits) ||
+                leading_zeros + meaningful_bits + 1 > VALUE_BITS) {
+            return false;
+        }
+        column->leading_zeros = leading_zeros;
+        column->trailing_zeros = VALUE_BITS - leading_zeros -
+                (meaningful_bits + 1);
+    }
+
+    if(!read_bits(scan, VALUE_BITS - column->leading_zeros -
+                column->trailing_zeros, &xor)) {
+        return false;
+    }
+    column->value_bits ^= xor << column->trailing_zeros;
+    return true;
+}
+
+/* Private: Move the scan to the next chunk of its series that overlaps its
+ * time range.
+ *
+ * Returns false at the end of the log or a malformed chunk.
+ */
+static bool next_chunk(DiagnosticRecorderScan* scan) {
+    while(scan->offset < scan->log_size) {
+        const uint8_t* header = &scan->log[scan->offset];
+        size_t remaining = scan->log_size - scan->offset;
+        if(remaining < DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE ||
+                header[0] != MAGIC_0 || header[1] != MAGIC_1 ||
+                header[2] != DIAGNOSTIC_RECORDER_VERSION) {
+            scan->malformed = true;
+            return false;
+        }
+
+        uint16_t data_length = get_big_endian(&header[12], 2);
+        if(remaining - DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE < data_length) {
+            scan->malformed = true;
+            return false;
+        }
+        scan->offset += DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE + data_length;
+
+        uint64_t first_timestamp_us = get_big_endian(&header[16], 8);
+        uint64_t last_timestamp_us = get_big_endian(&header[24], 8);
+        if(header[3] != scan->mode ||
+                get_big_endian(&header[4], 4) != scan->arbitration_id ||
+                get_big_endian(&header[8], 2) != scan->pid ||
+                last_timestamp_us < scan->start_us) {
+            continue;
+        } else if(first_timestamp_us > scan->end_us) {
+            // the rest of the series is later still
+            scan->offset = scan->log_size;
+            return false;
+        }
+
+        scan->chunk = &header[DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE];
+        scan->chunk_bit_count = data_length * 8;
+        scan->bit = 0;
+        scan->sample_count = get_big_endian(&header[10], 2);
+        scan->remaining_samples = scan->sample_count;
+        scan->column.timestamp_us = first_timestamp_us;
+        return true;
+    }
+    return false;
+}
+
+static bool read_sample(DiagnosticRecorderScan* scan) {
+    DiagnosticRecorderColumn* column = &scan->column;
+    if(scan->remaining_samples-- == scan->sample_count) {
+        uint64_t bits;
+        if(!read_bits(scan, VALUE_BITS, &bits)) {
+            return false;
+        }
+        column->value_bits = bits;
+        column->delta_us = 0;
+        column->leading_zeros = NO_WINDOW;
+        return true;
+    }
+    return read_timestamp(scan) && read_value(scan);
+}
+
+bool diagnostic_recorder_next_sample(DiagnosticRecorderScan* scan,
+        uint64_t* timestamp_us, float* value) {
+    while(!scan->malformed) {
+        if(scan->chunk == NULL || scan->remaining_samples == 0) {
+            if(!next_chunk(scan)) {
+                return false;
+            }
+            continue;
+        }
+
+        if(!read_sample(scan)) {
+            scan->malformed = true;
+            return false;
+        }
+        if(scan->column.timestamp_us > scan->end_us) {
+            // the rest of the series is later still
+            scan->chunk = NULL;
+            scan->offset = scan->log_size;
+            return false;
+        } else if(scan->column.timestamp_us >= scan->start_us) {
+            *timestamp_us = scan->column.timestamp_us;
+            memcpy(value, &scan->column.value_bits, sizeof(*value));
+            return true;
+        }
+    }
+    return false;
+}
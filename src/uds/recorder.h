@@ -0,0 +1,189 @@
+#ifndef __RECORDER_H__
+#define __RECORDER_H__
+
+#include <uds/uds_types.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of (ECU, mode, PID) series recorded at once, at most 255.
+#ifndef MAX_RECORDER_SERIES
+#define MAX_RECORDER_SERIES 64
+#endif
+
+// The compressed samples in one chunk of a series.
+#ifndef DIAGNOSTIC_RECORDER_CHUNK_SIZE
+#define DIAGNOSTIC_RECORDER_CHUNK_SIZE 512
+#endif
+
+#define DIAGNOSTIC_RECORDER_VERSION 1
+#define DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE 32
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Records the values of polled PIDs into a compact columnar log, one column
+ * per ECU and PID, for time series storage.
+ *
+ * Every value is decoded with diagnostic_decode_obd2_pid(...) and appended to
+ * the open chunk of its series, compressed like Facebook's Gorilla: the
+ * timestamp as the difference of its delta from the previous one in a few
+ * bits, the value XORed with the previous one. Recording a value never
+ * allocates and takes constant time. A full chunk is written out whole, so
+ * the log is append-only:
+ *
+ *      0x55 0x43 ("UC"), version, mode, arbitration ID (32 bits), PID (16
+ *      bits), sample count (16 bits), data length (16 bits), 0 (16 bits),
+ *      first timestamp (64 bits), last timestamp (64 bits), data
+ *
+ * all big endian. The log can be memory-mapped and scanned for one series and
+ * time range with diagnostic_recorder_start_scan(...), which skips other
+ * chunks by their headers alone.
+ */
+
+typedef struct DiagnosticRecorder DiagnosticRecorder;
+
+/* Public: Append a whole chunk to the log, e.g. with write(2) to a file opened
+ * with O_APPEND.
+ *
+ * Returns true if the chunk was written.
+ */
+typedef bool (*DiagnosticRecorderWriteShim)(DiagnosticRecorder* recorder,
+        const uint8_t data[], uint16_t size);
+
+/* Private: The state of the compression of a column, the same when writing
+ * and reading it.
+ */
+typedef struct {
+    uint64_t timestamp_us;
+    int64_t delta_us;
+    uint32_t value_bits;
+    uint8_t leading_zeros;
+    uint8_t trailing_zeros;
+} DiagnosticRecorderColumn;
+
+/* Private: One series and its open chunk, header first.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t mode;
+    uint16_t pid;
+    uint16_t sample_count;
+    uint32_t bit_count;
+    uint64_t first_timestamp_us;
+    DiagnosticRecorderColumn column;
+    uint8_t chunk[DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE +
+            DIAGNOSTIC_RECORDER_CHUNK_SIZE];
+} DiagnosticRecorderSeries;
+
+/* Public: A recorder. Initialize it with diagnostic_init_recorder(...).
+ *
+ * write - The shim that appends chunks to the log.
+ * context - (optional) Anything the write shim needs.
+ * sample_count - The number of values recorded.
+ * chunk_count - The number of chunks written.
+ * dropped_chunk_count - The number of chunks the write shim failed to write.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticRecorder {
+    DiagnosticRecorderWriteShim write;
+    void* context;
+    uint64_t sample_count;
+    uint64_t chunk_count;
+    uint64_t dropped_chunk_count;
+
+    // Private
+    uint8_t series_count;
+    // an open addressing hash table of series indexes + 1, 0 if empty
+    uint8_t series_table[MAX_RECORDER_SERIES * 2];
+    DiagnosticRecorderSeries series[MAX_RECORDER_SERIES];
+};
+
+/* Public: The state of a scan of a log. Start it with
+ * diagnostic_recorder_start_scan(...).
+ *
+ * malformed - true if the scan stopped at a truncated or invalid chunk.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    bool malformed;
+
+    // Private
+    const uint8_t* log;
+    size_t log_size;
+    size_t offset;
+    uint32_t arbitration_id;
+    uint8_t mode;
+    uint16_t pid;
+    uint64_t start_us;
+    uint64_t end_us;
+    const uint8_t* chunk;
+    uint32_t chunk_bit_count;
+    uint32_t bit;
+    uint16_t remaining_samples;
+    uint16_t sample_count;
+    DiagnosticRecorderColumn column;
+} DiagnosticRecorderScan;
+
+/* Public: Initialize a recorder with no series.
+ *
+ * write - the shim that appends chunks to the log.
+ * context - anything the write shim needs, or NULL.
+ */
+void diagnostic_init_recorder(DiagnosticRecorder* recorder,
+        DiagnosticRecorderWriteShim write, void* context);
+
+/* Public: Record the value of a response, e.g. from a
+ * DiagnosticResponseReceived callback. Values of a series should be recorded
+ * in time order.
+ *
+ * response - a response to a PID request.
+ * timestamp_us - when the response was received, in microseconds since any
+ *      epoch.
+ *
+ * Returns false if the value wasn't recorded: the response wasn't a
+ * successful PID response or MAX_RECORDER_SERIES series are already recorded.
+ * A full chunk that the write shim fails to write is dropped and counted in
+ * the recorder's 'dropped_chunk_count'.
+ */
+bool diagnostic_recorder_record(DiagnosticRecorder* recorder,
+        const DiagnosticResponse* response, uint64_t timestamp_us);
+
+/* Public: Write the open chunk of every series, e.g. before closing the log.
+ * Recording can continue afterwards, in new chunks.
+ *
+ * Returns false if any chunk couldn't be written.
+ */
+bool diagnostic_recorder_flush(DiagnosticRecorder* recorder);
+
+/* Public: Start a scan of a log for the values of one series in a time range.
+ *
+ * log - the log, e.g. memory-mapped. It is read in place, so it must stay
+ *      valid while scanning.
+ * log_size - the size of the log.
+ * arbitration_id, mode, pid - the series.
+ * start_us, end_us - the time range, both inclusive.
+ */
+void diagnostic_recorder_start_scan(DiagnosticRecorderScan* scan,
+        const uint8_t log[], size_t log_size, uint32_t arbitration_id,
+        uint8_t mode, uint16_t pid, uint64_t start_us, uint64_t end_us);
+
+/* Public: Read the next value of the scan.
+ *
+ * timestamp_us - set to the timestamp of the value.
+ * value - set to the value.
+ *
+ * Returns false at the end of the log, or if a chunk is malformed - see the
+ * scan's 'malformed'.
+ */
+bool diagnostic_recorder_next_sample(DiagnosticRecorderScan* scan,
+        uint64_t* timestamp_us, float* value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RECORDER_H__
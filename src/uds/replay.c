@@ -0,0 +1,247 @@
+#include <uds/replay.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define CAN_EXTENDED_ID_MASK 0x1fffffff
+#define STANDARD_ID_DIGITS 3
+#define EXTENDED_ID_DIGITS 8
+#define MICROSECOND_DIGITS 6
+
+static const int8_t HEX_DIGITS[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6,
+    ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16
+};
+
+// the table is offset by one so 0 can mean "not a hex digit"
+static int hex_value(char character) {
+    return HEX_DIGITS[(uint8_t) character] - 1;
+}
+
+bool diagnostic_parse_candump_line(const char* line, size_t length,
+        DiagnosticCanFrame* frame) {
+    const char* end = line + length;
+    const char* position = line;
+    if(position == end || *position++ != '(') {
+        return false;
+    }
+
+    uint64_t seconds = 0;
+    while(position < end && *position >= '0' && *position <= '9') {
+        seconds = seconds * 10 + (*position++ - '0');
+    }
+    if(position == end || *position++ != '.') {
+        return false;
+    }
+    uint32_t microseconds = 0;
+    int digits = 0;
+    while(position < end && *position >= '0' && *position <= '9') {
+        if(digits++ < MICROSECOND_DIGITS) {
+            microseconds = microseconds * 10 + (*position - '0');
+        }
+        ++position;
+    }
+    for(; digits < MICROSECOND_DIGITS; ++digits) {
+        microseconds *= 10;
+    }
+    if(position == end || *position++ != ')') {
+        return false;
+    }
+    frame->timestamp_us = seconds * 1000000 + microseconds;
+
+    // the interface name
+    while(position < end && *position == ' ') {
+        ++position;
+    }
+    while(position < end && *position != ' ') {
+        ++position;
+    }
+    while(position < end && *position == ' ') {
+        ++position;
+    }
+
+    const char* id_start = position;
+    uint32_t arbitration_id = 0;
+    int value;
+    while(position < end && (value = hex_value(*position)) >= 0) {
+        arbitration_id = (arbitration_id << 4) | value;
+        ++position;
+    }
+    if(position == end || *position++ != '#') {
+        return false;
+    }
+    if(position - 1 - id_start == STANDARD_ID_DIGITS) {
+        frame->arbitration_id = arbitration_id;
+    } else if(position - 1 - id_start == EXTENDED_ID_DIGITS) {
+        frame->arbitration_id = arbitration_id & CAN_EXTENDED_ID_MASK;
+    } else {
+        return false;
+    }
+
+    frame->can_fd = position < end && *position == '#';
+    if(frame->can_fd) {
+        // the second '#' is followed by a flags nibble
+        position += 2;
+        if(position > end) {
+            return false;
+        }
+    }
+
+    uint8_t size = 0;
+    while(position + 1 < end && size < CAN_FD_MESSAGE_BYTE_SIZE) {
+        int high = hex_value(position[0]);
+        int low = hex_value(position[1]);
+        if(high < 0 || low < 0) {
+            break;
+        }
+        frame->data[size++] = (high << 4) | low;
+        position += 2;
+    }
+    // anything left over, e.g. an 'R' for a remote frame, isn't data
+    while(position < end && (*position == '\r' || *position == ' ')) {
+        ++position;
+    }
+    if(position != end) {
+        return false;
+    }
+    frame->size = size;
+    return true;
+}
+
+static void forward_transaction(DiagnosticSniffer* sniffer,
+        const DiagnosticSnifferTransaction* transaction) {
+    DiagnosticReplay* replay = sniffer->context;
+    if(replay->transaction_completed != NULL) {
+        replay->transaction_completed(replay, transaction);
+    }
+}
+
+void diagnostic_init_replay(DiagnosticReplay* replay, const char* trace,
+        size_t trace_size) {
+    memset(replay, 0, sizeof(DiagnosticReplay));
+    replay->trace = trace;
+    replay->trace_size = trace_size;
+    diagnostic_init_sniffer(&replay->sniffer);
+    replay->sniffer.transaction_completed = forward_transaction;
+    replay->sniffer.context = replay;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+static uint64_t monotonic_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void wait_for_frame(DiagnosticReplay* replay,
+        const DiagnosticCanFrame* frame) {
+    if(replay->speed <= 0) {
+        return;
+    }
+    if(!replay->started) {
+        replay->start_clock_us = monotonic_time_us();
+        return;
+    }
+
+    uint64_t due_us = replay->start_clock_us + (uint64_t)((frame->timestamp_us -
+                replay->first_timestamp_us) / replay->speed);
+    uint64_t now_us = monotonic_time_us();
+    if(due_us > now_us) {
+        struct timespec delay = {
+            tv_sec: (due_us - now_us) / 1000000,
+            tv_nsec: ((due_us - now_us) % 1000000) * 1000
+        };
+        nanosleep(&delay, NULL);
+    }
+}
+
+#else
+
+static void wait_for_frame(DiagnosticReplay* replay,
+        const DiagnosticCanFrame* frame) {
+}
+
+#endif
+
+bool diagnostic_replay_next(DiagnosticReplay* replay) {
+    DiagnosticCanFrame frame;
+    while(replay->offset < replay->trace_size) {
+        const char* line = replay->trace + replay->offset;
+        size_t remaining = replay->trace_size - replay->offset;
+        const char* newline = memchr(line, '\n', remaining);
+        size_t length = newline != NULL ? (size_t)(newline - line) : remaining;
+        replay->offset += length + (newline != NULL ? 1 : 0);
+
+        if(length == 0) {
+            continue;
+        }
+        if(!diagnostic_parse_candump_line(line, length, &frame)) {
+            ++replay->malformed_line_count;
+            continue;
+        }
+        if(frame.timestamp_us < replay->first_timestamp_us) {
+            // out of order, e.g. traces from two interfaces concatenated
+            frame.timestamp_us = replay->first_timestamp_us;
+        }
+
+        wait_for_frame(replay, &frame);
+        if(!replay->started) {
+            replay->started = true;
+            replay->first_timestamp_us = frame.timestamp_us;
+        }
+        ++replay->frame_count;
+        if(replay->frame_received != NULL) {
+            replay->frame_received(replay, &frame);
+        }
+        diagnostic_sniffer_receive_can_frame(&replay->sniffer,
+                frame.arbitration_id, frame.data, frame.size,
+                frame.timestamp_us);
+        return true;
+    }
+    return false;
+}
+
+void diagnostic_replay_run(DiagnosticReplay* replay) {
+    while(diagnostic_replay_next(replay));
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+const char* diagnostic_replay_map_trace(const char* path, size_t* size) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    struct stat status;
+    void* trace = MAP_FAILED;
+    if(fstat(fd, &status) == 0 && status.st_size > 0) {
+        trace = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if(trace == MAP_FAILED) {
+        return NULL;
+    }
+    // traces are read once from start to end
+    madvise(trace, status.st_size, MADV_SEQUENTIAL);
+    *size = status.st_size;
+    return trace;
+}
+
+void diagnostic_replay_unmap_trace(const char* trace, size_t size) {
+    if(trace != NULL) {
+        munmap((void*) trace, size);
+    }
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <uds/uds_types.h>
+#include <uds/sniffer.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Replays a CAN trace recorded with candump (SocketCAN's "-l" log format)
+ * through a DiagnosticSniffer. Requests found in the trace are matched with
+ * their responses by the same code that handles live requests, and each
+ * completed transaction is reported with its timestamps - as fast as the CPU
+ * allows, or paced like the original recording.
+ */
+
+typedef struct DiagnosticReplay DiagnosticReplay;
+
+/* Public: One CAN frame from a trace.
+ *
+ * timestamp_us - When the frame was recorded, in microseconds since the epoch
+ *      of the trace.
+ * arbitration_id - The arbitration ID, 29 bits for extended IDs.
+ * can_fd - true if the frame was a CAN FD frame.
+ * size - The number of data bytes.
+ * data - The data bytes.
+ */
+typedef struct {
+    uint64_t timestamp_us;
+    uint32_t arbitration_id;
+    bool can_fd;
+    uint8_t size;
+    uint8_t data[CAN_FD_MESSAGE_BYTE_SIZE];
+} DiagnosticCanFrame;
+
+/* Public: Called for every frame read from the trace, before it's matched
+ * against the pending requests - e.g. to dispatch it somewhere else as well.
+ */
+typedef void (*DiagnosticReplayFrameReceived)(DiagnosticReplay* replay,
+        const DiagnosticCanFrame* frame);
+
+/* Public: Called for every response in the trace, with the request it
+ * answered if there was one.
+ */
+typedef void (*DiagnosticReplayTransactionCompleted)(DiagnosticReplay* replay,
+        const DiagnosticSnifferTransaction* transaction);
+
+/* Public: A replay of one trace. Initialize it with diagnostic_init_replay(...)
+ * and set the optional fields before the first frame.
+ *
+ * speed - (optional) 0 to replay as fast as possible, otherwise the speed
+ *      relative to the recording - 1 for the original timing, 10 for 10 times
+ *      faster. Pacing is only supported on Unix-like systems.
+ * frame_received - (optional) Called for every frame.
+ * transaction_completed - (optional) Called for every response.
+ * context - (optional) Anything the callbacks need.
+ * frame_count - The number of frames read so far.
+ * malformed_line_count - The number of lines that weren't CAN frames.
+ * sniffer - The sniffer decoding the trace, with the request and transaction
+ *      counts. Its tester_address and log may be changed before the first
+ *      frame; its callback belongs to the replay.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticReplay {
+    float speed;
+    DiagnosticReplayFrameReceived frame_received;
+    DiagnosticReplayTransactionCompleted transaction_completed;
+    void* context;
+    uint64_t frame_count;
+    uint64_t malformed_line_count;
+    DiagnosticSniffer sniffer;
+
+    // Private
+    const char* trace;
+    size_t trace_size;
+    size_t offset;
+    bool started;
+    uint64_t first_timestamp_us;
+    uint64_t start_clock_us;
+};
+
+/* Public: Parse one line of a candump log, e.g.
+ * "(1436509052.249713) can0 7E0#0201050000000000", or
+ * "(1436509052.249713) can0 18DAF110##10562F19031" for a CAN FD frame.
+ *
+ * line - the line, without the need for a terminating newline or NUL.
+ * length - the length of the line.
+ * frame - set to the parsed frame.
+ *
+ * Returns false if the line isn't a data frame (e.g. a remote frame or a
+ * malformed line).
+ */
+bool diagnostic_parse_candump_line(const char* line, size_t length,
+        DiagnosticCanFrame* frame);
+
+/* Public: Initialize a replay of a trace in memory.
+ *
+ * trace - the contents of a candump log, e.g. mapped with
+ *      diagnostic_replay_map_trace(...). It is read in place, so it must stay
+ *      valid until the replay is finished.
+ * trace_size - the size of the trace.
+ */
+void diagnostic_init_replay(DiagnosticReplay* replay, const char* trace,
+        size_t trace_size);
+
+/* Public: Replay the next frame of the trace, waiting for it first if the
+ * replay is paced.
+ *
+ * Returns false at the end of the trace.
+ */
+bool diagnostic_replay_next(DiagnosticReplay* replay);
+
+/* Public: Replay the rest of the trace.
+ */
+void diagnostic_replay_run(DiagnosticReplay* replay);
+
+#if defined(__unix__) || defined(__APPLE__)
+
+/* Public: Map a trace file read-only into memory, so even traces of many GB
+ * can be replayed without reading them into a buffer.
+ *
+ * path - the path of the trace.
+ * size - set to the size of the trace.
+ *
+ * Returns the mapped trace, or NULL if the file could not be mapped.
+ */
+const char* diagnostic_replay_map_trace(const char* path, size_t* size);
+
+/* Public: Unmap a trace mapped with diagnostic_replay_map_trace.
+ */
+void diagnostic_replay_unmap_trace(const char* trace, size_t size);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __REPLAY_H__
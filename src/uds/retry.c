@@ -0,0 +1,194 @@
+#include <uds/retry.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#define DEFAULT_MAX_ATTEMPTS 3
+#define DEFAULT_INITIAL_BACKOFF_US 50000
+#define DEFAULT_MAX_BACKOFF_US 2000000
+#define DEFAULT_JITTER_PERCENT 50
+#define DEFAULT_FAILURE_THRESHOLD 3
+#define DEFAULT_PROBE_INTERVAL_US 5000000
+
+void diagnostic_init_retry_policy(DiagnosticRetryPolicy* policy) {
+    memset(policy, 0, sizeof(DiagnosticRetryPolicy));
+    policy->max_attempts = DEFAULT_MAX_ATTEMPTS;
+    policy->initial_backoff_us = DEFAULT_INITIAL_BACKOFF_US;
+    policy->max_backoff_us = DEFAULT_MAX_BACKOFF_US;
+    policy->jitter_percent = DEFAULT_JITTER_PERCENT;
+    policy->retry_on_timeout = true;
+    diagnostic_retry_on_nrc(policy, NRC_BUSY_REPEAT_REQUEST);
+    diagnostic_retry_on_nrc(policy, NRC_CONDITIONS_NOT_CORRECT);
+}
+
+bool diagnostic_retry_on_nrc(DiagnosticRetryPolicy* policy,
+        DiagnosticNegativeResponseCode code) {
+    if(policy->nrc_count >= MAX_RETRY_NRCS) {
+        return false;
+    }
+    policy->nrcs[policy->nrc_count++] = code;
+    return true;
+}
+
+bool diagnostic_retry_needed(const DiagnosticRetryPolicy* policy,
+        const DiagnosticResponse* response, uint8_t attempts) {
+    if(attempts >= policy->max_attempts) {
+        return false;
+    }
+    if(response == NULL) {
+        return policy->retry_on_timeout;
+    }
+    if(response->success) {
+        return false;
+    }
+
+    for(uint8_t i = 0; i < policy->nrc_count; i++) {
+        if(policy->nrcs[i] == response->negative_response_code) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint32_t next_random(uint32_t* random_state) {
+    uint32_t x = *random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *random_state = x;
+    return x;
+}
+
+uint32_t diagnostic_retry_backoff_us(const DiagnosticRetryPolicy* policy,
+        uint8_t attempts, uint32_t* random_state) {
+    uint32_t backoff_us = policy->initial_backoff_us;
+    for(uint8_t i = 1; i < attempts && backoff_us < policy->max_backoff_us;
+            i++) {
+        backoff_us = backoff_us > UINT32_MAX / 2 ? UINT32_MAX :
+                backoff_us * 2;
+    }
+    if(backoff_us > policy->max_backoff_us) {
+        backoff_us = policy->max_backoff_us;
+    }
+
+    uint8_t jitter_percent = policy->jitter_percent > 100 ? 100 :
+            policy->jitter_percent;
+    uint32_t jitter_us = (uint64_t) backoff_us * jitter_percent / 100;
+    if(jitter_us == 0) {
+        return backoff_us;
+    }
+    return backoff_us - (uint32_t)(next_random(random_state) %
+            ((uint64_t) jitter_us + 1));
+}
+
+void diagnostic_init_circuit_breakers(DiagnosticCircuitBreakers* breakers) {
+    memset(breakers, 0, sizeof(DiagnosticCircuitBreakers));
+    breakers->failure_threshold = DEFAULT_FAILURE_THRESHOLD;
+    breakers->probe_interval_us = DEFAULT_PROBE_INTERVAL_US;
+}
+
+DiagnosticCircuitBreaker* diagnostic_find_circuit_breaker(
+        DiagnosticCircuitBreakers* breakers, uint32_t arbitration_id) {
+    for(uint8_t i = 0; i < breakers->breaker_count; i++) {
+        if(breakers->breakers[i].arbitration_id == arbitration_id) {
+            return &breakers->breakers[i];
+        }
+    }
+    return NULL;
+}
+
+bool diagnostic_circuit_allows(DiagnosticShims* shims,
+        DiagnosticCircuitBreakers* breakers, uint32_t arbitration_id) {
+    DiagnosticCircuitBreaker* breaker = diagnostic_find_circuit_breaker(
+            breakers, arbitration_id);
+    if(breaker == NULL) {
+        if(breakers->breaker_count < MAX_CIRCUIT_BREAKERS) {
+            breaker = &breakers->breakers[breakers->breaker_count++];
+            memset(breaker, 0, sizeof(DiagnosticCircuitBreaker));
+            breaker->arbitration_id = arbitration_id;
+        }
+        return true;
+    }
+
+    switch(breaker->state) {
+        case DIAGNOSTIC_CIRCUIT_CLOSED:
+            return true;
+        case DIAGNOSTIC_CIRCUIT_OPEN:
+            if(shims->get_time_us != NULL && shims->get_time_us() -
+                    breaker->opened_us >= breakers->probe_interval_us) {
+                breaker->state = DIAGNOSTIC_CIRCUIT_HALF_OPEN;
+                return true;
+            }
+            break;
+        case DIAGNOSTIC_CIRCUIT_HALF_OPEN:
+            break;
+    }
+    ++breaker->refused_count;
+    return false;
+}
+
+static void open_circuit(DiagnosticShims* shims,
+        DiagnosticCircuitBreaker* breaker) {
+    if(breaker->state == DIAGNOSTIC_CIRCUIT_CLOSED) {
+        ++breaker->opened_count;
+        if(shims->log != NULL) {
+            shims->log("No response from 0x%x %u times in a row, holding "
+                    "its requests", breaker->arbitration_id,
+                    breaker->failure_count);
+        }
+    }
+    breaker->state = DIAGNOSTIC_CIRCUIT_OPEN;
+    if(shims->get_time_us != NULL) {
+        breaker->opened_us = shims->get_time_us();
+    }
+}
+
+void diagnostic_circuit_record(DiagnosticShims* shims,
+        DiagnosticCircuitBreakers* breakers, uint32_t arbitration_id,
+        bool responded) {
+    DiagnosticCircuitBreaker* breaker = diagnostic_find_circuit_breaker(
+            breakers, arbitration_id);
+    if(breaker == NULL) {
+        return;
+    }
+
+    if(responded) {
+        breaker->state = DIAGNOSTIC_CIRCUIT_CLOSED;
+        breaker->failure_count = 0;
+        return;
+    }
+
+    if(breaker->failure_count < UINT8_MAX) {
+        ++breaker->failure_count;
+    }
+    if(breaker->state == DIAGNOSTIC_CIRCUIT_HALF_OPEN ||
+            breaker->failure_count >= breakers->failure_threshold) {
+        open_circuit(shims, breaker);
+    }
+}
+
+void diagnostic_circuit_reset(DiagnosticCircuitBreakers* breakers,
+        uint32_t arbitration_id) {
+    DiagnosticCircuitBreaker* breaker = diagnostic_find_circuit_breaker(
+            breakers, arbitration_id);
+    if(breaker != NULL) {
+        breaker->state = DIAGNOSTIC_CIRCUIT_CLOSED;
+        breaker->failure_count = 0;
+    }
+}
+
+void diagnostic_circuit_next_deadline(DiagnosticShims* shims,
+        const DiagnosticCircuitBreakers* breakers,
+        DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    for(uint8_t i = 0; i < breakers->breaker_count; i++) {
+        const DiagnosticCircuitBreaker* breaker = &breakers->breakers[i];
+        if(breaker->state == DIAGNOSTIC_CIRCUIT_OPEN) {
+            diagnostic_add_deadline(deadline, now, breaker->opened_us,
+                    breakers->probe_interval_us);
+        }
+    }
+}
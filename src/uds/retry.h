@@ -0,0 +1,177 @@
+#ifndef __RETRY_H__
+#define __RETRY_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of negative response codes one retry policy retries on.
+#ifndef MAX_RETRY_NRCS
+#define MAX_RETRY_NRCS 8
+#endif
+
+// The number of ECUs one set of circuit breakers tracks.
+#ifndef MAX_CIRCUIT_BREAKERS
+#define MAX_CIRCUIT_BREAKERS 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: When and how often to send a failed request again. Initialize it
+ * with diagnostic_init_retry_policy(...), then change what you need.
+ *
+ * max_attempts - The most times a request is sent, including the first. The
+ *      default is 3.
+ * initial_backoff_us - How long to wait before the first retry. The default is
+ *      50ms.
+ * max_backoff_us - The longest wait, which the backoff doubles up to with
+ *      every retry. The default is 2s.
+ * jitter_percent - How much of each wait is random, from 0 to 100, so ECUs
+ *      that failed together aren't retried together. The default is 50: a
+ *      wait of somewhere between half and all of the backoff.
+ * retry_on_timeout - true to retry requests that got no response. The default
+ *      is true.
+ * nrcs, nrc_count - The negative response codes to retry on. The default is
+ *      "busy, repeat request" (0x21) and "conditions not correct" (0x22).
+ */
+typedef struct {
+    uint8_t max_attempts;
+    uint32_t initial_backoff_us;
+    uint32_t max_backoff_us;
+    uint8_t jitter_percent;
+    bool retry_on_timeout;
+    DiagnosticNegativeResponseCode nrcs[MAX_RETRY_NRCS];
+    uint8_t nrc_count;
+} DiagnosticRetryPolicy;
+
+/* Public: Initialize a retry policy with the defaults.
+ */
+void diagnostic_init_retry_policy(DiagnosticRetryPolicy* policy);
+
+/* Public: Add a negative response code to retry on.
+ *
+ * Returns false if the policy already has MAX_RETRY_NRCS codes.
+ */
+bool diagnostic_retry_on_nrc(DiagnosticRetryPolicy* policy,
+        DiagnosticNegativeResponseCode code);
+
+/* Public: Returns true if a request that completed with 'response' - or that
+ * got no response, if it's NULL - should be sent again after 'attempts'
+ * attempts.
+ */
+bool diagnostic_retry_needed(const DiagnosticRetryPolicy* policy,
+        const DiagnosticResponse* response, uint8_t attempts);
+
+/* Public: Returns how long to wait before sending a request again after
+ * 'attempts' attempts, jittered with the xorshift generator in
+ * 'random_state', which must not be 0.
+ */
+uint32_t diagnostic_retry_backoff_us(const DiagnosticRetryPolicy* policy,
+        uint8_t attempts, uint32_t* random_state);
+
+/* Public: Where the circuit breaker of one ECU stands.
+ */
+typedef enum {
+    // requests are sent
+    DIAGNOSTIC_CIRCUIT_CLOSED,
+    // the ECU stopped responding, requests are refused without being sent
+    DIAGNOSTIC_CIRCUIT_OPEN,
+    // a single probe request was let through to see if the ECU is back
+    DIAGNOSTIC_CIRCUIT_HALF_OPEN
+} DiagnosticCircuitState;
+
+/* Public: The circuit breaker of one ECU.
+ *
+ * arbitration_id - The request arbitration ID of the ECU.
+ * state - Whether requests are sent to the ECU.
+ * failure_count - The requests in a row that got no response.
+ * opened_count - The number of times the circuit was opened.
+ * refused_count - The number of requests refused while it was open.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    DiagnosticCircuitState state;
+    uint8_t failure_count;
+    uint32_t opened_count;
+    uint32_t refused_count;
+
+    // Private
+    uint32_t opened_us;
+} DiagnosticCircuitBreaker;
+
+/* Public: Circuit breakers for a set of ECUs, which stop requests to an ECU
+ * that doesn't respond - one that's asleep or has dropped off the bus - and
+ * let a probe through now and then to find out when it's back. A negative
+ * response counts as a response. Initialize them with
+ * diagnostic_init_circuit_breakers(...); an ECU gets its breaker with its
+ * first request.
+ *
+ * failure_threshold - (optional) The requests in a row without a response
+ *      that open an ECU's circuit. The default is 3.
+ * probe_interval_us - (optional) How long an open circuit refuses requests
+ *      before letting a probe through. The default is 5s. Needs the
+ *      get_time_us shim; without it, an open circuit stays open until
+ *      diagnostic_circuit_reset(...).
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint8_t failure_threshold;
+    uint32_t probe_interval_us;
+
+    // Private
+    DiagnosticCircuitBreaker breakers[MAX_CIRCUIT_BREAKERS];
+    uint8_t breaker_count;
+} DiagnosticCircuitBreakers;
+
+/* Public: Initialize the circuit breakers with the defaults, tracking no ECUs.
+ */
+void diagnostic_init_circuit_breakers(DiagnosticCircuitBreakers* breakers);
+
+/* Public: Returns the circuit breaker of an ECU, or NULL if no request was
+ * sent to it yet.
+ */
+DiagnosticCircuitBreaker* diagnostic_find_circuit_breaker(
+        DiagnosticCircuitBreakers* breakers, uint32_t arbitration_id);
+
+/* Public: Returns true if a request may be sent to the ECU now. An open
+ * circuit whose probe interval has passed lets this one request through as a
+ * probe, and refuses the rest until its outcome is recorded. Requests to ECUs
+ * beyond MAX_CIRCUIT_BREAKERS are always allowed.
+ */
+bool diagnostic_circuit_allows(DiagnosticShims* shims,
+        DiagnosticCircuitBreakers* breakers, uint32_t arbitration_id);
+
+/* Public: Record the outcome of an allowed request to the ECU. Every allowed
+ * request needs one - a probe whose outcome is never recorded leaves the
+ * circuit half open, refusing everything.
+ *
+ * responded - true if the ECU responded, positively or not, false if the
+ *      request timed out or ended without a response some other way, e.g.
+ *      it couldn't be sent.
+ */
+void diagnostic_circuit_record(DiagnosticShims* shims,
+        DiagnosticCircuitBreakers* breakers, uint32_t arbitration_id,
+        bool responded);
+
+/* Public: Close the circuit of an ECU, e.g. once it's known to be awake.
+ */
+void diagnostic_circuit_reset(DiagnosticCircuitBreakers* breakers,
+        uint32_t arbitration_id);
+
+/* Public: Add the time the next open circuit lets a probe through to a
+ * deadline. Does nothing without the get_time_us shim.
+ */
+void diagnostic_circuit_next_deadline(DiagnosticShims* shims,
+        const DiagnosticCircuitBreakers* breakers,
+        DiagnosticDeadline* deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RETRY_H__
@@ -0,0 +1,405 @@
+#include <uds/scheduler.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#define DEFAULT_RESPONSE_TIMEOUT_US 1000000
+// P2*, the longest an ECU may take after saying the response is pending
+#define RESPONSE_PENDING_TIMEOUT_US 5000000
+#define DEFAULT_PREEMPTION_BLOCK_SIZE 8
+
+void diagnostic_init_request_scheduler(DiagnosticRequestScheduler* scheduler) {
+    memset(scheduler, 0, sizeof(DiagnosticRequestScheduler));
+    scheduler->response_timeout_us = DEFAULT_RESPONSE_TIMEOUT_US;
+    scheduler->preemption_block_size = DEFAULT_PREEMPTION_BLOCK_SIZE;
+    scheduler->random_state = 1;
+}
+
+static uint32_t now_us(DiagnosticShims* shims) {
+    return shims->get_time_us != NULL ? shims->get_time_us() : 0;
+}
+
+static bool ecu_busy(const DiagnosticRequestScheduler* scheduler,
+        uint32_t arbitration_id) {
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        const DiagnosticScheduledRequest* request = &scheduler->requests[i];
+        if(request->in_flight &&
+                request->handle.request.arbitration_id == arbitration_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Private: Returns true if request 'a' should be sent before 'b'.
+ */
+static bool sent_before(const DiagnosticScheduledRequest* a,
+        const DiagnosticScheduledRequest* b) {
+    return a->priority < b->priority || (a->priority == b->priority &&
+            (int32_t)(a->sequence - b->sequence) < 0);
+}
+
+/* Private: Returns true if the request is queued and not waiting out a retry
+ * backoff.
+ */
+static bool ready(const DiagnosticScheduledRequest* request, uint32_t now) {
+    return request->in_use && !request->in_flight &&
+            (!request->waiting_to_retry ||
+                (int32_t)(now - request->retry_at_us) >= 0);
+}
+
+/* Private: Returns the most urgent queued request whose ECU is free, or NULL.
+ */
+static DiagnosticScheduledRequest* next_request(
+        DiagnosticRequestScheduler* scheduler, uint32_t now) {
+    DiagnosticScheduledRequest* next = NULL;
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        DiagnosticScheduledRequest* request = &scheduler->requests[i];
+        if(ready(request, now) &&
+                (next == NULL || sent_before(request, next)) &&
+                !ecu_busy(scheduler, request->handle.request.arbitration_id)) {
+            next = request;
+        }
+    }
+    return next;
+}
+
+static void finish(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request) {
+    DiagnosticPriorityStatistics* statistics =
+            &scheduler->statistics[request->priority];
+    if(request->handle.success) {
+        uint32_t latency_us = now_us(shims) - request->scheduled_us;
+        ++statistics->completed_count;
+        statistics->total_latency_us += latency_us;
+        if(latency_us > statistics->max_latency_us) {
+            statistics->max_latency_us = latency_us;
+        }
+    } else {
+        ++statistics->failed_count;
+    }
+    request->in_use = false;
+    request->in_flight = false;
+}
+
+static void complete(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request,
+        const DiagnosticResponse* response) {
+    if(request->callback != NULL) {
+        request->callback(response);
+    }
+    if(request->context_callback != NULL) {
+        request->context_callback(response, request->context);
+    }
+    finish(shims, scheduler, request);
+}
+
+/* Private: Complete a request that got no response.
+ */
+static void fail(DiagnosticShims* shims, DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request) {
+    request->handle.completed = true;
+    request->handle.success = false;
+    DiagnosticResponse response = {
+        arbitration_id: request->handle.request.arbitration_id,
+        mode: request->handle.request.mode,
+        completed: true,
+        success: false
+    };
+    complete(shims, scheduler, request, &response);
+}
+
+/* Private: Fail a request that was sent but ended without a response - it
+ * couldn't be sent, or its handle gave up - and count it against the ECU's
+ * circuit breaker like a timeout, so a probe that ends this way opens the
+ * circuit again instead of leaving it half open.
+ */
+static void abandon(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request) {
+    if(scheduler->circuit_breakers != NULL) {
+        diagnostic_circuit_record(shims, scheduler->circuit_breakers,
+                request->handle.request.arbitration_id, false);
+    }
+    fail(shims, scheduler, request);
+}
+
+/* Private: Queue a request to be sent again if the retry policy says so, after
+ * its backoff.
+ *
+ * response - the response it got, or NULL if it got none.
+ *
+ * Returns true if it will be retried.
+ */
+static bool retry(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request,
+        const DiagnosticResponse* response) {
+    if(scheduler->retry_policy == NULL || !diagnostic_retry_needed(
+                scheduler->retry_policy, response, request->attempts)) {
+        return false;
+    }
+
+    request->in_flight = false;
+    request->waiting_to_retry = true;
+    request->retry_at_us = now_us(shims) + diagnostic_retry_backoff_us(
+            scheduler->retry_policy, request->attempts,
+            &scheduler->random_state);
+    ++scheduler->statistics[request->priority].retry_count;
+    return true;
+}
+
+/* Private: Retry or fail a request that got no response in time.
+ */
+static void time_out(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request) {
+    if(shims->log != NULL) {
+        shims->log("Request to 0x%x timed out",
+                request->handle.request.arbitration_id);
+    }
+    if(scheduler->circuit_breakers != NULL) {
+        diagnostic_circuit_record(shims, scheduler->circuit_breakers,
+                request->handle.request.arbitration_id, false);
+    }
+    if(!retry(shims, scheduler, request, NULL)) {
+        fail(shims, scheduler, request);
+    }
+}
+
+static void start(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler,
+        DiagnosticScheduledRequest* request) {
+    DiagnosticRequestHandle* handle = &request->handle;
+    request->waiting_to_retry = false;
+    if(scheduler->circuit_breakers != NULL && !diagnostic_circuit_allows(
+                shims, scheduler->circuit_breakers,
+                handle->request.arbitration_id)) {
+        fail(shims, scheduler, request);
+        return;
+    }
+
+    if(request->priority != DIAGNOSTIC_PRIORITY_HIGH &&
+            handle->flow_control.block_size == 0 &&
+            handle->receive_buffer != NULL) {
+        handle->flow_control.block_size = scheduler->preemption_block_size;
+    }
+
+    request->in_flight = true;
+    ++request->attempts;
+    request->last_activity_us = now_us(shims);
+    start_diagnostic_request(shims, handle);
+    if(handle->completed) {
+        abandon(shims, scheduler, request);
+    }
+}
+
+/* Private: Returns true if a request more urgent than 'request' is waiting
+ * for the bus and could go while it's paused. A request to the same ECU has
+ * to wait for it to finish anyway, so it doesn't count.
+ */
+static bool preempted(const DiagnosticRequestScheduler* scheduler,
+        const DiagnosticScheduledRequest* request) {
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        const DiagnosticScheduledRequest* other = &scheduler->requests[i];
+        if(other->in_use && !other->waiting_to_retry &&
+                other->priority < request->priority &&
+                other->handle.request.arbitration_id !=
+                    request->handle.request.arbitration_id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Private: Pause the multi-frame responses of requests while a more urgent
+ * request to another ECU is outstanding, and let them continue once there is
+ * none.
+ */
+static void update_holds(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler) {
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        DiagnosticScheduledRequest* request = &scheduler->requests[i];
+        if(!request->in_flight) {
+            continue;
+        }
+        bool hold = preempted(scheduler, request);
+        if(request->handle.transport_receiver.hold != hold) {
+            diagnostic_hold_response(shims, &request->handle, hold);
+        }
+    }
+}
+
+static void dispatch(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler) {
+    uint32_t now = now_us(shims);
+    DiagnosticScheduledRequest* request;
+    while((request = next_request(scheduler, now)) != NULL) {
+        start(shims, scheduler, request);
+    }
+    update_holds(shims, scheduler);
+}
+
+static DiagnosticScheduledRequest* add_request(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler, DiagnosticRequest* request,
+        DiagnosticPriority priority) {
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        DiagnosticScheduledRequest* scheduled = &scheduler->requests[i];
+        if(scheduled->in_use) {
+            continue;
+        }
+
+        // the scheduler calls back itself, once any retries are over
+        scheduled->handle = generate_diagnostic_request(shims, request, NULL);
+        scheduled->callback = NULL;
+        scheduled->context_callback = NULL;
+        scheduled->context = NULL;
+        scheduled->priority = priority;
+        scheduled->in_use = true;
+        scheduled->in_flight = false;
+        scheduled->waiting_to_retry = false;
+        scheduled->attempts = 0;
+        scheduled->sequence = scheduler->next_sequence++;
+        scheduled->scheduled_us = now_us(shims);
+        return scheduled;
+    }
+    return NULL;
+}
+
+DiagnosticRequestHandle* diagnostic_schedule_request(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler, DiagnosticRequest* request,
+        DiagnosticPriority priority, DiagnosticResponseReceived callback) {
+    DiagnosticScheduledRequest* scheduled = add_request(shims, scheduler,
+            request, priority);
+    if(scheduled == NULL) {
+        return NULL;
+    }
+    scheduled->callback = callback;
+    return &scheduled->handle;
+}
+
+DiagnosticRequestHandle* diagnostic_schedule_request_with_context(
+        DiagnosticShims* shims, DiagnosticRequestScheduler* scheduler,
+        DiagnosticRequest* request, DiagnosticPriority priority,
+        DiagnosticResponseReceivedWithContext callback, void* context) {
+    DiagnosticScheduledRequest* scheduled = add_request(shims, scheduler,
+            request, priority);
+    if(scheduled == NULL) {
+        return NULL;
+    }
+    scheduled->context_callback = callback;
+    scheduled->context = context;
+    return &scheduled->handle;
+}
+
+void diagnostic_scheduler_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    uint32_t now = now_us(shims);
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        DiagnosticScheduledRequest* request = &scheduler->requests[i];
+        if(!request->in_flight || !diagnostic_response_id_matches(
+                    &request->handle, arbitration_id)) {
+            continue;
+        }
+
+        request->last_activity_us = now;
+        DiagnosticResponse response = diagnostic_receive_can_frame(shims,
+                &request->handle, arbitration_id, data, size);
+        if(!request->handle.completed) {
+            continue;
+        }
+
+        if(!response.completed) {
+            abandon(shims, scheduler, request);
+            continue;
+        }
+        if(scheduler->circuit_breakers != NULL) {
+            diagnostic_circuit_record(shims, scheduler->circuit_breakers,
+                    request->handle.request.arbitration_id, true);
+        }
+        if(!retry(shims, scheduler, request, &response)) {
+            complete(shims, scheduler, request, &response);
+        }
+    }
+    dispatch(shims, scheduler);
+}
+
+void diagnostic_scheduler_poll(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler) {
+    bool has_clock = shims->get_time_us != NULL;
+    uint32_t now = now_us(shims);
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        DiagnosticScheduledRequest* request = &scheduler->requests[i];
+        if(!request->in_flight) {
+            continue;
+        }
+
+        DiagnosticRequestHandle* handle = &request->handle;
+        diagnostic_poll_request(shims, handle);
+        if(handle->completed) {
+            abandon(shims, scheduler, request);
+            continue;
+        }
+
+        if(handle->transport_receiver.holding) {
+            // the ECU is waiting for us, not the other way around
+            request->last_activity_us = now;
+        }
+        uint32_t timeout_us = handle->response_pending_count > 0 ?
+                RESPONSE_PENDING_TIMEOUT_US : scheduler->response_timeout_us;
+        if(has_clock && now - request->last_activity_us >= timeout_us) {
+            time_out(shims, scheduler, request);
+        }
+    }
+    dispatch(shims, scheduler);
+}
+
+void diagnostic_scheduler_next_deadline(DiagnosticShims* shims,
+        const DiagnosticRequestScheduler* scheduler,
+        DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        const DiagnosticScheduledRequest* request = &scheduler->requests[i];
+        if(!request->in_use) {
+            continue;
+        }
+        if(!request->in_flight) {
+            if(ecu_busy(scheduler, request->handle.request.arbitration_id)) {
+                continue;
+            }
+            if(request->waiting_to_retry && !ready(request, now)) {
+                diagnostic_add_deadline(deadline, now, now,
+                        request->retry_at_us - now);
+            } else {
+                // waiting to be sent by the next poll
+                diagnostic_add_deadline(deadline, now, now, 0);
+            }
+            continue;
+        }
+
+        diagnostic_request_next_deadline(shims, &request->handle, deadline);
+        if(!request->handle.transport_receiver.holding) {
+            diagnostic_add_deadline(deadline, now, request->last_activity_us,
+                    request->handle.response_pending_count > 0 ?
+                        RESPONSE_PENDING_TIMEOUT_US :
+                        scheduler->response_timeout_us);
+        }
+    }
+}
+
+uint8_t diagnostic_scheduled_request_count(
+        const DiagnosticRequestScheduler* scheduler) {
+    uint8_t count = 0;
+    for(uint8_t i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        if(scheduler->requests[i].in_use) {
+            ++count;
+        }
+    }
+    return count;
+}
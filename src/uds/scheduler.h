@@ -0,0 +1,173 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <uds/uds_types.h>
+#include <uds/retry.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of requests one scheduler holds, queued and in flight.
+#ifndef MAX_SCHEDULED_REQUESTS
+#define MAX_SCHEDULED_REQUESTS 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: How urgent a scheduled request is. Requests are sent in this order,
+ * and first come, first served within a class.
+ */
+typedef enum {
+    DIAGNOSTIC_PRIORITY_HIGH,
+    DIAGNOSTIC_PRIORITY_NORMAL,
+    DIAGNOSTIC_PRIORITY_LOW
+} DiagnosticPriority;
+
+#define DIAGNOSTIC_PRIORITY_CLASS_COUNT 3
+
+/* Public: How long the requests of one priority class took, from being
+ * scheduled to their response.
+ *
+ * completed_count - The number of requests answered.
+ * failed_count - The number of requests that could not be sent, timed out or
+ *      were refused by a circuit breaker.
+ * retry_count - The number of times requests were sent again.
+ * total_latency_us - The total latency of the answered requests, including
+ *      their retries.
+ * max_latency_us - The longest latency of an answered request.
+ */
+typedef struct {
+    uint32_t completed_count;
+    uint32_t failed_count;
+    uint32_t retry_count;
+    uint64_t total_latency_us;
+    uint32_t max_latency_us;
+} DiagnosticPriorityStatistics;
+
+/* Private: One request in a scheduler.
+ */
+typedef struct {
+    DiagnosticRequestHandle handle;
+    DiagnosticResponseReceived callback;
+    DiagnosticResponseReceivedWithContext context_callback;
+    void* context;
+    DiagnosticPriority priority;
+    bool in_use;
+    bool in_flight;
+    bool waiting_to_retry;
+    uint8_t attempts;
+    uint32_t sequence;
+    uint32_t scheduled_us;
+    uint32_t last_activity_us;
+    uint32_t retry_at_us;
+} DiagnosticScheduledRequest;
+
+/* Public: A queue of requests sent by priority instead of in the order they
+ * were made. Each ECU (request arbitration ID) has one request in flight at a
+ * time, and the most urgent request waiting for it goes next, so a slow
+ * transfer doesn't hold up a poll of another ECU. Multi-frame responses to
+ * requests that aren't high priority are received in blocks, and paused with
+ * WAIT flow control between blocks while more urgent requests are
+ * outstanding, keeping the bus free for them. Initialize it with
+ * diagnostic_init_request_scheduler(...).
+ *
+ * response_timeout_us - (optional) How long a request in flight may go
+ *      without a frame from the ECU before it fails. The default is 1s, or 5s
+ *      after the ECU said the response is pending (NRC 0x78). Only enforced
+ *      with the get_time_us shim.
+ * preemption_block_size - (optional) The block size to ask for in multi-frame
+ *      responses to requests that aren't high priority - the most consecutive
+ *      frames an urgent request waits behind. The default is 8. Only used for
+ *      handles with a receive_buffer and no block size of their own; 0 turns
+ *      preemption off.
+ * retry_policy - (optional) When to send requests again that got no response
+ *      or a negative response the policy retries on, instead of completing
+ *      them. Retries wait out the policy's backoff, and keep their place ahead
+ *      of later requests. NULL, the default, never retries.
+ * circuit_breakers - (optional) Circuit breakers that fail requests to ECUs
+ *      that stopped responding without sending them, letting a probe through
+ *      now and then. NULL, the default, sends every request.
+ * random_state - The state of the generator jittering the retry backoff,
+ *      seeded with 1. Seed it with something that differs between testers to
+ *      keep them from retrying in step; it must not be 0.
+ * statistics - The latency of each priority class.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t response_timeout_us;
+    uint8_t preemption_block_size;
+    const DiagnosticRetryPolicy* retry_policy;
+    DiagnosticCircuitBreakers* circuit_breakers;
+    uint32_t random_state;
+    DiagnosticPriorityStatistics statistics[DIAGNOSTIC_PRIORITY_CLASS_COUNT];
+
+    // Private
+    DiagnosticScheduledRequest requests[MAX_SCHEDULED_REQUESTS];
+    uint32_t next_sequence;
+} DiagnosticRequestScheduler;
+
+/* Public: Initialize an empty scheduler.
+ */
+void diagnostic_init_request_scheduler(DiagnosticRequestScheduler* scheduler);
+
+/* Public: Queue a request. It's sent from the next call to
+ * diagnostic_scheduler_poll(...) or diagnostic_scheduler_receive_can_frame(...)
+ * that finds its ECU with nothing else in flight and no more urgent request
+ * waiting for it.
+ *
+ * callback - (optional) called with the response once the request completes,
+ *      after any retries. A request that can't be sent, times out or is
+ *      refused by a circuit breaker is completed with a response whose
+ *      'success' is false and no negative response code. Use this rather than
+ *      the handle's own callbacks, which the scheduler doesn't call.
+ *
+ * Returns the request's handle, to give it a receive_buffer or other options
+ * before it's sent, or NULL if MAX_SCHEDULED_REQUESTS requests are already
+ * outstanding. The handle belongs to the scheduler and is reused once the
+ * request completes.
+ */
+DiagnosticRequestHandle* diagnostic_schedule_request(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler, DiagnosticRequest* request,
+        DiagnosticPriority priority, DiagnosticResponseReceived callback);
+
+/* Public: Queue a request like diagnostic_schedule_request(...), with a
+ * callback that's given 'context' along with the response.
+ */
+DiagnosticRequestHandle* diagnostic_schedule_request_with_context(
+        DiagnosticShims* shims, DiagnosticRequestScheduler* scheduler,
+        DiagnosticRequest* request, DiagnosticPriority priority,
+        DiagnosticResponseReceivedWithContext callback, void* context);
+
+/* Public: Continue the requests in flight with a received CAN frame, and send
+ * the next requests for ECUs that answered. Pass every frame received.
+ */
+void diagnostic_scheduler_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size);
+
+/* Public: Send consecutive frames that are due, keep paused responses waiting,
+ * fail or retry requests that timed out and send the next requests. Call this
+ * regularly from your main loop.
+ */
+void diagnostic_scheduler_poll(DiagnosticShims* shims,
+        DiagnosticRequestScheduler* scheduler);
+
+/* Public: Add the next time the scheduler needs diagnostic_scheduler_poll(...)
+ * to a deadline. Does nothing without the get_time_us shim.
+ */
+void diagnostic_scheduler_next_deadline(DiagnosticShims* shims,
+        const DiagnosticRequestScheduler* scheduler,
+        DiagnosticDeadline* deadline);
+
+/* Public: Returns the number of requests queued or in flight.
+ */
+uint8_t diagnostic_scheduled_request_count(
+        const DiagnosticRequestScheduler* scheduler);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SCHEDULER_H__
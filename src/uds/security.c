@@ -0,0 +1,290 @@
+#include <uds/security.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#define DEFAULT_DELAY_US 10000000
+#define DEFAULT_RESPONSE_TIMEOUT_US 1000000
+#define DEFAULT_EXTENDED_TIMEOUT_US 5000000
+
+void diagnostic_init_security_access(DiagnosticSecurityAccess* access,
+        uint32_t arbitration_id) {
+    memset(access, 0, sizeof(DiagnosticSecurityAccess));
+    access->arbitration_id = arbitration_id;
+    access->delay_us = DEFAULT_DELAY_US;
+    access->response_timeout_us = DEFAULT_RESPONSE_TIMEOUT_US;
+    access->extended_timeout_us = DEFAULT_EXTENDED_TIMEOUT_US;
+    access->state = DIAGNOSTIC_SECURITY_LOCKED;
+}
+
+static uint32_t now_us(DiagnosticShims* shims) {
+    return shims->get_time_us != NULL ? shims->get_time_us() : 0;
+}
+
+static DiagnosticSecurityKeyAlgorithm find_algorithm(
+        const DiagnosticSecurityAccess* access, uint8_t level) {
+    for(uint8_t i = 0; i < access->level_count; i++) {
+        if(access->levels[i].level == level) {
+            return access->levels[i].algorithm;
+        }
+    }
+    return NULL;
+}
+
+bool diagnostic_security_register_algorithm(DiagnosticSecurityAccess* access,
+        uint8_t level, DiagnosticSecurityKeyAlgorithm algorithm) {
+    uint8_t i;
+    for(i = 0; i < access->level_count; i++) {
+        if(access->levels[i].level == level) {
+            break;
+        }
+    }
+    if(i == MAX_SECURITY_KEY_ALGORITHMS) {
+        return false;
+    }
+    if(i == access->level_count) {
+        ++access->level_count;
+    }
+    access->levels[i].level = level;
+    access->levels[i].algorithm = algorithm;
+    return true;
+}
+
+static bool send_request(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access, DiagnosticRequest* request) {
+    request->arbitration_id = access->arbitration_id;
+    request->mode = DIAGNOSTIC_SECURITY_ACCESS_MODE;
+    request->has_pid = true;
+    request->pid_length = 1;
+    access->handle = diagnostic_request(shims, request, NULL);
+    access->request_sent_us = now_us(shims);
+    access->response_pending_count = 0;
+    ++access->exchange_count;
+    if(access->handle.completed) {
+        access->state = DIAGNOSTIC_SECURITY_FAILED;
+        return false;
+    }
+    return true;
+}
+
+static bool request_seed(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access) {
+    // the sub-function is echoed like a PID
+    DiagnosticRequest request = {
+        pid: access->level * 2 - 1
+    };
+    access->state = DIAGNOSTIC_SECURITY_REQUESTING_SEED;
+    access->negative_response_code = NRC_SUCCESS;
+    return send_request(shims, access, &request);
+}
+
+/* Private: Compute the key for a seed, or reuse the one computed for the same
+ * seed last time.
+ */
+static bool compute_key(DiagnosticSecurityAccess* access, const uint8_t seed[],
+        uint8_t seed_size) {
+    if(access->cached_seed_size == seed_size &&
+            access->cached_level == access->level &&
+            !memcmp(access->cached_seed, seed, seed_size)) {
+        return true;
+    }
+
+    DiagnosticSecurityKeyAlgorithm algorithm = find_algorithm(access,
+            access->level);
+    access->cached_seed_size = 0;
+    access->key_size = 0;
+    if(algorithm == NULL || !algorithm(access, access->level, seed, seed_size,
+                access->key, &access->key_size) || access->key_size == 0 ||
+            access->key_size > MAX_DIAGNOSTIC_SECURITY_KEY_SIZE) {
+        return false;
+    }
+    access->cached_level = access->level;
+    memcpy(access->cached_seed, seed, seed_size);
+    access->cached_seed_size = seed_size;
+    return true;
+}
+
+static void send_key(DiagnosticShims* shims, DiagnosticSecurityAccess* access) {
+    DiagnosticRequest request = {
+        pid: access->level * 2
+    };
+    if(access->key_size <= MAX_UDS_REQUEST_PAYLOAD_LENGTH) {
+        memcpy(request.payload, access->key, access->key_size);
+        request.payload_length = access->key_size;
+    } else {
+        request.large_payload = access->key;
+        request.large_payload_length = access->key_size;
+    }
+    access->state = DIAGNOSTIC_SECURITY_SENDING_KEY;
+    send_request(shims, access, &request);
+}
+
+static void receive_seed(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access, const DiagnosticResponse* response) {
+    const uint8_t* seed = response->full_payload != NULL ?
+            response->full_payload : response->payload;
+    uint16_t seed_size = response->full_payload != NULL ?
+            response->full_payload_length : response->payload_length;
+    if(seed_size == 0 || seed_size > MAX_DIAGNOSTIC_SECURITY_SEED_SIZE) {
+        access->state = DIAGNOSTIC_SECURITY_FAILED;
+        return;
+    }
+
+    uint8_t combined = 0;
+    for(uint16_t i = 0; i < seed_size; i++) {
+        combined |= seed[i];
+    }
+    if(combined == 0) {
+        // a zero seed means the level is already unlocked
+        access->state = DIAGNOSTIC_SECURITY_UNLOCKED;
+        return;
+    }
+
+    if(!compute_key(access, seed, seed_size)) {
+        access->state = DIAGNOSTIC_SECURITY_FAILED;
+        return;
+    }
+    send_key(shims, access);
+}
+
+void diagnostic_security_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    if(access->state != DIAGNOSTIC_SECURITY_REQUESTING_SEED &&
+            access->state != DIAGNOSTIC_SECURITY_SENDING_KEY) {
+        return;
+    }
+
+    DiagnosticResponse response = diagnostic_receive_can_frame(shims,
+            &access->handle, arbitration_id, data, size);
+    if(access->handle.response_pending_count !=
+            access->response_pending_count) {
+        // the ECU needs more time - the extended timeout starts over
+        access->response_pending_count = access->handle.response_pending_count;
+        access->request_sent_us = now_us(shims);
+    }
+    if(!response.completed) {
+        return;
+    }
+
+    if(response.success) {
+        if(access->state == DIAGNOSTIC_SECURITY_REQUESTING_SEED) {
+            receive_seed(shims, access, &response);
+        } else {
+            access->state = DIAGNOSTIC_SECURITY_UNLOCKED;
+        }
+        return;
+    }
+
+    access->negative_response_code = response.negative_response_code;
+    switch(response.negative_response_code) {
+        case NRC_TOO_MANY_ATTEMPS:
+        case NRC_TIME_DELAY_NOT_EXPIRED:
+            access->state = DIAGNOSTIC_SECURITY_DELAYED;
+            access->delay_started_us = now_us(shims);
+            break;
+        case NRC_INVALID_KEY:
+            // retrying the same key would only use up the ECU's attempts
+            access->cached_seed_size = 0;
+            access->state = DIAGNOSTIC_SECURITY_FAILED;
+            break;
+        default:
+            access->state = DIAGNOSTIC_SECURITY_FAILED;
+            break;
+    }
+}
+
+bool diagnostic_security_unlock(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access, uint8_t level) {
+    if(level == 0 || find_algorithm(access, level) == NULL) {
+        return false;
+    }
+
+    bool same_level = access->level == level;
+    switch(access->state) {
+        case DIAGNOSTIC_SECURITY_UNLOCKED:
+        case DIAGNOSTIC_SECURITY_REQUESTING_SEED:
+        case DIAGNOSTIC_SECURITY_SENDING_KEY:
+            if(same_level) {
+                return true;
+            }
+            break;
+        case DIAGNOSTIC_SECURITY_DELAYED:
+            access->level = level;
+            if(shims->get_time_us != NULL && now_us(shims) -
+                    access->delay_started_us < access->delay_us) {
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+
+    access->level = level;
+    return request_seed(shims, access);
+}
+
+/* Private: Returns how long the current request may go without a response -
+ * P2, or P2* once the ECU has said the response is pending.
+ */
+static uint32_t response_timeout(const DiagnosticSecurityAccess* access) {
+    return access->response_pending_count > 0 ?
+            access->extended_timeout_us : access->response_timeout_us;
+}
+
+void diagnostic_security_poll(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access) {
+    if(access->state == DIAGNOSTIC_SECURITY_SENDING_KEY) {
+        // a key too long for a single frame is sent as the ECU allows
+        diagnostic_poll_request(shims, &access->handle);
+    }
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    switch(access->state) {
+        case DIAGNOSTIC_SECURITY_REQUESTING_SEED:
+        case DIAGNOSTIC_SECURITY_SENDING_KEY:
+            if(now - access->request_sent_us >= response_timeout(access)) {
+                access->state = DIAGNOSTIC_SECURITY_FAILED;
+            }
+            break;
+        case DIAGNOSTIC_SECURITY_DELAYED:
+            if(now - access->delay_started_us >= access->delay_us) {
+                request_seed(shims, access);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void diagnostic_security_next_deadline(DiagnosticShims* shims,
+        const DiagnosticSecurityAccess* access, DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    switch(access->state) {
+        case DIAGNOSTIC_SECURITY_REQUESTING_SEED:
+        case DIAGNOSTIC_SECURITY_SENDING_KEY:
+            diagnostic_request_next_deadline(shims, &access->handle,
+                    deadline);
+            diagnostic_add_deadline(deadline, now, access->request_sent_us,
+                    response_timeout(access));
+            break;
+        case DIAGNOSTIC_SECURITY_DELAYED:
+            diagnostic_add_deadline(deadline, now, access->delay_started_us,
+                    access->delay_us);
+            break;
+        default:
+            break;
+    }
+}
+
+void diagnostic_security_lock(DiagnosticSecurityAccess* access) {
+    if(access->state == DIAGNOSTIC_SECURITY_UNLOCKED) {
+        access->state = DIAGNOSTIC_SECURITY_LOCKED;
+    }
+}
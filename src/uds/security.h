@@ -0,0 +1,176 @@
+#ifndef __SECURITY_H__
+#define __SECURITY_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIAGNOSTIC_SECURITY_ACCESS_MODE 0x27
+
+// The longest key a key algorithm can compute.
+#ifndef MAX_DIAGNOSTIC_SECURITY_KEY_SIZE
+#define MAX_DIAGNOSTIC_SECURITY_KEY_SIZE 16
+#endif
+
+// The number of levels one ECU can have key algorithms for.
+#ifndef MAX_SECURITY_KEY_ALGORITHMS
+#define MAX_SECURITY_KEY_ALGORITHMS 4
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: The steps of unlocking an ECU.
+ */
+typedef enum {
+    DIAGNOSTIC_SECURITY_LOCKED,
+    // requestSeed was sent, waiting for the seed
+    DIAGNOSTIC_SECURITY_REQUESTING_SEED,
+    // sendKey was sent, waiting for the verdict
+    DIAGNOSTIC_SECURITY_SENDING_KEY,
+    // the ECU refused a seed until its delay timer expires - it's requested
+    // again by diagnostic_security_poll(...) once it has
+    DIAGNOSTIC_SECURITY_DELAYED,
+    DIAGNOSTIC_SECURITY_UNLOCKED,
+    DIAGNOSTIC_SECURITY_FAILED
+} DiagnosticSecurityState;
+
+typedef struct DiagnosticSecurityAccess DiagnosticSecurityAccess;
+
+/* Public: The signature for a function that computes the key for a seed, e.g.
+ * with an OEM's algorithm.
+ *
+ * level - the security level being unlocked.
+ * seed - the seed the ECU sent.
+ * seed_size - the size of the seed.
+ * key - where to write the key, with room for MAX_DIAGNOSTIC_SECURITY_KEY_SIZE
+ *      bytes.
+ * key_size - set to the size of the key.
+ *
+ * Returns false if no key can be computed, which fails the unlock.
+ */
+typedef bool (*DiagnosticSecurityKeyAlgorithm)(
+        DiagnosticSecurityAccess* access, uint8_t level, const uint8_t seed[],
+        uint8_t seed_size, uint8_t key[], uint8_t* key_size);
+
+/* Private: The key algorithm of one level.
+ */
+typedef struct {
+    uint8_t level;
+    DiagnosticSecurityKeyAlgorithm algorithm;
+} DiagnosticSecurityLevel;
+
+/* Public: Unlocking one ECU with SecurityAccess (0x27): requestSeed, a key
+ * computed by the level's key algorithm, then sendKey. An ECU that answers
+ * with a zero seed is already unlocked, so no key is sent. An ECU that
+ * refuses with "too many attempts" (NRC 0x36) or "time delay not expired"
+ * (NRC 0x37) is asked again once the delay has passed, from
+ * diagnostic_security_poll(...), rather than retried right away. Keys are
+ * cached by seed, so ECUs with a fixed seed skip the key algorithm.
+ *
+ * Initialize it with diagnostic_init_security_access(...) and register a key
+ * algorithm for each level with diagnostic_security_register_algorithm(...).
+ *
+ * arbitration_id - The arbitration ID of the ECU.
+ * delay_us - (optional) How long to wait after the ECU asks for a delay. The
+ *      default is 10s.
+ * response_timeout_us - (optional) How long to wait for each response before
+ *      failing. The default is 1s. Timeouts are only enforced with the
+ *      get_time_us shim.
+ * extended_timeout_us - (optional) How long to wait after the ECU says a
+ *      response is pending (P2*), restarted with each of those. The default
+ *      is 5s.
+ * context - (optional) Anything the key algorithms need.
+ * state - Where the unlock stands.
+ * level - The level being unlocked, or that is unlocked.
+ * negative_response_code - If the unlock failed, the ECU's reason.
+ * exchange_count - The number of requests sent to the ECU.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticSecurityAccess {
+    uint32_t arbitration_id;
+    uint32_t delay_us;
+    uint32_t response_timeout_us;
+    uint32_t extended_timeout_us;
+    void* context;
+    DiagnosticSecurityState state;
+    uint8_t level;
+    DiagnosticNegativeResponseCode negative_response_code;
+    uint32_t exchange_count;
+
+    // Private
+    DiagnosticSecurityLevel levels[MAX_SECURITY_KEY_ALGORITHMS];
+    uint8_t level_count;
+    DiagnosticRequestHandle handle;
+    // when the request was sent, or the ECU last said its response is pending
+    uint32_t request_sent_us;
+    uint16_t response_pending_count;
+    uint32_t delay_started_us;
+    // the key computed for the last seed
+    uint8_t cached_level;
+    uint8_t cached_seed[MAX_DIAGNOSTIC_SECURITY_SEED_SIZE];
+    uint8_t cached_seed_size;
+    uint8_t key[MAX_DIAGNOSTIC_SECURITY_KEY_SIZE];
+    uint8_t key_size;
+};
+
+/* Public: Initialize a locked ECU with no key algorithms.
+ */
+void diagnostic_init_security_access(DiagnosticSecurityAccess* access,
+        uint32_t arbitration_id);
+
+/* Public: Set the key algorithm for a security level, replacing any it had.
+ *
+ * level - the security level, from 1 - requestSeed is sub-function
+ *      2 * level - 1 and sendKey 2 * level.
+ *
+ * Returns false if MAX_SECURITY_KEY_ALGORITHMS other levels already have one.
+ */
+bool diagnostic_security_register_algorithm(DiagnosticSecurityAccess* access,
+        uint8_t level, DiagnosticSecurityKeyAlgorithm algorithm);
+
+/* Public: Start unlocking a security level. Does nothing if it is already
+ * unlocked or being unlocked, or if the ECU is still in its delay - the seed
+ * is requested once the delay has passed.
+ *
+ * Returns false if the level has no key algorithm or the request could not
+ * be sent.
+ */
+bool diagnostic_security_unlock(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access, uint8_t level);
+
+/* Public: Continue the unlock with a received CAN frame. Pass every frame
+ * received while the unlock is in progress.
+ */
+void diagnostic_security_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size);
+
+/* Public: Send the consecutive frames of a long key, request the seed again
+ * once the ECU's delay has passed, and time out unanswered requests. Call this
+ * regularly from your main loop. Timers need the get_time_us shim - without
+ * it, a delayed unlock waits for the next call to
+ * diagnostic_security_unlock(...).
+ */
+void diagnostic_security_poll(DiagnosticShims* shims,
+        DiagnosticSecurityAccess* access);
+
+/* Public: Add the next time the unlock needs diagnostic_security_poll(...) -
+ * a consecutive frame of a long key, the end of the ECU's delay or a response
+ * timeout - to a deadline. Does nothing without the get_time_us shim.
+ */
+void diagnostic_security_next_deadline(DiagnosticShims* shims,
+        const DiagnosticSecurityAccess* access, DiagnosticDeadline* deadline);
+
+/* Public: Forget that the ECU is unlocked, e.g. after it was reset or changed
+ * sessions. The cached key is kept.
+ */
+void diagnostic_security_lock(DiagnosticSecurityAccess* access);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SECURITY_H__
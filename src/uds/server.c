@@ -0,0 +1,673 @@
+#include <uds/server.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#define POSITIVE_RESPONSE_OFFSET 0x40
+#define NEGATIVE_RESPONSE_SERVICE 0x7f
+#define SUPPRESS_POSITIVE_RESPONSE 0x80
+#define SUB_FUNCTION_MASK 0x7f
+
+#define SESSION_CONTROL_SERVICE 0x10
+#define READ_DTC_INFORMATION_SERVICE 0x19
+#define READ_DATA_BY_IDENTIFIER_SERVICE 0x22
+#define SECURITY_ACCESS_SERVICE 0x27
+#define WRITE_DATA_BY_IDENTIFIER_SERVICE 0x2e
+#define TESTER_PRESENT_SERVICE 0x3e
+
+// the timing reported in the DiagnosticSessionControl response
+#define P2_SERVER_MAX_MS 50
+#define P2_STAR_SERVER_MAX_MS 5000
+#define S3_SERVER_TIMEOUT_US 5000000
+#define SECURITY_ACCESS_DELAY_US 10000000
+#define MAX_FAILED_KEY_ATTEMPTS 3
+
+#define REPORT_NUMBER_OF_DTC_BY_STATUS_MASK 0x1
+#define REPORT_DTC_BY_STATUS_MASK 0x2
+#define REPORT_SUPPORTED_DTC 0xa
+#define DTC_FORMAT_ISO_14229 0x1
+#define DTC_STATUS_AVAILABILITY_MASK 0xff
+#define DTC_STATUS_PENDING 0x04
+#define DTC_STATUS_CONFIRMED 0x08
+#define DTC_STATUS_WARNING_INDICATOR_REQUESTED 0x80
+
+#define PIDS_SUPPORTED_RANGE 0x20
+#define PIDS_SUPPORTED_SIZE 4
+#define MAX_OBD2_PIDS_PER_REQUEST 6
+
+/* Private: Handle one service, writing the response after the service ID.
+ *
+ * request - the whole request, starting with the service ID.
+ * response - where to write the rest of the positive response.
+ * capacity - the room in 'response'.
+ * response_size - set to the number of bytes written.
+ *
+ * Returns NRC_SUCCESS or the negative response code to send.
+ */
+typedef DiagnosticNegativeResponseCode (*ServiceHandler)(
+        DiagnosticShims* shims, DiagnosticServer* server,
+        const uint8_t request[], uint16_t size, uint8_t response[],
+        uint16_t capacity, uint16_t* response_size);
+
+/* Private: An entry in the service table.
+ *
+ * minimum_size - the shortest valid request, including the service ID.
+ * has_sub_function - true if the service has a sub-function, whose top bit
+ *      suppresses the positive response.
+ * default_session - true if the service is available in the default session.
+ */
+typedef struct {
+    uint8_t service;
+    uint8_t minimum_size;
+    bool has_sub_function;
+    bool default_session;
+    ServiceHandler handle;
+} ServiceEntry;
+
+void diagnostic_init_server(DiagnosticServer* server,
+        uint32_t request_arbitration_id, uint32_t response_arbitration_id) {
+    memset(server, 0, sizeof(*server));
+    server->request_arbitration_id = request_arbitration_id;
+    server->functional_arbitration_id = OBD2_FUNCTIONAL_BROADCAST_ID;
+    server->response_arbitration_id = response_arbitration_id;
+    server->session = DIAGNOSTIC_DEFAULT_SESSION;
+}
+
+static void lock_security_access(DiagnosticServer* server) {
+    server->security_level = 0;
+    server->seed_level = 0;
+}
+
+static DiagnosticNegativeResponseCode session_control(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        uint8_t response[], uint16_t capacity, uint16_t* response_size) {
+    uint8_t session = request[1] & SUB_FUNCTION_MASK;
+    if(session < DIAGNOSTIC_DEFAULT_SESSION ||
+            session > DIAGNOSTIC_EXTENDED_SESSION) {
+        return NRC_SUB_FUNCTION_NOT_SUPPORTED;
+    }
+    if(size != 2) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+
+    server->session = session;
+    lock_security_access(server);
+    response[0] = session;
+    response[1] = P2_SERVER_MAX_MS >> 8;
+    response[2] = P2_SERVER_MAX_MS & 0xff;
+    // P2* is in units of 10ms
+    response[3] = (P2_STAR_SERVER_MAX_MS / 10) >> 8;
+    response[4] = (P2_STAR_SERVER_MAX_MS / 10) & 0xff;
+    *response_size = 5;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode tester_present(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        uint8_t response[], uint16_t capacity, uint16_t* response_size) {
+    if((request[1] & SUB_FUNCTION_MASK) != 0) {
+        return NRC_SUB_FUNCTION_NOT_SUPPORTED;
+    }
+    if(size != 2) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+
+    response[0] = 0;
+    *response_size = 1;
+    return NRC_SUCCESS;
+}
+
+static const DiagnosticServerDid* find_did(const DiagnosticServer* server,
+        uint16_t did) {
+    for(uint16_t i = 0; i < server->did_count; i++) {
+        if(server->dids[i].did == did) {
+            return &server->dids[i];
+        }
+    }
+    return NULL;
+}
+
+static DiagnosticNegativeResponseCode read_data_by_identifier(
+        DiagnosticShims* shims, DiagnosticServer* server,
+        const uint8_t request[], uint16_t size, uint8_t response[],
+        uint16_t capacity, uint16_t* response_size) {
+    if((size - 1) % 2 != 0) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+
+    uint16_t written = 0;
+    bool found = false;
+    for(uint16_t i = 1; i < size; i += 2) {
+        uint16_t did = (request[i] << 8) | request[i + 1];
+        const DiagnosticServerDid* entry = find_did(server, did);
+        if(entry == NULL || entry->read == NULL) {
+            // unsupported DIDs are skipped, only an error if none are
+            continue;
+        }
+        if(entry->security_level != 0 &&
+                entry->security_level != server->security_level) {
+            return NRC_SECURITY_ACCESS_DENIED;
+        }
+        if(capacity - written < 2) {
+            return NRC_RESPONSE_TOO_LONG;
+        }
+
+        response[written] = did >> 8;
+        response[written + 1] = did & 0xff;
+        uint16_t value_size = 0;
+        DiagnosticNegativeResponseCode code = entry->read(server, did,
+                &response[written + 2], capacity - written - 2, &value_size);
+        if(code != NRC_SUCCESS) {
+            return code;
+        }
+        written += 2 + value_size;
+        found = true;
+    }
+
+    if(!found) {
+        return NRC_REQUEST_OUT_OF_RANGE;
+    }
+    *response_size = written;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode write_data_by_identifier(
+        DiagnosticShims* shims, DiagnosticServer* server,
+        const uint8_t request[], uint16_t size, uint8_t response[],
+        uint16_t capacity, uint16_t* response_size) {
+    uint16_t did = (request[1] << 8) | request[2];
+    const DiagnosticServerDid* entry = find_did(server, did);
+    if(entry == NULL || entry->write == NULL) {
+        return NRC_REQUEST_OUT_OF_RANGE;
+    }
+    if(entry->security_level != 0 &&
+            entry->security_level != server->security_level) {
+        return NRC_SECURITY_ACCESS_DENIED;
+    }
+
+    DiagnosticNegativeResponseCode code = entry->write(server, did,
+            &request[3], size - 3);
+    if(code != NRC_SUCCESS) {
+        return code;
+    }
+    response[0] = request[1];
+    response[1] = request[2];
+    *response_size = 2;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode security_access(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        uint8_t response[], uint16_t capacity, uint16_t* response_size) {
+    if(server->seed_generator == NULL || server->key_validator == NULL) {
+        return NRC_SERVICE_NOT_SUPPORTED;
+    }
+
+    uint8_t sub_function = request[1] & SUB_FUNCTION_MASK;
+    if(sub_function == 0 || sub_function == SUB_FUNCTION_MASK) {
+        return NRC_SUB_FUNCTION_NOT_SUPPORTED;
+    }
+
+    if(sub_function % 2 == 1) {
+        // requestSeed for level (sub_function + 1) / 2
+        uint8_t level = (sub_function + 1) / 2;
+        if(server->security_locked_out) {
+            return NRC_TIME_DELAY_NOT_EXPIRED;
+        }
+
+        uint8_t seed_size = 0;
+        if(!server->seed_generator(server, level, server->seed, &seed_size) ||
+                seed_size > MAX_DIAGNOSTIC_SECURITY_SEED_SIZE) {
+            return NRC_SUB_FUNCTION_NOT_SUPPORTED;
+        }
+        if(capacity < 1 + seed_size) {
+            return NRC_RESPONSE_TOO_LONG;
+        }
+
+        if(server->security_level == level) {
+            // already unlocked - a zero seed tells the client to skip the key
+            memset(server->seed, 0, seed_size);
+            server->seed_level = 0;
+        } else {
+            server->seed_level = level;
+        }
+        server->seed_size = seed_size;
+        response[0] = sub_function;
+        memcpy(&response[1], server->seed, seed_size);
+        *response_size = 1 + seed_size;
+        return NRC_SUCCESS;
+    }
+
+    // sendKey for level sub_function / 2, which must follow its seed
+    uint8_t level = sub_function / 2;
+    if(server->seed_level != level) {
+        return NRC_REQUEST_SEQUENCE_ERROR;
+    }
+    server->seed_level = 0;
+
+    if(!server->key_validator(server, level, server->seed, server->seed_size,
+                &request[2], size - 2)) {
+        if(++server->failed_key_attempts >= MAX_FAILED_KEY_ATTEMPTS) {
+            server->security_locked_out = true;
+            if(shims->get_time_us != NULL) {
+                server->security_locked_out_time_us = shims->get_time_us();
+            }
+            return NRC_TOO_MANY_ATTEMPS;
+        }
+        return NRC_INVALID_KEY;
+    }
+
+    server->failed_key_attempts = 0;
+    server->security_level = level;
+    response[0] = sub_function;
+    *response_size = 1;
+    return NRC_SUCCESS;
+}
+
+/* Private: Write the DTCs matching a status mask as 3 byte DTCs followed by
+ * their status.
+ */
+static DiagnosticNegativeResponseCode write_dtcs(DiagnosticServer* server,
+        uint8_t status_mask, uint8_t response[], uint16_t capacity,
+        uint16_t* written) {
+    for(uint16_t i = 0; i < server->dtc_count; i++) {
+        const DiagnosticServerDtc* dtc = &server->dtcs[i];
+        if((dtc->status & status_mask) == 0) {
+            continue;
+        }
+        if(capacity - *written < 4) {
+            return NRC_RESPONSE_TOO_LONG;
+        }
+        response[(*written)++] = dtc->dtc >> 16;
+        response[(*written)++] = dtc->dtc >> 8;
+        response[(*written)++] = dtc->dtc;
+        response[(*written)++] = dtc->status;
+    }
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode read_dtc_information(
+        DiagnosticShims* shims, DiagnosticServer* server,
+        const uint8_t request[], uint16_t size, uint8_t response[],
+        uint16_t capacity, uint16_t* response_size) {
+    uint8_t sub_function = request[1] & SUB_FUNCTION_MASK;
+    uint16_t count = 0;
+    response[0] = sub_function;
+    response[1] = DTC_STATUS_AVAILABILITY_MASK;
+    *response_size = 2;
+    switch(sub_function) {
+        case REPORT_NUMBER_OF_DTC_BY_STATUS_MASK:
+            if(size != 3) {
+                return NRC_INCORRECT_LENGTH_OR_FORMAT;
+            }
+            for(uint16_t i = 0; i < server->dtc_count; i++) {
+                if(server->dtcs[i].status & request[2]) {
+                    ++count;
+                }
+            }
+            response[2] = DTC_FORMAT_ISO_14229;
+            response[3] = count >> 8;
+            response[4] = count & 0xff;
+            *response_size = 5;
+            return NRC_SUCCESS;
+        case REPORT_DTC_BY_STATUS_MASK:
+            if(size != 3) {
+                return NRC_INCORRECT_LENGTH_OR_FORMAT;
+            }
+            return write_dtcs(server, request[2], response, capacity,
+                    response_size);
+        case REPORT_SUPPORTED_DTC:
+            if(size != 2) {
+                return NRC_INCORRECT_LENGTH_OR_FORMAT;
+            }
+            return write_dtcs(server, 0xff, response, capacity,
+                    response_size);
+        default:
+            return NRC_SUB_FUNCTION_NOT_SUPPORTED;
+    }
+}
+
+static const DiagnosticServerPid* find_pid(const DiagnosticServer* server,
+        uint8_t mode, uint8_t pid) {
+    for(uint16_t i = 0; i < server->pid_count; i++) {
+        if(server->pids[i].mode == mode && server->pids[i].pid == pid) {
+            return &server->pids[i];
+        }
+    }
+    return NULL;
+}
+
+static bool has_pid_above(const DiagnosticServer* server, uint8_t mode,
+        uint8_t pid) {
+    for(uint16_t i = 0; i < server->pid_count; i++) {
+        if(server->pids[i].mode == mode && server->pids[i].pid > pid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Private: Returns true if a PID is supported - it's in the table or it's a
+ * "PIDs supported" PID for a range that leads to some that are.
+ */
+static bool pid_supported(const DiagnosticServer* server, uint8_t mode,
+        uint8_t pid) {
+    return find_pid(server, mode, pid) != NULL ||
+        (pid % PIDS_SUPPORTED_RANGE == 0 && has_pid_above(server, mode, pid));
+}
+
+static DiagnosticNegativeResponseCode read_pid(DiagnosticServer* server,
+        uint8_t mode, uint8_t pid, uint8_t destination[],
+        uint16_t destination_length, uint16_t* size) {
+    const DiagnosticServerPid* entry = find_pid(server, mode, pid);
+    if(entry != NULL && entry->read != NULL) {
+        return entry->read(server, mode, pid, destination, destination_length,
+                size);
+    }
+
+    if(!pid_supported(server, mode, pid)) {
+        return NRC_REQUEST_OUT_OF_RANGE;
+    }
+    if(destination_length < PIDS_SUPPORTED_SIZE) {
+        return NRC_RESPONSE_TOO_LONG;
+    }
+
+    // bit 31 is the next PID, bit 0 the last PID in the range
+    uint32_t supported = 0;
+    for(uint8_t i = 1; i <= PIDS_SUPPORTED_RANGE; i++) {
+        if(pid + i <= 0xff && pid_supported(server, mode, pid + i)) {
+            supported |= 1UL << (PIDS_SUPPORTED_RANGE - i);
+        }
+    }
+    destination[0] = supported >> 24;
+    destination[1] = supported >> 16;
+    destination[2] = supported >> 8;
+    destination[3] = supported;
+    *size = PIDS_SUPPORTED_SIZE;
+    return NRC_SUCCESS;
+}
+
+/* Private: OBD-II modes 0x1, 0x2, 0x6, 0x8 and 0x9. Mode 0x2 requests pair
+ * each PID with a freeze frame number, which is echoed, and mode 0x8 takes a
+ * single PID followed by data the PID reader doesn't see.
+ */
+static DiagnosticNegativeResponseCode obd2_pids(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        uint8_t response[], uint16_t capacity, uint16_t* response_size) {
+    uint8_t mode = request[0];
+    uint8_t step = mode == OBD2_MODE_POWERTRAIN_FREEZE_FRAME_REQUEST ? 2 : 1;
+    uint16_t count = mode == OBD2_MODE_CONTROL ? 1 : (size - 1) / step;
+    if(count == 0 || count > MAX_OBD2_PIDS_PER_REQUEST ||
+            (mode != OBD2_MODE_CONTROL && (size - 1) % step != 0)) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+
+    uint16_t written = 0;
+    for(uint16_t i = 0; i < count; i++) {
+        const uint8_t* item = &request[1 + i * step];
+        if(capacity - written < step) {
+            return NRC_RESPONSE_TOO_LONG;
+        }
+        memcpy(&response[written], item, step);
+
+        uint16_t value_size = 0;
+        DiagnosticNegativeResponseCode code = read_pid(server, mode, item[0],
+                &response[written + step], capacity - written - step,
+                &value_size);
+        if(code == NRC_REQUEST_OUT_OF_RANGE) {
+            // skipped, like an unsupported DID
+            continue;
+        } else if(code != NRC_SUCCESS) {
+            return code;
+        }
+        written += step + value_size;
+    }
+
+    if(written == 0) {
+        return NRC_REQUEST_OUT_OF_RANGE;
+    }
+    *response_size = written;
+    return NRC_SUCCESS;
+}
+
+/* Private: OBD-II modes 0x3 (confirmed), 0x7 (pending) and 0xa (permanent)
+ * DTCs, as a count followed by 2 byte DTCs. Permanent DTCs are those that
+ * requested the warning indicator.
+ */
+static DiagnosticNegativeResponseCode obd2_dtcs(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        uint8_t response[], uint16_t capacity, uint16_t* response_size) {
+    if(size != 1) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+
+    uint8_t status_mask;
+    switch(request[0]) {
+        case OBD2_MODE_EMISSIONS_DTC_REQUEST:
+            status_mask = DTC_STATUS_CONFIRMED;
+            break;
+        case OBD2_MODE_DRIVE_CYCLE_DTC_REQUEST:
+            status_mask = DTC_STATUS_PENDING;
+            break;
+        default:
+            status_mask = DTC_STATUS_WARNING_INDICATOR_REQUESTED;
+            break;
+    }
+
+    uint16_t written = 1;
+    for(uint16_t i = 0; i < server->dtc_count; i++) {
+        if((server->dtcs[i].status & status_mask) == 0) {
+            continue;
+        }
+        if(capacity - written < 2) {
+            return NRC_RESPONSE_TOO_LONG;
+        }
+        response[written++] = server->dtcs[i].dtc >> 16;
+        response[written++] = server->dtcs[i].dtc >> 8;
+    }
+    response[0] = (written - 1) / 2;
+    *response_size = written;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode obd2_clear_dtcs(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        uint8_t response[], uint16_t capacity, uint16_t* response_size) {
+    if(size != 1) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+
+    for(uint16_t i = 0; i < server->dtc_count; i++) {
+        server->dtcs[i].status = 0;
+    }
+    *response_size = 0;
+    return NRC_SUCCESS;
+}
+
+static const ServiceEntry SERVICES[] = {
+    {OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST, 2, false, true, obd2_pids},
+    {OBD2_MODE_POWERTRAIN_FREEZE_FRAME_REQUEST, 3, false, true, obd2_pids},
+    {OBD2_MODE_EMISSIONS_DTC_REQUEST, 1, false, true, obd2_dtcs},
+    {OBD2_MODE_EMISSIONS_DTC_CLEAR, 1, false, true, obd2_clear_dtcs},
+    {OBD2_MODE_TEST_RESULTS, 2, false, true, obd2_pids},
+    {OBD2_MODE_DRIVE_CYCLE_DTC_REQUEST, 1, false, true, obd2_dtcs},
+    {OBD2_MODE_CONTROL, 2, false, true, obd2_pids},
+    {OBD2_MODE_VEHICLE_INFORMATION, 2, false, true, obd2_pids},
+    {OBD2_MODE_PERMANENT_DTC_REQUEST, 1, false, true, obd2_dtcs},
+    {SESSION_CONTROL_SERVICE, 2, true, true, session_control},
+    {READ_DTC_INFORMATION_SERVICE, 2, true, true, read_dtc_information},
+    {READ_DATA_BY_IDENTIFIER_SERVICE, 3, false, true,
+        read_data_by_identifier},
+    {SECURITY_ACCESS_SERVICE, 2, true, false, security_access},
+    {WRITE_DATA_BY_IDENTIFIER_SERVICE, 4, false, false,
+        write_data_by_identifier},
+    {TESTER_PRESENT_SERVICE, 2, true, true, tester_present},
+};
+
+static const ServiceEntry* find_service(uint8_t service) {
+    for(uint8_t i = 0; i < sizeof(SERVICES) / sizeof(SERVICES[0]); i++) {
+        if(SERVICES[i].service == service) {
+            return &SERVICES[i];
+        }
+    }
+    return NULL;
+}
+
+/* Private: Returns true if a negative response code is not sent in response to
+ * a functional request, so that only the ECUs that support it reply.
+ */
+static bool suppressed_for_functional(DiagnosticNegativeResponseCode code) {
+    return code == NRC_SERVICE_NOT_SUPPORTED ||
+        code == NRC_SUB_FUNCTION_NOT_SUPPORTED ||
+        code == NRC_REQUEST_OUT_OF_RANGE ||
+        code == NRC_SUB_FUNCTION_NOT_SUPPORTED_IN_ACTIVE_SESSION ||
+        code == NRC_SERVICE_NOT_SUPPORTED_IN_ACTIVE_SESSION;
+}
+
+static DiagnosticTransportConfig transport_config(
+        const DiagnosticServer* server) {
+    DiagnosticTransportConfig config = {
+        can_fd: server->can_fd,
+        frame_padding: !server->no_frame_padding
+    };
+    return config;
+}
+
+bool diagnostic_server_handle_request(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        bool functional) {
+    if(size == 0) {
+        return false;
+    }
+    if(server->sender.active) {
+        if(shims->log != NULL) {
+            shims->log("Server 0x%x is still sending a response, dropping "
+                    "request for service 0x%x",
+                    server->request_arbitration_id, request[0]);
+        }
+        return false;
+    }
+    if(shims->get_time_us != NULL) {
+        server->last_request_time_us = shims->get_time_us();
+    }
+
+    uint8_t* buffer = server->frame_buffer;
+    uint16_t buffer_size = sizeof(server->frame_buffer);
+    if(server->transmit_buffer != NULL &&
+            server->transmit_buffer_size > buffer_size) {
+        buffer = server->transmit_buffer;
+        buffer_size = server->transmit_buffer_size;
+    }
+    // responses are built where they'll be sent from
+    uint8_t* response = &buffer[DIAGNOSTIC_TRANSPORT_HEADROOM];
+    uint16_t capacity = buffer_size - DIAGNOSTIC_TRANSPORT_HEADROOM;
+    if(capacity > MAX_DIAGNOSTIC_REQUEST_SIZE) {
+        capacity = MAX_DIAGNOSTIC_REQUEST_SIZE;
+    }
+
+    const ServiceEntry* service = find_service(request[0]);
+    DiagnosticNegativeResponseCode code;
+    uint16_t response_size = 0;
+    bool suppress_positive_response = false;
+    if(service == NULL) {
+        code = NRC_SERVICE_NOT_SUPPORTED;
+    } else if(size < service->minimum_size) {
+        code = NRC_INCORRECT_LENGTH_OR_FORMAT;
+    } else if(!service->default_session &&
+            server->session == DIAGNOSTIC_DEFAULT_SESSION) {
+        code = NRC_SERVICE_NOT_SUPPORTED_IN_ACTIVE_SESSION;
+    } else {
+        suppress_positive_response = service->has_sub_function &&
+                (request[1] & SUPPRESS_POSITIVE_RESPONSE);
+        code = service->handle(shims, server, request, size, &response[1],
+                capacity - 1, &response_size);
+        response[0] = request[0] + POSITIVE_RESPONSE_OFFSET;
+        ++response_size;
+    }
+
+    if(code != NRC_SUCCESS) {
+        if(functional && suppressed_for_functional(code)) {
+            return false;
+        }
+        response[0] = NEGATIVE_RESPONSE_SERVICE;
+        response[1] = request[0];
+        response[2] = code;
+        response_size = 3;
+    } else if(suppress_positive_response) {
+        return false;
+    }
+
+    DiagnosticTransportConfig config = transport_config(server);
+    return diagnostic_transport_send_in_place(shims, &config, &server->sender,
+            server->response_arbitration_id, buffer, buffer_size,
+            response_size) != DIAGNOSTIC_TRANSPORT_ERROR;
+}
+
+bool diagnostic_server_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    bool functional = server->functional_arbitration_id != 0 &&
+            arbitration_id == server->functional_arbitration_id;
+    if(arbitration_id != server->request_arbitration_id && !functional) {
+        return false;
+    }
+
+    DiagnosticTransportConfig config = transport_config(server);
+    if(server->sender.active && diagnostic_transport_continue_send(shims,
+                &config, &server->sender, data, size) !=
+            DIAGNOSTIC_TRANSPORT_IGNORED) {
+        return true;
+    }
+
+    const uint8_t* request = NULL;
+    uint16_t request_size = 0;
+    if(diagnostic_transport_receive(shims, &config, &server->receiver,
+                server->receive_buffer, server->receive_buffer_size,
+                server->response_arbitration_id, arbitration_id, data, size,
+                &request, &request_size) == DIAGNOSTIC_TRANSPORT_COMPLETED) {
+        diagnostic_server_handle_request(shims, server, request, request_size,
+                functional);
+    }
+    return true;
+}
+
+void diagnostic_server_poll(DiagnosticShims* shims, DiagnosticServer* server) {
+    if(server->sender.active) {
+        DiagnosticTransportConfig config = transport_config(server);
+        diagnostic_transport_poll_send(shims, &config, &server->sender);
+    }
+
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    if(server->session != DIAGNOSTIC_DEFAULT_SESSION &&
+            now - server->last_request_time_us >= S3_SERVER_TIMEOUT_US) {
+        server->session = DIAGNOSTIC_DEFAULT_SESSION;
+        lock_security_access(server);
+    }
+
+    if(server->security_locked_out && now -
+            server->security_locked_out_time_us >= SECURITY_ACCESS_DELAY_US) {
+        server->security_locked_out = false;
+        server->failed_key_attempts = 0;
+    }
+}
+
+void diagnostic_server_next_deadline(DiagnosticShims* shims,
+        const DiagnosticServer* server, DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    diagnostic_transport_next_deadline(&server->sender, now, deadline);
+    if(server->session != DIAGNOSTIC_DEFAULT_SESSION) {
+        diagnostic_add_deadline(deadline, now, server->last_request_time_us,
+                S3_SERVER_TIMEOUT_US);
+    }
+    if(server->security_locked_out) {
+        diagnostic_add_deadline(deadline, now,
+                server->security_locked_out_time_us, SECURITY_ACCESS_DELAY_US);
+    }
+}
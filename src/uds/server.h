@@ -0,0 +1,229 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <uds/uds_types.h>
+#include <uds/transport.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// enough for any single frame response, built in place
+#define DIAGNOSTIC_SERVER_FRAME_BUFFER_SIZE \
+    (DIAGNOSTIC_TRANSPORT_HEADROOM + CAN_FD_MESSAGE_BYTE_SIZE)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The server (ECU) side of the protocol: it receives requests, dispatches them
+ * to built-in service implementations backed by caller-owned tables of data
+ * identifiers, OBD-II PIDs and DTCs, and sends the responses - or the right
+ * negative response code, for services, sub-functions and identifiers it
+ * doesn't support.
+ */
+
+typedef struct DiagnosticServer DiagnosticServer;
+
+/* Public: Read the value of a data identifier (DID) into a response.
+ *
+ * server - the server handling the request.
+ * did - the data identifier that was requested.
+ * destination - where to write the value, directly in the response.
+ * destination_length - the room left in the response.
+ * size - set to the number of bytes written.
+ *
+ * Returns NRC_SUCCESS, or the negative response code to send instead.
+ */
+typedef DiagnosticNegativeResponseCode (*DiagnosticServerDidReader)(
+        DiagnosticServer* server, uint16_t did, uint8_t destination[],
+        uint16_t destination_length, uint16_t* size);
+
+/* Public: Write a new value to a data identifier.
+ *
+ * Returns NRC_SUCCESS, or the negative response code to send instead.
+ */
+typedef DiagnosticNegativeResponseCode (*DiagnosticServerDidWriter)(
+        DiagnosticServer* server, uint16_t did, const uint8_t data[],
+        uint16_t size);
+
+/* Public: Read the value of an OBD-II PID into a response, for modes 0x1, 0x2,
+ * 0x6, 0x8 and 0x9.
+ *
+ * Returns NRC_SUCCESS, or the negative response code to send instead.
+ */
+typedef DiagnosticNegativeResponseCode (*DiagnosticServerPidReader)(
+        DiagnosticServer* server, uint8_t mode, uint8_t pid,
+        uint8_t destination[], uint16_t destination_length, uint16_t* size);
+
+/* Public: Generate the seed for a SecurityAccess level.
+ *
+ * seed - where to write the seed.
+ * size - set to the size of the seed, at most
+ *      MAX_DIAGNOSTIC_SECURITY_SEED_SIZE.
+ *
+ * Returns false if the level isn't supported.
+ */
+typedef bool (*DiagnosticServerSeedGenerator)(DiagnosticServer* server,
+        uint8_t level, uint8_t seed[], uint8_t* size);
+
+/* Public: Returns true if 'key' is the right key for the seed that was sent for
+ * a SecurityAccess level.
+ */
+typedef bool (*DiagnosticServerKeyValidator)(DiagnosticServer* server,
+        uint8_t level, const uint8_t seed[], uint8_t seed_size,
+        const uint8_t key[], uint16_t key_size);
+
+/* Public: A data identifier served by 0x22 ReadDataByIdentifier and 0x2E
+ * WriteDataByIdentifier.
+ *
+ * did - the data identifier.
+ * read - (optional) reads the value, NULL if it can't be read.
+ * write - (optional) writes the value, NULL if it can't be written.
+ * security_level - the SecurityAccess level that must be unlocked to read or
+ *      write it, 0 for none.
+ */
+typedef struct {
+    uint16_t did;
+    DiagnosticServerDidReader read;
+    DiagnosticServerDidWriter write;
+    uint8_t security_level;
+} DiagnosticServerDid;
+
+/* Public: An OBD-II PID served by one of the OBD-II modes. The "PIDs
+ * supported" PIDs (0x0, 0x20, 0x40, ...) are generated from the table unless
+ * they are in it.
+ */
+typedef struct {
+    uint8_t mode;
+    uint8_t pid;
+    DiagnosticServerPidReader read;
+} DiagnosticServerPid;
+
+/* Public: A diagnostic trouble code stored by the server, served by 0x19
+ * ReadDTCInformation and the OBD-II DTC modes.
+ *
+ * dtc - the 3 byte DTC.
+ * status - the ISO 14229 status byte, e.g. 0x08 for a confirmed DTC. OBD-II
+ *      mode 0x4 clears it.
+ */
+typedef struct {
+    uint32_t dtc;
+    uint8_t status;
+} DiagnosticServerDtc;
+
+/* Public: One simulated or embedded ECU.
+ *
+ * Initialize it with diagnostic_init_server(...), then fill in the tables and
+ * callbacks it should serve. All tables are owned by the caller.
+ *
+ * request_arbitration_id - The physical arbitration ID requests arrive on.
+ * functional_arbitration_id - The functional (broadcast) arbitration ID, or 0
+ *      for none. Negative responses to functional requests for unsupported
+ *      services or identifiers are suppressed, as ISO 14229 requires.
+ * response_arbitration_id - The arbitration ID responses are sent on.
+ * can_fd - true to send CAN FD frames.
+ * no_frame_padding - true if sent classic frames should not be padded out to
+ *      8 bytes.
+ * dids, did_count - The data identifiers it serves.
+ * pids, pid_count - The OBD-II PIDs it serves.
+ * dtcs, dtc_count - The DTCs it has stored.
+ * seed_generator, key_validator - (optional) SecurityAccess callbacks, without
+ *      which 0x27 isn't supported.
+ * receive_buffer - (optional) Storage for multi-frame requests. Without it,
+ *      only single frame requests are accepted.
+ * receive_buffer_size - The size of receive_buffer.
+ * transmit_buffer - (optional) Storage responses are built in and sent from.
+ *      Without it, or if it's smaller than DIAGNOSTIC_SERVER_FRAME_BUFFER_SIZE,
+ *      responses are built in the server itself and limited to
+ *      CAN_FD_MESSAGE_BYTE_SIZE bytes. A multi-frame response is sent from
+ *      the buffer, so don't move the server while one is in progress.
+ * transmit_buffer_size - The size of transmit_buffer.
+ * context - (optional) Anything the callbacks need to tell servers apart.
+ * session - The active diagnostic session.
+ * security_level - The unlocked SecurityAccess level, 0 if locked.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticServer {
+    uint32_t request_arbitration_id;
+    uint32_t functional_arbitration_id;
+    uint32_t response_arbitration_id;
+    bool can_fd;
+    bool no_frame_padding;
+    const DiagnosticServerDid* dids;
+    uint16_t did_count;
+    const DiagnosticServerPid* pids;
+    uint16_t pid_count;
+    DiagnosticServerDtc* dtcs;
+    uint16_t dtc_count;
+    DiagnosticServerSeedGenerator seed_generator;
+    DiagnosticServerKeyValidator key_validator;
+    uint8_t* receive_buffer;
+    uint16_t receive_buffer_size;
+    uint8_t* transmit_buffer;
+    uint16_t transmit_buffer_size;
+    void* context;
+    uint8_t session;
+    uint8_t security_level;
+
+    // Private
+    uint8_t seed[MAX_DIAGNOSTIC_SECURITY_SEED_SIZE];
+    uint8_t seed_size;
+    uint8_t seed_level;
+    uint8_t failed_key_attempts;
+    bool security_locked_out;
+    uint32_t security_locked_out_time_us;
+    uint32_t last_request_time_us;
+    DiagnosticTransportReceiver receiver;
+    DiagnosticTransportSender sender;
+    uint8_t frame_buffer[DIAGNOSTIC_SERVER_FRAME_BUFFER_SIZE];
+};
+
+/* Public: Initialize a server in the default session, with no tables.
+ *
+ * server - the server to initialize.
+ * request_arbitration_id - the physical arbitration ID requests arrive on.
+ * response_arbitration_id - the arbitration ID to respond on.
+ */
+void diagnostic_init_server(DiagnosticServer* server,
+        uint32_t request_arbitration_id, uint32_t response_arbitration_id);
+
+/* Public: Pass a received CAN frame to the server. Requests are handled and
+ * responded to as soon as they are complete.
+ *
+ * Returns true if the frame was addressed to the server.
+ */
+bool diagnostic_server_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size);
+
+/* Public: Handle a complete request PDU and send the response, e.g. for
+ * requests reassembled by some other ISO-TP implementation.
+ *
+ * functional - true if the request was sent to the functional address.
+ *
+ * Returns true if a response was sent.
+ */
+bool diagnostic_server_handle_request(DiagnosticShims* shims,
+        DiagnosticServer* server, const uint8_t request[], uint16_t size,
+        bool functional);
+
+/* Public: Send consecutive frames of a response paced by the client's STmin,
+ * and expire the session (S3, 5 seconds) and SecurityAccess delay (10 seconds)
+ * timers. A response whose flow control doesn't arrive within a second is
+ * abandoned, so the next request isn't dropped. Timers need the get_time_us
+ * shim.
+ */
+void diagnostic_server_poll(DiagnosticShims* shims, DiagnosticServer* server);
+
+/* Public: Add the next time the server needs diagnostic_server_poll(...) - a
+ * consecutive frame, or a session or SecurityAccess timer running out - to a
+ * deadline. Does nothing without the get_time_us shim.
+ */
+void diagnostic_server_next_deadline(DiagnosticShims* shims,
+        const DiagnosticServer* server, DiagnosticDeadline* deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SERVER_H__
@@ -0,0 +1,269 @@
+#include <uds/session.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#define DEFAULT_KEEP_ALIVE_INTERVAL_US 2000000
+#define DEFAULT_RESPONSE_TIMEOUT_US 1000000
+#define DEFAULT_EXTENDED_TIMEOUT_US 5000000
+#define MODE_RESPONSE_OFFSET 0x40
+#define NEGATIVE_RESPONSE_MODE 0x7f
+#define SINGLE_FRAME_PCI 0x0
+#define CLASSIC_FRAME_LENGTH 8
+
+void diagnostic_init_session_manager(DiagnosticSessionManager* manager) {
+    memset(manager, 0, sizeof(DiagnosticSessionManager));
+    manager->keep_alive_interval_us = DEFAULT_KEEP_ALIVE_INTERVAL_US;
+    manager->response_timeout_us = DEFAULT_RESPONSE_TIMEOUT_US;
+    manager->extended_timeout_us = DEFAULT_EXTENDED_TIMEOUT_US;
+}
+
+static uint32_t now_us(DiagnosticShims* shims) {
+    return shims->get_time_us != NULL ? shims->get_time_us() : 0;
+}
+
+static DiagnosticSession* find_session(DiagnosticSessionManager* manager,
+        uint32_t arbitration_id) {
+    for(uint8_t i = 0; i < manager->session_count; i++) {
+        if(manager->sessions[i].arbitration_id == arbitration_id) {
+            return &manager->sessions[i];
+        }
+    }
+    return NULL;
+}
+
+const DiagnosticSession* diagnostic_session_find(
+        const DiagnosticSessionManager* manager, uint32_t arbitration_id) {
+    return find_session((DiagnosticSessionManager*) manager, arbitration_id);
+}
+
+/* Private: Send DiagnosticSessionControl for the session's session.
+ */
+static bool enter_session(DiagnosticShims* shims,
+        DiagnosticSession* session) {
+    DiagnosticRequest request = {
+        arbitration_id: session->arbitration_id,
+        mode: DIAGNOSTIC_SESSION_CONTROL_MODE,
+        has_pid: true,
+        pid: session->session,
+        pid_length: 1
+    };
+    session->handle = diagnostic_request(shims, &request, NULL);
+    session->request_sent_us = now_us(shims);
+    session->last_traffic_us = session->request_sent_us;
+    session->response_pending_count = 0;
+    if(session->handle.completed) {
+        session->state = DIAGNOSTIC_SESSION_LOST;
+        return false;
+    }
+    session->state = DIAGNOSTIC_SESSION_ENTERING;
+    return true;
+}
+
+bool diagnostic_session_start(DiagnosticShims* shims,
+        DiagnosticSessionManager* manager, uint32_t arbitration_id,
+        uint8_t session_type) {
+    DiagnosticSession* session = find_session(manager, arbitration_id);
+    if(session == NULL) {
+        if(manager->session_count == MAX_SESSION_ECUS) {
+            return false;
+        }
+        session = &manager->sessions[manager->session_count];
+        memset(session, 0, sizeof(DiagnosticSession));
+        session->arbitration_id = arbitration_id;
+
+        // the keep-alive is always the same single frame, so it's encoded
+        // once and sent without a request handle
+        DiagnosticRequest request = {
+            arbitration_id: arbitration_id,
+            mode: DIAGNOSTIC_TESTER_PRESENT_MODE,
+            has_pid: true,
+            pid: DIAGNOSTIC_SUPPRESS_POSITIVE_RESPONSE,
+            pid_length: 1
+        };
+        DiagnosticRequestHandle handle = generate_diagnostic_request(shims,
+                &request, NULL);
+        if(!diagnostic_init_request_template(&session->keep_alive, &handle)) {
+            return false;
+        }
+        ++manager->session_count;
+    }
+
+    session->session = session_type;
+    session->negative_response_code = NRC_SUCCESS;
+    return enter_session(shims, session);
+}
+
+/* Private: Returns true if a frame from an ECU shows it isn't in
+ * 'session_type' any more: a single frame with an ECUReset response, a
+ * DiagnosticSessionControl response for another session, or a negative
+ * response for a service or sub-function not supported in the active session.
+ */
+static bool left_session(const uint8_t data[], uint8_t size,
+        uint8_t session_type) {
+    if(size < 2 || (data[0] >> 4) != SINGLE_FRAME_PCI) {
+        return false;
+    }
+    uint8_t header_size = 1;
+    uint8_t length = data[0] & 0xf;
+    if(length == 0 && size > CLASSIC_FRAME_LENGTH) {
+        // CAN FD escape sequence
+        header_size = 2;
+        length = data[1];
+    }
+    if(length == 0 || header_size + length > size) {
+        return false;
+    }
+
+    const uint8_t* payload = &data[header_size];
+    switch(payload[0]) {
+        case DIAGNOSTIC_ECU_RESET_MODE + MODE_RESPONSE_OFFSET:
+            return true;
+        case DIAGNOSTIC_SESSION_CONTROL_MODE + MODE_RESPONSE_OFFSET:
+            return length > 1 && payload[1] != session_type;
+        case NEGATIVE_RESPONSE_MODE:
+            return length > 2 && (payload[2] ==
+                    NRC_SUB_FUNCTION_NOT_SUPPORTED_IN_ACTIVE_SESSION ||
+                payload[2] == NRC_SERVICE_NOT_SUPPORTED_IN_ACTIVE_SESSION);
+        default:
+            return false;
+    }
+}
+
+/* Private: Continue the DiagnosticSessionControl request being sent to the
+ * ECU with a frame from it.
+ */
+static void receive_session_response(DiagnosticShims* shims,
+        DiagnosticSession* session, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    DiagnosticResponse response = diagnostic_receive_can_frame(shims,
+            &session->handle, arbitration_id, data, size);
+    if(session->handle.response_pending_count !=
+            session->response_pending_count) {
+        // the ECU needs more time - the extended timeout starts over
+        session->response_pending_count =
+                session->handle.response_pending_count;
+        session->request_sent_us = now_us(shims);
+    }
+    if(!response.completed) {
+        return;
+    }
+
+    if(response.success) {
+        session->state = session->session == DIAGNOSTIC_DEFAULT_SESSION ?
+                DIAGNOSTIC_SESSION_DEFAULT : DIAGNOSTIC_SESSION_ACTIVE;
+    } else if(response.negative_response_code == NRC_BUSY_REPEAT_REQUEST) {
+        session->state = DIAGNOSTIC_SESSION_LOST;
+    } else {
+        session->state = DIAGNOSTIC_SESSION_REFUSED;
+        session->negative_response_code = response.negative_response_code;
+    }
+}
+
+void diagnostic_session_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticSessionManager* manager, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size) {
+    uint32_t now = now_us(shims);
+    for(uint8_t i = 0; i < manager->session_count; i++) {
+        DiagnosticSession* session = &manager->sessions[i];
+        bool from_ecu = diagnostic_response_id_matches(
+                &session->keep_alive.handle, arbitration_id);
+        if(!from_ecu && arbitration_id != session->arbitration_id) {
+            continue;
+        }
+
+        session->last_traffic_us = now;
+        if(!from_ecu) {
+            continue;
+        }
+        if(session->state == DIAGNOSTIC_SESSION_ENTERING) {
+            receive_session_response(shims, session, arbitration_id, data,
+                    size);
+        } else if(session->state == DIAGNOSTIC_SESSION_ACTIVE &&
+                left_session(data, size, session->session)) {
+            session->state = DIAGNOSTIC_SESSION_LOST;
+        }
+    }
+}
+
+void diagnostic_session_lost(DiagnosticSessionManager* manager,
+        uint32_t arbitration_id) {
+    DiagnosticSession* session = find_session(manager, arbitration_id);
+    if(session != NULL && session->state != DIAGNOSTIC_SESSION_DEFAULT) {
+        session->state = DIAGNOSTIC_SESSION_LOST;
+    }
+}
+
+/* Private: Returns how long DiagnosticSessionControl may go without a
+ * response - P2, or P2* once the ECU has said the response is pending.
+ */
+static uint32_t response_timeout(const DiagnosticSessionManager* manager,
+        const DiagnosticSession* session) {
+    return session->response_pending_count > 0 ?
+            manager->extended_timeout_us : manager->response_timeout_us;
+}
+
+void diagnostic_session_poll(DiagnosticShims* shims,
+        DiagnosticSessionManager* manager) {
+    bool has_clock = shims->get_time_us != NULL;
+    uint32_t now = now_us(shims);
+    for(uint8_t i = 0; i < manager->session_count; i++) {
+        DiagnosticSession* session = &manager->sessions[i];
+        switch(session->state) {
+            case DIAGNOSTIC_SESSION_ENTERING:
+                if(has_clock && now - session->request_sent_us >=
+                        response_timeout(manager, session)) {
+                    // e.g. the ECU is still booting - try again
+                    session->state = DIAGNOSTIC_SESSION_LOST;
+                }
+                break;
+            case DIAGNOSTIC_SESSION_LOST:
+                if(enter_session(shims, session)) {
+                    ++session->reentry_count;
+                }
+                break;
+            case DIAGNOSTIC_SESSION_ACTIVE:
+                if(has_clock && now - session->last_traffic_us <
+                        manager->keep_alive_interval_us) {
+                    break;
+                }
+                if(shims->send_can_message(session->keep_alive.arbitration_id,
+                            session->keep_alive.frame,
+                            session->keep_alive.frame_size)) {
+                    ++session->keep_alive_count;
+                    session->last_traffic_us = now;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void diagnostic_session_next_deadline(DiagnosticShims* shims,
+        const DiagnosticSessionManager* manager, DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    for(uint8_t i = 0; i < manager->session_count; i++) {
+        const DiagnosticSession* session = &manager->sessions[i];
+        switch(session->state) {
+            case DIAGNOSTIC_SESSION_ENTERING:
+                diagnostic_add_deadline(deadline, now,
+                        session->request_sent_us,
+                        response_timeout(manager, session));
+                break;
+            case DIAGNOSTIC_SESSION_LOST:
+                diagnostic_add_deadline(deadline, now, now, 0);
+                break;
+            case DIAGNOSTIC_SESSION_ACTIVE:
+                diagnostic_add_deadline(deadline, now,
+                        session->last_traffic_us,
+                        manager->keep_alive_interval_us);
+                break;
+            default:
+                break;
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIAGNOSTIC_SESSION_CONTROL_MODE 0x10
+#define DIAGNOSTIC_ECU_RESET_MODE 0x11
+#define DIAGNOSTIC_TESTER_PRESENT_MODE 0x3e
+// set in a sub-function to ask the ECU not to send a positive response
+#define DIAGNOSTIC_SUPPRESS_POSITIVE_RESPONSE 0x80
+
+// The number of ECUs one session manager keeps sessions with.
+#ifndef MAX_SESSION_ECUS
+#define MAX_SESSION_ECUS 8
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Public: Where a session with one ECU stands.
+ */
+typedef enum {
+    // in the default session, which needs no keep-alive
+    DIAGNOSTIC_SESSION_DEFAULT,
+    // DiagnosticSessionControl was sent, waiting for the response
+    DIAGNOSTIC_SESSION_ENTERING,
+    // in the session, kept alive with TesterPresent
+    DIAGNOSTIC_SESSION_ACTIVE,
+    // the ECU left the session, e.g. after a reset - it's entered again on the
+    // next poll
+    DIAGNOSTIC_SESSION_LOST,
+    // the ECU refused the session, see negative_response_code
+    DIAGNOSTIC_SESSION_REFUSED
+} DiagnosticSessionState;
+
+/* Public: The session with one ECU.
+ *
+ * arbitration_id - The arbitration ID of the ECU.
+ * session - The session the ECU should be in.
+ * state - Where the session stands.
+ * negative_response_code - If the ECU refused the session, the reason.
+ * keep_alive_count - The number of TesterPresent requests sent.
+ * reentry_count - The number of times the session was entered again after
+ *      the ECU left it.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t session;
+    DiagnosticSessionState state;
+    DiagnosticNegativeResponseCode negative_response_code;
+    uint32_t keep_alive_count;
+    uint32_t reentry_count;
+
+    // Private
+    DiagnosticRequestHandle handle;
+    DiagnosticRequestTemplate keep_alive;
+    uint32_t last_traffic_us;
+    // when DiagnosticSessionControl was sent, or the ECU last said its
+    // response is pending
+    uint32_t request_sent_us;
+    uint16_t response_pending_count;
+} DiagnosticSession;
+
+/* Public: The non-default diagnostic sessions (0x10) with a set of ECUs, kept
+ * from timing out (S3) with suppress-positive-response TesterPresent (0x3E)
+ * requests - only when no other traffic with the ECU restarted its timer
+ * recently. A session the ECU leaves, e.g. because it was reset, is entered
+ * again automatically. Initialize it with diagnostic_init_session_manager(...).
+ *
+ * keep_alive_interval_us - (optional) How long the ECU may go without traffic
+ *      before a TesterPresent is sent. The default is 2s, well within the
+ *      5s S3 timeout.
+ * response_timeout_us - (optional) How long to wait for the response to
+ *      DiagnosticSessionControl before trying again. The default is 1s.
+ * extended_timeout_us - (optional) How long to wait after the ECU says the
+ *      response is pending (P2*), e.g. while it switches to the programming
+ *      session, restarted with each of those. The default is 5s.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t keep_alive_interval_us;
+    uint32_t response_timeout_us;
+    uint32_t extended_timeout_us;
+
+    // Private
+    DiagnosticSession sessions[MAX_SESSION_ECUS];
+    uint8_t session_count;
+} DiagnosticSessionManager;
+
+/* Public: Initialize a session manager with no sessions.
+ */
+void diagnostic_init_session_manager(DiagnosticSessionManager* manager);
+
+/* Public: Enter a session with an ECU and keep it alive, or return it to the
+ * default session with DIAGNOSTIC_DEFAULT_SESSION.
+ *
+ * shims - Low-level shims required to send CAN messages, etc.
+ * arbitration_id - the arbitration ID of the ECU, which responds on the usual
+ *      response ID for it.
+ * session - the session, e.g. DIAGNOSTIC_EXTENDED_SESSION.
+ *
+ * Returns false if MAX_SESSION_ECUS other ECUs already have sessions, or the
+ * request could not be sent.
+ */
+bool diagnostic_session_start(DiagnosticShims* shims,
+        DiagnosticSessionManager* manager, uint32_t arbitration_id,
+        uint8_t session);
+
+/* Public: Returns the session with an ECU, or NULL if there is none.
+ */
+const DiagnosticSession* diagnostic_session_find(
+        const DiagnosticSessionManager* manager, uint32_t arbitration_id);
+
+/* Public: Pass a CAN frame to the manager - every received frame, and any
+ * requests sent by other code if the bus interface doesn't echo them. Any
+ * traffic with an ECU restarts its S3 timer, so the next TesterPresent is
+ * postponed. An ECUReset response, or a negative response saying a service
+ * isn't supported in the active session, means the ECU left the session.
+ */
+void diagnostic_session_receive_can_frame(DiagnosticShims* shims,
+        DiagnosticSessionManager* manager, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size);
+
+/* Public: Tell the manager an ECU left its session, e.g. after sending it an
+ * ECUReset with the positive response suppressed. The session is entered
+ * again on the next poll.
+ */
+void diagnostic_session_lost(DiagnosticSessionManager* manager,
+        uint32_t arbitration_id);
+
+/* Public: Send the TesterPresent requests that are due, enter lost sessions
+ * again and time out unanswered DiagnosticSessionControl requests. Call this
+ * regularly from your main loop. Timing needs the get_time_us shim - without
+ * it, every call sends a TesterPresent to each ECU in a session.
+ */
+void diagnostic_session_poll(DiagnosticShims* shims,
+        DiagnosticSessionManager* manager);
+
+/* Public: Add the next time the sessions need diagnostic_session_poll(...) -
+ * a keep-alive, a response timeout or a lost session to enter again - to a
+ * deadline. Does nothing without the get_time_us shim.
+ */
+void diagnostic_session_next_deadline(DiagnosticShims* shims,
+        const DiagnosticSessionManager* manager, DiagnosticDeadline* deadline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SESSION_H__
@@ -0,0 +1,374 @@
+#include <uds/simulator.h>
+#include <uds/transport.h>
+#include <uds/uds.h>
+#include <string.h>
+
+#define EVENT_FRAME 0
+#define EVENT_ECU_POLL 1
+#define EVENT_TIMER 2
+
+#define SINGLE_FRAME_PCI 0x0
+#define FIRST_FRAME_PCI 0x1
+#define NEGATIVE_RESPONSE_SERVICE 0x7f
+#define CLASSIC_FRAME_LENGTH 8
+#define CAN_STANDARD_ID_MASK 0x7ff
+
+// frame overhead with an 11-bit ID and the interframe space, ignoring stuff
+// bits; a 29-bit ID adds 20 bits to the arbitration field
+#define CLASSIC_FRAME_OVERHEAD_BITS 47
+#define EXTENDED_ID_EXTRA_BITS 20
+#define CAN_FD_NOMINAL_PHASE_BITS 30
+#define CAN_FD_DATA_PHASE_OVERHEAD_BITS 9
+#define CAN_FD_SHORT_CRC_BITS 17
+#define CAN_FD_LONG_CRC_BITS 21
+
+static DiagnosticSimulator* active_simulator;
+
+static bool event_before(const DiagnosticSimulatorEvent* a,
+        const DiagnosticSimulatorEvent* b) {
+    return a->time_us < b->time_us ||
+        (a->time_us == b->time_us && (int32_t)(a->sequence - b->sequence) < 0);
+}
+
+static void swap_events(DiagnosticSimulatorEvent* a,
+        DiagnosticSimulatorEvent* b) {
+    DiagnosticSimulatorEvent temporary = *a;
+    *a = *b;
+    *b = temporary;
+}
+
+/* Private: Queue an event, keeping the array a binary min-heap ordered by time
+ * and then by the order the events were queued in.
+ *
+ * Returns the queued event, to fill in, or NULL if the array is full.
+ */
+static DiagnosticSimulatorEvent* push_event(DiagnosticSimulator* simulator,
+        uint8_t type, uint64_t time_us) {
+    if(simulator->event_count >= simulator->event_capacity) {
+        ++simulator->overflowed_event_count;
+        return NULL;
+    }
+
+    DiagnosticSimulatorEvent* events = simulator->events;
+    uint32_t index = simulator->event_count++;
+    events[index].time_us = time_us;
+    events[index].sequence = simulator->next_sequence++;
+    events[index].type = type;
+    events[index].ecu = 0;
+    events[index].size = 0;
+    while(index > 0 && event_before(&events[index],
+                &events[(index - 1) / 2])) {
+        swap_events(&events[index], &events[(index - 1) / 2]);
+        index = (index - 1) / 2;
+    }
+    return &events[index];
+}
+
+static DiagnosticSimulatorEvent pop_event(DiagnosticSimulator* simulator) {
+    DiagnosticSimulatorEvent* events = simulator->events;
+    DiagnosticSimulatorEvent first = events[0];
+    events[0] = events[--simulator->event_count];
+
+    uint32_t index = 0;
+    while(true) {
+        uint32_t smallest = index;
+        uint32_t child;
+        for(child = 2 * index + 1; child <= 2 * index + 2 &&
+                child < simulator->event_count; ++child) {
+            if(event_before(&events[child], &events[smallest])) {
+                smallest = child;
+            }
+        }
+        if(smallest == index) {
+            break;
+        }
+        swap_events(&events[index], &events[smallest]);
+        index = smallest;
+    }
+    return first;
+}
+
+static uint64_t frame_duration_us(const DiagnosticSimulator* simulator,
+        uint32_t arbitration_id, uint8_t size) {
+    if(simulator->bitrate == 0) {
+        return 0;
+    }
+
+    uint32_t id_bits = arbitration_id > CAN_STANDARD_ID_MASK ?
+            EXTENDED_ID_EXTRA_BITS : 0;
+    if(size <= CLASSIC_FRAME_LENGTH) {
+        return ((CLASSIC_FRAME_OVERHEAD_BITS + id_bits + size * 8) *
+                1000000ULL + simulator->bitrate - 1) / simulator->bitrate;
+    }
+
+    uint32_t data_bitrate = simulator->data_bitrate != 0 ?
+            simulator->data_bitrate : simulator->bitrate;
+    uint32_t data_bits = CAN_FD_DATA_PHASE_OVERHEAD_BITS + size * 8 +
+            (size > 16 ? CAN_FD_LONG_CRC_BITS : CAN_FD_SHORT_CRC_BITS);
+    return ((CAN_FD_NOMINAL_PHASE_BITS + id_bits) * 1000000ULL +
+                simulator->bitrate - 1) / simulator->bitrate +
+        (data_bits * 1000000ULL + data_bitrate - 1) / data_bitrate;
+}
+
+// xorshift32, so runs repeat for the same seed on every platform
+static bool random_event(DiagnosticSimulator* simulator, float rate) {
+    if(rate <= 0) {
+        return false;
+    }
+    uint32_t x = simulator->random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    simulator->random_state = x;
+    return (x >> 8) / 16777216.0f < rate;
+}
+
+static bool simulated_send_can(const uint32_t arbitration_id,
+        const uint8_t* data, const uint8_t size) {
+    DiagnosticSimulator* simulator = active_simulator;
+    if(simulator == NULL || size > CAN_FD_MESSAGE_BYTE_SIZE) {
+        return false;
+    }
+
+    uint64_t time_us = simulator->now_us;
+    if(simulator->sending_ecu != 0 && size > 0) {
+        // the ECU's processing time delays the start of every response
+        uint8_t pci = data[0] >> 4;
+        if(pci == SINGLE_FRAME_PCI || pci == FIRST_FRAME_PCI) {
+            time_us += simulator->ecus[simulator->sending_ecu - 1]
+                    .response_delay_us;
+        }
+    }
+
+    DiagnosticSimulatorEvent* event = push_event(simulator, EVENT_FRAME,
+            time_us);
+    if(event == NULL) {
+        return false;
+    }
+    event->arbitration_id = arbitration_id;
+    event->ecu = simulator->sending_ecu;
+    event->size = size;
+    memcpy(event->data, data, size);
+    return true;
+}
+
+static uint32_t simulated_time_us(void) {
+    return active_simulator != NULL ? (uint32_t) active_simulator->now_us : 0;
+}
+
+void diagnostic_init_virtual_ecu(DiagnosticVirtualEcu* ecu,
+        uint32_t request_arbitration_id, uint32_t response_arbitration_id) {
+    memset(ecu, 0, sizeof(DiagnosticVirtualEcu));
+    diagnostic_init_server(&ecu->server, request_arbitration_id,
+            response_arbitration_id);
+}
+
+void diagnostic_init_simulator(DiagnosticSimulator* simulator,
+        DiagnosticVirtualEcu ecus[], uint16_t ecu_count,
+        DiagnosticSimulatorEvent events[], uint32_t event_capacity,
+        uint32_t seed) {
+    memset(simulator, 0, sizeof(DiagnosticSimulator));
+    simulator->ecus = ecus;
+    simulator->ecu_count = ecu_count;
+    simulator->events = events;
+    simulator->event_capacity = event_capacity;
+    simulator->random_state = seed != 0 ? seed : 1;
+
+    simulator->ecus_sorted = true;
+    uint16_t i;
+    for(i = 1; i < ecu_count; ++i) {
+        if(ecus[i].server.request_arbitration_id <
+                ecus[i - 1].server.request_arbitration_id) {
+            simulator->ecus_sorted = false;
+            break;
+        }
+    }
+    active_simulator = simulator;
+}
+
+DiagnosticShims diagnostic_simulator_shims(DiagnosticSimulator* simulator,
+        LogShim log) {
+    active_simulator = simulator;
+    DiagnosticShims shims = diagnostic_init_shims(log, simulated_send_can,
+            NULL);
+    shims.get_time_us = simulated_time_us;
+    return shims;
+}
+
+static DiagnosticVirtualEcu* find_ecu(DiagnosticSimulator* simulator,
+        uint32_t arbitration_id) {
+    if(simulator->ecus_sorted) {
+        uint16_t low = 0;
+        uint16_t high = simulator->ecu_count;
+        while(low < high) {
+            uint16_t middle = low + (high - low) / 2;
+            uint32_t id = simulator->ecus[middle].server.request_arbitration_id;
+            if(id == arbitration_id) {
+                return &simulator->ecus[middle];
+            } else if(id < arbitration_id) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        return NULL;
+    }
+
+    uint16_t i;
+    for(i = 0; i < simulator->ecu_count; ++i) {
+        if(simulator->ecus[i].server.request_arbitration_id ==
+                arbitration_id) {
+            return &simulator->ecus[i];
+        }
+    }
+    return NULL;
+}
+
+static uint16_t ecu_number(const DiagnosticSimulator* simulator,
+        const DiagnosticVirtualEcu* ecu) {
+    return ecu - simulator->ecus + 1;
+}
+
+/* Private: Make sure the ECU is polled when its response needs it - to send
+ * the next consecutive frame, or to give up waiting for flow control.
+ */
+static void schedule_poll(DiagnosticSimulator* simulator,
+        DiagnosticVirtualEcu* ecu) {
+    const DiagnosticTransportSender* sender = &ecu->server.sender;
+    if(ecu->poll_scheduled || !sender->active) {
+        return;
+    }
+
+    uint32_t delay_us = sender->waiting_for_flow_control ?
+            DIAGNOSTIC_TRANSPORT_FLOW_CONTROL_TIMEOUT_US :
+            sender->separation_time_us;
+    DiagnosticSimulatorEvent* event = push_event(simulator, EVENT_ECU_POLL,
+            simulator->now_us + (delay_us > 0 ? delay_us : 1));
+    if(event != NULL) {
+        event->ecu = ecu_number(simulator, ecu);
+        ecu->poll_scheduled = true;
+    }
+}
+
+static void inject_negative_response(DiagnosticSimulator* simulator,
+        DiagnosticVirtualEcu* ecu, const uint8_t data[]) {
+    uint8_t service = (data[0] & 0xf) != 0 ? data[1] : data[2];
+    uint8_t frame[CLASSIC_FRAME_LENGTH] = {3, NEGATIVE_RESPONSE_SERVICE,
+        service, NRC_BUSY_REPEAT_REQUEST};
+    ++ecu->negative_response_count;
+    simulator->sending_ecu = ecu_number(simulator, ecu);
+    simulated_send_can(ecu->server.response_arbitration_id, frame,
+            ecu->server.no_frame_padding ? 4 : sizeof(frame));
+    simulator->sending_ecu = 0;
+}
+
+static void deliver_to_ecu(DiagnosticShims* shims,
+        DiagnosticSimulator* simulator, DiagnosticVirtualEcu* ecu,
+        const DiagnosticSimulatorEvent* event, bool functional) {
+    if(random_event(simulator, ecu->drop_rate)) {
+        ++simulator->dropped_frame_count;
+        return;
+    }
+
+    uint8_t pci = event->size > 0 ? event->data[0] >> 4 : 0xf;
+    if(pci == SINGLE_FRAME_PCI || pci == FIRST_FRAME_PCI) {
+        ++ecu->request_count;
+        if(pci == SINGLE_FRAME_PCI && event->size > 2 && !functional &&
+                !ecu->server.sender.active &&
+                random_event(simulator, ecu->negative_response_rate)) {
+            inject_negative_response(simulator, ecu, event->data);
+            return;
+        }
+    }
+
+    simulator->sending_ecu = ecu_number(simulator, ecu);
+    diagnostic_server_receive_can_frame(shims, &ecu->server,
+            event->arbitration_id, event->data, event->size);
+    simulator->sending_ecu = 0;
+    schedule_poll(simulator, ecu);
+}
+
+static void deliver_frame(DiagnosticShims* shims,
+        DiagnosticSimulator* simulator,
+        const DiagnosticSimulatorEvent* event) {
+    if(event->ecu != 0) {
+        if(random_event(simulator, simulator->ecus[event->ecu - 1].drop_rate)) {
+            ++simulator->dropped_frame_count;
+        } else if(simulator->tester != NULL) {
+            simulator->tester(simulator, event->arbitration_id, event->data,
+                    event->size);
+        }
+        return;
+    }
+
+    DiagnosticVirtualEcu* ecu = find_ecu(simulator, event->arbitration_id);
+    if(ecu != NULL) {
+        deliver_to_ecu(shims, simulator, ecu, event, false);
+        return;
+    }
+
+    uint16_t i;
+    for(i = 0; i < simulator->ecu_count; ++i) {
+        ecu = &simulator->ecus[i];
+        if(ecu->server.functional_arbitration_id != 0 &&
+                ecu->server.functional_arbitration_id ==
+                    event->arbitration_id) {
+            deliver_to_ecu(shims, simulator, ecu, event, true);
+        }
+    }
+}
+
+bool diagnostic_simulator_step(DiagnosticShims* shims,
+        DiagnosticSimulator* simulator) {
+    if(simulator->event_count == 0) {
+        return false;
+    }
+
+    active_simulator = simulator;
+    DiagnosticSimulatorEvent event = pop_event(simulator);
+    if(event.time_us > simulator->now_us) {
+        simulator->now_us = event.time_us;
+    }
+
+    DiagnosticVirtualEcu* ecu;
+    switch(event.type) {
+        case EVENT_FRAME:
+            {
+                // frames take turns on the bus, in the order they were ready
+                uint64_t duration_us = frame_duration_us(simulator,
+                        event.arbitration_id, event.size);
+                simulator->now_us += duration_us;
+                simulator->bus_busy_us += duration_us;
+                ++simulator->delivered_frame_count;
+                deliver_frame(shims, simulator, &event);
+            }
+            break;
+        case EVENT_ECU_POLL:
+            ecu = &simulator->ecus[event.ecu - 1];
+            ecu->poll_scheduled = false;
+            simulator->sending_ecu = event.ecu;
+            diagnostic_server_poll(shims, &ecu->server);
+            simulator->sending_ecu = 0;
+            schedule_poll(simulator, ecu);
+            break;
+        case EVENT_TIMER:
+            if(simulator->timer_expired != NULL) {
+                simulator->timer_expired(simulator, event.arbitration_id);
+            }
+            break;
+    }
+    return true;
+}
+
+void diagnostic_simulator_start_timer(DiagnosticSimulator* simulator,
+        uint32_t timer_id, uint32_t delay_us) {
+    DiagnosticSimulatorEvent* event = push_event(simulator, EVENT_TIMER,
+            simulator->now_us + delay_us);
+    if(event != NULL) {
+        event->arbitration_id = timer_id;
+    }
+}
+
+uint64_t diagnostic_simulator_time_us(const DiagnosticSimulator* simulator) {
+    return simulator->now_us;
+}
@@ -0,0 +1,171 @@
+#ifndef __SIMULATOR_H__
+#define __SIMULATOR_H__
+
+#include <uds/uds_types.h>
+#include <uds/server.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* An in-process CAN bus with a fleet of virtual ECUs, for exercising the
+ * library at scale without a vehicle. Frames sent through the simulator's shims
+ * are queued on the bus and delivered one at a time on a virtual clock - to the
+ * ECU they're addressed to, or to the tester for frames the ECUs send.
+ *
+ * The shims don't carry a context, so only one simulator can be in use at a
+ * time: the last one initialized.
+ */
+
+typedef struct DiagnosticSimulator DiagnosticSimulator;
+
+/* Public: Receive a frame sent by one of the virtual ECUs, e.g. to pass it to
+ * diagnostic_receive_can_frame(...).
+ */
+typedef void (*DiagnosticSimulatorFrameReceived)(DiagnosticSimulator* simulator,
+        const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size);
+
+/* Public: Called when a timer started with diagnostic_simulator_start_timer
+ * expires.
+ */
+typedef void (*DiagnosticSimulatorTimerExpired)(DiagnosticSimulator* simulator,
+        uint32_t timer_id);
+
+/* Public: One simulated ECU - a DiagnosticServer and the ways it misbehaves.
+ * Initialize it with diagnostic_init_virtual_ecu(...), then set up its server
+ * tables like any other server's.
+ *
+ * server - The server answering the ECU's requests.
+ * response_delay_us - How long the ECU takes to start each response - every
+ *      single frame or first frame it sends.
+ * negative_response_rate - The fraction of single frame requests, from 0 to 1,
+ *      answered with "busy, repeat request" (NRC 0x21) instead.
+ * drop_rate - The fraction of frames to or from the ECU, from 0 to 1, that are
+ *      lost on the bus.
+ * request_count - The number of request frames delivered to the ECU.
+ * negative_response_count - The number of negative responses injected.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    DiagnosticServer server;
+    uint32_t response_delay_us;
+    float negative_response_rate;
+    float drop_rate;
+    uint32_t request_count;
+    uint32_t negative_response_count;
+
+    // Private
+    bool poll_scheduled;
+} DiagnosticVirtualEcu;
+
+/* Public: Storage for one event queued on the simulated bus - a frame in
+ * flight or a timer. The simulator needs an array of them, large enough for
+ * every frame and timer pending at once.
+ */
+typedef struct {
+    uint64_t time_us;
+    uint32_t sequence;
+    uint32_t arbitration_id;
+    uint16_t ecu;
+    uint8_t type;
+    uint8_t size;
+    uint8_t data[CAN_FD_MESSAGE_BYTE_SIZE];
+} DiagnosticSimulatorEvent;
+
+/* Public: A simulated bus. Initialize it with diagnostic_init_simulator(...).
+ *
+ * ecus, ecu_count - The virtual ECUs on the bus. If they're sorted by request
+ *      arbitration ID, frames are routed to them with a binary search.
+ * bitrate - (optional) The bus bitrate. Each frame occupies the bus for as long
+ *      as it would take to send, so traffic queues up like on a real bus. 0
+ *      for an infinitely fast bus, to measure the CPU cost alone.
+ * data_bitrate - (optional) The CAN FD data phase bitrate, if it's switched.
+ * tester - (optional) Receives every frame sent by the ECUs.
+ * timer_expired - (optional) Called for the tester's timers.
+ * context - (optional) Anything the callbacks need.
+ * delivered_frame_count - The number of frames sent over the bus so far.
+ * dropped_frame_count - The number of frames lost to the ECUs' drop rates.
+ * overflowed_event_count - The number of frames and timers lost because the
+ *      event array was full.
+ * bus_busy_us - The total time frames have occupied the bus.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticSimulator {
+    DiagnosticVirtualEcu* ecus;
+    uint16_t ecu_count;
+    uint32_t bitrate;
+    uint32_t data_bitrate;
+    DiagnosticSimulatorFrameReceived tester;
+    DiagnosticSimulatorTimerExpired timer_expired;
+    void* context;
+    uint64_t delivered_frame_count;
+    uint64_t dropped_frame_count;
+    uint64_t overflowed_event_count;
+    uint64_t bus_busy_us;
+
+    // Private
+    DiagnosticSimulatorEvent* events;
+    uint32_t event_capacity;
+    uint32_t event_count;
+    uint32_t next_sequence;
+    uint64_t now_us;
+    uint32_t random_state;
+    uint16_t sending_ecu;
+    bool ecus_sorted;
+};
+
+/* Public: Initialize a virtual ECU with an empty server and no delays or
+ * errors.
+ */
+void diagnostic_init_virtual_ecu(DiagnosticVirtualEcu* ecu,
+        uint32_t request_arbitration_id, uint32_t response_arbitration_id);
+
+/* Public: Initialize a simulated bus at time 0 and make it the one the
+ * simulator's shims use.
+ *
+ * ecus, ecu_count - the virtual ECUs on the bus, already initialized.
+ * events, event_capacity - storage for the frames and timers in flight.
+ * seed - the seed for the ECUs' random errors, so runs can be repeated.
+ */
+void diagnostic_init_simulator(DiagnosticSimulator* simulator,
+        DiagnosticVirtualEcu ecus[], uint16_t ecu_count,
+        DiagnosticSimulatorEvent events[], uint32_t event_capacity,
+        uint32_t seed);
+
+/* Public: Returns shims that send frames onto the simulated bus and read its
+ * virtual clock, for the tester and the ECUs alike.
+ *
+ * log - (optional) the log shim.
+ */
+DiagnosticShims diagnostic_simulator_shims(DiagnosticSimulator* simulator,
+        LogShim log);
+
+/* Public: Deliver the next frame on the bus, or expire the next timer,
+ * advancing the virtual clock to it.
+ *
+ * Returns false if nothing is left to do.
+ */
+bool diagnostic_simulator_step(DiagnosticShims* shims,
+        DiagnosticSimulator* simulator);
+
+/* Public: Start a tester timer that calls simulator->timer_expired after
+ * 'delay_us' of virtual time.
+ */
+void diagnostic_simulator_start_timer(DiagnosticSimulator* simulator,
+        uint32_t timer_id, uint32_t delay_us);
+
+/* Public: Returns the virtual time in microseconds since the simulator was
+ * initialized.
+ */
+uint64_t diagnostic_simulator_time_us(const DiagnosticSimulator* simulator);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SIMULATOR_H__
@@ -0,0 +1,339 @@
+#include <uds/sniffer.h>
+#include <uds/uds.h>
+#include <uds/transport.h>
+#include <string.h>
+
+#define CAN_STANDARD_ID_MASK 0x7ff
+#define CLASSIC_FRAME_LENGTH 8
+#define FIRST_FRAME_PCI 0x1
+#define MODE_RESPONSE_OFFSET 0x40
+#define NEGATIVE_RESPONSE_MODE 0x7f
+#define WRITE_DATA_BY_IDENTIFIER_SERVICE 0x2e
+#define IO_CONTROL_BY_IDENTIFIER_SERVICE 0x2f
+
+#define OBD2_PHYSICAL_REQUEST_START 0x7e0
+#define OBD2_PHYSICAL_RESPONSE_START 0x7e8
+#define OBD2_NODE_COUNT 8
+
+#define FIXED_FORMAT_SHIFT 16
+#define FIXED_TARGET_ADDRESS_SHIFT 8
+#define NORMAL_FIXED_PHYSICAL_FORMAT 0xda
+#define NORMAL_FIXED_FUNCTIONAL_FORMAT 0xdb
+#define NORMAL_FIXED_NODE 0x100
+
+/* Private: What a frame on the bus is, as far as the sniffer is concerned.
+ */
+typedef enum {
+    FRAME_OTHER,
+    FRAME_PHYSICAL_REQUEST,
+    FRAME_FUNCTIONAL_REQUEST,
+    FRAME_RESPONSE
+} FrameKind;
+
+void diagnostic_init_sniffer(DiagnosticSniffer* sniffer) {
+    memset(sniffer, 0, sizeof(DiagnosticSniffer));
+    sniffer->tester_address = OBD2_EXTERNAL_TEST_EQUIPMENT_ADDRESS;
+}
+
+// flow control frames the transport would send are the tester's business
+static bool discard_can_frame(const uint32_t arbitration_id,
+        const uint8_t* data, const uint8_t size) {
+    return true;
+}
+
+static FrameKind classify_frame(const DiagnosticSniffer* sniffer,
+        uint32_t arbitration_id, uint16_t* node) {
+    if(arbitration_id <= CAN_STANDARD_ID_MASK) {
+        if(arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
+            return FRAME_FUNCTIONAL_REQUEST;
+        } else if(arbitration_id - OBD2_PHYSICAL_REQUEST_START <
+                OBD2_NODE_COUNT) {
+            *node = arbitration_id - OBD2_PHYSICAL_REQUEST_START;
+            return FRAME_PHYSICAL_REQUEST;
+        } else if(arbitration_id - OBD2_PHYSICAL_RESPONSE_START <
+                OBD2_NODE_COUNT) {
+            *node = arbitration_id - OBD2_PHYSICAL_RESPONSE_START;
+            return FRAME_RESPONSE;
+        }
+        return FRAME_OTHER;
+    }
+
+    uint8_t format = arbitration_id >> FIXED_FORMAT_SHIFT;
+    uint8_t target_address = arbitration_id >> FIXED_TARGET_ADDRESS_SHIFT;
+    uint8_t source_address = arbitration_id;
+    if(format == NORMAL_FIXED_PHYSICAL_FORMAT) {
+        if(source_address == sniffer->tester_address) {
+            *node = NORMAL_FIXED_NODE | target_address;
+            return FRAME_PHYSICAL_REQUEST;
+        } else if(target_address == sniffer->tester_address) {
+            *node = NORMAL_FIXED_NODE | source_address;
+            return FRAME_RESPONSE;
+        }
+    } else if(format == NORMAL_FIXED_FUNCTIONAL_FORMAT &&
+            source_address == sniffer->tester_address) {
+        return FRAME_FUNCTIONAL_REQUEST;
+    }
+    return FRAME_OTHER;
+}
+
+static uint8_t pid_length_for_mode(uint8_t mode) {
+    switch(mode) {
+        case OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST:
+        case OBD2_MODE_POWERTRAIN_FREEZE_FRAME_REQUEST:
+        case OBD2_MODE_TEST_RESULTS:
+        case OBD2_MODE_CONTROL:
+        case OBD2_MODE_VEHICLE_INFORMATION:
+            return 1;
+        case OBD2_MODE_ENHANCED_DIAGNOSTIC_REQUEST:
+        case WRITE_DATA_BY_IDENTIFIER_SERVICE:
+        case IO_CONTROL_BY_IDENTIFIER_SERVICE:
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+/* Private: Rebuild the request a tester sent as 'message', with everything
+ * after the mode and PID in the large payload.
+ */
+static DiagnosticRequest decode_request(uint32_t arbitration_id,
+        const uint8_t message[], uint16_t size, bool can_fd) {
+    DiagnosticRequest request = {
+        arbitration_id: arbitration_id,
+        mode: message[0],
+        can_fd: can_fd,
+        addressing: arbitration_id > CAN_STANDARD_ID_MASK ?
+                DIAGNOSTIC_ADDRESSING_NORMAL_FIXED :
+                DIAGNOSTIC_ADDRESSING_NORMAL
+    };
+    uint16_t index = 1;
+    uint8_t pid_length = pid_length_for_mode(request.mode);
+    if(pid_length > 0 && size > pid_length) {
+        request.has_pid = true;
+        request.pid_length = pid_length;
+        request.pid = pid_length == 1 ? message[1] :
+                (message[1] << 8) | message[2];
+        index += pid_length;
+    }
+    request.large_payload = &message[index];
+    request.large_payload_length = size - index;
+    return request;
+}
+
+static DiagnosticSnifferSession* find_session(DiagnosticSniffer* sniffer,
+        uint16_t node) {
+    DiagnosticSnifferSession* oldest = &sniffer->sessions[0];
+    int i;
+    for(i = 0; i < MAX_SNIFFER_SESSIONS; ++i) {
+        DiagnosticSnifferSession* session = &sniffer->sessions[i];
+        if(session->active && session->node == node) {
+            return session;
+        } else if(!session->active) {
+            oldest = session;
+        } else if(oldest->active && session->last_frame_time_us <
+                oldest->last_frame_time_us) {
+            oldest = session;
+        }
+    }
+
+    memset(oldest, 0, sizeof(DiagnosticSnifferSession));
+    oldest->active = true;
+    oldest->node = node;
+    return oldest;
+}
+
+static void start_request(DiagnosticSniffer* sniffer,
+        DiagnosticShims* shims, DiagnosticSnifferRequest* pending,
+        uint32_t arbitration_id, const uint8_t message[], uint16_t size,
+        bool can_fd, uint64_t timestamp_us) {
+    DiagnosticRequest request = decode_request(arbitration_id, message, size,
+            can_fd);
+    pending->handle = generate_diagnostic_request(shims, &request, NULL);
+    pending->request_time_us = timestamp_us;
+    pending->pending = true;
+    pending->sequence = ++sniffer->request_count;
+}
+
+static void receive_request(DiagnosticSniffer* sniffer,
+        DiagnosticShims* shims, FrameKind kind, uint16_t node,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        uint64_t timestamp_us) {
+    DiagnosticTransportConfig config = {0};
+    const uint8_t* payload = NULL;
+    uint16_t payload_size = 0;
+    bool can_fd = size > CLASSIC_FRAME_LENGTH;
+
+    if(kind == FRAME_FUNCTIONAL_REQUEST) {
+        // functional requests are always single frames
+        DiagnosticTransportReceiver receiver = {0};
+        uint8_t index = arbitration_id > CAN_STANDARD_ID_MASK;
+        DiagnosticTransportStatus status = diagnostic_transport_receive(
+                shims, &config, &receiver, NULL, 0, 0, arbitration_id, data,
+                size, &payload, &payload_size);
+        if(status == DIAGNOSTIC_TRANSPORT_COMPLETED) {
+            uint8_t* message = sniffer->functional_payloads[index];
+            memcpy(message, payload, payload_size);
+            start_request(sniffer, shims,
+                    &sniffer->functional_requests[index], arbitration_id,
+                    message, payload_size, can_fd, timestamp_us);
+        } else if(status == DIAGNOSTIC_TRANSPORT_ERROR) {
+            ++sniffer->error_count;
+        }
+        return;
+    }
+
+    DiagnosticSnifferSession* session = find_session(sniffer, node);
+    session->last_frame_time_us = timestamp_us;
+    if(size > 0 && (data[0] >> 4) == FIRST_FRAME_PCI) {
+        // the last consecutive frame of a CAN FD message may be short
+        session->request_can_fd = can_fd;
+    }
+    // flow control frames for the response are ignored by the transport
+    DiagnosticTransportStatus status = diagnostic_transport_receive(shims,
+            &config, &session->request_receiver, session->request_buffer,
+            sizeof(session->request_buffer), 0, arbitration_id, data, size,
+            &payload, &payload_size);
+    if(status == DIAGNOSTIC_TRANSPORT_COMPLETED) {
+        if(payload != session->request_buffer) {
+            // a single frame, kept until the response arrives
+            memcpy(session->request_buffer, payload, payload_size);
+        } else {
+            can_fd = session->request_can_fd;
+        }
+        start_request(sniffer, shims, &session->request, arbitration_id,
+                session->request_buffer, payload_size, can_fd, timestamp_us);
+    } else if(status == DIAGNOSTIC_TRANSPORT_ERROR) {
+        ++sniffer->error_count;
+    }
+}
+
+/* Private: Returns the request a response from the session's ECU answers -
+ * its own if the tester asked it last, otherwise a functional request it
+ * hasn't answered yet - or NULL.
+ */
+static DiagnosticSnifferRequest* find_request(DiagnosticSniffer* sniffer,
+        DiagnosticSnifferSession* session, uint32_t arbitration_id) {
+    DiagnosticSnifferRequest* physical = &session->request;
+    DiagnosticSnifferRequest* functional = &sniffer->functional_requests[
+            arbitration_id > CAN_STANDARD_ID_MASK];
+    if(functional->pending && functional->sequence !=
+                session->answered_functional_sequence &&
+            (!physical->pending ||
+                functional->sequence > physical->sequence)) {
+        // each ECU answers a functional request once, so it gets a copy
+        *physical = *functional;
+        session->answered_functional_sequence = functional->sequence;
+    }
+    return physical->pending ? physical : NULL;
+}
+
+static void complete_transaction(DiagnosticSniffer* sniffer,
+        DiagnosticSnifferTransaction* transaction) {
+    if(sniffer->transaction_completed != NULL) {
+        sniffer->transaction_completed(sniffer, transaction);
+    }
+}
+
+/* Private: Decode a response nobody was seen asking for, as if it answered
+ * the mode and PID it claims to.
+ */
+static void receive_unsolicited_response(DiagnosticSniffer* sniffer,
+        DiagnosticShims* shims, uint32_t arbitration_id,
+        const uint8_t payload[], uint16_t size, bool multi_frame,
+        uint64_t timestamp_us) {
+    uint8_t mode = payload[0] == NEGATIVE_RESPONSE_MODE ?
+            (size > 1 ? payload[1] : 0) : payload[0] - MODE_RESPONSE_OFFSET;
+    uint8_t request_message[3] = {mode};
+    uint16_t request_size = 1;
+    if(payload[0] != NEGATIVE_RESPONSE_MODE) {
+        uint8_t pid_length = pid_length_for_mode(mode);
+        if(pid_length > 0 && size > pid_length) {
+            memcpy(&request_message[1], &payload[1], pid_length);
+            request_size += pid_length;
+        }
+    }
+
+    DiagnosticRequest request = decode_request(arbitration_id,
+            request_message, request_size, false);
+    DiagnosticRequestHandle handle = generate_diagnostic_request(shims,
+            &request, NULL);
+    DiagnosticSnifferTransaction transaction = {
+        has_request: false,
+        request: request,
+        response: diagnostic_receive_pdu(shims, &handle, arbitration_id,
+                payload, size),
+        response_time_us: timestamp_us
+    };
+    transaction.response.multi_frame = multi_frame;
+    ++sniffer->unsolicited_response_count;
+    complete_transaction(sniffer, &transaction);
+}
+
+static void receive_response(DiagnosticSniffer* sniffer,
+        DiagnosticShims* shims, uint16_t node, uint32_t arbitration_id,
+        const uint8_t data[], uint8_t size, uint64_t timestamp_us) {
+    DiagnosticSnifferSession* session = find_session(sniffer, node);
+    session->last_frame_time_us = timestamp_us;
+
+    DiagnosticTransportConfig config = {0};
+    const uint8_t* payload = NULL;
+    uint16_t payload_size = 0;
+    DiagnosticTransportStatus status = diagnostic_transport_receive(shims,
+            &config, &session->response_receiver, session->response_buffer,
+            sizeof(session->response_buffer), 0, arbitration_id, data, size,
+            &payload, &payload_size);
+    if(status == DIAGNOSTIC_TRANSPORT_ERROR) {
+        ++sniffer->error_count;
+        return;
+    } else if(status != DIAGNOSTIC_TRANSPORT_COMPLETED || payload_size == 0) {
+        return;
+    }
+
+    bool multi_frame = payload == session->response_buffer;
+    DiagnosticSnifferRequest* request = find_request(sniffer, session,
+            arbitration_id);
+    if(request != NULL) {
+        DiagnosticResponse response = diagnostic_receive_pdu(shims,
+                &request->handle, arbitration_id, payload, payload_size);
+        response.multi_frame = multi_frame;
+        if(response.completed) {
+            request->pending = false;
+            ++sniffer->transaction_count;
+            DiagnosticSnifferTransaction transaction = {
+                has_request: true,
+                request: request->handle.request,
+                response: response,
+                request_time_us: request->request_time_us,
+                response_time_us: timestamp_us
+            };
+            complete_transaction(sniffer, &transaction);
+            return;
+        } else if(response.negative_response_code == NRC_RESPONSE_PENDING) {
+            return;
+        }
+    }
+    receive_unsolicited_response(sniffer, shims, arbitration_id, payload,
+            payload_size, multi_frame, timestamp_us);
+}
+
+bool diagnostic_sniffer_receive_can_frame(DiagnosticSniffer* sniffer,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        uint64_t timestamp_us) {
+    uint16_t node = 0;
+    FrameKind kind = classify_frame(sniffer, arbitration_id, &node);
+    if(kind == FRAME_OTHER) {
+        return false;
+    }
+
+    ++sniffer->frame_count;
+    DiagnosticShims shims = diagnostic_init_shims(sniffer->log,
+            discard_can_frame, NULL);
+    if(kind == FRAME_RESPONSE) {
+        receive_response(sniffer, &shims, node, arbitration_id, data, size,
+                timestamp_us);
+    } else {
+        receive_request(sniffer, &shims, kind, node, arbitration_id, data,
+                size, timestamp_us);
+    }
+    return true;
+}
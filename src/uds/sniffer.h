@@ -0,0 +1,148 @@
+#ifndef __SNIFFER_H__
+#define __SNIFFER_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of ECUs followed at once, the least recently active one is
+// forgotten to follow another.
+#ifndef MAX_SNIFFER_SESSIONS
+#define MAX_SNIFFER_SESSIONS 16
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Decodes diagnostic traffic between someone else's tester and the ECUs, e.g.
+ * from a monitoring box on the bus next to a scan tool. The sniffer never
+ * sends anything: it reassembles the ISO-TP messages in both directions,
+ * pairs every response with the request it answers and decodes it exactly
+ * like a response to a request of our own.
+ *
+ * Traffic is recognized on the OBD-II and UDS diagnostic IDs - requests on
+ * 0x7df and 0x7e0 to 0x7e7 with their responses on 0x7e8 to 0x7ef, and 29-bit
+ * normal fixed IDs to and from the tester's address.
+ */
+
+typedef struct DiagnosticSniffer DiagnosticSniffer;
+
+/* Public: A response seen on the bus and the request it answers.
+ *
+ * has_request - false if no request was seen for the response, e.g. because
+ *      sniffing started in between. The response is still decoded, with the
+ *      mode and PID it claims to answer.
+ * request - The request, as the tester would have built it. Its
+ *      large_payload holds everything after the mode and PID, and is only
+ *      valid inside the callback.
+ * response - The decoded response, as diagnostic_receive_pdu(...) returned
+ *      it. Its full_payload is only valid inside the callback.
+ * request_time_us - The timestamp of the last frame of the request.
+ * response_time_us - The timestamp of the last frame of the response.
+ */
+typedef struct {
+    bool has_request;
+    DiagnosticRequest request;
+    DiagnosticResponse response;
+    uint64_t request_time_us;
+    uint64_t response_time_us;
+} DiagnosticSnifferTransaction;
+
+/* Public: Called for every complete response - "response pending" negative
+ * responses excepted, they only mean the real response will follow.
+ */
+typedef void (*DiagnosticSnifferTransactionCompleted)(
+        DiagnosticSniffer* sniffer,
+        const DiagnosticSnifferTransaction* transaction);
+
+/* Private: A request waiting for its response.
+ *
+ * sequence - The request's number in the order requests were seen, which
+ *      tells which of two requests came last even with equal timestamps.
+ */
+typedef struct {
+    bool pending;
+    uint64_t sequence;
+    uint64_t request_time_us;
+    DiagnosticRequestHandle handle;
+} DiagnosticSnifferRequest;
+
+/* Private: The traffic between the tester and one ECU.
+ *
+ * node - The ECU: its offset from 0x7e0 for 11-bit IDs, 0x100 plus its
+ *      address for 29-bit IDs.
+ */
+typedef struct {
+    bool active;
+    uint16_t node;
+    uint64_t last_frame_time_us;
+    uint64_t answered_functional_sequence;
+    bool request_can_fd;
+    DiagnosticSnifferRequest request;
+    DiagnosticTransportReceiver request_receiver;
+    DiagnosticTransportReceiver response_receiver;
+    uint8_t request_buffer[MAX_DIAGNOSTIC_REQUEST_SIZE];
+    uint8_t response_buffer[MAX_DIAGNOSTIC_REQUEST_SIZE];
+} DiagnosticSnifferSession;
+
+/* Public: A passive observer of diagnostic traffic. Initialize it with
+ * diagnostic_init_sniffer(...) and set the optional fields before the first
+ * frame. It's about 140KB with the default MAX_SNIFFER_SESSIONS, so don't
+ * put it on a small stack.
+ *
+ * tester_address - The address of the tester for 29-bit IDs,
+ *      OBD2_EXTERNAL_TEST_EQUIPMENT_ADDRESS by default.
+ * transaction_completed - (optional) Called for every complete response.
+ * log - (optional) A log shim for the library's messages.
+ * context - (optional) Anything the callback needs.
+ * frame_count - The number of diagnostic frames seen so far.
+ * request_count - The number of complete requests seen so far.
+ * transaction_count - The number of responses paired with a request so far.
+ * unsolicited_response_count - The number of responses without a request.
+ * error_count - The number of messages lost to malformed frames or sequence
+ *      errors.
+ *
+ * The other fields are private.
+ */
+struct DiagnosticSniffer {
+    uint8_t tester_address;
+    DiagnosticSnifferTransactionCompleted transaction_completed;
+    LogShim log;
+    void* context;
+    uint64_t frame_count;
+    uint64_t request_count;
+    uint64_t transaction_count;
+    uint64_t unsolicited_response_count;
+    uint64_t error_count;
+
+    // Private
+    // one for 11-bit and one for 29-bit IDs
+    DiagnosticSnifferRequest functional_requests[2];
+    uint8_t functional_payloads[2][CAN_FD_MESSAGE_BYTE_SIZE];
+    DiagnosticSnifferSession sessions[MAX_SNIFFER_SESSIONS];
+};
+
+/* Public: Initialize a sniffer with no sessions.
+ */
+void diagnostic_init_sniffer(DiagnosticSniffer* sniffer);
+
+/* Public: Pass a CAN frame seen on the bus to the sniffer. Frames with more
+ * than 8 bytes are taken to be CAN FD frames.
+ *
+ * arbitration_id - the arbitration ID of the frame.
+ * data - the data of the frame.
+ * size - the size of the frame.
+ * timestamp_us - when the frame was seen, in microseconds since any epoch.
+ *
+ * Returns true if the frame was diagnostic traffic.
+ */
+bool diagnostic_sniffer_receive_can_frame(DiagnosticSniffer* sniffer,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        uint64_t timestamp_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __SNIFFER_H__
@@ -0,0 +1,223 @@
+#include <uds/telemetry.h>
+#include <string.h>
+
+#define MAGIC_0 0x55
+#define MAGIC_1 0x44
+#define MAX_BATCH_RECORDS 0xffff
+#define MAX_VARINT_SIZE 10
+
+#define FLAG_COMPLETED 0x1
+#define FLAG_SUCCESS 0x2
+#define FLAG_MULTI_FRAME 0x4
+#define FLAG_HAS_PID 0x8
+#define FLAG_WIDE_PID 0x10
+#define KNOWN_FLAGS 0x1f
+
+#ifndef MIN
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#endif
+
+static uint64_t zigzag_encode(int64_t value) {
+    return ((uint64_t) value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t zigzag_decode(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static uint8_t* write_varint(uint8_t* destination, uint64_t value) {
+    while(value >= 0x80) {
+        *destination++ = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *destination++ = value;
+    return destination;
+}
+
+static bool read_varint(DiagnosticTelemetryDecoder* decoder,
+        uint64_t* value) {
+    uint64_t result = 0;
+    int shift;
+    for(shift = 0; shift < MAX_VARINT_SIZE * 7 &&
+            decoder->offset < decoder->body_length; shift += 7) {
+        uint8_t byte = decoder->body[decoder->offset++];
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_byte(DiagnosticTelemetryDecoder* decoder, uint8_t* value) {
+    if(decoder->offset >= decoder->body_length) {
+        return false;
+    }
+    *value = decoder->body[decoder->offset++];
+    return true;
+}
+
+bool diagnostic_telemetry_start_batch(DiagnosticTelemetryEncoder* encoder,
+        uint8_t buffer[], uint32_t size) {
+    memset(encoder, 0, sizeof(DiagnosticTelemetryEncoder));
+    if(buffer == NULL || size < DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE) {
+        // left empty, so nothing is ever written to the buffer
+        return false;
+    }
+    encoder->buffer = buffer;
+    encoder->size = size;
+    encoder->length = DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE;
+    return true;
+}
+
+bool diagnostic_telemetry_encode(DiagnosticTelemetryEncoder* encoder,
+        const DiagnosticResponse* response, uint64_t timestamp_us) {
+    const uint8_t* payload = response->payload;
+    uint32_t payload_length = response->payload_length;
+    if(response->full_payload != NULL) {
+        payload = response->full_payload;
+        payload_length = response->full_payload_length;
+    }
+
+    if(encoder->record_count == MAX_BATCH_RECORDS ||
+            encoder->length > encoder->size ||
+            encoder->size - encoder->length <
+                DIAGNOSTIC_TELEMETRY_MAX_RECORD_OVERHEAD + payload_length) {
+        return false;
+    }
+
+    uint8_t* destination = &encoder->buffer[encoder->length];
+    destination = write_varint(destination, zigzag_encode(
+                (int64_t)(timestamp_us - encoder->last_timestamp_us)));
+    destination = write_varint(destination, zigzag_encode(
+                (int64_t) response->arbitration_id -
+                    encoder->last_arbitration_id));
+
+    bool wide_pid = response->has_pid && response->pid > 0xff;
+    *destination++ = (response->completed ? FLAG_COMPLETED : 0) |
+            (response->success ? FLAG_SUCCESS : 0) |
+            (response->multi_frame ? FLAG_MULTI_FRAME : 0) |
+            (response->has_pid ? FLAG_HAS_PID : 0) |
+            (wide_pid ? FLAG_WIDE_PID : 0);
+    *destination++ = response->mode;
+    if(wide_pid) {
+        *destination++ = response->pid >> 8;
+    }
+    if(response->has_pid) {
+        *destination++ = response->pid;
+    }
+    if(!response->success) {
+        *destination++ = response->negative_response_code;
+    }
+    destination = write_varint(destination, payload_length);
+    if(payload_length > 0) {
+        memcpy(destination, payload, payload_length);
+        destination += payload_length;
+    }
+
+    encoder->length = destination - encoder->buffer;
+    ++encoder->record_count;
+    encoder->last_timestamp_us = timestamp_us;
+    encoder->last_arbitration_id = response->arbitration_id;
+    return true;
+}
+
+uint32_t diagnostic_telemetry_finish_batch(
+        DiagnosticTelemetryEncoder* encoder) {
+    if(encoder->length < DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE) {
+        // the buffer was refused
+        return 0;
+    }
+    uint32_t body_length = encoder->length -
+            DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE;
+    uint8_t* header = encoder->buffer;
+    header[0] = MAGIC_0;
+    header[1] = MAGIC_1;
+    header[2] = DIAGNOSTIC_TELEMETRY_VERSION;
+    header[3] = 0;
+    header[4] = encoder->record_count >> 8;
+    header[5] = encoder->record_count;
+    header[6] = body_length >> 24;
+    header[7] = body_length >> 16;
+    header[8] = body_length >> 8;
+    header[9] = body_length;
+    return encoder->length;
+}
+
+uint32_t diagnostic_telemetry_start_decoding(
+        DiagnosticTelemetryDecoder* decoder, const uint8_t data[],
+        uint32_t size) {
+    memset(decoder, 0, sizeof(DiagnosticTelemetryDecoder));
+    if(size < DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE || data[0] != MAGIC_0 ||
+            data[1] != MAGIC_1 || data[2] != DIAGNOSTIC_TELEMETRY_VERSION) {
+        return 0;
+    }
+
+    uint32_t body_length = ((uint32_t) data[6] << 24) |
+            ((uint32_t) data[7] << 16) | ((uint32_t) data[8] << 8) | data[9];
+    if(body_length > size - DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE) {
+        return 0;
+    }
+
+    decoder->record_count = (data[4] << 8) | data[5];
+    decoder->body = &data[DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE];
+    decoder->body_length = body_length;
+    return DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE + body_length;
+}
+
+bool diagnostic_telemetry_decode(DiagnosticTelemetryDecoder* decoder,
+        DiagnosticResponse* response, uint64_t* timestamp_us) {
+    if(decoder->malformed || decoder->body == NULL ||
+            decoder->decoded_count == decoder->record_count) {
+        return false;
+    }
+
+    uint64_t timestamp_delta, arbitration_id_delta, payload_length;
+    uint8_t flags, pid_high = 0, pid_low = 0;
+    memset(response, 0, sizeof(DiagnosticResponse));
+    if(!read_varint(decoder, &timestamp_delta) ||
+            !read_varint(decoder, &arbitration_id_delta) ||
+            !read_byte(decoder, &flags) || (flags & ~KNOWN_FLAGS) ||
+            !read_byte(decoder, &response->mode) ||
+            ((flags & FLAG_WIDE_PID) && !read_byte(decoder, &pid_high)) ||
+            ((flags & FLAG_HAS_PID) && !read_byte(decoder, &pid_low))) {
+        decoder->malformed = true;
+        return false;
+    }
+    if(!(flags & FLAG_SUCCESS)) {
+        uint8_t negative_response_code;
+        if(!read_byte(decoder, &negative_response_code)) {
+            decoder->malformed = true;
+            return false;
+        }
+        response->negative_response_code = negative_response_code;
+    }
+    if(!read_varint(decoder, &payload_length) || payload_length > UINT16_MAX ||
+            payload_length > decoder->body_length - decoder->offset) {
+        decoder->malformed = true;
+        return false;
+    }
+
+    decoder->last_timestamp_us += zigzag_decode(timestamp_delta);
+    decoder->last_arbitration_id += zigzag_decode(arbitration_id_delta);
+    *timestamp_us = decoder->last_timestamp_us;
+
+    response->completed = flags & FLAG_COMPLETED;
+    response->success = flags & FLAG_SUCCESS;
+    response->multi_frame = flags & FLAG_MULTI_FRAME;
+    response->has_pid = flags & FLAG_HAS_PID;
+    response->arbitration_id = decoder->last_arbitration_id;
+    response->pid = (pid_high << 8) | pid_low;
+    if(payload_length > 0) {
+        response->full_payload = &decoder->body[decoder->offset];
+        response->full_payload_length = payload_length;
+        response->payload_length = MIN(MAX_UDS_RESPONSE_PAYLOAD_LENGTH,
+                payload_length);
+        memcpy(response->payload, response->full_payload,
+                response->payload_length);
+    }
+    decoder->offset += payload_length;
+    ++decoder->decoded_count;
+    return true;
+}
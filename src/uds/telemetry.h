@@ -0,0 +1,151 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DIAGNOSTIC_TELEMETRY_VERSION 1
+// magic, version, flags, record count and body length
+#define DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE 10
+// the most a record adds to its payload: timestamp, ID, flags, mode, PID,
+// NRC and payload length
+#define DIAGNOSTIC_TELEMETRY_MAX_RECORD_OVERHEAD 23
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A compact binary encoding of decoded responses, e.g. to upload them in bulk
+ * instead of as diagnostic_response_to_string(...) text.
+ *
+ * Responses are encoded into batches, and a stream is any number of batches
+ * back to back. A batch is a header followed by its records:
+ *
+ *      0x55 0x44 ("UD"), version, flags (0), record count (16-bit big endian),
+ *      body length (32-bit big endian)
+ *
+ * and every record is:
+ *
+ *      varint   timestamp - the previous record's timestamp, zigzag encoded
+ *               (the first record of a batch is relative to 0)
+ *      varint   arbitration ID - the previous record's ID, zigzag encoded
+ *      byte     flags: completed, success, multi-frame, has PID, 2 byte PID
+ *      byte     mode
+ *      1-2 byte PID, if it has one
+ *      byte     negative response code, if it wasn't a success
+ *      varint   payload length
+ *      bytes    payload
+ *
+ * Varints are unsigned LEB128, 7 bits per byte with the least significant
+ * group first. Responses polled from a few ECUs at a steady rate take 1 or 2
+ * bytes each for their timestamp and ID.
+ */
+
+/* Public: The state of one batch being encoded. Start it with
+ * diagnostic_telemetry_start_batch(...).
+ *
+ * buffer - Where the batch is written.
+ * size - The size of the buffer.
+ * length - The number of bytes of the batch written so far.
+ * record_count - The number of records in the batch.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint8_t* buffer;
+    uint32_t size;
+    uint32_t length;
+    uint16_t record_count;
+
+    // Private
+    uint64_t last_timestamp_us;
+    uint32_t last_arbitration_id;
+} DiagnosticTelemetryEncoder;
+
+/* Public: The state of one batch being decoded. Start it with
+ * diagnostic_telemetry_start_decoding(...).
+ *
+ * record_count - The number of records in the batch.
+ * malformed - true if decoding stopped at a truncated or invalid record.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint16_t record_count;
+    bool malformed;
+
+    // Private
+    const uint8_t* body;
+    uint32_t body_length;
+    uint32_t offset;
+    uint16_t decoded_count;
+    uint64_t last_timestamp_us;
+    uint32_t last_arbitration_id;
+} DiagnosticTelemetryDecoder;
+
+/* Public: Start a new batch in a buffer.
+ *
+ * buffer - where to write the batch. It must have room for at least the
+ *      header, DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE bytes.
+ * size - the size of the buffer.
+ *
+ * Returns false if the buffer is too small for the header. Nothing is then
+ * encoded into it and finishing the batch returns 0.
+ */
+bool diagnostic_telemetry_start_batch(DiagnosticTelemetryEncoder* encoder,
+        uint8_t buffer[], uint32_t size);
+
+/* Public: Append a response to the batch. The whole payload is encoded -
+ * the full_payload of a reassembled response if it has one, otherwise
+ * 'payload'.
+ *
+ * timestamp_us - when the response was received, in microseconds since any
+ *      epoch.
+ *
+ * Returns false if the record doesn't fit in the rest of the buffer or the
+ * batch already has 65535 records, in which case the batch is unchanged and
+ * should be finished.
+ */
+bool diagnostic_telemetry_encode(DiagnosticTelemetryEncoder* encoder,
+        const DiagnosticResponse* response, uint64_t timestamp_us);
+
+/* Public: Write the batch header, completing the batch. More records can't be
+ * added afterwards, start a new batch for them.
+ *
+ * Returns the length of the batch in the buffer, or 0 if the buffer was
+ * refused.
+ */
+uint32_t diagnostic_telemetry_finish_batch(
+        DiagnosticTelemetryEncoder* encoder);
+
+/* Public: Start decoding the batch at the start of 'data'.
+ *
+ * data - a batch, possibly followed by more of the stream. It is read in
+ *      place, so it must stay valid while decoding.
+ * size - the number of bytes available in 'data'.
+ *
+ * Returns the length of the batch, i.e. the offset of the next one in the
+ * stream, or 0 if 'data' doesn't start with a whole batch of a known version.
+ */
+uint32_t diagnostic_telemetry_start_decoding(
+        DiagnosticTelemetryDecoder* decoder, const uint8_t data[],
+        uint32_t size);
+
+/* Public: Decode the next response of the batch.
+ *
+ * response - set to the response. Its full_payload points into the batch
+ *      and 'payload' holds as much of it as fits.
+ * timestamp_us - set to the timestamp it was encoded with.
+ *
+ * Returns false after the last record, or if a record is malformed - see the
+ * decoder's 'malformed'.
+ */
+bool diagnostic_telemetry_decode(DiagnosticTelemetryDecoder* decoder,
+        DiagnosticResponse* response, uint64_t* timestamp_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TELEMETRY_H__
@@ -0,0 +1,586 @@
+#include <uds/transport.h>
+#include <uds/uds.h>
+#include <uds/flow_control.h>
+#include <string.h>
+
+#define SINGLE_FRAME_PCI 0x0
+#define FIRST_FRAME_PCI 0x1
+#define CONSECUTIVE_FRAME_PCI 0x2
+#define FLOW_CONTROL_PCI 0x3
+
+#define FLOW_STATUS_CONTINUE 0x0
+#define FLOW_STATUS_WAIT 0x1
+#define FLOW_STATUS_OVERFLOW 0x2
+
+#define CLASSIC_FRAME_LENGTH 8
+#define MAX_CLASSIC_SINGLE_FRAME_SIZE 7
+#define SEQUENCE_NUMBER_MASK 0xf
+#define FIRST_FRAME_HEADER_SIZE 2
+// give up if the receiver keeps asking us to wait
+#define MAX_FLOW_CONTROL_WAITS 16
+
+static const uint8_t CAN_FD_DATA_LENGTHS[] = {12, 16, 20, 24, 32, 48, 64};
+
+uint8_t diagnostic_transport_frame_length(uint8_t size,
+        const DiagnosticTransportConfig* config) {
+    if(size <= CLASSIC_FRAME_LENGTH) {
+        return config->frame_padding ? CLASSIC_FRAME_LENGTH : size;
+    }
+
+    uint8_t i;
+    for(i = 0; i < sizeof(CAN_FD_DATA_LENGTHS) - 1; ++i) {
+        if(size <= CAN_FD_DATA_LENGTHS[i]) {
+            break;
+        }
+    }
+    return CAN_FD_DATA_LENGTHS[i];
+}
+
+uint8_t diagnostic_transport_max_frame_length(
+        const DiagnosticTransportConfig* config) {
+    return config->can_fd ? CAN_FD_MESSAGE_BYTE_SIZE : CLASSIC_FRAME_LENGTH;
+}
+
+static bool send_frame(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config, uint32_t arbitration_id,
+        uint8_t frame[], uint8_t size) {
+    uint8_t length = diagnostic_transport_frame_length(size, config);
+    // the caller's frame buffer is zeroed, so the padding is too
+    return shims->send_can_message(arbitration_id, frame, length);
+}
+
+/* Private: Returns the index of the PCI byte in a frame - the first byte may be
+ * an address.
+ */
+static uint8_t pci_index(const DiagnosticTransportConfig* config) {
+    return config->has_address_extension ? 1 : 0;
+}
+
+static void send_flow_control(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config, uint32_t arbitration_id,
+        uint8_t flow_status) {
+    uint8_t frame[CLASSIC_FRAME_LENGTH] = {0};
+    uint8_t index = pci_index(config);
+    frame[0] = config->address_extension;
+    frame[index] = (FLOW_CONTROL_PCI << 4) | flow_status;
+    frame[index + 1] = config->block_size;
+    frame[index + 2] = config->separation_time;
+    send_frame(shims, config, arbitration_id, frame, index + 3);
+}
+
+uint8_t diagnostic_transport_encode_single_frame(
+        const DiagnosticTransportConfig* config, const uint8_t payload[],
+        uint16_t size, uint8_t frame[]) {
+    uint8_t max_length = diagnostic_transport_max_frame_length(config);
+    uint8_t index = pci_index(config);
+    uint8_t length;
+    memset(frame, 0, max_length);
+    frame[0] = config->address_extension;
+    if(size <= MAX_CLASSIC_SINGLE_FRAME_SIZE - index) {
+        frame[index] = (SINGLE_FRAME_PCI << 4) | size;
+        memcpy(&frame[index + 1], payload, size);
+        length = index + 1 + size;
+    } else if(config->can_fd && size <= max_length - 2 - index) {
+        // escape sequence - the length doesn't fit in the PCI nibble
+        frame[index] = SINGLE_FRAME_PCI << 4;
+        frame[index + 1] = size;
+        memcpy(&frame[index + 2], payload, size);
+        length = index + 2 + size;
+    } else {
+        return 0;
+    }
+    return diagnostic_transport_frame_length(length, config);
+}
+
+bool diagnostic_transport_send_single_frame(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config, uint32_t arbitration_id,
+        const uint8_t payload[], uint16_t size) {
+    uint8_t frame[CAN_FD_MESSAGE_BYTE_SIZE];
+    uint8_t length = diagnostic_transport_encode_single_frame(config, payload,
+            size, frame);
+    return length > 0 &&
+        shims->send_can_message(arbitration_id, frame, length);
+}
+
+/* Private: Copy part of the message being sent, which is split between the
+ * sender's header and the caller's body.
+ */
+static void copy_message(const DiagnosticTransportSender* sender,
+        uint16_t offset, uint8_t destination[], uint16_t size) {
+    if(offset < sender->header_size) {
+        uint16_t from_header = sender->header_size - offset;
+        if(from_header > size) {
+            from_header = size;
+        }
+        memcpy(destination, &sender->header[offset], from_header);
+        destination += from_header;
+        size -= from_header;
+        offset += from_header;
+    }
+
+    if(size > 0) {
+        memcpy(destination, &sender->body[offset - sender->header_size], size);
+    }
+}
+
+static uint16_t message_size(const DiagnosticTransportSender* sender) {
+    return sender->header_size + sender->body_size;
+}
+
+DiagnosticTransportStatus diagnostic_transport_send(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender, uint32_t arbitration_id,
+        const uint8_t header[], uint8_t header_size, const uint8_t body[],
+        uint16_t body_size) {
+    sender->active = false;
+    if(header_size > sizeof(sender->header) ||
+            header_size + body_size > MAX_DIAGNOSTIC_REQUEST_SIZE) {
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    memcpy(sender->header, header, header_size);
+    sender->header_size = header_size;
+    sender->body = body;
+    sender->body_size = body_size;
+    sender->arbitration_id = arbitration_id;
+
+    uint16_t size = message_size(sender);
+    uint8_t frame[CAN_FD_MESSAGE_BYTE_SIZE] = {0};
+    uint8_t max_length = diagnostic_transport_max_frame_length(config);
+    uint8_t index = pci_index(config);
+    uint8_t single_frame_capacity = max_length - index - (config->can_fd ?
+            2 : 1);
+    if(size <= single_frame_capacity) {
+        // the single frame gathers from both parts
+        uint8_t message[CAN_FD_MESSAGE_BYTE_SIZE];
+        copy_message(sender, 0, message, size);
+        return diagnostic_transport_send_single_frame(shims, config,
+                arbitration_id, message, size) ?
+            DIAGNOSTIC_TRANSPORT_COMPLETED : DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    uint8_t capacity = max_length - index - FIRST_FRAME_HEADER_SIZE;
+    frame[0] = config->address_extension;
+    frame[index] = (FIRST_FRAME_PCI << 4) | (size >> 8);
+    frame[index + 1] = size & 0xff;
+    copy_message(sender, 0, &frame[index + FIRST_FRAME_HEADER_SIZE], capacity);
+    if(!send_frame(shims, config, arbitration_id, frame, max_length)) {
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    sender->active = true;
+    sender->waiting_for_flow_control = true;
+    if(shims->get_time_us != NULL) {
+        sender->last_frame_time_us = shims->get_time_us();
+    }
+    sender->sent_size = capacity;
+    sender->next_sequence = 1;
+    sender->wait_count = 0;
+    return DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+}
+
+DiagnosticTransportStatus diagnostic_transport_send_in_place(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender, uint32_t arbitration_id,
+        uint8_t buffer[], uint16_t buffer_size, uint16_t size) {
+    uint8_t* message = &buffer[DIAGNOSTIC_TRANSPORT_HEADROOM];
+    uint8_t index = pci_index(config);
+    uint8_t max_length = diagnostic_transport_max_frame_length(config);
+    uint8_t pci_size;
+    if(size <= MAX_CLASSIC_SINGLE_FRAME_SIZE - index) {
+        pci_size = 1;
+    } else if(config->can_fd && size <= max_length - 2 - index) {
+        pci_size = 2;
+    } else {
+        sender->active = false;
+        return diagnostic_transport_send(shims, config, sender,
+                arbitration_id, NULL, 0, message, size);
+    }
+
+    uint8_t* frame = message - pci_size - index;
+    uint8_t length = diagnostic_transport_frame_length(
+            index + pci_size + size, config);
+    if(frame + length > buffer + buffer_size) {
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    frame[0] = config->address_extension;
+    if(pci_size == 1) {
+        frame[index] = (SINGLE_FRAME_PCI << 4) | size;
+    } else {
+        frame[index] = SINGLE_FRAME_PCI << 4;
+        frame[index + 1] = size;
+    }
+    memset(&message[size], 0, length - (index + pci_size + size));
+    return shims->send_can_message(arbitration_id, frame, length) ?
+        DIAGNOSTIC_TRANSPORT_COMPLETED : DIAGNOSTIC_TRANSPORT_ERROR;
+}
+
+static DiagnosticTransportStatus send_consecutive_frame(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender) {
+    uint8_t frame[CAN_FD_MESSAGE_BYTE_SIZE] = {0};
+    uint8_t index = pci_index(config);
+    uint16_t size = diagnostic_transport_max_frame_length(config) - index - 1;
+    uint16_t remaining = message_size(sender) - sender->sent_size;
+    if(size > remaining) {
+        size = remaining;
+    }
+
+    frame[0] = config->address_extension;
+    frame[index] = (CONSECUTIVE_FRAME_PCI << 4) | sender->next_sequence;
+    copy_message(sender, sender->sent_size, &frame[index + 1], size);
+    if(!send_frame(shims, config, sender->arbitration_id, frame,
+                index + 1 + size)) {
+        sender->active = false;
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    sender->sent_size += size;
+    sender->next_sequence = (sender->next_sequence + 1) & SEQUENCE_NUMBER_MASK;
+    if(shims->get_time_us != NULL) {
+        sender->last_frame_time_us = shims->get_time_us();
+    }
+
+    if(sender->sent_size >= message_size(sender)) {
+        sender->active = false;
+        return DIAGNOSTIC_TRANSPORT_COMPLETED;
+    }
+
+    if(sender->block_size != 0 && --sender->block_remaining == 0) {
+        sender->waiting_for_flow_control = true;
+    }
+    return DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+}
+
+DiagnosticTransportStatus diagnostic_transport_continue_send(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender, const uint8_t data[],
+        uint8_t size) {
+    if(config->has_address_extension) {
+        if(size < 1 || data[0] != config->response_address_extension) {
+            return DIAGNOSTIC_TRANSPORT_IGNORED;
+        }
+        ++data;
+        --size;
+    }
+
+    if(!sender->active || !sender->waiting_for_flow_control || size < 3 ||
+            (data[0] >> 4) != FLOW_CONTROL_PCI) {
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    switch(data[0] & 0xf) {
+        case FLOW_STATUS_CONTINUE:
+            break;
+        case FLOW_STATUS_WAIT:
+            if(++sender->wait_count > MAX_FLOW_CONTROL_WAITS) {
+                if(shims->log != NULL) {
+                    shims->log("Too many flow control waits from the receiver "
+                            "of 0x%x, aborting", sender->arbitration_id);
+                }
+                sender->active = false;
+                return DIAGNOSTIC_TRANSPORT_ERROR;
+            }
+            // a wait restarts the flow control timeout
+            if(shims->get_time_us != NULL) {
+                sender->last_frame_time_us = shims->get_time_us();
+            }
+            return DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+        default:
+            if(shims->log != NULL) {
+                shims->log("Receiver of 0x%x aborted the message with flow "
+                        "status 0x%x", sender->arbitration_id, data[0] & 0xf);
+            }
+            sender->active = false;
+            return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    sender->waiting_for_flow_control = false;
+    sender->wait_count = 0;
+    sender->block_size = data[1];
+    sender->block_remaining = data[1];
+    sender->separation_time_us = diagnostic_decode_separation_time(data[2]);
+
+    DiagnosticTransportStatus status;
+    do {
+        status = send_consecutive_frame(shims, config, sender);
+    } while(status == DIAGNOSTIC_TRANSPORT_IN_PROGRESS &&
+            !sender->waiting_for_flow_control &&
+            sender->separation_time_us == 0);
+    return status;
+}
+
+DiagnosticTransportStatus diagnostic_transport_poll_send(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender) {
+    if(!sender->active) {
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    if(sender->waiting_for_flow_control) {
+        if(shims->get_time_us == NULL || shims->get_time_us() -
+                sender->last_frame_time_us <
+                DIAGNOSTIC_TRANSPORT_FLOW_CONTROL_TIMEOUT_US) {
+            return DIAGNOSTIC_TRANSPORT_IGNORED;
+        }
+        if(shims->log != NULL) {
+            shims->log("Timed out waiting for flow control from the receiver "
+                    "of 0x%x, aborting", sender->arbitration_id);
+        }
+        sender->active = false;
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    if(shims->get_time_us != NULL && shims->get_time_us() -
+            sender->last_frame_time_us < sender->separation_time_us) {
+        return DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+    }
+    return send_consecutive_frame(shims, config, sender);
+}
+
+void diagnostic_transport_next_deadline(const DiagnosticTransportSender* sender,
+        uint32_t now_us, DiagnosticDeadline* deadline) {
+    if(!sender->active) {
+        return;
+    }
+    diagnostic_add_deadline(deadline, now_us, sender->last_frame_time_us,
+            sender->waiting_for_flow_control ?
+                DIAGNOSTIC_TRANSPORT_FLOW_CONTROL_TIMEOUT_US :
+                sender->separation_time_us);
+}
+
+static DiagnosticTransportStatus receive_single_frame(DiagnosticShims* shims,
+        DiagnosticTransportReceiver* receiver, uint32_t arbitration_id,
+        const uint8_t data[], uint8_t size, const uint8_t** payload,
+        uint16_t* payload_size) {
+    uint8_t offset = 1;
+    uint16_t length = data[0] & 0xf;
+    if(length == 0 && size > 1) {
+        length = data[1];
+        offset = 2;
+    }
+
+    if(length == 0 || offset + length > size) {
+        if(shims->log != NULL) {
+            shims->log("Malformed single frame on arb ID 0x%x",
+                    arbitration_id);
+        }
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    if(receiver->active && receiver->arbitration_id == arbitration_id) {
+        // a new message from the same node replaces the one in progress
+        receiver->active = false;
+    }
+
+    *payload = &data[offset];
+    *payload_size = length;
+    return DIAGNOSTIC_TRANSPORT_COMPLETED;
+}
+
+/* Private: Send the flow control frame that starts the next block - or, if
+ * the receiver is to hold the sender, a WAIT.
+ */
+static void continue_or_hold(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint32_t flow_control_id) {
+    if(!receiver->hold ||
+            receiver->wait_count >= DIAGNOSTIC_TRANSPORT_MAX_HOLD_WAITS) {
+        receiver->holding = false;
+        send_flow_control(shims, config, flow_control_id,
+                FLOW_STATUS_CONTINUE);
+        return;
+    }
+
+    receiver->holding = true;
+    ++receiver->wait_count;
+    if(shims->get_time_us != NULL) {
+        receiver->wait_sent_us = shims->get_time_us();
+    }
+    send_flow_control(shims, config, flow_control_id, FLOW_STATUS_WAIT);
+}
+
+static DiagnosticTransportStatus receive_first_frame(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint8_t buffer[],
+        uint16_t buffer_size, uint32_t flow_control_id,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size) {
+    if(size < 2) {
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    uint8_t offset = 2;
+    uint32_t length = ((data[0] & 0xf) << 8) | data[1];
+    if(length == 0 && size >= 6) {
+        // escape sequence for messages longer than 4095 bytes
+        length = ((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) |
+                ((uint32_t)data[4] << 8) | data[5];
+        offset = 6;
+    }
+
+    if(receiver->active && receiver->arbitration_id != arbitration_id) {
+        if(shims->log != NULL) {
+            shims->log("Ignoring multi-frame message from 0x%x, already "
+                    "receiving from 0x%x", arbitration_id,
+                    receiver->arbitration_id);
+        }
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    if(buffer == NULL || length > buffer_size || offset >= size) {
+        if(shims->log != NULL) {
+            shims->log("Multi-frame message of %u bytes from 0x%x doesn't fit "
+                    "the receive buffer", (unsigned) length, arbitration_id);
+        }
+        receiver->active = false;
+        send_flow_control(shims, config, flow_control_id,
+                FLOW_STATUS_OVERFLOW);
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    uint16_t copied = size - offset;
+    if(copied > length) {
+        copied = length;
+    }
+    memcpy(buffer, &data[offset], copied);
+
+    receiver->active = true;
+    receiver->overrun = false;
+    receiver->arbitration_id = arbitration_id;
+    receiver->expected_size = length;
+    receiver->received_size = copied;
+    receiver->next_sequence = 1;
+    receiver->block_remaining = config->block_size;
+    receiver->frame_interval_total_us = 0;
+    receiver->frame_interval_count = 0;
+    receiver->last_frame_time_us = 0;
+    receiver->wait_count = 0;
+
+    continue_or_hold(shims, config, receiver, flow_control_id);
+    return DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+}
+
+/* Private: Accumulate the gap since the previous consecutive frame of the same
+ * block. The gap after a flow control frame includes its round trip, so it's
+ * left out - last_frame_time_us is reset to 0 whenever one is sent.
+ */
+static void measure_frame_interval(DiagnosticShims* shims,
+        DiagnosticTransportReceiver* receiver) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    if(receiver->last_frame_time_us != 0) {
+        receiver->frame_interval_total_us += now -
+                receiver->last_frame_time_us;
+        ++receiver->frame_interval_count;
+    }
+    // 0 means unset, it's a 1us error at worst
+    receiver->last_frame_time_us = now == 0 ? 1 : now;
+}
+
+static DiagnosticTransportStatus receive_consecutive_frame(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint8_t buffer[],
+        uint32_t flow_control_id, uint32_t arbitration_id,
+        const uint8_t data[], uint8_t size, const uint8_t** payload,
+        uint16_t* payload_size) {
+    if(!receiver->active || receiver->arbitration_id != arbitration_id) {
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    receiver->holding = false;
+    if((data[0] & SEQUENCE_NUMBER_MASK) != receiver->next_sequence) {
+        if(shims->log != NULL) {
+            shims->log("Expected consecutive frame %u from 0x%x but got %u, "
+                    "aborting", receiver->next_sequence, arbitration_id,
+                    data[0] & SEQUENCE_NUMBER_MASK);
+        }
+        receiver->active = false;
+        receiver->overrun = true;
+        return DIAGNOSTIC_TRANSPORT_ERROR;
+    }
+
+    measure_frame_interval(shims, receiver);
+
+    uint16_t remaining = receiver->expected_size - receiver->received_size;
+    uint16_t copied = size - 1;
+    if(copied > remaining) {
+        copied = remaining;
+    }
+    memcpy(&buffer[receiver->received_size], &data[1], copied);
+    receiver->received_size += copied;
+    receiver->next_sequence = (receiver->next_sequence + 1) &
+            SEQUENCE_NUMBER_MASK;
+
+    if(receiver->received_size < receiver->expected_size) {
+        if(config->block_size != 0 && --receiver->block_remaining == 0) {
+            receiver->block_remaining = config->block_size;
+            receiver->last_frame_time_us = 0;
+            continue_or_hold(shims, config, receiver, flow_control_id);
+        }
+        return DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+    }
+
+    receiver->active = false;
+    *payload = buffer;
+    *payload_size = receiver->expected_size;
+    return DIAGNOSTIC_TRANSPORT_COMPLETED;
+}
+
+DiagnosticTransportStatus diagnostic_transport_receive(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint8_t buffer[],
+        uint16_t buffer_size, uint32_t flow_control_id,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        const uint8_t** payload, uint16_t* payload_size) {
+    if(config->has_address_extension) {
+        if(size < 1 || data[0] != config->response_address_extension) {
+            return DIAGNOSTIC_TRANSPORT_IGNORED;
+        }
+        ++data;
+        --size;
+    }
+
+    if(size < 1) {
+        return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+
+    switch(data[0] >> 4) {
+        case SINGLE_FRAME_PCI:
+            return receive_single_frame(shims, receiver, arbitration_id, data,
+                    size, payload, payload_size);
+        case FIRST_FRAME_PCI:
+            return receive_first_frame(shims, config, receiver, buffer,
+                    buffer_size, flow_control_id, arbitration_id, data, size);
+        case CONSECUTIVE_FRAME_PCI:
+            return receive_consecutive_frame(shims, config, receiver, buffer,
+                    flow_control_id, arbitration_id, data, size, payload,
+                    payload_size);
+        default:
+            return DIAGNOSTIC_TRANSPORT_IGNORED;
+    }
+}
+
+void diagnostic_transport_release_receive(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint32_t flow_control_id) {
+    receiver->hold = false;
+    if(receiver->active && receiver->holding) {
+        continue_or_hold(shims, config, receiver, flow_control_id);
+    }
+}
+
+void diagnostic_transport_poll_receive(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint32_t flow_control_id) {
+    if(!receiver->active || !receiver->holding ||
+            shims->get_time_us == NULL ||
+            shims->get_time_us() - receiver->wait_sent_us <
+                DIAGNOSTIC_TRANSPORT_HOLD_INTERVAL_US) {
+        return;
+    }
+    continue_or_hold(shims, config, receiver, flow_control_id);
+}
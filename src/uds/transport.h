@@ -0,0 +1,224 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <uds/uds_types.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Private: The library's own ISO-TP (ISO 15765-2) framing, used for the cases
+ * isotp-c doesn't cover, e.g. CAN FD. Requests that can use isotp-c still do.
+ */
+
+/* Private: The bytes to reserve in front of a message to send it in place
+ * with diagnostic_transport_send_in_place - an address extension and a CAN FD
+ * single frame escape sequence.
+ */
+#define DIAGNOSTIC_TRANSPORT_HEADROOM 3
+
+/* Private: How long a sender waits for a flow control frame before giving up on
+ * the message (ISO 15765-2's N_Bs timeout).
+ */
+#define DIAGNOSTIC_TRANSPORT_FLOW_CONTROL_TIMEOUT_US 1000000
+
+/* Private: The link layer settings for one ISO-TP connection.
+ *
+ * can_fd - true if frames of up to 64 bytes may be sent and received.
+ * frame_padding - true if frames should be padded out to 8 bytes. CAN FD frames
+ *      longer than 8 bytes are always padded to the next valid data length.
+ * has_address_extension - true for extended and mixed addressing, where the
+ *      first byte of every frame is an address, not protocol data.
+ * address_extension - The first byte of every sent frame.
+ * response_address_extension - The first byte of every frame to receive, other
+ *      frames are ignored.
+ * block_size - The block size to send in flow control frames.
+ * separation_time - The encoded STmin to send in flow control frames.
+ */
+typedef struct {
+    bool can_fd;
+    bool frame_padding;
+    bool has_address_extension;
+    uint8_t address_extension;
+    uint8_t response_address_extension;
+    uint8_t block_size;
+    uint8_t separation_time;
+} DiagnosticTransportConfig;
+
+/* Private: The result of passing a CAN frame to
+ * diagnostic_transport_receive(...).
+ */
+typedef enum {
+    DIAGNOSTIC_TRANSPORT_IGNORED,
+    DIAGNOSTIC_TRANSPORT_IN_PROGRESS,
+    DIAGNOSTIC_TRANSPORT_COMPLETED,
+    DIAGNOSTIC_TRANSPORT_ERROR
+} DiagnosticTransportStatus;
+
+/* Private: Returns the length of the CAN frame to send for 'size' bytes of
+ * data, rounding up to the next valid CAN FD data length (12, 16, 20, 24, 32,
+ * 48 or 64) or to 8 bytes if padding is enabled.
+ */
+uint8_t diagnostic_transport_frame_length(uint8_t size,
+        const DiagnosticTransportConfig* config);
+
+/* Private: Returns the largest CAN frame the connection may send - 8 bytes for
+ * classic CAN and 64 for CAN FD.
+ */
+uint8_t diagnostic_transport_max_frame_length(
+        const DiagnosticTransportConfig* config);
+
+/* Private: Build the CAN frame for an ISO-TP message that fits in a single
+ * frame, padded as it would be sent.
+ *
+ * frame - the frame to build, with room for
+ *      diagnostic_transport_max_frame_length(config) bytes.
+ *
+ * Returns the length of the frame, or 0 if the payload doesn't fit in a single
+ * frame.
+ */
+uint8_t diagnostic_transport_encode_single_frame(
+        const DiagnosticTransportConfig* config, const uint8_t payload[],
+        uint16_t size, uint8_t frame[]);
+
+/* Private: Send an ISO-TP message that fits in a single frame. CAN FD single
+ * frames with more than 7 bytes of payload use the escape sequence (a 0 length
+ * nibble followed by a full length byte).
+ *
+ * Returns false if the payload doesn't fit in a single frame or the frame
+ * couldn't be sent.
+ */
+bool diagnostic_transport_send_single_frame(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config, uint32_t arbitration_id,
+        const uint8_t payload[], uint16_t size);
+
+/* Private: Start sending an ISO-TP message made of a header followed by a body.
+ * If it fits in a single frame it's sent right away, otherwise the first frame
+ * is sent and the rest waits for flow control from the receiver.
+ *
+ * sender - the state for the message, which keeps pointing at 'body' until the
+ *      message is completely sent.
+ * header - up to MAX_DIAGNOSTIC_REQUEST_HEADER_SIZE bytes, copied.
+ * body - the rest of the message, not copied. May be NULL if body_size is 0.
+ *
+ * Returns DIAGNOSTIC_TRANSPORT_COMPLETED if the message was sent as a single
+ * frame, DIAGNOSTIC_TRANSPORT_IN_PROGRESS if a first frame was sent or
+ * DIAGNOSTIC_TRANSPORT_ERROR if it couldn't be sent.
+ */
+DiagnosticTransportStatus diagnostic_transport_send(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender, uint32_t arbitration_id,
+        const uint8_t header[], uint8_t header_size, const uint8_t body[],
+        uint16_t body_size);
+
+/* Private: Start sending a message that was written straight into a transmit
+ * buffer, without copying it again. A single frame is built around the
+ * message in place, so the buffer must have DIAGNOSTIC_TRANSPORT_HEADROOM bytes
+ * in front of the message and room for a whole frame; longer messages are sent
+ * from the buffer as the body of a multi-frame message.
+ *
+ * buffer - the transmit buffer, with the message at
+ *      buffer[DIAGNOSTIC_TRANSPORT_HEADROOM].
+ * buffer_size - the size of the whole buffer.
+ * size - the size of the message.
+ *
+ * Returns the same as diagnostic_transport_send.
+ */
+DiagnosticTransportStatus diagnostic_transport_send_in_place(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender, uint32_t arbitration_id,
+        uint8_t buffer[], uint16_t buffer_size, uint16_t size);
+
+/* Private: Continue sending a multi-frame message with a received CAN frame,
+ * which should be a flow control frame from the receiver. Consecutive frames
+ * are sent as allowed by its block size, and immediately if its separation
+ * time is 0 - otherwise one at a time from diagnostic_transport_poll_send.
+ *
+ * Returns DIAGNOSTIC_TRANSPORT_IGNORED if the frame isn't flow control,
+ * DIAGNOSTIC_TRANSPORT_COMPLETED once the last frame is sent and
+ * DIAGNOSTIC_TRANSPORT_ERROR if the receiver aborted the message.
+ */
+DiagnosticTransportStatus diagnostic_transport_continue_send(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender, const uint8_t data[],
+        uint8_t size);
+
+/* Private: Send the next consecutive frame of a message paced by a separation
+ * time, if it's due. Without the get_time_us shim, every call sends a frame.
+ * With it, a message that has waited
+ * DIAGNOSTIC_TRANSPORT_FLOW_CONTROL_TIMEOUT_US for flow control is aborted.
+ *
+ * Returns the same as diagnostic_transport_continue_send, or
+ * DIAGNOSTIC_TRANSPORT_IGNORED if nothing is being sent.
+ */
+DiagnosticTransportStatus diagnostic_transport_poll_send(
+        DiagnosticShims* shims, const DiagnosticTransportConfig* config,
+        DiagnosticTransportSender* sender);
+
+/* Private: How often a held sender is sent another WAIT flow control frame,
+ * well within the 1 second it waits for flow control (N_Bs).
+ */
+#define DIAGNOSTIC_TRANSPORT_HOLD_INTERVAL_US 500000
+
+/* Private: The most WAIT flow control frames sent to hold one sender, which
+ * is released after that so it doesn't give up on the message.
+ */
+#define DIAGNOSTIC_TRANSPORT_MAX_HOLD_WAITS 8
+
+/* Private: Add the next time diagnostic_transport_poll_send has something to
+ * do - send a consecutive frame, or abort a message still waiting for flow
+ * control - to a deadline. Does nothing if nothing is being sent.
+ */
+void diagnostic_transport_next_deadline(const DiagnosticTransportSender* sender,
+        uint32_t now_us, DiagnosticDeadline* deadline);
+
+/* Private: Continue receiving an ISO-TP message with a freshly received CAN
+ * frame, sending flow control frames as required.
+ *
+ * receiver - the reassembly state, zero-initialized before the first frame.
+ * buffer - storage for reassembling multi-frame messages, may be NULL if only
+ *      single frames are expected.
+ * flow_control_id - the arbitration ID to send flow control frames to.
+ * payload - set to the complete message when it's completed. Single frames
+ *      point into 'data', multi-frame messages into 'buffer'.
+ * payload_size - set to the size of the completed message.
+ *
+ * If the get_time_us shim is set, the gaps between consecutive frames are
+ * measured into the receiver, for flow control tuning. If the receiver's
+ * 'hold' is set, the sender is sent WAIT instead of clear to send flow control
+ * at the next block boundary, until diagnostic_transport_release_receive.
+ *
+ * Returns DIAGNOSTIC_TRANSPORT_COMPLETED when 'payload' holds a complete
+ * message, DIAGNOSTIC_TRANSPORT_ERROR if a malformed frame or a sequence error
+ * aborted the message. After a sequence error, the receiver's 'overrun' is
+ * true.
+ */
+DiagnosticTransportStatus diagnostic_transport_receive(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint8_t buffer[],
+        uint16_t buffer_size, uint32_t flow_control_id,
+        uint32_t arbitration_id, const uint8_t data[], uint8_t size,
+        const uint8_t** payload, uint16_t* payload_size);
+
+/* Private: Let the sender of a message held with WAIT flow control continue,
+ * with a clear to send flow control frame. Clears the receiver's 'hold'.
+ */
+void diagnostic_transport_release_receive(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint32_t flow_control_id);
+
+/* Private: Keep the sender of a held message waiting by sending another WAIT
+ * flow control frame every DIAGNOSTIC_TRANSPORT_HOLD_INTERVAL_US, releasing it
+ * after DIAGNOSTIC_TRANSPORT_MAX_HOLD_WAITS. Needs the get_time_us shim.
+ */
+void diagnostic_transport_poll_receive(DiagnosticShims* shims,
+        const DiagnosticTransportConfig* config,
+        DiagnosticTransportReceiver* receiver, uint32_t flow_control_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __TRANSPORT_H__
@@ -1,4 +1,8 @@
 #include <uds/uds.h>
+#include <uds/transport.h>
+#include <uds/flow_control.h>
+#include <uds/reassembly.h>
+#include <uds/extract.h>
 #include <bitfield/bitfield.h>
 #include <canutil/read.h>
 #include <string.h>
@@ -10,7 +14,7 @@
 #define ARBITRATION_ID_OFFSET 0x8
 #define MODE_RESPONSE_OFFSET 0x40
 #define NEGATIVE_RESPONSE_MODE 0x7f
-#define MAX_DIAGNOSTIC_PAYLOAD_SIZE 6
+#define MAX_DIAGNOSTIC_PAYLOAD_SIZE (CAN_MESSAGE_BYTE_SIZE - 1)
 #define MODE_BYTE_INDEX 0
 #define PID_BYTE_INDEX 1
 #define NEGATIVE_RESPONSE_MODE_INDEX 1
@@ -35,8 +39,133 @@ DiagnosticShims diagnostic_init_shims(LogShim log,
     return shims;
 }
 
+#define CAN_EXTENDED_ID_MASK 0x1fffffff
+#define CAN_STANDARD_ID_MASK 0x7ff
+#define FIXED_PRIORITY_MASK 0x1f000000
+#define FIXED_FORMAT_SHIFT 16
+#define FIXED_TARGET_ADDRESS_SHIFT 8
+#define NORMAL_FIXED_PHYSICAL_FORMAT 0xda
+#define NORMAL_FIXED_FUNCTIONAL_FORMAT 0xdb
+#define MIXED_PHYSICAL_FORMAT 0xce
+#define MIXED_FUNCTIONAL_FORMAT 0xcd
+
+static uint16_t autoset_pid_length(uint8_t mode, uint16_t pid,
+        uint8_t pid_length) {
+    if(pid_length == 0) {
+        if(mode <= 0xa || mode == 0x3e ) {
+            pid_length = 1;
+        } else if(pid > 0xffff || ((pid & 0xFF00) > 0x0)) {
+            pid_length = 2;
+        } else {
+            pid_length = 1;
+        }
+    }
+    return pid_length;
+}
+
+/* Private: Returns the size of the request, including the large payload.
+ */
+static uint32_t request_size(const DiagnosticRequest* request) {
+    uint8_t pid_length = request->has_pid ? autoset_pid_length(request->mode,
+            request->pid, request->pid_length) : 0;
+    return 1 + pid_length + request->payload_length +
+        (request->large_payload != NULL ? request->large_payload_length : 0);
+}
+
+/* Private: Returns true if the handle must use the library's own ISO-TP
+ * transport instead of isotp-c, which only sends single frames, handles
+ * classic CAN frames with 11-bit IDs and no address extension, and always sends
+ * the same flow control.
+ */
+static bool uses_library_transport(DiagnosticRequestHandle* handle) {
+    return handle->request.can_fd ||
+        request_size(&handle->request) > MAX_DIAGNOSTIC_PAYLOAD_SIZE ||
+        handle->flow_control.block_size != 0 ||
+        handle->flow_control.separation_time_us != 0 ||
+        handle->flow_control_profiles != NULL ||
+        handle->reassembler != NULL ||
+        handle->request.addressing != DIAGNOSTIC_ADDRESSING_NORMAL ||
+        handle->request.arbitration_id > CAN_STANDARD_ID_MASK ||
+        handle->request.response_arbitration_id > CAN_STANDARD_ID_MASK;
+}
+
+static bool is_fixed_addressing(DiagnosticAddressing addressing) {
+    return addressing == DIAGNOSTIC_ADDRESSING_NORMAL_FIXED ||
+        addressing == DIAGNOSTIC_ADDRESSING_MIXED;
+}
+
+/* Private: Build a physically addressed 29-bit ID in the normal fixed or mixed
+ * format, keeping the priority bits of 'priority_source'.
+ */
+static uint32_t fixed_physical_id(DiagnosticAddressing addressing,
+        uint32_t priority_source, uint8_t target_address,
+        uint8_t source_address) {
+    uint32_t format = addressing == DIAGNOSTIC_ADDRESSING_MIXED ?
+            MIXED_PHYSICAL_FORMAT : NORMAL_FIXED_PHYSICAL_FORMAT;
+    return (priority_source & FIXED_PRIORITY_MASK) |
+        (format << FIXED_FORMAT_SHIFT) |
+        (target_address << FIXED_TARGET_ADDRESS_SHIFT) | source_address;
+}
+
+/* Private: Precompute the table of arbitration IDs responses to the request
+ * may arrive on, so received frames can be matched with a mask and compare.
+ */
+static void setup_response_filters(DiagnosticRequestHandle* handle) {
+    DiagnosticRequest* request = &handle->request;
+    DiagnosticArbitrationFilter* filter = &handle->response_filters[0];
+    handle->response_filter_count = 1;
+    filter->mask = CAN_EXTENDED_ID_MASK;
+
+    if(request->response_arbitration_id != 0) {
+        filter->arbitration_id = request->response_arbitration_id;
+    } else if(is_fixed_addressing(request->addressing)) {
+        uint8_t format = request->arbitration_id >> FIXED_FORMAT_SHIFT;
+        uint8_t target_address =
+                request->arbitration_id >> FIXED_TARGET_ADDRESS_SHIFT;
+        uint8_t source_address = request->arbitration_id;
+        // responses come from the target, to us - and the ECU may pick its
+        // own priority
+        filter->mask &= ~FIXED_PRIORITY_MASK;
+        filter->arbitration_id = fixed_physical_id(request->addressing, 0,
+                source_address, target_address);
+        if(format == NORMAL_FIXED_FUNCTIONAL_FORMAT ||
+                format == MIXED_FUNCTIONAL_FORMAT) {
+            // any node may respond to a functional request
+            filter->mask &= ~0xff;
+            filter->arbitration_id &= ~0xff;
+        }
+    } else if(request->arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
+        filter->arbitration_id = OBD2_FUNCTIONAL_RESPONSE_START;
+        filter->mask &= ~(OBD2_FUNCTIONAL_RESPONSE_COUNT - 1);
+    } else {
+        filter->arbitration_id =
+                request->arbitration_id + ARBITRATION_ID_OFFSET;
+    }
+}
+
+/* Private: Returns the arbitration ID to send flow control frames to, for a
+ * multi-frame response received on 'response_id'.
+ */
+static uint32_t flow_control_arbitration_id(DiagnosticRequestHandle* handle,
+        uint32_t response_id) {
+    DiagnosticRequest* request = &handle->request;
+    if(request->response_arbitration_id == 0 &&
+            is_fixed_addressing(request->addressing)) {
+        return fixed_physical_id(request->addressing,
+                request->arbitration_id,
+                response_id & 0xff, request->arbitration_id & 0xff);
+    } else if(request->arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
+        return response_id - ARBITRATION_ID_OFFSET;
+    }
+    return request->arbitration_id;
+}
+
 static void setup_receive_handle(DiagnosticRequestHandle* handle) {
-    if(handle->request.arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
+    setup_response_filters(handle);
+    if(uses_library_transport(handle)) {
+        handle->isotp_receive_handle_count = 0;
+    } else if(handle->request.response_arbitration_id == 0 &&
+            handle->request.arbitration_id == OBD2_FUNCTIONAL_BROADCAST_ID) {
         uint32_t response_id;
         for(response_id = 0;
                 response_id < OBD2_FUNCTIONAL_RESPONSE_COUNT; ++response_id) {
@@ -49,46 +178,149 @@ static void setup_receive_handle(DiagnosticRequestHandle* handle) {
     } else {
         handle->isotp_receive_handle_count = 1;
         handle->isotp_receive_handles[0] = isotp_receive(&handle->isotp_shims,
-                handle->request.arbitration_id + ARBITRATION_ID_OFFSET,
-                NULL);
+                handle->response_filters[0].arbitration_id, NULL);
     }
 }
 
-static uint16_t autoset_pid_length(uint8_t mode, uint16_t pid,
-        uint8_t pid_length) {
-    if(pid_length == 0) {
-        if(mode <= 0xa || mode == 0x3e ) {
-            pid_length = 1;
-        } else if(pid > 0xffff || ((pid & 0xFF00) > 0x0)) {
-            pid_length = 2;
-        } else {
-            pid_length = 1;
+bool diagnostic_add_response_filter(DiagnosticRequestHandle* handle,
+        uint32_t arbitration_id, uint32_t mask) {
+    if(handle->response_filter_count >= MAX_RESPONSE_FILTER_COUNT ||
+            !uses_library_transport(handle)) {
+        return false;
+    }
+
+    DiagnosticArbitrationFilter* filter =
+            &handle->response_filters[handle->response_filter_count++];
+    filter->mask = mask & CAN_EXTENDED_ID_MASK;
+    filter->arbitration_id = arbitration_id & filter->mask;
+    return true;
+}
+
+bool diagnostic_response_id_matches(const DiagnosticRequestHandle* handle,
+        uint32_t arbitration_id) {
+    uint8_t i;
+    for(i = 0; i < handle->response_filter_count; ++i) {
+        if((arbitration_id & handle->response_filters[i].mask) ==
+                handle->response_filters[i].arbitration_id) {
+            return true;
         }
     }
-    return pid_length;
+    return false;
 }
 
-static void send_diagnostic_request(DiagnosticShims* shims,
+static DiagnosticTransportConfig transport_config(
         DiagnosticRequestHandle* handle) {
-    uint8_t payload[MAX_DIAGNOSTIC_PAYLOAD_SIZE] = {0};
-    payload[MODE_BYTE_INDEX] = handle->request.mode;
-    if(handle->request.has_pid) {
-        handle->request.pid_length = autoset_pid_length(handle->request.mode,
-                handle->request.pid, handle->request.pid_length);
-        set_bitfield(handle->request.pid, PID_BYTE_INDEX * CHAR_BIT,
-                handle->request.pid_length * CHAR_BIT, payload,
-                sizeof(payload));
+    DiagnosticAddressing addressing = handle->request.addressing;
+    DiagnosticTransportConfig config = {
+        can_fd: handle->request.can_fd,
+        frame_padding: !handle->request.no_frame_padding,
+        has_address_extension: addressing == DIAGNOSTIC_ADDRESSING_EXTENDED ||
+            addressing == DIAGNOSTIC_ADDRESSING_MIXED,
+        address_extension: handle->request.address_extension,
+        response_address_extension: handle->request.response_address_extension
+    };
+    return config;
+}
+
+/* Private: The transport configuration for receiving a response from
+ * 'arbitration_id', with the flow control to send it - from the node's
+ * profile if it has one, which is returned in 'profile'.
+ */
+static DiagnosticTransportConfig receive_config(
+        DiagnosticRequestHandle* handle, uint32_t arbitration_id,
+        DiagnosticFlowControlProfile** profile) {
+    DiagnosticTransportConfig config = transport_config(handle);
+    *profile = diagnostic_find_flow_control_profile(
+            handle->flow_control_profiles,
+            handle->flow_control_profile_count, arbitration_id);
+    DiagnosticFlowControl* flow_control = *profile != NULL ?
+            &(*profile)->tuned : &handle->flow_control;
+    config.block_size = flow_control->block_size;
+    config.separation_time = diagnostic_encode_separation_time(
+            flow_control->separation_time_us);
+    return config;
+}
+
+/* Private: Encode the mode, PID and fixed size payload of a request, setting
+ * the PID length if it's automatic. The large payload isn't included.
+ *
+ * Returns the number of bytes written, or 0 if the destination was too small.
+ */
+static uint8_t encode_request_header(DiagnosticRequest* request,
+        uint8_t destination[], uint16_t destination_length) {
+    if(request->has_pid) {
+        request->pid_length = autoset_pid_length(request->mode,
+                request->pid, request->pid_length);
+    } else {
+        request->pid_length = 0;
+    }
+
+    uint8_t size = 1 + request->pid_length + request->payload_length;
+    if(size > destination_length) {
+        return 0;
+    }
+
+    memset(destination, 0, size);
+    destination[MODE_BYTE_INDEX] = request->mode;
+    if(request->has_pid) {
+        set_bitfield(request->pid, PID_BYTE_INDEX * CHAR_BIT,
+                request->pid_length * CHAR_BIT, destination,
+                destination_length);
+    }
+
+    if(request->payload_length > 0) {
+        memcpy(&destination[PID_BYTE_INDEX + request->pid_length],
+                request->payload, request->payload_length);
+    }
+    return size;
+}
+
+uint16_t diagnostic_encode_request(DiagnosticRequest* request,
+        uint8_t destination[], uint16_t destination_length) {
+    uint8_t header_size = encode_request_header(request, destination,
+            destination_length);
+    if(header_size == 0 || request->large_payload == NULL) {
+        return header_size;
+    }
+
+    if(header_size + request->large_payload_length > destination_length) {
+        return 0;
     }
+    memcpy(&destination[header_size], request->large_payload,
+            request->large_payload_length);
+    return header_size + request->large_payload_length;
+}
 
-    if(handle->request.payload_length > 0) {
-        memcpy(&payload[PID_BYTE_INDEX + handle->request.pid_length],
-                handle->request.payload, handle->request.payload_length);
+static void send_diagnostic_request(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle) {
+    uint8_t header[MAX_DIAGNOSTIC_REQUEST_HEADER_SIZE] = {0};
+    uint8_t header_size = encode_request_header(&handle->request, header,
+            sizeof(header));
+    handle->transport_sender.active = false;
+    if(header_size == 0) {
+        handle->isotp_send_handle.completed = true;
+        handle->isotp_send_handle.success = false;
+    } else if(uses_library_transport(handle)) {
+        DiagnosticTransportConfig config = transport_config(handle);
+        DiagnosticTransportStatus status = diagnostic_transport_send(shims,
+                &config, &handle->transport_sender,
+                handle->request.arbitration_id, header, header_size,
+                handle->request.large_payload,
+                handle->request.large_payload != NULL ?
+                    handle->request.large_payload_length : 0);
+        handle->isotp_send_handle.completed =
+                status != DIAGNOSTIC_TRANSPORT_IN_PROGRESS;
+        handle->isotp_send_handle.success =
+                status != DIAGNOSTIC_TRANSPORT_ERROR;
+    } else {
+        // the whole request fits in a single frame
+        uint8_t payload[MAX_DIAGNOSTIC_PAYLOAD_SIZE];
+        uint16_t size = diagnostic_encode_request(&handle->request, payload,
+                sizeof(payload));
+        handle->isotp_send_handle = isotp_send(&handle->isotp_shims,
+                handle->request.arbitration_id, payload, size, NULL);
     }
 
-    handle->isotp_send_handle = isotp_send(&handle->isotp_shims,
-            handle->request.arbitration_id, payload,
-            1 + handle->request.payload_length + handle->request.pid_length,
-            NULL);
     if(handle->isotp_send_handle.completed &&
             !handle->isotp_send_handle.success) {
         handle->completed = true;
@@ -104,7 +336,96 @@ static void send_diagnostic_request(DiagnosticShims* shims,
     }
 }
 
-bool diagnostic_request_sent(DiagnosticRequestHandle* handle) {
+/* Private: Update the handle after the library's transport sent more of a
+ * multi-frame request.
+ */
+static void update_send_status(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, DiagnosticTransportStatus status) {
+    if(status == DIAGNOSTIC_TRANSPORT_COMPLETED) {
+        handle->isotp_send_handle.completed = true;
+        handle->isotp_send_handle.success = true;
+    } else if(status == DIAGNOSTIC_TRANSPORT_ERROR) {
+        handle->isotp_send_handle.completed = true;
+        handle->isotp_send_handle.success = false;
+        handle->completed = true;
+        handle->success = false;
+        if(shims->log != NULL) {
+            shims->log("%s", "Diagnostic request not sent");
+        }
+    }
+}
+
+void diagnostic_poll_request(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle) {
+    if(handle->transport_sender.active) {
+        DiagnosticTransportConfig config = transport_config(handle);
+        update_send_status(shims, handle, diagnostic_transport_poll_send(
+                    shims, &config, &handle->transport_sender));
+    }
+
+    DiagnosticTransportReceiver* receiver = &handle->transport_receiver;
+    if(receiver->holding) {
+        DiagnosticFlowControlProfile* profile;
+        DiagnosticTransportConfig config = receive_config(handle,
+                receiver->arbitration_id, &profile);
+        diagnostic_transport_poll_receive(shims, &config, receiver,
+                flow_control_arbitration_id(handle, receiver->arbitration_id));
+    }
+}
+
+void diagnostic_hold_response(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, bool hold) {
+    DiagnosticTransportReceiver* receiver = &handle->transport_receiver;
+    if(hold) {
+        receiver->hold = true;
+        return;
+    }
+
+    DiagnosticFlowControlProfile* profile;
+    DiagnosticTransportConfig config = receive_config(handle,
+            receiver->arbitration_id, &profile);
+    diagnostic_transport_release_receive(shims, &config, receiver,
+            flow_control_arbitration_id(handle, receiver->arbitration_id));
+}
+
+void diagnostic_add_deadline(DiagnosticDeadline* deadline, uint32_t now_us,
+        uint32_t started_us, uint32_t duration_us) {
+    uint32_t elapsed_us = now_us - started_us;
+    uint32_t remaining_us = elapsed_us < duration_us ?
+            duration_us - elapsed_us : 0;
+    if(!deadline->pending ||
+            remaining_us < diagnostic_deadline_remaining_us(deadline, now_us)) {
+        deadline->pending = true;
+        deadline->time_us = now_us + remaining_us;
+    }
+}
+
+uint32_t diagnostic_deadline_remaining_us(const DiagnosticDeadline* deadline,
+        uint32_t now_us) {
+    if(!deadline->pending) {
+        return UINT32_MAX;
+    }
+    int32_t remaining_us = (int32_t)(deadline->time_us - now_us);
+    return remaining_us > 0 ? (uint32_t) remaining_us : 0;
+}
+
+void diagnostic_request_next_deadline(DiagnosticShims* shims,
+        const DiagnosticRequestHandle* handle, DiagnosticDeadline* deadline) {
+    if(shims->get_time_us == NULL) {
+        return;
+    }
+
+    uint32_t now = shims->get_time_us();
+    diagnostic_transport_next_deadline(&handle->transport_sender, now,
+            deadline);
+    const DiagnosticTransportReceiver* receiver = &handle->transport_receiver;
+    if(receiver->active && receiver->holding) {
+        diagnostic_add_deadline(deadline, now, receiver->wait_sent_us,
+                DIAGNOSTIC_TRANSPORT_HOLD_INTERVAL_US);
+    }
+}
+
+bool diagnostic_request_sent(const DiagnosticRequestHandle* handle) {
     return handle->isotp_send_handle.completed;
 }
 
@@ -112,12 +433,62 @@ void start_diagnostic_request(DiagnosticShims* shims,
         DiagnosticRequestHandle* handle) {
     handle->success = false;
     handle->completed = false;
+    handle->response_pending_count = 0;
+    handle->transport_receiver.active = false;
     send_diagnostic_request(shims, handle);
     if(!handle->completed) {
         setup_receive_handle(handle);
     }
 }
 
+bool diagnostic_init_request_template(
+        DiagnosticRequestTemplate* request_template,
+        const DiagnosticRequestHandle* handle) {
+    request_template->handle = *handle;
+    DiagnosticRequestHandle* prototype = &request_template->handle;
+    uint8_t payload[CAN_FD_MESSAGE_BYTE_SIZE];
+    uint16_t size = diagnostic_encode_request(&prototype->request, payload,
+            sizeof(payload));
+    DiagnosticTransportConfig config = transport_config(prototype);
+    request_template->arbitration_id = prototype->request.arbitration_id;
+    request_template->frame_size = size == 0 ? 0 :
+            diagnostic_transport_encode_single_frame(&config, payload, size,
+                request_template->frame);
+    if(request_template->frame_size == 0) {
+        return false;
+    }
+
+    // the state of a request that was just sent
+    prototype->success = false;
+    prototype->completed = false;
+    prototype->response_pending_count = 0;
+    prototype->transport_receiver.active = false;
+    prototype->transport_sender.active = false;
+    prototype->isotp_send_handle.completed = true;
+    prototype->isotp_send_handle.success = true;
+    setup_receive_handle(prototype);
+    return true;
+}
+
+void diagnostic_start_request_template(DiagnosticShims* shims,
+        const DiagnosticRequestTemplate* request_template,
+        DiagnosticRequestHandle* handle) {
+    *handle = request_template->handle;
+    if(!shims->send_can_message(request_template->arbitration_id,
+                request_template->frame, request_template->frame_size)) {
+        handle->isotp_send_handle.success = false;
+        handle->completed = true;
+        if(shims->log != NULL) {
+            shims->log("%s", "Diagnostic request not sent");
+        }
+    } else if(shims->log != NULL) {
+        char request_string[128] = {0};
+        diagnostic_request_to_string(&handle->request, request_string,
+                sizeof(request_string));
+        shims->log("Sending diagnostic request: %s", request_string);
+    }
+}
+
 DiagnosticRequestHandle generate_diagnostic_request(DiagnosticShims* shims,
         DiagnosticRequest* request, DiagnosticResponseReceived callback) {
     DiagnosticRequestHandle handle = {
@@ -173,18 +544,19 @@ DiagnosticRequestHandle diagnostic_request_pid(DiagnosticShims* shims,
     return diagnostic_request(shims, &request, callback);
 }
 
-static bool handle_negative_response(IsoTpMessage* message,
-        DiagnosticResponse* response, DiagnosticShims* shims) {
+static bool handle_negative_response(const uint8_t payload[],
+        const uint16_t size, DiagnosticResponse* response,
+        DiagnosticShims* shims) {
     bool response_was_negative = false;
     if(response->mode == NEGATIVE_RESPONSE_MODE) {
         response_was_negative = true;
-        if(message->size > NEGATIVE_RESPONSE_MODE_INDEX) {
-            response->mode = message->payload[NEGATIVE_RESPONSE_MODE_INDEX];
+        if(size > NEGATIVE_RESPONSE_MODE_INDEX) {
+            response->mode = payload[NEGATIVE_RESPONSE_MODE_INDEX];
         }
 
-        if(message->size > NEGATIVE_RESPONSE_NRC_INDEX) {
+        if(size > NEGATIVE_RESPONSE_NRC_INDEX) {
             response->negative_response_code =
-                    message->payload[NEGATIVE_RESPONSE_NRC_INDEX];
+                    payload[NEGATIVE_RESPONSE_NRC_INDEX];
         }
 
         response->success = false;
@@ -194,8 +566,8 @@ static bool handle_negative_response(IsoTpMessage* message,
 }
 
 static bool handle_positive_response(DiagnosticRequestHandle* handle,
-        IsoTpMessage* message, DiagnosticResponse* response,
-        DiagnosticShims* shims) {
+        const uint8_t payload[], const uint16_t size,
+        DiagnosticResponse* response, DiagnosticShims* shims) {
     bool response_was_positive = false;
     if(response->mode == handle->request.mode + MODE_RESPONSE_OFFSET) {
         response_was_positive = true;
@@ -203,13 +575,13 @@ static bool handle_positive_response(DiagnosticRequestHandle* handle,
         // if it matched
         response->mode = handle->request.mode;
         response->has_pid = false;
-        if(handle->request.has_pid && message->size > 1) {
+        if(handle->request.has_pid && size > 1) {
             response->has_pid = true;
             if(handle->request.pid_length == 2) {
-                response->pid = get_bitfield(message->payload, message->size,
+                response->pid = diagnostic_extract_field(payload, size,
                         PID_BYTE_INDEX * CHAR_BIT, sizeof(uint16_t) * CHAR_BIT);
             } else {
-                response->pid = message->payload[PID_BYTE_INDEX];
+                response->pid = payload[PID_BYTE_INDEX];
             }
 
         }
@@ -219,12 +591,13 @@ static bool handle_positive_response(DiagnosticRequestHandle* handle,
             response->success = true;
             response->completed = true;
 
-            uint8_t payload_index = 1 + handle->request.pid_length;
-            response->payload_length = MAX(0, message->size - payload_index);
+            uint16_t payload_index = 1 + handle->request.pid_length;
+            response->full_payload_length = MAX(0, size - payload_index);
             response->payload_length = MIN(MAX_UDS_RESPONSE_PAYLOAD_LENGTH,
-                                           response->payload_length);
-            if(response->payload_length > 0) {
-                memcpy(response->payload, &message->payload[payload_index], 
+                                           response->full_payload_length);
+            if(response->full_payload_length > 0) {
+                response->full_payload = &payload[payload_index];
+                memcpy(response->payload, &payload[payload_index],
                         response->payload_length);
             }
         } else {
@@ -234,6 +607,154 @@ static bool handle_positive_response(DiagnosticRequestHandle* handle,
     return response_was_positive;
 }
 
+/* Private: Returns true if the payload is a "response pending" negative
+ * response to the handle's request, which only means the ECU needs more time
+ * and the real response will follow.
+ */
+static bool handle_response_pending(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, const uint8_t payload[],
+        const uint16_t size, DiagnosticResponse* response) {
+    if(size <= NEGATIVE_RESPONSE_NRC_INDEX ||
+            payload[0] != NEGATIVE_RESPONSE_MODE ||
+            payload[NEGATIVE_RESPONSE_MODE_INDEX] != handle->request.mode ||
+            payload[NEGATIVE_RESPONSE_NRC_INDEX] != NRC_RESPONSE_PENDING) {
+        return false;
+    }
+
+    ++handle->response_pending_count;
+    response->mode = handle->request.mode;
+    response->negative_response_code = NRC_RESPONSE_PENDING;
+    if(shims->log != NULL) {
+        shims->log("Response to mode 0x%x pending from arb ID 0x%x",
+                handle->request.mode, response->arbitration_id);
+    }
+    return true;
+}
+
+/* Private: Parse a complete ISO-TP payload received for the handle into the
+ * response, completing the handle and calling its callback if the payload
+ * answers the request.
+ */
+static void handle_complete_payload(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, const uint8_t payload[],
+        const uint16_t size, DiagnosticResponse* response) {
+    if(handle_response_pending(shims, handle, payload, size, response)) {
+        // keep waiting for the real response
+    } else if(size > 0) {
+        response->mode = payload[0];
+        if(handle_negative_response(payload, size, response, shims) ||
+                handle_positive_response(handle, payload, size, response,
+                    shims)) {
+            if(shims->log != NULL) {
+                char response_string[128] = {0};
+                diagnostic_response_to_string(response,
+                        response_string, sizeof(response_string));
+                shims->log("Diagnostic response received: %s",
+                        response_string);
+            }
+
+            handle->success = true;
+            handle->completed = true;
+        }
+    } else {
+        if(shims->log != NULL) {
+            shims->log("Received an empty response on arb ID 0x%x",
+                    response->arbitration_id);
+        }
+    }
+
+    if(handle->completed) {
+        if(handle->callback != NULL) {
+            handle->callback(response);
+        }
+        if(handle->context_callback != NULL) {
+            handle->context_callback(response, handle->context);
+        }
+    }
+}
+
+/* Private: Complete the handle unsuccessfully after the library's transport
+ * aborted its response, so a caller without a response timeout doesn't wait
+ * for it forever.
+ */
+static void fail_transport_receive(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, DiagnosticResponse* response) {
+    if(shims->log != NULL) {
+        shims->log("Response from arb ID 0x%x aborted",
+                response->arbitration_id);
+    }
+    response->mode = handle->request.mode;
+    response->success = false;
+    response->completed = true;
+    handle->success = false;
+    handle->completed = true;
+    if(handle->callback != NULL) {
+        handle->callback(response);
+    }
+    if(handle->context_callback != NULL) {
+        handle->context_callback(response, handle->context);
+    }
+}
+
+static void receive_transport_frame(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, const uint32_t arbitration_id,
+        const uint8_t data[], const uint8_t size,
+        DiagnosticResponse* response) {
+    DiagnosticFlowControlProfile* profile;
+    DiagnosticTransportConfig config = receive_config(handle, arbitration_id,
+            &profile);
+
+    const uint8_t* payload = NULL;
+    uint16_t payload_size = 0;
+    DiagnosticTransportReceiver* receiver;
+    DiagnosticTransportStatus status;
+    if(handle->reassembler != NULL) {
+        status = diagnostic_reassembler_receive(shims, &config,
+                handle->reassembler,
+                flow_control_arbitration_id(handle, arbitration_id),
+                arbitration_id, data, size, &payload, &payload_size,
+                &receiver);
+        response->multi_frame = receiver != NULL &&
+                (status == DIAGNOSTIC_TRANSPORT_IN_PROGRESS ||
+                    status == DIAGNOSTIC_TRANSPORT_COMPLETED);
+    } else {
+        uint8_t* buffer = handle->receive_buffer;
+        uint16_t buffer_size = handle->receive_buffer_size;
+        if(buffer == NULL) {
+            buffer = handle->default_receive_buffer;
+            buffer_size = sizeof(handle->default_receive_buffer);
+        }
+        receiver = &handle->transport_receiver;
+        status = diagnostic_transport_receive(shims, &config, receiver,
+                buffer, buffer_size,
+                flow_control_arbitration_id(handle, arbitration_id),
+                arbitration_id, data, size, &payload, &payload_size);
+        response->multi_frame = status == DIAGNOSTIC_TRANSPORT_IN_PROGRESS ||
+                (status == DIAGNOSTIC_TRANSPORT_COMPLETED &&
+                    payload == buffer);
+    }
+
+    if(profile != NULL && receiver != NULL &&
+            ((status == DIAGNOSTIC_TRANSPORT_COMPLETED &&
+                    response->multi_frame) ||
+                (status == DIAGNOSTIC_TRANSPORT_ERROR && receiver->overrun))) {
+        diagnostic_tune_flow_control(profile, receiver->overrun,
+                receiver->frame_interval_count == 0 ? 0 :
+                    receiver->frame_interval_total_us /
+                    receiver->frame_interval_count,
+                receiver->frame_interval_count);
+    }
+
+    if(status == DIAGNOSTIC_TRANSPORT_COMPLETED) {
+        handle_complete_payload(shims, handle, payload, payload_size,
+                response);
+    } else if(status == DIAGNOSTIC_TRANSPORT_ERROR &&
+            handle->reassembler == NULL) {
+        // with a reassembler, the other nodes' responses are still coming
+        fail_transport_receive(shims, handle, response);
+    }
+}
+
 DiagnosticResponse diagnostic_receive_can_frame(DiagnosticShims* shims,
         DiagnosticRequestHandle* handle, const uint32_t arbitration_id,
         const uint8_t data[], const uint8_t size) {
@@ -245,7 +766,17 @@ DiagnosticResponse diagnostic_receive_can_frame(DiagnosticShims* shims,
         completed: false
     };
 
-    if(!handle->isotp_send_handle.completed) {
+    if(!diagnostic_response_id_matches(handle, arbitration_id)) {
+        // not a response to this request - the common case when every
+        // received frame is passed to every handle
+    } else if(handle->transport_sender.active) {
+        DiagnosticTransportConfig config = transport_config(handle);
+        update_send_status(shims, handle, diagnostic_transport_continue_send(
+                    shims, &config, &handle->transport_sender, data, size));
+    } else if(uses_library_transport(handle)) {
+        receive_transport_frame(shims, handle, arbitration_id, data, size,
+                &response);
+    } else if(!handle->isotp_send_handle.completed) {
         isotp_continue_send(&handle->isotp_shims,
                 &handle->isotp_send_handle, arbitration_id, data, size);
     } else {
@@ -254,51 +785,49 @@ DiagnosticResponse diagnostic_receive_can_frame(DiagnosticShims* shims,
             IsoTpMessage message = isotp_continue_receive(&handle->isotp_shims,
                     &handle->isotp_receive_handles[i], arbitration_id, data,
                     size);
-            response.multi_frame = message.multi_frame;
             if(message.completed) {
-                if(message.size > 0) {
-                    response.mode = message.payload[0];
-                    if(handle_negative_response(&message, &response, shims) ||
-                            handle_positive_response(handle, &message,
-                                &response, shims)) {
-                        if(shims->log != NULL) {
-                            char response_string[128] = {0};
-                            diagnostic_response_to_string(&response,
-                                    response_string, sizeof(response_string));
-                            shims->log("Diagnostic response received: %s",
-                                    response_string);
-                        }
-
-                        handle->success = true;
-                        handle->completed = true;
-                    }
-                } else {
-                    if(shims->log != NULL) {
-                        shims->log("Received an empty response on arb ID 0x%x",
-                                response.arbitration_id);
-                    }
-                }
-
-                if(handle->completed && handle->callback != NULL) {
-                    handle->callback(&response);
-                }
-
+                response.multi_frame = message.multi_frame;
+                handle_complete_payload(shims, handle, message.payload,
+                        message.size, &response);
+                // the message buffer goes out of scope when we return
+                response.full_payload = NULL;
+                response.full_payload_length = 0;
                 break;
-            } else {  // NEW 4/25/2020- Copy partial message into the response buffer
-                memcpy(response.payload, message.payload, message.size);
-                response.payload_length = message.size;
+            } else if(message.size != 0) {
+                // the start of a multi-frame message from this node - only
+                // as much as fits the response is copied, and the other
+                // receive handles belong to other nodes
                 response.multi_frame = true;
-                if (message.size != 0)
-                    break;
+                response.payload_length = MIN(message.size,
+                        MAX_UDS_RESPONSE_PAYLOAD_LENGTH);
+                memcpy(response.payload, message.payload,
+                        response.payload_length);
+                break;
             }
         }
     }
     return response;
 }
 
+DiagnosticResponse diagnostic_receive_pdu(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, const uint32_t arbitration_id,
+        const uint8_t payload[], const uint16_t size) {
+    DiagnosticResponse response = {
+        arbitration_id: arbitration_id,
+        multi_frame: size > CAN_MESSAGE_BYTE_SIZE - 1,
+        success: false,
+        completed: false
+    };
+
+    if(!handle->completed) {
+        handle_complete_payload(shims, handle, payload, size, &response);
+    }
+    return response;
+}
+
 int diagnostic_payload_to_integer(const DiagnosticResponse* response) {
-    return get_bitfield(response->payload, response->payload_length, 0,
-            response->payload_length * CHAR_BIT);
+    return diagnostic_extract_field(response->payload,
+            response->payload_length, 0, response->payload_length * CHAR_BIT);
 }
 
 float diagnostic_decode_obd2_pid(const DiagnosticResponse* response) {
@@ -334,71 +863,138 @@ float diagnostic_decode_obd2_pid(const DiagnosticResponse* response) {
     }
 }
 
-void diagnostic_response_to_string(const DiagnosticResponse* response,
-        char* destination, size_t destination_length) {
-    int bytes_used = snprintf(destination, destination_length,
-            "arb_id: 0x%lx, mode: 0x%x, ",
-            (unsigned long) response->arbitration_id,
-            response->mode);
+/* Private: A bounded string being written by the formatters below. Whatever
+ * doesn't fit is dropped, keeping room for the NUL written by
+ * finish_string(...).
+ */
+typedef struct {
+    char* destination;
+    size_t size;
+    size_t length;
+} StringWriter;
+
+#define WRITE_LITERAL(writer, literal) \
+    write_characters((writer), (literal), sizeof(literal) - 1)
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+/* Private: Returns the number of characters that still fit in the string.
+ */
+static size_t string_room(const StringWriter* writer) {
+    return writer->size > writer->length + 1 ?
+            writer->size - writer->length - 1 : 0;
+}
 
-    if(response->has_pid) {
-        bytes_used += snprintf(destination + bytes_used,
-                destination_length - bytes_used,
-                "pid: 0x%x, ",
-                response->pid);
+static inline void write_characters(StringWriter* writer,
+        const char* characters, size_t count) {
+    size_t room = string_room(writer);
+    // copying a literal's constant size in the common case lets the compiler
+    // inline the copy
+    if(count <= room) {
+        memcpy(&writer->destination[writer->length], characters, count);
+        writer->length += count;
+    } else {
+        memcpy(&writer->destination[writer->length], characters, room);
+        writer->length += room;
     }
+}
 
-    if(!response->success) {
-        bytes_used += snprintf(destination + bytes_used,
-                destination_length - bytes_used,
-                "nrc: 0x%x, ",
-                response->negative_response_code);
-    }
-
-    if(response->payload_length > 0) {
-        snprintf(destination + bytes_used, destination_length - bytes_used,
-                "payload: 0x%02x%02x%02x%02x%02x%02x%02x",
-                response->payload[0],
-                response->payload[1],
-                response->payload[2],
-                response->payload[3],
-                response->payload[4],
-                response->payload[5],
-                response->payload[6]);
-    } else {
-        snprintf(destination + bytes_used, destination_length - bytes_used,
-                "no payload");
+/* Private: Write "0x" and the value in hex, without leading zeros - like
+ * printf's "0x%x".
+ */
+static void write_hex(StringWriter* writer, uint32_t value) {
+    char digits[10];
+    uint8_t start = sizeof(digits);
+    do {
+        digits[--start] = HEX_DIGITS[value & 0xf];
+        value >>= 4;
+    } while(value != 0);
+    digits[--start] = 'x';
+    digits[--start] = '0';
+    write_characters(writer, &digits[start], sizeof(digits) - start);
+}
+
+/* Private: Write two hex digits per byte, for as many whole bytes as fit.
+ */
+static void write_hex_bytes(StringWriter* writer, const uint8_t data[],
+        uint16_t size) {
+    size = MIN(size, string_room(writer) / 2);
+    char* destination = &writer->destination[writer->length];
+    uint16_t i;
+    for(i = 0; i < size; i++) {
+        *destination++ = HEX_DIGITS[data[i] >> 4];
+        *destination++ = HEX_DIGITS[data[i] & 0xf];
+    }
+    writer->length += size * 2;
+}
+
+static size_t finish_string(StringWriter* writer) {
+    if(writer->size > 0) {
+        writer->destination[writer->length] = '\0';
     }
+    return writer->length;
 }
 
-void diagnostic_request_to_string(const DiagnosticRequest* request,
+static void write_header(StringWriter* writer, uint32_t arbitration_id,
+        uint8_t mode, bool has_pid, uint16_t pid) {
+    WRITE_LITERAL(writer, "arb_id: ");
+    write_hex(writer, arbitration_id);
+    WRITE_LITERAL(writer, ", mode: ");
+    write_hex(writer, mode);
+    WRITE_LITERAL(writer, ", ");
+    if(has_pid) {
+        WRITE_LITERAL(writer, "pid: ");
+        write_hex(writer, pid);
+        WRITE_LITERAL(writer, ", ");
+    }
+}
+
+size_t diagnostic_response_to_string(const DiagnosticResponse* response,
         char* destination, size_t destination_length) {
-    int bytes_used = snprintf(destination, destination_length,
-            "arb_id: 0x%lx, mode: 0x%x, ",
-            (unsigned long) request->arbitration_id,
-            request->mode);
+    StringWriter writer = {destination, destination_length, 0};
+    write_header(&writer, response->arbitration_id, response->mode,
+            response->has_pid, response->pid);
+    if(!response->success) {
+        WRITE_LITERAL(&writer, "nrc: ");
+        write_hex(&writer, response->negative_response_code);
+        WRITE_LITERAL(&writer, ", ");
+    }
 
-    if(request->has_pid) {
-        bytes_used += snprintf(destination + bytes_used,
-                destination_length - bytes_used,
-                "pid: 0x%x, ",
-                request->pid);
+    const uint8_t* payload = response->payload;
+    uint16_t payload_length = MIN(response->payload_length,
+            MAX_UDS_RESPONSE_PAYLOAD_LENGTH);
+    if(response->full_payload != NULL) {
+        payload = response->full_payload;
+        payload_length = response->full_payload_length;
     }
 
-    int remaining_space = destination_length - bytes_used;
-    if(request->payload_length > 0) {
-        snprintf(destination + bytes_used, remaining_space,
-                "payload: 0x%02x%02x%02x%02x%02x%02x%02x",
-                request->payload[0],
-                request->payload[1],
-                request->payload[2],
-                request->payload[3],
-                request->payload[4],
-                request->payload[5],
-                request->payload[6]);
+    if(payload_length > 0) {
+        WRITE_LITERAL(&writer, "payload: 0x");
+        write_hex_bytes(&writer, payload, payload_length);
+    } else {
+        WRITE_LITERAL(&writer, "no payload");
+    }
+    return finish_string(&writer);
+}
+
+size_t diagnostic_request_to_string(const DiagnosticRequest* request,
+        char* destination, size_t destination_length) {
+    StringWriter writer = {destination, destination_length, 0};
+    write_header(&writer, request->arbitration_id, request->mode,
+            request->has_pid, request->pid);
+
+    uint8_t payload_length = MIN(request->payload_length,
+            MAX_UDS_REQUEST_PAYLOAD_LENGTH);
+    uint16_t large_payload_length = request->large_payload != NULL ?
+            request->large_payload_length : 0;
+    if(payload_length > 0 || large_payload_length > 0) {
+        WRITE_LITERAL(&writer, "payload: 0x");
+        write_hex_bytes(&writer, request->payload, payload_length);
+        write_hex_bytes(&writer, request->large_payload, large_payload_length);
     } else {
-        snprintf(destination + bytes_used, remaining_space, "no payload");
+        WRITE_LITERAL(&writer, "no payload");
     }
+    return finish_string(&writer);
 }
 
 bool diagnostic_request_equals(const DiagnosticRequest* ours,
@@ -2,6 +2,7 @@
 #define __UDS_H__
 
 #include <uds/uds_types.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 
@@ -9,6 +10,15 @@
 #define OBD2_FUNCTIONAL_RESPONSE_START 0x7e8
 #define OBD2_FUNCTIONAL_RESPONSE_COUNT 8
 
+// 29-bit functional broadcast from the external test equipment (0xf1) to all
+// OBD-II nodes (0x33), with DIAGNOSTIC_ADDRESSING_NORMAL_FIXED
+#define OBD2_FUNCTIONAL_BROADCAST_EXTENDED_ID 0x18db33f1
+#define OBD2_EXTERNAL_TEST_EQUIPMENT_ADDRESS 0xf1
+
+// Build a physically addressed 29-bit ID for DIAGNOSTIC_ADDRESSING_NORMAL_FIXED
+#define DIAGNOSTIC_NORMAL_FIXED_ID(target_address, source_address) \
+    (0x18da0000 | ((target_address) << 8) | (source_address))
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -64,11 +74,51 @@ DiagnosticRequestHandle generate_diagnostic_request(DiagnosticShims* shims,
  * by generate_diagnostic_request.
  *
  * You can also call this method to re-do the request for a handle that has
- * already completed.
+ * already completed. To retry failed requests with a backoff, and stop sending
+ * to ECUs that don't respond, schedule them with a DiagnosticRetryPolicy and
+ * DiagnosticCircuitBreakers instead (uds/scheduler.h).
  */
 void start_diagnostic_request(DiagnosticShims* shims,
                 DiagnosticRequestHandle* handle);
 
+/* Public: Precompile a request that is sent over and over, e.g. one of a
+ * fixed set of polled PIDs. The request is encoded into its CAN frame and the
+ * table of response IDs is built once, so starting it again with
+ * diagnostic_start_request_template(...) only copies the handle and sends the
+ * frame.
+ *
+ * request_template - the template to initialize.
+ * handle - a handle from generate_diagnostic_request(...), with any receive
+ *      buffer and flow control settings already set. It is copied.
+ *
+ * Returns false if the request doesn't fit in a single frame - only single
+ * frame requests can be precompiled.
+ */
+bool diagnostic_init_request_template(
+        DiagnosticRequestTemplate* request_template,
+        const DiagnosticRequestHandle* handle);
+
+/* Public: Start a precompiled request, like start_diagnostic_request(...) but
+ * with a single call to the send_can_message shim and nothing to encode.
+ *
+ * shims -  Low-level shims required to send CAN messages, etc.
+ * request_template - a template from diagnostic_init_request_template(...).
+ *      Any number of requests can be started from the same template, one
+ *      after another or into different handles.
+ * handle - the handle to start, overwritten with the template's, callbacks and
+ *      context included - set its context afterwards to tell the requests
+ *      started from one template apart. Pass received CAN frames to it with
+ *      diagnostic_receive_can_frame(...) as usual.
+ *
+ * The handle is a copy, so every request started from one template shares the
+ * template's receive_buffer and reassembler. Only one of them may be receiving
+ * a multi-frame response at a time, unless each is given its own buffer (and
+ * reassembler, if the template has one) right after it's started.
+ */
+void diagnostic_start_request_template(DiagnosticShims* shims,
+        const DiagnosticRequestTemplate* request_template,
+        DiagnosticRequestHandle* handle);
+
 /* Public: Request a PID from the given arbitration ID, determining the mode
  * automatically based on the PID type.
  *
@@ -109,30 +159,74 @@ DiagnosticResponse diagnostic_receive_can_frame(DiagnosticShims* shims,
         const uint32_t arbitration_id, const uint8_t data[],
         const uint8_t size);
 
+/* Public: Continue a diagnostic request with a complete ISO-TP payload that
+ * was already reassembled outside of the library, e.g. read from a Linux
+ * CAN_ISOTP socket.
+ *
+ * shims -  Low-level shims required to send CAN messages, etc.
+ * handle - A DiagnosticRequestHandle previously returned by one of the
+ *      diagnostic_request*(..) functions.
+ * arbitration_id - The arbitration_id the payload was received on.
+ * payload - The complete ISO-TP payload, starting with the response mode.
+ * size - The size of the payload.
+ *
+ * Returns a DiagnosticResponse with the same semantics as
+ * diagnostic_receive_can_frame. The response's full_payload points into
+ * 'payload'.
+ */
+DiagnosticResponse diagnostic_receive_pdu(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, const uint32_t arbitration_id,
+        const uint8_t payload[], const uint16_t size);
+
+/* Public: Encode the ISO-TP payload for a request - the mode, PID and payload -
+ * without sending it. If the request has a PID and pid_length is 0, pid_length
+ * is set automatically based on the request mode.
+ *
+ * request - the request to encode.
+ * destination - the target buffer.
+ * destination_length - the size of the destination buffer.
+ *
+ * Returns the number of bytes written, or 0 if the destination buffer was too
+ * small.
+ */
+uint16_t diagnostic_encode_request(DiagnosticRequest* request,
+        uint8_t destination[], uint16_t destination_length);
+
 /* Public: Parse the entier payload of the reponse as a single integer.
  *
  * response - the received DiagnosticResponse.
  */
 int diagnostic_payload_to_integer(const DiagnosticResponse* response);
 
-/* Public: Render a DiagnosticResponse as a string into the given buffer.
+/* Public: Render a DiagnosticResponse as a string into the given buffer, e.g.
+ * "arb_id: 0x7e8, mode: 0x1, pid: 0xc, payload: 0x1af8". The whole payload
+ * is written - the full_payload of a completed multi-frame response if there
+ * is one - as long as it fits, and the string is always NUL terminated.
+ * It doesn't allocate or call printf, so it's cheap enough for logging every
+ * response.
  *
  * response - the response to convert to a string, for debug logging.
  * destination - the target string buffer.
  * destination_length - the size of the destination buffer, i.e. the max size
  *      for the rendered string.
+ *
+ * Returns the length of the string written, without the NUL.
  */
-void diagnostic_response_to_string(const DiagnosticResponse* response,
+size_t diagnostic_response_to_string(const DiagnosticResponse* response,
         char* destination, size_t destination_length);
 
-/* Public: Render a DiagnosticRequest as a string into the given buffer.
+/* Public: Render a DiagnosticRequest as a string into the given buffer, the
+ * same way as diagnostic_response_to_string(...). The payload is the fixed
+ * size payload followed by the large payload.
  *
  * request - the request to convert to a string, for debug logging.
  * destination - the target string buffer.
  * destination_length - the size of the destination buffer, i.e. the max size
  *      for the rendered string.
+ *
+ * Returns the length of the string written, without the NUL.
  */
-void diagnostic_request_to_string(const DiagnosticRequest* request,
+size_t diagnostic_request_to_string(const DiagnosticRequest* request,
         char* destination, size_t destination_length);
 
 /* Public: For many OBD-II PIDs with a numerical result, translate a diagnostic
@@ -151,12 +245,91 @@ float diagnostic_decode_obd2_pid(const DiagnosticResponse* response);
 bool diagnostic_request_equals(const DiagnosticRequest* ours,
         const DiagnosticRequest* theirs);
 
+/* Public: Returns true if a CAN frame with the given arbitration ID may be a
+ * response to the handle's request, using the table of response IDs computed
+ * when the request was started. This is a cheap check to dispatch received
+ * frames to the right handle before calling diagnostic_receive_can_frame.
+ */
+bool diagnostic_response_id_matches(const DiagnosticRequestHandle* handle,
+        uint32_t arbitration_id);
+
+/* Public: Also accept responses on arbitration IDs where
+ * (arbitration_id & mask) matches, e.g. for gateways that answer on behalf of
+ * other nodes. Call this after the request is started, as starting a request
+ * rebuilds its table of response IDs.
+ *
+ * Returns false if the table is full, or the request is handled by isotp-c
+ * (normal addressing over classic CAN with 11-bit IDs), which can only listen
+ * on the default response IDs.
+ */
+bool diagnostic_add_response_filter(DiagnosticRequestHandle* handle,
+        uint32_t arbitration_id, uint32_t mask);
+
 /* Public: Returns true if the request has been completely sent - if false, make
  * sure you called start_diagnostic_request once to start it, and then pass
  * incoming CAN messages to it with diagnostic_receive_can_frame(...) so it can
  * continue the ISO-TP transfer.
  */
-bool diagnostic_request_sent(DiagnosticRequestHandle* handle);
+bool diagnostic_request_sent(const DiagnosticRequestHandle* handle);
+
+/* Public: Send the next consecutive frame of a multi-frame request if the
+ * separation time requested by the ECU has passed.
+ *
+ * When the ECU's flow control asks for no separation time, the whole block is
+ * sent from diagnostic_receive_can_frame and this does nothing. Otherwise call
+ * it regularly (e.g. from your main loop) until diagnostic_request_sent returns
+ * true. The separation time is only honored if shims.get_time_us is set,
+ * otherwise one frame is sent per call. With the clock, a request that waits
+ * more than a second for the ECU's flow control fails.
+ *
+ * shims - Low-level shims required to send CAN messages, etc.
+ * handle - A handle for a request that was started.
+ */
+void diagnostic_poll_request(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle);
+
+/* Public: Pause a multi-frame response at its next block boundary, e.g. to
+ * let more urgent traffic through, or let it continue. A paused ECU is sent
+ * WAIT flow control frames instead of clear to send - from
+ * diagnostic_poll_request(...) every half second with the get_time_us shim,
+ * and for at most DIAGNOSTIC_TRANSPORT_MAX_HOLD_WAITS frames before it's let
+ * go, so it doesn't abort. Only responses received by the library's own
+ * transport with a block size in 'flow_control' or the node's profile have
+ * block boundaries, and the ECU must accept WAIT frames.
+ *
+ * hold - true to pause the response, false to let it continue.
+ */
+void diagnostic_hold_response(DiagnosticShims* shims,
+        DiagnosticRequestHandle* handle, bool hold);
+
+/* Public: Add a timer to a deadline, keeping whichever is earlier. Timers are
+ * compared by how long they have left at 'now_us', so it works across the
+ * wraparound of get_time_us.
+ *
+ * deadline - the deadline to update.
+ * now_us - the current time.
+ * started_us - when the timer started.
+ * duration_us - how long the timer runs - a timer that has already run out
+ *      makes the deadline 'now_us'.
+ */
+void diagnostic_add_deadline(DiagnosticDeadline* deadline, uint32_t now_us,
+        uint32_t started_us, uint32_t duration_us);
+
+/* Public: Returns how long an event loop can sleep from 'now_us' before the
+ * deadline, 0 if it has passed, or UINT32_MAX if nothing is pending - e.g. to
+ * wait for CAN frames with epoll_wait until then.
+ */
+uint32_t diagnostic_deadline_remaining_us(const DiagnosticDeadline* deadline,
+        uint32_t now_us);
+
+/* Public: Add the next time the request needs diagnostic_poll_request(...) -
+ * to send a consecutive frame after the ECU's separation time, to give up on
+ * its flow control or to keep a held response waiting - to a deadline. Does
+ * nothing for a request that isn't sending or holding, or without the
+ * get_time_us shim.
+ */
+void diagnostic_request_next_deadline(DiagnosticShims* shims,
+        const DiagnosticRequestHandle* handle, DiagnosticDeadline* deadline);
 
 #ifdef __cplusplus
 }
@@ -25,8 +25,35 @@ extern "C" {
 #define MAX_UDS_RESPONSE_PAYLOAD_LENGTH 127
 #endif
 #define MAX_UDS_REQUEST_PAYLOAD_LENGTH 7
+// The largest request that can be sent, including the mode and PID - the
+// largest ISO-TP message without the first frame length escape
+#define MAX_DIAGNOSTIC_REQUEST_SIZE 4095
+// The mode, a PID of up to 2 bytes and the fixed size payload
+#define MAX_DIAGNOSTIC_REQUEST_HEADER_SIZE (3 + MAX_UDS_REQUEST_PAYLOAD_LENGTH)
 #define MAX_RESPONDING_ECU_COUNT 8
+// The number of nodes a DiagnosticReassembler receives multi-frame messages
+// from at the same time.
+#ifndef MAX_REASSEMBLY_STREAMS
+#define MAX_REASSEMBLY_STREAMS MAX_RESPONDING_ECU_COUNT
+#endif
 #define VIN_LENGTH 17
+// The multi-frame responses a handle using the library's own ISO-TP
+// transport reassembles without a receive_buffer - enough for the VIN.
+#ifndef DIAGNOSTIC_DEFAULT_RECEIVE_BUFFER_SIZE
+#define DIAGNOSTIC_DEFAULT_RECEIVE_BUFFER_SIZE 64
+#endif
+
+// The standard DiagnosticSessionControl (0x10) sessions
+#define DIAGNOSTIC_DEFAULT_SESSION 0x1
+#define DIAGNOSTIC_PROGRAMMING_SESSION 0x2
+#define DIAGNOSTIC_EXTENDED_SESSION 0x3
+// The longest SecurityAccess (0x27) seed
+#define MAX_DIAGNOSTIC_SECURITY_SEED_SIZE 16
+
+// The largest CAN FD frame, and so the largest frame ever passed to the
+// SendCanMessageShim.
+#define CAN_FD_MESSAGE_BYTE_SIZE 64
+#define MAX_RESPONSE_FILTER_COUNT 4
 
 /* Private: The four main types of diagnositc requests that determine how the
  * request should be parsed and what type of callback should be used.
@@ -40,6 +67,34 @@ typedef enum {
     DIAGNOSTIC_REQUEST_TYPE_VIN
 } DiagnosticRequestType;
 
+/* Public: The ISO 15765-2 addressing formats a request can use.
+ *
+ * DIAGNOSTIC_ADDRESSING_NORMAL - 11-bit IDs, responses arrive on the request ID
+ *      + 0x8, or 0x7e8 - 0x7ef for the 0x7df functional broadcast.
+ * DIAGNOSTIC_ADDRESSING_NORMAL_FIXED - 29-bit IDs with the target and source
+ *      addresses in the ID, e.g. 0x18da10f1 (physical, to 0x10 from 0xf1) or
+ *      0x18db33f1 (functional). Responses swap the two addresses.
+ * DIAGNOSTIC_ADDRESSING_EXTENDED - like normal addressing, but the first byte
+ *      of every frame is the target address.
+ * DIAGNOSTIC_ADDRESSING_MIXED - 29-bit IDs like normal fixed addressing (0x18ce
+ *      physical, 0x18cd functional), and the first byte of every frame is an
+ *      address extension.
+ */
+typedef enum {
+    DIAGNOSTIC_ADDRESSING_NORMAL,
+    DIAGNOSTIC_ADDRESSING_NORMAL_FIXED,
+    DIAGNOSTIC_ADDRESSING_EXTENDED,
+    DIAGNOSTIC_ADDRESSING_MIXED
+} DiagnosticAddressing;
+
+/* Public: Matches received arbitration IDs where
+ * (received & mask) == arbitration_id.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    uint32_t mask;
+} DiagnosticArbitrationFilter;
+
 /* Public: A container for a single diagnostic request.
  *
  * The only required fields are the arbitration_id and mode.
@@ -55,10 +110,29 @@ typedef enum {
  * payload - (optional) The payload for the request, if the request requires
  *      one. If payload_length is 0 this field is ignored.
  * payload_length - The length of the payload, or 0 if no payload is used.
+ * large_payload - (optional) A caller-owned payload of any length, sent after
+ *      'payload', e.g. the data for a WriteDataByIdentifier or TransferData
+ *      request. It is sent straight from this buffer as a multi-frame ISO-TP
+ *      message without being copied, so it must stay valid until the request
+ *      is completely sent. The whole request can be up to
+ *      MAX_DIAGNOSTIC_REQUEST_SIZE bytes.
+ * large_payload_length - The length of large_payload.
  * no_frame_padding - false if sent CAN payloads should *not* be padded out to a
  *      full 8 byte CAN frame. Many ECUs require this, but others require the
  *      size of the CAN message to only be the actual data. By default padding
  *      is enabled (so this struct value can default to 0).
+ * can_fd - true if the request and its response should use CAN FD frames of up
+ *      to 64 bytes. Frames longer than 8 bytes are always padded to the next
+ *      valid CAN FD data length. Because the handle keeps a copy of the
+ *      request, classic and CAN FD nodes can be used side by side.
+ * addressing - (optional) The addressing format, normal 11-bit addressing by
+ *      default.
+ * address_extension - For extended addressing, the target address sent as the
+ *      first byte of every frame. For mixed addressing, the address extension.
+ * response_address_extension - The first byte expected in every response
+ *      frame with extended (usually the tester's address) or mixed addressing.
+ * response_arbitration_id - (optional) The arbitration ID responses arrive on,
+ *      if it can't be derived from the arbitration_id and addressing format.
  * type - the type of the request (TODO unused)
  */
 typedef struct {
@@ -69,7 +143,14 @@ typedef struct {
     uint8_t pid_length;
     uint8_t payload[MAX_UDS_REQUEST_PAYLOAD_LENGTH];
     uint8_t payload_length;
+    const uint8_t* large_payload;
+    uint16_t large_payload_length;
     bool no_frame_padding;
+    bool can_fd;
+    DiagnosticAddressing addressing;
+    uint8_t address_extension;
+    uint8_t response_address_extension;
+    uint32_t response_arbitration_id;
     DiagnosticRequestType type;
 } DiagnosticRequest;
 
@@ -84,16 +165,23 @@ typedef struct {
  */
 typedef enum {
     NRC_SUCCESS = 0x0,
+    NRC_GENERAL_REJECT = 0x10,
     NRC_SERVICE_NOT_SUPPORTED = 0x11,
     NRC_SUB_FUNCTION_NOT_SUPPORTED = 0x12,
     NRC_INCORRECT_LENGTH_OR_FORMAT = 0x13,
+    NRC_RESPONSE_TOO_LONG = 0x14,
+    NRC_BUSY_REPEAT_REQUEST = 0x21,
     NRC_CONDITIONS_NOT_CORRECT = 0x22,
+    NRC_REQUEST_SEQUENCE_ERROR = 0x24,
     NRC_REQUEST_OUT_OF_RANGE = 0x31,
     NRC_SECURITY_ACCESS_DENIED = 0x33,
     NRC_INVALID_KEY = 0x35,
     NRC_TOO_MANY_ATTEMPS = 0x36,
     NRC_TIME_DELAY_NOT_EXPIRED = 0x37,
-    NRC_RESPONSE_PENDING = 0x78
+    NRC_GENERAL_PROGRAMMING_FAILURE = 0x72,
+    NRC_RESPONSE_PENDING = 0x78,
+    NRC_SUB_FUNCTION_NOT_SUPPORTED_IN_ACTIVE_SESSION = 0x7e,
+    NRC_SERVICE_NOT_SUPPORTED_IN_ACTIVE_SESSION = 0x7f
 } DiagnosticNegativeResponseCode;
 
 /* Public: A partially or fully completed response to a diagnostic request.
@@ -117,6 +205,13 @@ typedef enum {
  *      by the other node.
  * payload - An optional payload for the response - NULL if no payload.
  * payload_length - The length of the payload or 0 if none.
+ * full_payload - The complete payload of a completed response, which may be
+ *      longer than 'payload' can hold (e.g. a whole PDU read from an ISO-TP
+ *      socket). Points into the buffer the response was received into, so it
+ *      is only valid until that buffer is reused - for classic CAN responses
+ *      from diagnostic_receive_can_frame, only inside the callback. NULL if
+ *      the response is not completed or has no payload.
+ * full_payload_length - The length of full_payload, or 0 if none.
  */
 typedef struct {
     bool completed;
@@ -129,6 +224,8 @@ typedef struct {
     DiagnosticNegativeResponseCode negative_response_code;
     uint8_t payload[MAX_UDS_RESPONSE_PAYLOAD_LENGTH];
     uint8_t payload_length;
+    const uint8_t* full_payload;
+    uint16_t full_payload_length;
 } DiagnosticResponse;
 
 /* Public: Friendly names for all OBD-II modes.
@@ -157,6 +254,137 @@ typedef enum {
  */
 typedef void (*DiagnosticResponseReceived)(const DiagnosticResponse* response);
 
+/* Public: The signature for a function to be called when a diagnostic request
+ * is complete, like DiagnosticResponseReceived, along with the context it was
+ * given - to find the work the response belongs to without a table of your
+ * own.
+ *
+ * response - the completed DiagnosticResponse.
+ * context - the handle's 'context'.
+ */
+typedef void (*DiagnosticResponseReceivedWithContext)(
+        const DiagnosticResponse* response, void* context);
+
+/* Private: The state of one ISO-TP message being reassembled by the library's
+ * own transport (see uds/transport.h), used for CAN FD.
+ */
+typedef struct {
+    bool active;
+    bool overrun;
+    uint32_t arbitration_id;
+    uint16_t expected_size;
+    uint16_t received_size;
+    uint8_t next_sequence;
+    uint8_t block_remaining;
+    uint32_t last_frame_time_us;
+    uint32_t frame_interval_total_us;
+    uint16_t frame_interval_count;
+    // pause the sender with WAIT flow control at the next block boundary
+    bool hold;
+    bool holding;
+    uint8_t wait_count;
+    uint32_t wait_sent_us;
+} DiagnosticTransportReceiver;
+
+/* Private: The state of one multi-frame ISO-TP message being sent by the
+ * library's own transport. The message is the header (copied) followed by the
+ * body (not copied).
+ */
+typedef struct {
+    bool active;
+    bool waiting_for_flow_control;
+    uint32_t arbitration_id;
+    uint8_t header[MAX_DIAGNOSTIC_REQUEST_HEADER_SIZE];
+    uint8_t header_size;
+    const uint8_t* body;
+    uint16_t body_size;
+    uint16_t sent_size;
+    uint8_t next_sequence;
+    uint8_t block_size;
+    uint8_t block_remaining;
+    uint8_t wait_count;
+    uint32_t separation_time_us;
+    uint32_t last_frame_time_us;
+} DiagnosticTransportSender;
+
+/* Private: One responding node's multi-frame message being reassembled by a
+ * DiagnosticReassembler, into its own slice of the reassembler's buffer.
+ */
+typedef struct {
+    DiagnosticTransportReceiver receiver;
+    uint8_t* buffer;
+    uint32_t last_frame_time_us;
+} DiagnosticReassemblyStream;
+
+/* Public: Reassembly of multi-frame responses from several nodes at once,
+ * e.g. every ECU answering a functional request with interleaved consecutive
+ * frames. Each responding arbitration ID gets its own ISO-TP session and its
+ * own part of a caller-provided buffer, so a frame from one node can't land in
+ * another node's message. Initialize it with diagnostic_init_reassembler(...)
+ * and give it to the handles that should use it.
+ *
+ * completed_count - The number of multi-frame messages reassembled.
+ * aborted_count - The number of messages abandoned part way - after a
+ *      sequence number gap, or when a node stopped sending for longer than
+ *      N_Cr (1 second) and its stream was needed for another node.
+ * dropped_count - The number of messages refused with an overflow flow control
+ *      frame because they didn't fit a stream's buffer or every stream was
+ *      busy.
+ *
+ * The other fields are private.
+ */
+typedef struct {
+    uint32_t completed_count;
+    uint32_t aborted_count;
+    uint32_t dropped_count;
+
+    // Private
+    DiagnosticReassemblyStream streams[MAX_REASSEMBLY_STREAMS];
+    uint8_t stream_count;
+    uint16_t stream_buffer_size;
+} DiagnosticReassembler;
+
+/* Public: The block size and separation time (STmin) sent in flow control
+ * frames, asking the sender of a multi-frame response to pace itself.
+ *
+ * block_size - The number of consecutive frames to send before waiting for the
+ *      next flow control frame, or 0 to send them all.
+ * separation_time_us - The minimum gap between consecutive frames in
+ *      microseconds, sent with ISO-TP's 100us resolution below 1ms and 1ms
+ *      resolution up to 127ms.
+ */
+typedef struct {
+    uint8_t block_size;
+    uint32_t separation_time_us;
+} DiagnosticFlowControl;
+
+/* Public: Flow control settings for one responding node, shared by every
+ * request that node answers. Initialize with
+ * diagnostic_init_flow_control_profile(...).
+ *
+ * arbitration_id - The arbitration ID the node responds on.
+ * flow_control - The configured flow control. When auto-tuning, this is the
+ *      most conservative setting that will be used.
+ * auto_tune - If true, the separation time is lowered after every clean
+ *      multi-frame response until the node's measured frame cadence stops
+ *      improving, and backed off again if consecutive frames are lost.
+ * tuned - The flow control currently in use.
+ * frame_interval_us - The average gap between consecutive frames measured on
+ *      the last clean multi-frame response, or 0 if unknown.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    DiagnosticFlowControl flow_control;
+    bool auto_tune;
+    DiagnosticFlowControl tuned;
+    uint32_t frame_interval_us;
+
+    // Private
+    bool converged;
+    bool has_failed;
+    uint32_t failed_separation_time_us;
+    uint32_t good_separation_time_us;
+} DiagnosticFlowControlProfile;
 /* Public: A handle for initiating and continuing a single diagnostic request.
  *
  * A diagnostic request requires one or more CAN messages to be sent, and one
@@ -169,22 +397,87 @@ typedef void (*DiagnosticResponseReceived)(const DiagnosticResponse* response);
  *      cancelled.
  * success - True if the request send and receive process was successful. The
  *      value if this field isn't valid if 'completed' isn't true.
+ * receive_buffer - (optional) Storage for reassembling multi-frame responses
+ *      in the library's own ISO-TP transport, at least as large as the
+ *      largest expected response. Without one, the handle reassembles
+ *      responses of up to DIAGNOSTIC_DEFAULT_RECEIVE_BUFFER_SIZE bytes itself,
+ *      and a longer one fails the request. Requests with 11-bit IDs, normal
+ *      addressing and none of the settings below go through isotp-c instead
+ *      and don't use it.
+ * receive_buffer_size - The size of receive_buffer.
+ * flow_control - (optional) The flow control to send for multi-frame
+ *      responses, by default asking for all frames as fast as possible.
+ * flow_control_profiles - (optional) Per-node flow control settings, which
+ *      override 'flow_control' for responses from those nodes. The array is
+ *      owned by the caller and may be shared by many handles, so auto-tuning
+ *      carries over from one request to the next.
+ * flow_control_profile_count - The number of profiles in the array.
+ * reassembler - (optional) Reassembles multi-frame responses from each
+ *      responding node separately, for requests several nodes answer at once.
+ *      Owned by the caller, and used instead of receive_buffer.
+ * response_pending_count - The number of "response pending" negative responses
+ *      (NRC 0x78) received so far. The ECU sends these when it needs more than
+ *      its normal response time, e.g. while erasing flash, so they don't
+ *      complete the request - but a caller enforcing a response timeout should
+ *      restart it with the longer P2* timeout each time this changes.
+ * context_callback - (optional) A function to be called with 'context' when
+ *      the request completes, after the callback the handle was created with.
+ *      Set it and 'context' before passing received frames to the handle.
+ * context - (optional) Anything the context_callback needs.
+ *
+ * CAN FD, 29-bit IDs, addressing other than DIAGNOSTIC_ADDRESSING_NORMAL, a
+ * request too long for a single frame, or setting any of the flow control
+ * fields or a reassembler makes the request use the library's own ISO-TP
+ * transport, so it needs a receive_buffer or a reassembler for multi-frame
+ * responses longer than DIAGNOSTIC_DEFAULT_RECEIVE_BUFFER_SIZE. A response the
+ * transport has to abort - it doesn't fit, or its frames are out of sequence -
+ * completes the request unsuccessfully, calling its callbacks.
  */
 typedef struct {
     DiagnosticRequest request;
     bool success;
     bool completed;
+    uint8_t* receive_buffer;
+    uint16_t receive_buffer_size;
+    DiagnosticFlowControl flow_control;
+    DiagnosticFlowControlProfile* flow_control_profiles;
+    uint8_t flow_control_profile_count;
+    DiagnosticReassembler* reassembler;
+    uint16_t response_pending_count;
+    DiagnosticResponseReceivedWithContext context_callback;
+    void* context;
 
     // Private
     IsoTpShims isotp_shims;
     IsoTpSendHandle isotp_send_handle;
     IsoTpReceiveHandle isotp_receive_handles[MAX_RESPONDING_ECU_COUNT];
     uint8_t isotp_receive_handle_count;
+    bool isotp_socket_bound;
+    int isotp_socket;
+    uint32_t isotp_socket_rx_id;
+    DiagnosticTransportReceiver transport_receiver;
+    DiagnosticTransportSender transport_sender;
+    uint8_t default_receive_buffer[DIAGNOSTIC_DEFAULT_RECEIVE_BUFFER_SIZE];
+    DiagnosticArbitrationFilter response_filters[MAX_RESPONSE_FILTER_COUNT];
+    uint8_t response_filter_count;
     DiagnosticResponseReceived callback;
     // DiagnosticMilStatusReceived mil_status_callback;
     // DiagnosticVinReceived vin_callback;
 } DiagnosticRequestHandle;
 
+/* Public: A request precompiled for polling it over and over: the CAN frame
+ * to send and a handle that is already set up to receive the response.
+ * Initialize it with diagnostic_init_request_template(...).
+ *
+ * All fields are private.
+ */
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t frame[CAN_FD_MESSAGE_BYTE_SIZE];
+    uint8_t frame_size;
+    DiagnosticRequestHandle handle;
+} DiagnosticRequestTemplate;
+
 /* Public: The two major types of PIDs that determine the OBD-II mode and PID
  * field length.
  */
@@ -193,18 +486,39 @@ typedef enum {
     DIAGNOSTIC_ENHANCED_PID
 } DiagnosticPidRequestType;
 
-/* Public: A container for the 3 shim functions used by the library to interact
+/* Public: The signature for an optional function returning a monotonic time in
+ * microseconds. It may wrap around.
+ */
+typedef uint32_t (*DiagnosticTimeShim)(void);
+
+/* Public: A container for the shim functions used by the library to interact
  * with the wider system.
  *
  * Use the diagnostic_init_shims(...) function to create an instance of this
- * struct.
+ * struct. get_time_us is optional and isn't set by diagnostic_init_shims -
+ * assign it afterwards to enable features that need a clock, e.g. flow control
+ * auto-tuning.
  */
 typedef struct {
     LogShim log;
     SendCanMessageShim send_can_message;
     SetTimerShim set_timer;
+    DiagnosticTimeShim get_time_us;
 } DiagnosticShims;
 
+/* Public: The earliest time something needs diagnostic_*_poll(...) to be
+ * called, collected from the handles of an event loop so it can sleep until
+ * then instead of polling on a fixed tick. Zero-initialize it, then pass it to
+ * the diagnostic_*_next_deadline(...) functions of each handle.
+ *
+ * pending - true if any handle has a deadline.
+ * time_us - the earliest deadline, in get_time_us time.
+ */
+typedef struct {
+    bool pending;
+    uint32_t time_us;
+} DiagnosticDeadline;
+
 #ifdef __cplusplus
 }
 #endif
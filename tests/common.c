@@ -8,7 +8,7 @@
 DiagnosticShims SHIMS;
 
 uint32_t last_can_frame_sent_arb_id;
-uint8_t last_can_payload_sent[8];
+uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
 uint8_t last_can_payload_size;
 bool can_frame_was_sent;
 
@@ -3,14 +3,15 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
 
 extern bool can_frame_was_sent;
 extern void setup();
 extern bool last_response_was_received;
 extern DiagnosticResponse last_response_received;
 extern DiagnosticShims SHIMS;
-extern uint16_t last_can_frame_sent_arb_id;
-extern uint8_t last_can_payload_sent[8];
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
 extern uint8_t last_can_payload_size;
 
 void response_received_handler(const DiagnosticResponse* response) {
@@ -35,6 +36,33 @@ START_TEST (test_receive_wrong_arb_id)
 }
 END_TEST
 
+static void* last_response_context;
+
+static void context_response_received(const DiagnosticResponse* response,
+        void* context) {
+    last_response_context = context;
+    ck_assert_int_eq(response->pid, 0xc);
+}
+
+START_TEST (test_context_callback)
+{
+    int work_item;
+    last_response_context = NULL;
+    DiagnosticRequestHandle handle = diagnostic_request_pid(&SHIMS,
+            DIAGNOSTIC_STANDARD_PID, 0x7e0, 0xc, response_received_handler);
+    handle.context_callback = context_response_received;
+    handle.context = &work_item;
+
+    const uint8_t can_data[] = {0x4, 0x41, 0xc, 0x1a, 0xf8};
+    diagnostic_receive_can_frame(&SHIMS, &handle, 0x7e8, can_data,
+            sizeof(can_data));
+    fail_unless(handle.completed);
+    // both callbacks are called
+    fail_unless(last_response_was_received);
+    fail_unless(last_response_context == &work_item);
+}
+END_TEST
+
 START_TEST (test_send_diag_request_with_payload)
 {
     DiagnosticRequest request = {
@@ -419,6 +447,366 @@ START_TEST (test_payload_to_integer)
 }
 END_TEST
 
+START_TEST (test_receive_pdu)
+{
+    uint16_t arb_id = 0x7e0;
+    DiagnosticRequestHandle handle = diagnostic_request_pid(&SHIMS,
+            DIAGNOSTIC_ENHANCED_PID, arb_id, 0xf190, response_received_handler);
+
+    const uint8_t pdu[] = {0x22 + 0x40, 0xf1, 0x90, 0x31, 0x46, 0x4d, 0x43,
+        0x55, 0x39, 0x4a, 0x39, 0x34, 0x48, 0x55, 0x41, 0x30, 0x34, 0x35, 0x32,
+        0x34};
+    DiagnosticResponse response = diagnostic_receive_pdu(&SHIMS, &handle,
+            arb_id + 0x8, pdu, sizeof(pdu));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_unless(response.multi_frame);
+    fail_unless(handle.completed);
+    fail_unless(last_response_was_received);
+    ck_assert_int_eq(response.pid, 0xf190);
+    ck_assert_int_eq(response.full_payload_length, VIN_LENGTH);
+    ck_assert(response.full_payload == &pdu[3]);
+    ck_assert_int_eq(response.payload_length, MAX_UDS_RESPONSE_PAYLOAD_LENGTH);
+    ck_assert_int_eq(response.payload[0], pdu[3]);
+}
+END_TEST
+
+START_TEST (test_receive_pdu_negative_response)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x100,
+        mode: OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    const uint8_t pdu[] = {0x7f, request.mode, NRC_CONDITIONS_NOT_CORRECT};
+    DiagnosticResponse response = diagnostic_receive_pdu(&SHIMS, &handle,
+            request.arbitration_id + 0x8, pdu, sizeof(pdu));
+    fail_unless(response.completed);
+    fail_if(response.success);
+    fail_unless(handle.completed);
+    ck_assert_int_eq(response.negative_response_code,
+            NRC_CONDITIONS_NOT_CORRECT);
+    ck_assert(response.full_payload == NULL);
+}
+END_TEST
+
+START_TEST (test_can_fd_single_frame_escape)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x100,
+        mode: 0x2e,
+        has_pid: true,
+        pid: 0x1234,
+        payload: {0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7},
+        payload_length: 7,
+        can_fd: true
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+
+    fail_if(handle.completed);
+    fail_unless(diagnostic_request_sent(&handle));
+    ck_assert_int_eq(last_can_frame_sent_arb_id, request.arbitration_id);
+    // 10 bytes don't fit a classic single frame - escape sequence, padded to
+    // the next CAN FD data length
+    ck_assert_int_eq(last_can_payload_sent[0], 0x0);
+    ck_assert_int_eq(last_can_payload_sent[1], 10);
+    ck_assert_int_eq(last_can_payload_sent[2], request.mode);
+    ck_assert_int_eq(last_can_payload_sent[3], 0x12);
+    ck_assert_int_eq(last_can_payload_sent[4], 0x34);
+    ck_assert_int_eq(last_can_payload_sent[11], 0x7);
+    ck_assert_int_eq(last_can_payload_size, 12);
+
+    uint8_t can_data[20] = {0x0, 18, 0x2e + 0x40, 0x12, 0x34};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, can_data, sizeof(can_data));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_if(response.multi_frame);
+    ck_assert_int_eq(response.pid, 0x1234);
+    ck_assert_int_eq(response.full_payload_length, 15);
+}
+END_TEST
+
+START_TEST (test_can_fd_multi_frame_response)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x100,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        can_fd: true,
+        no_frame_padding: true
+    };
+    uint8_t receive_buffer[128];
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    handle.receive_buffer = receive_buffer;
+    handle.receive_buffer_size = sizeof(receive_buffer);
+    ck_assert_int_eq(last_can_payload_size, 4);
+
+    uint8_t first_frame[64] = {0x10, 100, 0x22 + 0x40, 0xf1, 0x90};
+    for(int i = 5; i < 64; i++) {
+        first_frame[i] = i - 2;
+    }
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, first_frame, sizeof(first_frame));
+    fail_if(response.completed);
+    fail_unless(response.multi_frame);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, request.arbitration_id);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x30);
+
+    // the final consecutive frame is shorter, but padded to a valid length
+    uint8_t consecutive_frame[48] = {0x21};
+    for(int i = 1; i < 39; i++) {
+        consecutive_frame[i] = 61 + i;
+    }
+    response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, consecutive_frame,
+            sizeof(consecutive_frame));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_unless(response.multi_frame);
+    fail_unless(last_response_was_received);
+    ck_assert_int_eq(response.pid, 0xf190);
+    ck_assert_int_eq(response.full_payload_length, 97);
+    ck_assert(response.full_payload == &receive_buffer[3]);
+    for(int i = 0; i < 97; i++) {
+        ck_assert_int_eq(response.full_payload[i], i + 3);
+    }
+}
+END_TEST
+
+START_TEST (test_can_fd_sequence_error_aborts)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x100,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        can_fd: true
+    };
+    uint8_t receive_buffer[128];
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    handle.receive_buffer = receive_buffer;
+    handle.receive_buffer_size = sizeof(receive_buffer);
+
+    const uint8_t first_frame[64] = {0x10, 100, 0x22 + 0x40, 0xf1, 0x90};
+    diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, first_frame, sizeof(first_frame));
+
+    const uint8_t consecutive_frame[48] = {0x22};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, consecutive_frame,
+            sizeof(consecutive_frame));
+    fail_unless(response.completed);
+    fail_if(response.success);
+    fail_unless(handle.completed);
+    fail_if(handle.success);
+    fail_unless(last_response_was_received);
+    fail_if(last_response_received.success);
+
+    last_response_was_received = false;
+    const uint8_t in_sequence[48] = {0x21};
+    response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, in_sequence, sizeof(in_sequence));
+    fail_if(response.completed);
+    fail_if(last_response_was_received);
+}
+END_TEST
+
+START_TEST (test_can_fd_multi_frame_without_buffer)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x100,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        can_fd: true
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+
+    // longer than the handle's own buffer
+    const uint8_t first_frame[64] = {0x10, 100, 0x22 + 0x40, 0xf1, 0x90};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            request.arbitration_id + 0x8, first_frame, sizeof(first_frame));
+    // flow control overflow
+    ck_assert_int_eq(last_can_payload_sent[0], 0x32);
+    fail_unless(response.completed);
+    fail_if(response.success);
+    fail_unless(handle.completed);
+    fail_unless(last_response_was_received);
+}
+END_TEST
+
+START_TEST (test_response_id_table_functional)
+{
+    DiagnosticRequest request = {
+        arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID,
+        mode: OBD2_MODE_EMISSIONS_DTC_REQUEST
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+
+    fail_if(diagnostic_response_id_matches(&handle,
+                OBD2_FUNCTIONAL_RESPONSE_START - 1));
+    for(uint32_t id = OBD2_FUNCTIONAL_RESPONSE_START;
+            id < OBD2_FUNCTIONAL_RESPONSE_START +
+                OBD2_FUNCTIONAL_RESPONSE_COUNT; id++) {
+        fail_unless(diagnostic_response_id_matches(&handle, id));
+    }
+    fail_if(diagnostic_response_id_matches(&handle,
+            OBD2_FUNCTIONAL_RESPONSE_START + OBD2_FUNCTIONAL_RESPONSE_COUNT));
+    // isotp-c can't listen on extra IDs
+    fail_if(diagnostic_add_response_filter(&handle, 0x700, 0x7ff));
+}
+END_TEST
+
+START_TEST (test_normal_fixed_addressing_physical)
+{
+    DiagnosticRequest request = {
+        arbitration_id: DIAGNOSTIC_NORMAL_FIXED_ID(0x10,
+                OBD2_EXTERNAL_TEST_EQUIPMENT_ADDRESS),
+        mode: OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST,
+        has_pid: true,
+        pid: 0xc,
+        addressing: DIAGNOSTIC_ADDRESSING_NORMAL_FIXED
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x18da10f1);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x2);
+    ck_assert_int_eq(last_can_payload_sent[1], request.mode);
+    ck_assert_int_eq(last_can_payload_sent[2], request.pid);
+
+    const uint8_t can_data[] = {0x4, 0x1 + 0x40, 0xc, 0x1a, 0xf8};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            0x18daf111, can_data, sizeof(can_data));
+    fail_if(response.completed);
+
+    response = diagnostic_receive_can_frame(&SHIMS, &handle, 0x18daf110,
+            can_data, sizeof(can_data));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    ck_assert_int_eq(response.arbitration_id, 0x18daf110);
+    ck_assert_int_eq(response.pid, 0xc);
+    ck_assert_int_eq(diagnostic_payload_to_integer(&response), 0x1af8);
+}
+END_TEST
+
+START_TEST (test_29_bit_multi_frame_without_buffer)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x18db33f1,
+        mode: OBD2_MODE_VEHICLE_INFORMATION,
+        has_pid: true,
+        pid: 0x2,
+        addressing: DIAGNOSTIC_ADDRESSING_NORMAL_FIXED
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+
+    const uint8_t first_frame[] = {0x10, 0x14, 0x9 + 0x40, 0x2, 0x1, 0x31,
+        0x46, 0x4d};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+            &handle, 0x18daf110, first_frame, sizeof(first_frame));
+    fail_if(response.completed);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x18da10f1);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x30);
+
+    const uint8_t consecutive_frames[][8] = {
+        {0x21, 0x43, 0x55, 0x39, 0x4a, 0x39, 0x34, 0x48},
+        {0x22, 0x55, 0x41, 0x30, 0x34, 0x35, 0x32, 0x34}
+    };
+    for(int i = 0; i < 2; i++) {
+        response = diagnostic_receive_can_frame(&SHIMS, &handle, 0x18daf110,
+                consecutive_frames[i], sizeof(consecutive_frames[i]));
+    }
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_unless(response.multi_frame);
+    fail_unless(last_response_was_received);
+    ck_assert_int_eq(response.pid, 0x2);
+    ck_assert_int_eq(response.full_payload_length, 18);
+    ck_assert_int_eq(response.full_payload[0], 0x01);
+    ck_assert_int_eq(response.full_payload[1], 0x31);
+    ck_assert_int_eq(response.full_payload[17], 0x34);
+}
+END_TEST
+
+START_TEST (test_normal_fixed_addressing_functional)
+{
+    DiagnosticRequest request = {
+        arbitration_id: OBD2_FUNCTIONAL_BROADCAST_EXTENDED_ID,
+        mode: OBD2_MODE_VEHICLE_INFORMATION,
+        has_pid: true,
+        pid: 0x2,
+        addressing: DIAGNOSTIC_ADDRESSING_NORMAL_FIXED
+    };
+    uint8_t receive_buffer[32];
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    handle.receive_buffer = receive_buffer;
+    handle.receive_buffer_size = sizeof(receive_buffer);
+    ck_assert_int_eq(last_can_frame_sent_arb_id,
+            OBD2_FUNCTIONAL_BROADCAST_EXTENDED_ID);
+
+    fail_unless(diagnostic_response_id_matches(&handle, 0x18daf110));
+    fail_unless(diagnostic_response_id_matches(&handle, 0x18daf1ee));
+    fail_if(diagnostic_response_id_matches(&handle, 0x18da10f1));
+    fail_if(diagnostic_response_id_matches(&handle, 0x7e8));
+
+    const uint8_t first_frame[] = {0x10, 0x14, 0x9 + 0x40, 0x2, 0x1, 0x31,
+        0x46, 0x4d};
+    diagnostic_receive_can_frame(&SHIMS, &handle, 0x18daf117, first_frame,
+            sizeof(first_frame));
+    // flow control goes back to the node that is responding
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x18da17f1);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x30);
+}
+END_TEST
+
+START_TEST (test_extended_addressing)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x6f1,
+        mode: OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST,
+        has_pid: true,
+        pid: 0xc,
+        addressing: DIAGNOSTIC_ADDRESSING_EXTENDED,
+        address_extension: 0x12,
+        response_address_extension: OBD2_EXTERNAL_TEST_EQUIPMENT_ADDRESS,
+        response_arbitration_id: 0x612
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, request.arbitration_id);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x12);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x2);
+    ck_assert_int_eq(last_can_payload_sent[2], request.mode);
+    ck_assert_int_eq(last_can_payload_sent[3], request.pid);
+    ck_assert_int_eq(last_can_payload_size, 8);
+
+    uint8_t can_data[] = {0xf0, 0x4, 0x1 + 0x40, 0xc, 0x1a, 0xf8};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            0x612, can_data, sizeof(can_data));
+    fail_if(response.completed);
+
+    can_data[0] = OBD2_EXTERNAL_TEST_EQUIPMENT_ADDRESS;
+    response = diagnostic_receive_can_frame(&SHIMS, &handle, 0x612, can_data,
+            sizeof(can_data));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    ck_assert_int_eq(diagnostic_payload_to_integer(&response), 0x1af8);
+
+    fail_unless(diagnostic_add_response_filter(&handle, 0x600, 0x7f0));
+    fail_unless(diagnostic_response_id_matches(&handle, 0x60a));
+}
+END_TEST
+
 #define STITCH_MULTIFRAME 1
 
 START_TEST (test_response_multi_frame)
@@ -495,6 +883,271 @@ START_TEST (test_response_multi_frame)
 }
 END_TEST
 
+START_TEST (test_response_pending_is_absorbed)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x31,
+        has_pid: true,
+        pid: 0xff00
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+
+    const uint8_t pending[] = {0x3, 0x7f, 0x31, NRC_RESPONSE_PENDING};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+            &handle, 0x7e8, pending, sizeof(pending));
+    fail_if(response.completed);
+    fail_if(handle.completed);
+    fail_if(last_response_was_received);
+    ck_assert_int_eq(response.negative_response_code, NRC_RESPONSE_PENDING);
+    ck_assert_int_eq(handle.response_pending_count, 1);
+
+    diagnostic_receive_can_frame(&SHIMS, &handle, 0x7e8, pending,
+            sizeof(pending));
+    ck_assert_int_eq(handle.response_pending_count, 2);
+
+    const uint8_t can_data[] = {0x4, 0x31 + 0x40, 0xff, 0x00, 0x1};
+    response = diagnostic_receive_can_frame(&SHIMS, &handle, 0x7e8,
+            can_data, sizeof(can_data));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_unless(last_response_was_received);
+}
+END_TEST
+
+START_TEST (test_payload_to_integer_sizes)
+{
+    DiagnosticResponse response = {
+        payload: {0x12, 0x34, 0x56, 0x78, 0x9a}
+    };
+    const int expected[] = {0, 0x12, 0x1234, 0x123456, 0x12345678};
+    int length;
+    for(length = 0; length <= 4; length++) {
+        response.payload_length = length;
+        ck_assert_int_eq(diagnostic_payload_to_integer(&response),
+                expected[length]);
+    }
+    // longer payloads keep the low 32 bits
+    response.payload_length = 5;
+    ck_assert_int_eq(diagnostic_payload_to_integer(&response), 0x3456789a);
+}
+END_TEST
+
+START_TEST (test_truncated_enhanced_pid_response)
+{
+    uint16_t arb_id = 0x100;
+    DiagnosticRequestHandle handle = diagnostic_request_pid(&SHIMS,
+            DIAGNOSTIC_ENHANCED_PID, arb_id, 0x1234, response_received_handler);
+
+    // only the high byte of the PID echo
+    const uint8_t can_data[] = {0x2, 0x22 + 0x40, 0x12};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            arb_id + 0x8, can_data, sizeof(can_data));
+    fail_if(response.completed);
+    fail_if(last_response_was_received);
+}
+END_TEST
+
+START_TEST (test_response_to_string)
+{
+    DiagnosticResponse response = {
+        completed: true,
+        success: true,
+        arbitration_id: 0x7e8,
+        mode: 0x1,
+        has_pid: true,
+        pid: 0xc,
+        payload: {0x1a, 0xf8},
+        payload_length: 2
+    };
+    char string[128];
+    size_t length = diagnostic_response_to_string(&response, string,
+            sizeof(string));
+    ck_assert_str_eq(string,
+            "arb_id: 0x7e8, mode: 0x1, pid: 0xc, payload: 0x1af8");
+    ck_assert_int_eq(length, strlen(string));
+
+    response.success = false;
+    response.has_pid = false;
+    response.negative_response_code = NRC_REQUEST_OUT_OF_RANGE;
+    response.payload_length = 0;
+    diagnostic_response_to_string(&response, string, sizeof(string));
+    ck_assert_str_eq(string, "arb_id: 0x7e8, mode: 0x1, nrc: 0x31, "
+            "no payload");
+}
+END_TEST
+
+START_TEST (test_response_to_string_full_payload)
+{
+    uint8_t vin[VIN_LENGTH];
+    int i;
+    for(i = 0; i < VIN_LENGTH; i++) {
+        vin[i] = 0xa0 + i;
+    }
+    DiagnosticResponse response = {
+        completed: true,
+        success: true,
+        arbitration_id: 0x18daf110,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        payload_length: MAX_UDS_RESPONSE_PAYLOAD_LENGTH,
+        full_payload: vin,
+        full_payload_length: sizeof(vin)
+    };
+    char string[128];
+    diagnostic_response_to_string(&response, string, sizeof(string));
+    ck_assert_str_eq(string, "arb_id: 0x18daf110, mode: 0x22, pid: 0xf190, "
+            "payload: 0xa0a1a2a3a4a5a6a7a8a9aaabacadaeafb0");
+}
+END_TEST
+
+START_TEST (test_to_string_truncates)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x2e,
+        has_pid: true,
+        pid: 0xf190,
+        payload: {0x12, 0x34, 0x56},
+        payload_length: 3
+    };
+    char string[128];
+    memset(string, 'x', sizeof(string));
+    size_t length = diagnostic_request_to_string(&request, string, 52);
+    ck_assert_str_eq(string, "arb_id: 0x7e0, mode: 0x2e, pid: 0xf190, "
+            "payload: 0x");
+    ck_assert_int_eq(length, 51);
+
+    // whole bytes only
+    length = diagnostic_request_to_string(&request, string, 57);
+    ck_assert_str_eq(string, "arb_id: 0x7e0, mode: 0x2e, pid: 0xf190, "
+            "payload: 0x1234");
+    ck_assert_int_eq(length, 55);
+    ck_assert_int_eq(string[56], 'x');
+
+    ck_assert_int_eq(diagnostic_request_to_string(&request, string, 1), 0);
+    ck_assert_str_eq(string, "");
+    ck_assert_int_eq(diagnostic_request_to_string(&request, NULL, 0), 0);
+}
+END_TEST
+
+START_TEST (test_request_to_string_large_payload)
+{
+    const uint8_t data[] = {0xde, 0xad, 0xbe, 0xef};
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x36,
+        payload: {0x1},
+        payload_length: 1,
+        large_payload: data,
+        large_payload_length: sizeof(data)
+    };
+    char string[128];
+    diagnostic_request_to_string(&request, string, sizeof(string));
+    ck_assert_str_eq(string,
+            "arb_id: 0x7e0, mode: 0x36, payload: 0x01deadbeef");
+}
+END_TEST
+
+START_TEST (test_request_template_sends_the_same_frame)
+{
+    DiagnosticRequest requests[] = {
+        {arbitration_id: 0x7e0, mode: 0x1, has_pid: true, pid: 0xc},
+        {arbitration_id: 0x7e0, mode: 0x22, has_pid: true, pid: 0xf190,
+            no_frame_padding: true},
+        {arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID, mode: 0x9,
+            has_pid: true, pid: 0x2},
+        {arbitration_id: 0x6f1, mode: 0x1, has_pid: true, pid: 0xd,
+            addressing: DIAGNOSTIC_ADDRESSING_EXTENDED,
+            address_extension: 0x12, response_arbitration_id: 0x612},
+        {arbitration_id: DIAGNOSTIC_NORMAL_FIXED_ID(0x10, 0xf1), mode: 0x22,
+            has_pid: true, pid: 0xf18c, payload: {1, 2, 3, 4, 5, 6},
+            payload_length: 6, can_fd: true,
+            addressing: DIAGNOSTIC_ADDRESSING_NORMAL_FIXED}
+    };
+    unsigned int i;
+    for(i = 0; i < sizeof(requests) / sizeof(requests[0]); i++) {
+        diagnostic_request(&SHIMS, &requests[i], NULL);
+        uint8_t expected[CAN_FD_MESSAGE_BYTE_SIZE];
+        uint8_t expected_size = last_can_payload_size;
+        memcpy(expected, last_can_payload_sent, expected_size);
+
+        DiagnosticRequestHandle handle = generate_diagnostic_request(&SHIMS,
+                &requests[i], NULL);
+        DiagnosticRequestTemplate request_template;
+        fail_unless(diagnostic_init_request_template(&request_template,
+                    &handle));
+        last_can_frame_sent_arb_id = 0;
+        diagnostic_start_request_template(&SHIMS, &request_template, &handle);
+        ck_assert_int_eq(last_can_frame_sent_arb_id,
+                requests[i].arbitration_id);
+        ck_assert_int_eq(last_can_payload_size, expected_size);
+        fail_unless(!memcmp(last_can_payload_sent, expected, expected_size));
+        fail_if(handle.completed);
+    }
+}
+END_TEST
+
+START_TEST (test_request_template_receives_responses)
+{
+    DiagnosticRequest request = {
+        arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID,
+        mode: OBD2_MODE_POWERTRAIN_DIAGNOSTIC_REQUEST,
+        has_pid: true,
+        pid: 0xc
+    };
+    DiagnosticRequestHandle handle = generate_diagnostic_request(&SHIMS,
+            &request, response_received_handler);
+    DiagnosticRequestTemplate request_template;
+    fail_unless(diagnostic_init_request_template(&request_template, &handle));
+    fail_if(can_frame_was_sent);
+
+    int i;
+    for(i = 0; i < 3; i++) {
+        last_response_was_received = false;
+        diagnostic_start_request_template(&SHIMS, &request_template, &handle);
+        fail_unless(diagnostic_request_sent(&handle));
+        fail_unless(diagnostic_response_id_matches(&handle, 0x7e9));
+        fail_if(diagnostic_response_id_matches(&handle, 0x7e0));
+
+        const uint8_t can_data[] = {0x4, 0x1 + 0x40, 0xc, 0x1a, i};
+        DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+                &handle, 0x7e9, can_data, sizeof(can_data));
+        fail_unless(response.completed);
+        fail_unless(response.success);
+        fail_unless(handle.completed);
+        fail_unless(last_response_was_received);
+        ck_assert_int_eq(response.pid, 0xc);
+        ck_assert_int_eq(diagnostic_payload_to_integer(&response),
+                0x1a00 + i);
+    }
+}
+END_TEST
+
+START_TEST (test_request_template_needs_a_single_frame)
+{
+    uint8_t data[32] = {0};
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x2e,
+        has_pid: true,
+        pid: 0xf190,
+        large_payload: data,
+        large_payload_length: sizeof(data)
+    };
+    DiagnosticRequestHandle handle = generate_diagnostic_request(&SHIMS,
+            &request, NULL);
+    DiagnosticRequestTemplate request_template;
+    fail_if(diagnostic_init_request_template(&request_template, &handle));
+
+    // but it fits in a CAN FD frame
+    handle.request.can_fd = true;
+    fail_unless(diagnostic_init_request_template(&request_template, &handle));
+}
+END_TEST
+
 Suite* testSuite(void) {
     Suite* s = suite_create("uds");
     TCase *tc_core = tcase_create("core");
@@ -508,6 +1161,7 @@ Suite* testSuite(void) {
     tcase_add_test(tc_core, test_send_functional_request);
     tcase_add_test(tc_core, test_send_diag_request_with_payload);
     tcase_add_test(tc_core, test_receive_wrong_arb_id);
+    tcase_add_test(tc_core, test_context_callback);
     tcase_add_test(tc_core, test_autoset_pid_length);
     tcase_add_test(tc_core, test_request_pid_standard);
     tcase_add_test(tc_core, test_request_pid_enhanced);
@@ -518,6 +1172,27 @@ Suite* testSuite(void) {
     tcase_add_test(tc_core, test_negative_response);
     tcase_add_test(tc_core, test_payload_to_integer);
     tcase_add_test(tc_core, test_response_multi_frame);
+    tcase_add_test(tc_core, test_receive_pdu);
+    tcase_add_test(tc_core, test_receive_pdu_negative_response);
+    tcase_add_test(tc_core, test_can_fd_single_frame_escape);
+    tcase_add_test(tc_core, test_can_fd_multi_frame_response);
+    tcase_add_test(tc_core, test_can_fd_sequence_error_aborts);
+    tcase_add_test(tc_core, test_can_fd_multi_frame_without_buffer);
+    tcase_add_test(tc_core, test_response_id_table_functional);
+    tcase_add_test(tc_core, test_normal_fixed_addressing_physical);
+    tcase_add_test(tc_core, test_29_bit_multi_frame_without_buffer);
+    tcase_add_test(tc_core, test_normal_fixed_addressing_functional);
+    tcase_add_test(tc_core, test_extended_addressing);
+    tcase_add_test(tc_core, test_response_pending_is_absorbed);
+    tcase_add_test(tc_core, test_payload_to_integer_sizes);
+    tcase_add_test(tc_core, test_truncated_enhanced_pid_response);
+    tcase_add_test(tc_core, test_response_to_string);
+    tcase_add_test(tc_core, test_response_to_string_full_payload);
+    tcase_add_test(tc_core, test_to_string_truncates);
+    tcase_add_test(tc_core, test_request_to_string_large_payload);
+    tcase_add_test(tc_core, test_request_template_sends_the_same_frame);
+    tcase_add_test(tc_core, test_request_template_receives_responses);
+    tcase_add_test(tc_core, test_request_template_needs_a_single_frame);
 
     // TODO these are future work:
     // TODO test request MIL
@@ -0,0 +1,347 @@
+#include <uds/uds.h>
+#include <uds/coroutine.hpp>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern "C" {
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+}
+
+static uint32_t current_time_us;
+static uint8_t sent_frame_count;
+static bool send_fails;
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static bool count_send(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    if(send_fails) {
+        return false;
+    }
+    ++sent_frame_count;
+    last_can_frame_sent_arb_id = arbitration_id;
+    memcpy(last_can_payload_sent, data, size);
+    return true;
+}
+
+static void setup_coroutine() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    SHIMS.send_can_message = count_send;
+    current_time_us = 1000;
+    sent_frame_count = 0;
+    send_fails = false;
+}
+
+static void answer_pid(uds::Executor& executor, uint32_t arbitration_id,
+        uint8_t pid, uint8_t high, uint8_t low) {
+    const uint8_t frame[] = {0x4, 0x41, pid, high, low, 0, 0, 0};
+    executor.receive_can_frame(arbitration_id, frame, sizeof(frame));
+}
+
+static uds::Task<float> read_rpm(uds::Executor& executor) {
+    uds::PidResult rpm = co_await executor.read_pid(0x7e0, 0xc);
+    co_return rpm ? rpm.value : -1;
+}
+
+START_TEST (test_read_pid)
+{
+    uds::Executor executor(&SHIMS);
+    uds::Task<float> task = read_rpm(executor);
+    fail_unless(static_cast<bool>(task));
+    fail_if(task.done());
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x1);
+    ck_assert_int_eq(last_can_payload_sent[2], 0xc);
+    ck_assert_int_eq(executor.pending_count(), 1);
+
+    answer_pid(executor, 0x7e8, 0xc, 0x1a, 0xf8);
+    fail_unless(task.done());
+    ck_assert_int_eq(task.result() * 4, 0x1af8);
+    ck_assert_int_eq(executor.pending_count(), 0);
+}
+END_TEST
+
+static uds::Task<int> read_both(uds::Executor& executor) {
+    // both are on the bus before either is awaited
+    auto rpm = executor.read_pid(0x7e0, 0xc);
+    auto speed = executor.read_pid(0x7e1, 0xd);
+    uds::PidResult speed_result = co_await speed;
+    uds::PidResult rpm_result = co_await rpm;
+    co_return (int) rpm_result.value + (int) speed_result.value;
+}
+
+START_TEST (test_concurrent_requests)
+{
+    uds::Executor executor(&SHIMS);
+    uds::Task<int> task = read_both(executor);
+    ck_assert_int_eq(sent_frame_count, 2);
+    ck_assert_int_eq(executor.pending_count(), 2);
+
+    // answered in the other order than they're awaited
+    answer_pid(executor, 0x7e8, 0xc, 0x0, 0x28);
+    fail_if(task.done());
+    answer_pid(executor, 0x7e9, 0xd, 0x32, 0x0);
+    fail_unless(task.done());
+    ck_assert_int_eq(task.result(), 10 + 0x32);
+}
+END_TEST
+
+static uds::Task<> read_into(uds::Executor& executor, uint32_t arbitration_id,
+        float* value) {
+    uds::PidResult result = co_await executor.read_pid(arbitration_id, 0xd);
+    *value = result.value;
+}
+
+START_TEST (test_many_coroutines)
+{
+    uds::Executor executor(&SHIMS);
+    const int count = 8;
+    float values[count] = {0};
+    uds::Task<> tasks[count];
+    for(int i = 0; i < count; i++) {
+        tasks[i] = read_into(executor, 0x7e0 + i, &values[i]);
+    }
+    ck_assert_int_eq(executor.pending_count(), count);
+
+    for(int i = count - 1; i >= 0; i--) {
+        answer_pid(executor, 0x7e8 + i, 0xd, i * 10, 0);
+        fail_unless(tasks[i].done());
+    }
+    for(int i = 0; i < count; i++) {
+        ck_assert_int_eq(values[i], i * 10);
+    }
+}
+END_TEST
+
+static uds::Task<uds::PidResult> read_speed(uds::Executor& executor) {
+    co_return co_await executor.read_pid(0x7e0, 0xd);
+}
+
+START_TEST (test_negative_response)
+{
+    uds::Executor executor(&SHIMS);
+    uds::Task<uds::PidResult> task = read_speed(executor);
+    const uint8_t frame[] = {0x3, 0x7f, 0x1, NRC_CONDITIONS_NOT_CORRECT, 0, 0,
+        0, 0};
+    executor.receive_can_frame(0x7e8, frame, sizeof(frame));
+    fail_unless(task.done());
+    fail_if(task.result().success);
+    ck_assert_int_eq(task.result().negative_response_code,
+            NRC_CONDITIONS_NOT_CORRECT);
+}
+END_TEST
+
+START_TEST (test_timeout)
+{
+    uds::Executor executor(&SHIMS);
+    uds::Task<uds::PidResult> task = read_speed(executor);
+    current_time_us += executor.response_timeout_us - 1;
+    executor.poll();
+    fail_if(task.done());
+
+    current_time_us += 1;
+    executor.poll();
+    fail_unless(task.done());
+    fail_if(task.result().success);
+    ck_assert_int_eq(task.result().negative_response_code, NRC_SUCCESS);
+    ck_assert_int_eq(executor.pending_count(), 0);
+}
+END_TEST
+
+START_TEST (test_response_pending_extends_timeout)
+{
+    uds::Executor executor(&SHIMS);
+    uds::Task<uds::PidResult> task = read_speed(executor);
+    current_time_us += executor.response_timeout_us / 2;
+    const uint8_t pending[] = {0x3, 0x7f, 0x1, NRC_RESPONSE_PENDING, 0, 0, 0,
+        0};
+    executor.receive_can_frame(0x7e8, pending, sizeof(pending));
+    fail_if(task.done());
+
+    current_time_us += executor.extended_timeout_us - 1;
+    executor.poll();
+    fail_if(task.done());
+
+    current_time_us += 1;
+    executor.poll();
+    fail_unless(task.done());
+    fail_if(task.result().success);
+}
+END_TEST
+
+START_TEST (test_send_failure)
+{
+    uds::Executor executor(&SHIMS);
+    send_fails = true;
+    uds::Task<uds::PidResult> task = read_speed(executor);
+    // never suspended
+    fail_unless(task.done());
+    fail_if(task.result().success);
+}
+END_TEST
+
+static uds::Task<DiagnosticResponse> read_did(uds::Executor& executor,
+        uint8_t* buffer, uint16_t buffer_size) {
+    DiagnosticRequest request = {};
+    request.arbitration_id = 0x7e0;
+    request.mode = 0x22;
+    request.has_pid = true;
+    request.pid = 0xf190;
+    request.pid_length = 2;
+    co_return co_await executor.request(request, buffer, buffer_size);
+}
+
+START_TEST (test_request)
+{
+    uds::Executor executor(&SHIMS);
+    uint8_t buffer[64];
+    uds::Task<DiagnosticResponse> task = read_did(executor, buffer,
+            sizeof(buffer));
+    ck_assert_int_eq(last_can_payload_sent[1], 0x22);
+
+    const uint8_t frame[] = {0x5, 0x62, 0xf1, 0x90, 0xab, 0xcd, 0, 0};
+    executor.receive_can_frame(0x7e8, frame, sizeof(frame));
+    fail_unless(task.done());
+    const DiagnosticResponse& response = task.result();
+    fail_unless(response.success);
+    ck_assert_int_eq(response.pid, 0xf190);
+    ck_assert_int_eq(response.payload_length, 2);
+    ck_assert_int_eq(response.payload[1], 0xcd);
+}
+END_TEST
+
+START_TEST (test_frames_extend_timeout)
+{
+    uds::Executor executor(&SHIMS);
+    uint8_t buffer[64];
+    uds::Task<DiagnosticResponse> task = read_did(executor, buffer,
+            sizeof(buffer));
+    const uint8_t frames[][8] = {
+        {0x10, 0x14, 0x62, 0xf1, 0x90, 'A', 'B', 'C'},
+        {0x21, 'D', 'E', 'F', 'G', 'H', 'I', 'J'},
+        {0x22, 'K', 'L', 'M', 'N', 'O', 'P', 'Q'}
+    };
+    // the whole response takes longer than the timeout, but no gap does
+    for(const uint8_t* frame : frames) {
+        current_time_us += executor.response_timeout_us - 1;
+        executor.poll();
+        fail_if(task.done());
+        executor.receive_can_frame(0x7e8, frame, 8);
+    }
+    fail_unless(task.done());
+    fail_unless(task.result().success);
+    ck_assert_int_eq(task.result().pid, 0xf190);
+}
+END_TEST
+
+static uds::Task<float> read_twice(uds::Executor& executor) {
+    float first = co_await read_rpm(executor);
+    float second = co_await read_rpm(executor);
+    co_return first + second;
+}
+
+START_TEST (test_awaiting_a_task)
+{
+    uds::Executor executor(&SHIMS);
+    uds::Task<float> task = read_twice(executor);
+    answer_pid(executor, 0x7e8, 0xc, 0x0, 0x4);
+    fail_if(task.done());
+    answer_pid(executor, 0x7e8, 0xc, 0x0, 0x8);
+    fail_unless(task.done());
+    ck_assert_int_eq(task.result(), 3);
+}
+END_TEST
+
+static uds::Task<> forget(uds::Executor& executor) {
+    executor.read_pid(0x7e0, 0xc);
+    co_return;
+}
+
+START_TEST (test_forgotten_request_freed)
+{
+    uds::Executor executor(&SHIMS);
+    for(int i = 0; i < UDS_MAX_PENDING_REQUESTS; i++) {
+        uds::Task<> task = forget(executor);
+        fail_unless(task.done());
+    }
+    ck_assert_int_eq(executor.pending_count(), UDS_MAX_PENDING_REQUESTS);
+
+    // all the requests are taken until they complete
+    uds::Task<uds::PidResult> task = read_speed(executor);
+    fail_unless(task.done());
+    fail_if(task.result().success);
+
+    current_time_us += executor.response_timeout_us;
+    executor.poll();
+    ck_assert_int_eq(executor.pending_count(), 0);
+    task = read_speed(executor);
+    fail_if(task.done());
+}
+END_TEST
+
+START_TEST (test_frame_pool_exhausted)
+{
+    uds::Executor executor(&SHIMS);
+    static uds::Task<> tasks[UDS_COROUTINE_FRAME_COUNT];
+    float value;
+    for(int i = 0; i < UDS_COROUTINE_FRAME_COUNT; i++) {
+        tasks[i] = read_into(executor, 0x7e0, &value);
+        fail_unless(static_cast<bool>(tasks[i]));
+    }
+    uds::Task<> extra = read_into(executor, 0x7e0, &value);
+    fail_if(static_cast<bool>(extra));
+    fail_unless(extra.done());
+
+    // destroying a task gives its frame back
+    tasks[0] = uds::Task<>();
+    extra = read_into(executor, 0x7e0, &value);
+    fail_unless(static_cast<bool>(extra));
+    extra = uds::Task<>();
+    for(int i = 0; i < UDS_COROUTINE_FRAME_COUNT; i++) {
+        tasks[i] = uds::Task<>();
+    }
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("coroutine");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_coroutine, NULL);
+    tcase_add_test(tc_core, test_read_pid);
+    tcase_add_test(tc_core, test_concurrent_requests);
+    tcase_add_test(tc_core, test_many_coroutines);
+    tcase_add_test(tc_core, test_negative_response);
+    tcase_add_test(tc_core, test_timeout);
+    tcase_add_test(tc_core, test_response_pending_extends_timeout);
+    tcase_add_test(tc_core, test_send_failure);
+    tcase_add_test(tc_core, test_request);
+    tcase_add_test(tc_core, test_frames_extend_timeout);
+    tcase_add_test(tc_core, test_awaiting_a_task);
+    tcase_add_test(tc_core, test_forgotten_request_freed);
+    tcase_add_test(tc_core, test_frame_pool_exhausted);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,423 @@
+#include <uds/uds.h>
+#include <uds/daemon.h>
+#include <uds/ipc.h>
+#include <uds/simulator.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[];
+extern bool can_frame_was_sent;
+
+#define EVENT_CAPACITY 64
+#define LONG_DID 0x0200
+
+static uint32_t current_time_us;
+static DiagnosticIpcSegment segment;
+static DiagnosticDaemon daemon_state;
+static DiagnosticIpcClient clients[2];
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static void setup_daemon() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    current_time_us = 1000;
+    diagnostic_ipc_init_segment(&segment);
+    diagnostic_init_daemon(&daemon_state, &segment);
+    fail_unless(diagnostic_ipc_attach(&clients[0], &segment));
+    fail_unless(diagnostic_ipc_attach(&clients[1], &segment));
+}
+
+static DiagnosticRequest did_request(uint32_t arbitration_id, uint16_t did) {
+    DiagnosticRequest request = {
+        arbitration_id: arbitration_id,
+        mode: 0x22,
+        has_pid: true,
+        pid: did,
+        pid_length: 2
+    };
+    return request;
+}
+
+static uint32_t submit(DiagnosticIpcClient* client, uint16_t did,
+        DiagnosticPriority priority) {
+    DiagnosticRequest request = did_request(0x7e0, did);
+    return diagnostic_ipc_submit(client, &request, priority);
+}
+
+static void respond(uint16_t did, uint8_t value) {
+    const uint8_t response[] = {0x4, 0x62, did >> 8, did & 0xff, value};
+    diagnostic_daemon_receive_can_frame(&SHIMS, &daemon_state, 0x7e8,
+            response, sizeof(response));
+}
+
+START_TEST (test_round_trip)
+{
+    uint32_t tag = submit(&clients[0], 0xf190, DIAGNOSTIC_PRIORITY_NORMAL);
+    fail_if(tag == 0);
+    fail_unless(diagnostic_ipc_peek_response(&clients[0]) == NULL);
+
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x22);
+    ck_assert_int_eq(last_can_payload_sent[2], 0xf1);
+    ck_assert_int_eq(last_can_payload_sent[3], 0x90);
+
+    respond(0xf190, 0x42);
+    const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+            &clients[0]);
+    fail_if(response == NULL);
+    ck_assert_int_eq(response->tag, tag);
+    fail_unless(response->response.completed);
+    fail_unless(response->response.success);
+    ck_assert_int_eq(response->response.pid, 0xf190);
+    ck_assert_int_eq(response->response.full_payload_length, 1);
+    fail_unless(response->response.full_payload == response->payload);
+    ck_assert_int_eq(response->payload[0], 0x42);
+
+    diagnostic_ipc_release_response(&clients[0]);
+    fail_unless(diagnostic_ipc_peek_response(&clients[0]) == NULL);
+    fail_unless(diagnostic_ipc_peek_response(&clients[1]) == NULL);
+    ck_assert_int_eq(daemon_state.delivered_count, 1);
+    ck_assert_int_eq(diagnostic_daemon_request_count(&daemon_state), 0);
+}
+END_TEST
+
+START_TEST (test_identical_requests_deduplicated)
+{
+    uint32_t first_tag = submit(&clients[0], 0xf190,
+            DIAGNOSTIC_PRIORITY_NORMAL);
+    uint32_t second_tag = submit(&clients[1], 0xf190,
+            DIAGNOSTIC_PRIORITY_LOW);
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    ck_assert_int_eq(daemon_state.received_count, 2);
+    ck_assert_int_eq(daemon_state.deduplicated_count, 1);
+    ck_assert_int_eq(diagnostic_daemon_request_count(&daemon_state), 1);
+
+    respond(0xf190, 0x42);
+    for(int i = 0; i < 2; i++) {
+        const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+                &clients[i]);
+        fail_if(response == NULL);
+        ck_assert_int_eq(response->tag, i == 0 ? first_tag : second_tag);
+        ck_assert_int_eq(response->payload[0], 0x42);
+    }
+    ck_assert_int_eq(daemon_state.delivered_count, 2);
+}
+END_TEST
+
+START_TEST (test_different_requests_not_deduplicated)
+{
+    submit(&clients[0], 0xf190, DIAGNOSTIC_PRIORITY_NORMAL);
+    submit(&clients[1], 0xf191, DIAGNOSTIC_PRIORITY_NORMAL);
+    DiagnosticRequest request = did_request(0x7e0, 0xf190);
+    request.payload[0] = 0x1;
+    request.payload_length = 1;
+    diagnostic_ipc_submit(&clients[1], &request, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    ck_assert_int_eq(daemon_state.deduplicated_count, 0);
+    ck_assert_int_eq(diagnostic_daemon_request_count(&daemon_state), 3);
+}
+END_TEST
+
+START_TEST (test_more_urgent_request_not_deduplicated)
+{
+    submit(&clients[0], 0xf190, DIAGNOSTIC_PRIORITY_LOW);
+    submit(&clients[1], 0xf190, DIAGNOSTIC_PRIORITY_HIGH);
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    ck_assert_int_eq(daemon_state.deduplicated_count, 0);
+    ck_assert_int_eq(diagnostic_daemon_request_count(&daemon_state), 2);
+}
+END_TEST
+
+START_TEST (test_timeout_answered)
+{
+    uint32_t tag = submit(&clients[0], 0xf190, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    current_time_us += daemon_state.scheduler.response_timeout_us;
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+
+    const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+            &clients[0]);
+    fail_if(response == NULL);
+    ck_assert_int_eq(response->tag, tag);
+    fail_unless(response->response.completed);
+    fail_if(response->response.success);
+    ck_assert_int_eq(response->response.negative_response_code, NRC_SUCCESS);
+    fail_unless(response->response.full_payload == NULL);
+}
+END_TEST
+
+START_TEST (test_detached_client_gets_nothing)
+{
+    submit(&clients[0], 0xf190, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    diagnostic_ipc_detach(&clients[0]);
+    fail_unless(diagnostic_ipc_peek_response(&clients[0]) == NULL);
+
+    // another client takes the channel over before the response arrives
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    DiagnosticIpcClient client;
+    fail_unless(diagnostic_ipc_attach(&client, &segment));
+    fail_unless(client.channel == &segment.channels[0]);
+
+    respond(0xf190, 0x42);
+    fail_unless(diagnostic_ipc_peek_response(&client) == NULL);
+    ck_assert_int_eq(daemon_state.dropped_count, 1);
+}
+END_TEST
+
+START_TEST (test_channels_exhausted_and_reclaimed)
+{
+    DiagnosticIpcClient others[MAX_IPC_CLIENTS];
+    for(int i = 2; i < MAX_IPC_CLIENTS; i++) {
+        fail_unless(diagnostic_ipc_attach(&others[i], &segment));
+    }
+    DiagnosticIpcClient client;
+    fail_if(diagnostic_ipc_attach(&client, &segment));
+
+    diagnostic_ipc_detach(&clients[1]);
+    // the channel is free once the daemon has emptied it
+    fail_if(diagnostic_ipc_attach(&client, &segment));
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    fail_unless(diagnostic_ipc_attach(&client, &segment));
+}
+END_TEST
+
+START_TEST (test_uninitialized_segment)
+{
+    static DiagnosticIpcSegment blank;
+    DiagnosticIpcClient client;
+    fail_if(diagnostic_ipc_attach(&client, &blank));
+    DiagnosticRequest request = did_request(0x7e0, 0xf190);
+    ck_assert_int_eq(diagnostic_ipc_submit(&client, &request,
+                DIAGNOSTIC_PRIORITY_NORMAL), 0);
+}
+END_TEST
+
+START_TEST (test_request_ring_full)
+{
+    for(int i = 0; i < IPC_RING_SIZE; i++) {
+        fail_if(submit(&clients[0], i, DIAGNOSTIC_PRIORITY_NORMAL) == 0);
+    }
+    ck_assert_int_eq(submit(&clients[0], 0xffff, DIAGNOSTIC_PRIORITY_NORMAL),
+            0);
+
+    // the scheduler takes what it has room for, the rest waits in the ring
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    ck_assert_int_eq(daemon_state.received_count, MAX_SCHEDULED_REQUESTS);
+    fail_if(submit(&clients[0], 0xffff, DIAGNOSTIC_PRIORITY_NORMAL) == 0);
+}
+END_TEST
+
+START_TEST (test_large_payload_refused)
+{
+    static const uint8_t data[16] = {0};
+    DiagnosticRequest request = did_request(0x7e0, 0xf190);
+    request.mode = 0x2e;
+    request.large_payload = data;
+    request.large_payload_length = sizeof(data);
+    ck_assert_int_eq(diagnostic_ipc_submit(&clients[0], &request,
+                DIAGNOSTIC_PRIORITY_NORMAL), 0);
+}
+END_TEST
+
+START_TEST (test_malformed_request_rejected)
+{
+    // a client that writes into its ring directly instead of submitting
+    uint32_t bad_priority = submit(&clients[0], 0xf190,
+            DIAGNOSTIC_PRIORITY_NORMAL);
+    DiagnosticIpcChannel* channel = clients[0].channel;
+    channel->requests[(channel->request_head - 1) % IPC_RING_SIZE].priority =
+            (DiagnosticPriority) 100000;
+    uint32_t bad_payload = submit(&clients[0], 0xf190,
+            DIAGNOSTIC_PRIORITY_NORMAL);
+    channel->requests[(channel->request_head - 1) % IPC_RING_SIZE]
+            .request.payload_length = UINT8_MAX;
+    uint32_t good = submit(&clients[0], 0xf191, DIAGNOSTIC_PRIORITY_NORMAL);
+
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    ck_assert_int_eq(daemon_state.received_count, 3);
+    ck_assert_int_eq(daemon_state.rejected_count, 2);
+    ck_assert_int_eq(diagnostic_daemon_request_count(&daemon_state), 1);
+    ck_assert_int_eq(last_can_payload_sent[3], 0x91);
+
+    const uint32_t rejected[] = {bad_priority, bad_payload};
+    for(int i = 0; i < 2; i++) {
+        const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+                &clients[0]);
+        fail_if(response == NULL);
+        ck_assert_int_eq(response->tag, rejected[i]);
+        fail_unless(response->response.completed);
+        fail_if(response->response.success);
+        diagnostic_ipc_release_response(&clients[0]);
+    }
+
+    respond(0xf191, 0x42);
+    const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+            &clients[0]);
+    fail_if(response == NULL);
+    ck_assert_int_eq(response->tag, good);
+    fail_unless(response->response.success);
+}
+END_TEST
+
+START_TEST (test_response_ring_full)
+{
+    // one request on the bus, answering more waiting clients than the ring
+    // holds is impossible, so fill the ring directly
+    DiagnosticResponse response = {completed: true, success: true};
+    uint32_t generation = diagnostic_ipc_channel_generation(&segment, 0);
+    for(int i = 0; i < IPC_RING_SIZE; i++) {
+        fail_unless(diagnostic_ipc_post_response(&segment, 0, generation, i,
+                    &response));
+    }
+    fail_if(diagnostic_ipc_post_response(&segment, 0, generation, 0,
+                &response));
+    ck_assert_int_eq(diagnostic_ipc_dropped_response_count(&clients[0]), 1);
+
+    diagnostic_ipc_release_response(&clients[0]);
+    fail_unless(diagnostic_ipc_post_response(&segment, 0, generation, 0,
+                &response));
+}
+END_TEST
+
+static DiagnosticSimulator simulator;
+
+static DiagnosticNegativeResponseCode read_long_value(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    *size = did & 0xfff;
+    for(uint16_t i = 0; i < *size; i++) {
+        destination[i] = i;
+    }
+    return NRC_SUCCESS;
+}
+
+static const DiagnosticServerDid long_dids[] = {
+    {LONG_DID, read_long_value, NULL, 0}
+};
+
+static void tester_received(DiagnosticSimulator* simulator,
+        const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    diagnostic_daemon_receive_can_frame(&SHIMS, &daemon_state, arbitration_id,
+            data, size);
+}
+
+START_TEST (test_simulated_bus)
+{
+    static DiagnosticVirtualEcu ecu;
+    static DiagnosticSimulatorEvent events[EVENT_CAPACITY];
+    static uint8_t transmit_buffer[1024];
+    diagnostic_init_virtual_ecu(&ecu, 0x7e0, 0x7e8);
+    ecu.response_delay_us = 1000;
+    ecu.server.dids = long_dids;
+    ecu.server.did_count = 1;
+    ecu.server.transmit_buffer = transmit_buffer;
+    ecu.server.transmit_buffer_size = sizeof(transmit_buffer);
+    diagnostic_init_simulator(&simulator, &ecu, 1, events, EVENT_CAPACITY, 1);
+    simulator.tester = tester_received;
+    SHIMS = diagnostic_simulator_shims(&simulator, NULL);
+
+    uint32_t tags[2];
+    for(int i = 0; i < 2; i++) {
+        tags[i] = submit(&clients[i], LONG_DID, DIAGNOSTIC_PRIORITY_NORMAL);
+    }
+    diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    while(diagnostic_simulator_step(&SHIMS, &simulator)) {
+        diagnostic_daemon_poll(&SHIMS, &daemon_state);
+    }
+
+    // the ECU was asked once, and both clients got the whole response
+    ck_assert_int_eq(ecu.request_count, 1);
+    for(int i = 0; i < 2; i++) {
+        const DiagnosticIpcResponse* response = diagnostic_ipc_peek_response(
+                &clients[i]);
+        fail_if(response == NULL);
+        ck_assert_int_eq(response->tag, tags[i]);
+        fail_unless(response->response.success);
+        ck_assert_int_eq(response->response.full_payload_length,
+                LONG_DID & 0xfff);
+        ck_assert_int_eq(response->response.full_payload[0xff], 0xff);
+    }
+}
+END_TEST
+
+#ifdef __linux__
+
+START_TEST (test_shared_memory_segment)
+{
+    DiagnosticIpcSegment* created = diagnostic_ipc_open_segment(
+            "/uds-test-daemon", true);
+    fail_if(created == NULL);
+    DiagnosticIpcSegment* mapped = diagnostic_ipc_open_segment(
+            "/uds-test-daemon", false);
+    fail_if(mapped == NULL);
+    fail_if(mapped == created);
+
+    // a request submitted through one mapping is read through the other
+    DiagnosticIpcClient client;
+    fail_unless(diagnostic_ipc_attach(&client, mapped));
+    DiagnosticRequest request = did_request(0x7e0, 0xf190);
+    uint32_t tag = diagnostic_ipc_submit(&client, &request,
+            DIAGNOSTIC_PRIORITY_NORMAL);
+    const DiagnosticIpcRequest* received = diagnostic_ipc_next_request(
+            created, 0);
+    fail_if(received == NULL);
+    ck_assert_int_eq(received->tag, tag);
+    ck_assert_int_eq(received->request.pid, 0xf190);
+
+    diagnostic_ipc_close_segment(mapped);
+    diagnostic_ipc_close_segment(created);
+    fail_unless(diagnostic_ipc_open_segment("/uds-test-none", false) == NULL);
+}
+END_TEST
+
+#endif // __linux__
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("daemon");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_daemon, NULL);
+    tcase_add_test(tc_core, test_round_trip);
+    tcase_add_test(tc_core, test_identical_requests_deduplicated);
+    tcase_add_test(tc_core, test_different_requests_not_deduplicated);
+    tcase_add_test(tc_core, test_more_urgent_request_not_deduplicated);
+    tcase_add_test(tc_core, test_timeout_answered);
+    tcase_add_test(tc_core, test_detached_client_gets_nothing);
+    tcase_add_test(tc_core, test_channels_exhausted_and_reclaimed);
+    tcase_add_test(tc_core, test_uninitialized_segment);
+    tcase_add_test(tc_core, test_request_ring_full);
+    tcase_add_test(tc_core, test_large_payload_refused);
+    tcase_add_test(tc_core, test_malformed_request_rejected);
+    tcase_add_test(tc_core, test_response_ring_full);
+    tcase_add_test(tc_core, test_simulated_bus);
+#ifdef __linux__
+    tcase_add_test(tc_core, test_shared_memory_segment);
+#endif
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
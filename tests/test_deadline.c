@@ -0,0 +1,283 @@
+#include <uds/uds.h>
+#include <uds/server.h>
+#include <uds/session.h>
+#include <uds/security.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern bool can_frame_was_sent;
+
+static uint32_t current_time_us;
+static uint8_t transfer_data[100];
+static DiagnosticDeadline deadline;
+
+static const uint8_t EXTENDED_SESSION_RESPONSE[] = {0x06, 0x50, 0x03, 0x00,
+    0x32, 0x01, 0xf4, 0x00};
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static bool invert_seed(DiagnosticSecurityAccess* access, uint8_t level,
+        const uint8_t seed[], uint8_t seed_size, uint8_t key[],
+        uint8_t* size) {
+    for(uint8_t i = 0; i < seed_size; i++) {
+        key[i] = ~seed[i];
+    }
+    *size = seed_size;
+    return true;
+}
+
+static void setup_deadline() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    current_time_us = 1000;
+    memset(&deadline, 0, sizeof(deadline));
+}
+
+static uint32_t remaining_us() {
+    return diagnostic_deadline_remaining_us(&deadline, current_time_us);
+}
+
+static void start_extended_session(DiagnosticSessionManager* manager) {
+    diagnostic_init_session_manager(manager);
+    diagnostic_session_start(&SHIMS, manager, 0x7e0,
+            DIAGNOSTIC_EXTENDED_SESSION);
+    diagnostic_session_receive_can_frame(&SHIMS, manager, 0x7e8,
+            EXTENDED_SESSION_RESPONSE, sizeof(EXTENDED_SESSION_RESPONSE));
+}
+
+START_TEST (test_add_deadline)
+{
+    ck_assert_int_eq(remaining_us(), UINT32_MAX);
+
+    diagnostic_add_deadline(&deadline, current_time_us, 500, 3000);
+    fail_unless(deadline.pending);
+    ck_assert_int_eq(deadline.time_us, 3500);
+    ck_assert_int_eq(remaining_us(), 2500);
+
+    // a later timer doesn't move it, an earlier one does
+    diagnostic_add_deadline(&deadline, current_time_us, 1000, 5000);
+    ck_assert_int_eq(deadline.time_us, 3500);
+    diagnostic_add_deadline(&deadline, current_time_us, 1000, 2000);
+    ck_assert_int_eq(deadline.time_us, 3000);
+
+    // a timer that has run out is due now
+    diagnostic_add_deadline(&deadline, current_time_us, 0, 10);
+    ck_assert_int_eq(remaining_us(), 0);
+    current_time_us += 100;
+    ck_assert_int_eq(remaining_us(), 0);
+}
+END_TEST
+
+START_TEST (test_deadline_wraps)
+{
+    current_time_us = 0xfffffff0;
+    diagnostic_add_deadline(&deadline, current_time_us, 0xffffff00, 1000);
+    ck_assert_int_eq(deadline.time_us, 0x2e8);
+    diagnostic_add_deadline(&deadline, current_time_us, current_time_us,
+            2000);
+    ck_assert_int_eq(deadline.time_us, 0x2e8);
+    ck_assert_int_eq(remaining_us(), 0x2f8);
+    current_time_us = 0x2e8;
+    ck_assert_int_eq(remaining_us(), 0);
+}
+END_TEST
+
+START_TEST (test_request_deadline)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x36,
+        payload: {0x1},
+        payload_length: 1,
+        large_payload: transfer_data,
+        large_payload_length: sizeof(transfer_data)
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            NULL);
+
+    // waiting for flow control
+    diagnostic_request_next_deadline(&SHIMS, &handle, &deadline);
+    ck_assert_int_eq(remaining_us(), 1000000);
+
+    // the ECU's STmin of 5ms
+    const uint8_t flow_control[] = {0x30, 0x00, 0x05};
+    diagnostic_receive_can_frame(&SHIMS, &handle, 0x7e8, flow_control,
+            sizeof(flow_control));
+    current_time_us += 1000;
+    memset(&deadline, 0, sizeof(deadline));
+    diagnostic_request_next_deadline(&SHIMS, &handle, &deadline);
+    ck_assert_int_eq(remaining_us(), 4000);
+
+    while(!diagnostic_request_sent(&handle)) {
+        current_time_us = deadline.time_us;
+        diagnostic_poll_request(&SHIMS, &handle);
+        memset(&deadline, 0, sizeof(deadline));
+        diagnostic_request_next_deadline(&SHIMS, &handle, &deadline);
+    }
+    fail_if(deadline.pending);
+}
+END_TEST
+
+START_TEST (test_session_deadline)
+{
+    DiagnosticSessionManager manager;
+    start_extended_session(&manager);
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    ck_assert_int_eq(remaining_us(), 2000000);
+
+    // traffic with the ECU pushes the keep-alive back
+    current_time_us += 500000;
+    const uint8_t response[] = {0x03, 0x62, 0xf1, 0x90};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, response,
+            sizeof(response));
+    memset(&deadline, 0, sizeof(deadline));
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    ck_assert_int_eq(remaining_us(), 2000000);
+
+    // a lost session is entered again right away
+    diagnostic_session_lost(&manager, 0x7e0);
+    memset(&deadline, 0, sizeof(deadline));
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    ck_assert_int_eq(remaining_us(), 0);
+
+    can_frame_was_sent = false;
+    diagnostic_session_poll(&SHIMS, &manager);
+    fail_unless(can_frame_was_sent);
+    memset(&deadline, 0, sizeof(deadline));
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    ck_assert_int_eq(remaining_us(), 1000000);
+}
+END_TEST
+
+START_TEST (test_security_deadline)
+{
+    DiagnosticSecurityAccess access;
+    diagnostic_init_security_access(&access, 0x7e0);
+    diagnostic_security_register_algorithm(&access, 1, invert_seed);
+    diagnostic_security_next_deadline(&SHIMS, &access, &deadline);
+    fail_if(deadline.pending);
+
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    diagnostic_security_next_deadline(&SHIMS, &access, &deadline);
+    ck_assert_int_eq(remaining_us(), 1000000);
+
+    current_time_us += 20000;
+    const uint8_t delayed[] = {0x03, 0x7f, 0x27, 0x37};
+    diagnostic_security_receive_can_frame(&SHIMS, &access, 0x7e8, delayed,
+            sizeof(delayed));
+    memset(&deadline, 0, sizeof(deadline));
+    diagnostic_security_next_deadline(&SHIMS, &access, &deadline);
+    ck_assert_int_eq(remaining_us(), 10000000);
+
+    current_time_us = deadline.time_us;
+    can_frame_was_sent = false;
+    diagnostic_security_poll(&SHIMS, &access);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_REQUESTING_SEED);
+}
+END_TEST
+
+START_TEST (test_server_deadline)
+{
+    DiagnosticServer server;
+    diagnostic_init_server(&server, 0x7e0, 0x7e8);
+    diagnostic_server_next_deadline(&SHIMS, &server, &deadline);
+    fail_if(deadline.pending);
+
+    const uint8_t request[] = {0x02, 0x10, 0x03};
+    diagnostic_server_receive_can_frame(&SHIMS, &server, 0x7e0, request,
+            sizeof(request));
+    ck_assert_int_eq(server.session, DIAGNOSTIC_EXTENDED_SESSION);
+    diagnostic_server_next_deadline(&SHIMS, &server, &deadline);
+    ck_assert_int_eq(remaining_us(), 5000000);
+
+    current_time_us = deadline.time_us;
+    diagnostic_server_poll(&SHIMS, &server);
+    ck_assert_int_eq(server.session, DIAGNOSTIC_DEFAULT_SESSION);
+}
+END_TEST
+
+START_TEST (test_earliest_across_handles)
+{
+    DiagnosticSessionManager manager;
+    start_extended_session(&manager);
+    DiagnosticSecurityAccess access;
+    diagnostic_init_security_access(&access, 0x7e0);
+    diagnostic_security_register_algorithm(&access, 1, invert_seed);
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    diagnostic_security_next_deadline(&SHIMS, &access, &deadline);
+    ck_assert_int_eq(remaining_us(), 1000000);
+}
+END_TEST
+
+START_TEST (test_no_clock)
+{
+    DiagnosticSessionManager manager;
+    start_extended_session(&manager);
+    SHIMS.get_time_us = NULL;
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    fail_if(deadline.pending);
+}
+END_TEST
+
+START_TEST (test_sleep_until_deadline)
+{
+    DiagnosticSessionManager manager;
+    start_extended_session(&manager);
+
+    // 10 seconds of an idle session, waking up only at deadlines
+    uint32_t wakeups = 0;
+    uint32_t end_us = current_time_us + 10000000;
+    while(true) {
+        memset(&deadline, 0, sizeof(deadline));
+        diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+        if(remaining_us() > end_us - current_time_us) {
+            break;
+        }
+        current_time_us += remaining_us();
+        diagnostic_session_poll(&SHIMS, &manager);
+        ++wakeups;
+    }
+    ck_assert_int_eq(wakeups, 5);
+    ck_assert_int_eq(manager.sessions[0].keep_alive_count, 5);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("deadline");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_deadline, NULL);
+    tcase_add_test(tc_core, test_add_deadline);
+    tcase_add_test(tc_core, test_deadline_wraps);
+    tcase_add_test(tc_core, test_request_deadline);
+    tcase_add_test(tc_core, test_session_deadline);
+    tcase_add_test(tc_core, test_security_deadline);
+    tcase_add_test(tc_core, test_server_deadline);
+    tcase_add_test(tc_core, test_earliest_across_handles);
+    tcase_add_test(tc_core, test_no_clock);
+    tcase_add_test(tc_core, test_sleep_until_deadline);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,185 @@
+#include <uds/uds.h>
+#include <uds/did.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+
+static DiagnosticDidRegistry registry;
+
+static float decode_temperature(uint16_t did, const uint8_t data[],
+        uint8_t size) {
+    return data[0] - 40;
+}
+
+static void setup_registry() {
+    setup();
+    diagnostic_init_did_registry(&registry, 8, 64);
+    diagnostic_register_did(&registry, 0xf40c, 2, NULL);
+    diagnostic_register_did(&registry, 0xf405, 1, decode_temperature);
+    diagnostic_register_did(&registry, 0xf190, 17, NULL);
+    diagnostic_register_did(&registry, 0xf40d, 1, NULL);
+}
+
+START_TEST (test_register_did)
+{
+    const DiagnosticDidDefinition* definition = diagnostic_lookup_did(
+            &registry, 0xf405);
+    fail_if(definition == NULL);
+    ck_assert_int_eq(definition->length, 1);
+    fail_unless(definition->decoder == decode_temperature);
+    fail_unless(diagnostic_lookup_did(&registry, 0xf406) == NULL);
+
+    fail_unless(diagnostic_register_did(&registry, 0xf405, 2, NULL));
+    ck_assert_int_eq(diagnostic_lookup_did(&registry, 0xf405)->length, 2);
+    fail_if(diagnostic_register_did(&registry, 0xf406, 0, NULL));
+
+    int i;
+    for(i = 4; i < MAX_REGISTERED_DIDS; i++) {
+        fail_unless(diagnostic_register_did(&registry, 0x100 + i, 1, NULL));
+    }
+    fail_if(diagnostic_register_did(&registry, 0x1, 1, NULL));
+    for(i = 4; i < MAX_REGISTERED_DIDS; i++) {
+        fail_if(diagnostic_lookup_did(&registry, 0x100 + i) == NULL);
+    }
+    fail_if(diagnostic_lookup_did(&registry, 0xf190) == NULL);
+}
+END_TEST
+
+START_TEST (test_multi_did_request)
+{
+    const uint16_t dids[] = {0xf40c, 0xf405, 0xf40d};
+    DiagnosticMultiDidPayload payload;
+    DiagnosticRequest request;
+    ck_assert_int_eq(diagnostic_multi_did_request(&registry, 0x7e0, dids, 3,
+                &payload, &request), 3);
+    diagnostic_request(&SHIMS, &request, NULL);
+    const uint8_t expected[] = {0x7, 0x22, 0xf4, 0x0c, 0xf4, 0x05, 0xf4, 0x0d};
+    fail_unless(!memcmp(last_can_payload_sent, expected, sizeof(expected)));
+}
+END_TEST
+
+START_TEST (test_multi_did_request_limits)
+{
+    const uint16_t dids[] = {0xf40c, 0xf405, 0xf190, 0xf40d, 0xf40c, 0xf405,
+        0xf40d, 0xf40c, 0xf405, 0xf40d};
+    DiagnosticMultiDidPayload payload;
+    DiagnosticRequest request;
+    // the response to all 10 would fit in 50 bytes, but the ECU takes 8
+    ck_assert_int_eq(diagnostic_multi_did_request(&registry, 0x7e0, dids, 10,
+                &payload, &request), 8);
+    uint8_t encoded[32];
+    ck_assert_int_eq(diagnostic_encode_request(&request, encoded,
+                sizeof(encoded)), 17);
+    ck_assert_int_eq(encoded[15], 0xf4);
+    ck_assert_int_eq(encoded[16], 0x0c);
+
+    diagnostic_init_did_registry(&registry, 8, 30);
+    diagnostic_register_did(&registry, 0xf40c, 2, NULL);
+    diagnostic_register_did(&registry, 0xf405, 1, NULL);
+    diagnostic_register_did(&registry, 0xf190, 17, NULL);
+    // 1 + 4 + 3 + 19 = 27, and the next DID doesn't fit
+    ck_assert_int_eq(diagnostic_multi_did_request(&registry, 0x7e0, dids, 10,
+                &payload, &request), 3);
+
+    const uint16_t unregistered[] = {0xf40c, 0x1234, 0xf405};
+    ck_assert_int_eq(diagnostic_multi_did_request(&registry, 0x7e0,
+                unregistered, 3, &payload, &request), 1);
+    ck_assert_int_eq(diagnostic_multi_did_request(&registry, 0x7e0,
+                &unregistered[1], 2, &payload, &request), 0);
+}
+END_TEST
+
+START_TEST (test_parse_multi_did_response)
+{
+    const uint16_t dids[] = {0xf40c, 0xf405, 0xf40d};
+    DiagnosticMultiDidPayload payload;
+    DiagnosticRequest request;
+    diagnostic_multi_did_request(&registry, 0x7e0, dids, 3, &payload,
+            &request);
+    DiagnosticRequestHandle handle = generate_diagnostic_request(&SHIMS,
+            &request, NULL);
+
+    const uint8_t pdu[] = {0x62, 0xf4, 0x0c, 0x1a, 0xf8, 0xf4, 0x05, 0x7b,
+        0xf4, 0x0d, 0x32};
+    DiagnosticResponse response = diagnostic_receive_pdu(&SHIMS, &handle,
+            0x7e8, pdu, sizeof(pdu));
+    fail_unless(response.success);
+
+    DiagnosticDidValue values[4];
+    ck_assert_int_eq(diagnostic_parse_multi_did_response(&registry, &response,
+                values, 4), 3);
+    ck_assert_int_eq(values[0].did, 0xf40c);
+    ck_assert_int_eq(values[0].size, 2);
+    ck_assert_int_eq(values[0].value, 0x1af8);
+    ck_assert_int_eq(values[1].did, 0xf405);
+    ck_assert_int_eq(values[1].value, 0x7b - 40);
+    ck_assert_int_eq(values[2].did, 0xf40d);
+    ck_assert_int_eq(values[2].value, 0x32);
+    ck_assert_int_eq(values[2].data[0], 0x32);
+
+    ck_assert_int_eq(diagnostic_parse_multi_did_response(&registry, &response,
+                values, 2), 2);
+}
+END_TEST
+
+START_TEST (test_parse_truncated_response)
+{
+    DiagnosticResponse response = {
+        completed: true,
+        success: true,
+        has_pid: true,
+        pid: 0xf40c,
+        mode: 0x22
+    };
+    // the second record is cut short
+    const uint8_t data[] = {0x1a, 0xf8, 0xf4, 0x0c, 0x01};
+    response.full_payload = data;
+    response.full_payload_length = sizeof(data);
+    DiagnosticDidValue values[4];
+    ck_assert_int_eq(diagnostic_parse_multi_did_response(&registry, &response,
+                values, 4), 1);
+
+    // an unknown DID ends it too
+    const uint8_t unknown[] = {0x1a, 0xf8, 0x12, 0x34, 0x01, 0xf4, 0x0d, 0x1};
+    response.full_payload = unknown;
+    response.full_payload_length = sizeof(unknown);
+    ck_assert_int_eq(diagnostic_parse_multi_did_response(&registry, &response,
+                values, 4), 1);
+
+    response.success = false;
+    ck_assert_int_eq(diagnostic_parse_multi_did_response(&registry, &response,
+                values, 4), 0);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("did");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_registry, NULL);
+    tcase_add_test(tc_core, test_register_did);
+    tcase_add_test(tc_core, test_multi_did_request);
+    tcase_add_test(tc_core, test_multi_did_request_limits);
+    tcase_add_test(tc_core, test_parse_multi_did_response);
+    tcase_add_test(tc_core, test_parse_truncated_response);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,304 @@
+#include <uds/uds.h>
+#include <uds/flash.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+
+#define ECU_ID 0x7e0
+#define IMAGE_SIZE 2100
+// 8 bytes of data per TransferData, so the counter wraps
+#define BLOCK_LENGTH 10
+#define MAX_QUEUED_FRAMES 8
+
+static uint32_t current_time_us;
+static uint8_t image[IMAGE_SIZE];
+static uint8_t flashed[IMAGE_SIZE];
+static uint32_t flashed_size;
+
+// the loopback ECU
+static uint8_t ecu_message[64];
+static uint16_t ecu_expected_size;
+static uint16_t ecu_received_size;
+static uint8_t ecu_expected_counter;
+static bool ecu_counter_error;
+static uint8_t ecu_refuse_download;
+static uint16_t ecu_pending_block;
+static bool ecu_silent;
+static uint16_t ecu_blocks;
+static uint8_t queued_frames[MAX_QUEUED_FRAMES][8];
+static uint8_t queued_frame_count;
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static void queue_response(const uint8_t payload[], uint8_t size) {
+    if(!ecu_silent && queued_frame_count < MAX_QUEUED_FRAMES) {
+        uint8_t* frame = queued_frames[queued_frame_count++];
+        memset(frame, 0, 8);
+        frame[0] = size;
+        memcpy(&frame[1], payload, size);
+    }
+}
+
+static void ecu_handle_message() {
+    uint8_t response[4] = {ecu_message[0] + 0x40};
+    switch(ecu_message[0]) {
+        case 0x34:
+            if(ecu_refuse_download != 0) {
+                const uint8_t negative[] = {0x7f, 0x34, ecu_refuse_download};
+                queue_response(negative, sizeof(negative));
+                return;
+            }
+            ck_assert_int_eq(ecu_expected_size, 11);
+            ck_assert_int_eq(ecu_message[2], 0x44);
+            ck_assert_int_eq(ecu_message[5], 0x80);
+            ck_assert_int_eq(ecu_message[9], IMAGE_SIZE >> 8);
+            ck_assert_int_eq(ecu_message[10], IMAGE_SIZE & 0xff);
+            response[1] = 0x20;
+            response[2] = 0;
+            response[3] = BLOCK_LENGTH;
+            queue_response(response, 4);
+            ecu_expected_counter = 1;
+            break;
+        case 0x36:
+            if(ecu_message[1] != ecu_expected_counter) {
+                ecu_counter_error = true;
+            }
+            ++ecu_expected_counter;
+            memcpy(&flashed[flashed_size], &ecu_message[2],
+                    ecu_expected_size - 2);
+            flashed_size += ecu_expected_size - 2;
+            if(++ecu_blocks == ecu_pending_block) {
+                const uint8_t pending[] = {0x7f, 0x36, NRC_RESPONSE_PENDING};
+                queue_response(pending, sizeof(pending));
+            }
+            response[1] = ecu_message[1];
+            queue_response(response, 2);
+            break;
+        case 0x37:
+            queue_response(response, 1);
+            break;
+    }
+}
+
+static bool ecu_receive(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    ck_assert_int_eq(arbitration_id, ECU_ID);
+    uint16_t length;
+    switch(data[0] >> 4) {
+        case 0x0:
+            ecu_expected_size = data[0] & 0xf;
+            memcpy(ecu_message, &data[1], ecu_expected_size);
+            ecu_handle_message();
+            break;
+        case 0x1:
+            ecu_expected_size = ((data[0] & 0xf) << 8) | data[1];
+            memcpy(ecu_message, &data[2], 6);
+            ecu_received_size = 6;
+            if(!ecu_silent) {
+                uint8_t* frame = queued_frames[queued_frame_count++];
+                memset(frame, 0, 8);
+                frame[0] = 0x30;
+            }
+            break;
+        case 0x2:
+            length = ecu_expected_size - ecu_received_size;
+            if(length > 7) {
+                length = 7;
+            }
+            memcpy(&ecu_message[ecu_received_size], &data[1], length);
+            ecu_received_size += length;
+            if(ecu_received_size == ecu_expected_size) {
+                ecu_handle_message();
+            }
+            break;
+    }
+    return true;
+}
+
+static void deliver_frames(DiagnosticFlashTransfer* transfer) {
+    while(queued_frame_count > 0 && !diagnostic_flash_completed(transfer)) {
+        uint8_t frame[8];
+        memcpy(frame, queued_frames[0], 8);
+        memmove(queued_frames[0], queued_frames[1],
+                --queued_frame_count * sizeof(queued_frames[0]));
+        diagnostic_flash_receive_can_frame(&SHIMS, transfer, ECU_ID + 0x8,
+                frame, 8);
+    }
+}
+
+static void setup_flash() {
+    setup();
+    SHIMS.send_can_message = ecu_receive;
+    current_time_us = 1000;
+    for(int i = 0; i < IMAGE_SIZE; i++) {
+        image[i] = rand();
+    }
+    memset(flashed, 0, sizeof(flashed));
+    flashed_size = 0;
+    ecu_counter_error = false;
+    ecu_refuse_download = 0;
+    ecu_pending_block = 0;
+    ecu_silent = false;
+    ecu_blocks = 0;
+    queued_frame_count = 0;
+}
+
+START_TEST (test_flash_download)
+{
+    ecu_pending_block = 3;
+    DiagnosticFlashTransfer transfer;
+    diagnostic_init_flash(&transfer, ECU_ID, image, sizeof(image), 0x8000);
+    fail_unless(diagnostic_flash_start(&SHIMS, &transfer));
+    deliver_frames(&transfer);
+
+    ck_assert_int_eq(transfer.state, DIAGNOSTIC_FLASH_COMPLETED);
+    fail_if(ecu_counter_error);
+    ck_assert_int_eq(flashed_size, IMAGE_SIZE);
+    fail_if(memcmp(flashed, image, IMAGE_SIZE) != 0);
+    // the counter wrapped back to 0 after block 255
+    ck_assert_int_eq(ecu_blocks, (IMAGE_SIZE + 7) / 8);
+
+    DiagnosticFlashStatistics statistics = diagnostic_flash_statistics(&SHIMS,
+            &transfer);
+    ck_assert_int_eq(statistics.bytes_transferred, IMAGE_SIZE);
+    ck_assert_int_eq(statistics.blocks_transferred, (IMAGE_SIZE + 7) / 8);
+    ck_assert_int_eq(statistics.response_pending_count, 1);
+}
+END_TEST
+
+START_TEST (test_flash_refused)
+{
+    ecu_refuse_download = NRC_CONDITIONS_NOT_CORRECT;
+    DiagnosticFlashTransfer transfer;
+    diagnostic_init_flash(&transfer, ECU_ID, image, sizeof(image), 0x8000);
+    diagnostic_flash_start(&SHIMS, &transfer);
+    deliver_frames(&transfer);
+
+    fail_unless(diagnostic_flash_completed(&transfer));
+    ck_assert_int_eq(transfer.state, DIAGNOSTIC_FLASH_FAILED);
+    ck_assert_int_eq(transfer.negative_response_code,
+            NRC_CONDITIONS_NOT_CORRECT);
+    ck_assert_int_eq(flashed_size, 0);
+}
+END_TEST
+
+START_TEST (test_flash_response_timeout)
+{
+    SHIMS.get_time_us = mock_get_time;
+    ecu_silent = true;
+    DiagnosticFlashTransfer transfer;
+    diagnostic_init_flash(&transfer, ECU_ID, image, sizeof(image), 0x8000);
+    transfer.response_timeout_us = 10000;
+    diagnostic_flash_start(&SHIMS, &transfer);
+
+    // the request isn't sent until the ECU's flow control arrives
+    current_time_us += 20000;
+    diagnostic_flash_poll(&SHIMS, &transfer);
+    fail_if(diagnostic_flash_completed(&transfer));
+
+    const uint8_t flow_control[] = {0x30, 0, 0};
+    diagnostic_flash_receive_can_frame(&SHIMS, &transfer, ECU_ID + 0x8,
+            flow_control, sizeof(flow_control));
+    current_time_us += 9000;
+    diagnostic_flash_poll(&SHIMS, &transfer);
+    fail_if(diagnostic_flash_completed(&transfer));
+
+    current_time_us += 1000;
+    diagnostic_flash_poll(&SHIMS, &transfer);
+    ck_assert_int_eq(transfer.state, DIAGNOSTIC_FLASH_FAILED);
+}
+END_TEST
+
+START_TEST (test_flash_response_pending_extends_timeout)
+{
+    SHIMS.get_time_us = mock_get_time;
+    ecu_silent = true;
+    DiagnosticFlashTransfer transfer;
+    diagnostic_init_flash(&transfer, ECU_ID, image, sizeof(image), 0x8000);
+    transfer.response_timeout_us = 10000;
+    transfer.extended_timeout_us = 100000;
+    diagnostic_flash_start(&SHIMS, &transfer);
+
+    const uint8_t flow_control[] = {0x30, 0, 0};
+    diagnostic_flash_receive_can_frame(&SHIMS, &transfer, ECU_ID + 0x8,
+            flow_control, sizeof(flow_control));
+    current_time_us += 5000;
+    const uint8_t pending[] = {0x3, 0x7f, 0x34, NRC_RESPONSE_PENDING};
+    diagnostic_flash_receive_can_frame(&SHIMS, &transfer, ECU_ID + 0x8,
+            pending, sizeof(pending));
+
+    current_time_us += 90000;
+    diagnostic_flash_poll(&SHIMS, &transfer);
+    fail_if(diagnostic_flash_completed(&transfer));
+
+    current_time_us += 10000;
+    diagnostic_flash_poll(&SHIMS, &transfer);
+    ck_assert_int_eq(transfer.state, DIAGNOSTIC_FLASH_FAILED);
+}
+END_TEST
+
+START_TEST (test_theoretical_throughput)
+{
+    ck_assert_int_eq(diagnostic_flash_theoretical_throughput(500000, 0, false),
+            31531);
+    ck_assert_int_eq(diagnostic_flash_theoretical_throughput(500000, 2000000,
+                true), 190332);
+    ck_assert_int_eq(diagnostic_flash_theoretical_throughput(0, 0, false), 0);
+}
+END_TEST
+
+START_TEST (test_map_image)
+{
+    char path[] = "/tmp/uds-c-flash-XXXXXX";
+    int fd = mkstemp(path);
+    fail_if(fd < 0);
+    FILE* file = fdopen(fd, "w");
+    fwrite(image, 1, sizeof(image), file);
+    fclose(file);
+
+    uint32_t size = 0;
+    const uint8_t* mapped = diagnostic_flash_map_image(path, &size);
+    fail_if(mapped == NULL);
+    ck_assert_int_eq(size, IMAGE_SIZE);
+    fail_if(memcmp(mapped, image, IMAGE_SIZE) != 0);
+    diagnostic_flash_unmap_image(mapped, size);
+    remove(path);
+
+    fail_unless(diagnostic_flash_map_image(path, &size) == NULL);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("flash");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_flash, NULL);
+    tcase_add_test(tc_core, test_flash_download);
+    tcase_add_test(tc_core, test_flash_refused);
+    tcase_add_test(tc_core, test_flash_response_timeout);
+    tcase_add_test(tc_core, test_flash_response_pending_extends_timeout);
+    tcase_add_test(tc_core, test_theoretical_throughput);
+    tcase_add_test(tc_core, test_map_image);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
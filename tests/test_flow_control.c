@@ -0,0 +1,242 @@
+#include <uds/uds.h>
+#include <uds/flow_control.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+extern void setup();
+extern bool last_response_was_received;
+extern DiagnosticResponse last_response_received;
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern uint8_t last_can_payload_size;
+
+static uint32_t current_time_us;
+static uint8_t receive_buffer[256];
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static void response_received_handler(const DiagnosticResponse* response) {
+    last_response_was_received = true;
+    last_response_received = *response;
+}
+
+static void setup_clock() {
+    setup();
+    current_time_us = 1000;
+    SHIMS.get_time_us = mock_get_time;
+}
+
+static DiagnosticRequestHandle request_vin(
+        DiagnosticFlowControlProfile* profiles, uint8_t profile_count) {
+    DiagnosticRequestHandle handle = diagnostic_request_pid(&SHIMS,
+            DIAGNOSTIC_ENHANCED_PID, 0x7e0, 0xf190, response_received_handler);
+    handle.receive_buffer = receive_buffer;
+    handle.receive_buffer_size = sizeof(receive_buffer);
+    handle.flow_control_profiles = profiles;
+    handle.flow_control_profile_count = profile_count;
+    return handle;
+}
+
+/* Simulate a node answering with 'frame_count' consecutive frames, sent no
+ * faster than both the requested separation time and its own minimum cadence.
+ * Frame 'drop_frame' (1-based, 0 for none) is lost on the way.
+ */
+static DiagnosticResponse receive_response(DiagnosticRequestHandle* handle,
+        uint8_t frame_count, uint32_t node_cadence_us, uint8_t drop_frame) {
+    uint16_t length = 6 + frame_count * 7;
+    uint8_t first_frame[] = {0x10 | (length >> 8), length & 0xff, 0x62, 0xf1,
+        0x90, 0x1, 0x2, 0x3};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, handle,
+            0x7e8, first_frame, sizeof(first_frame));
+    uint32_t separation_time_us = diagnostic_decode_separation_time(
+            last_can_payload_sent[2]);
+    uint32_t cadence = separation_time_us > node_cadence_us ?
+            separation_time_us : node_cadence_us;
+
+    for(uint8_t i = 1; i <= frame_count; i++) {
+        current_time_us += cadence;
+        if(i == drop_frame) {
+            continue;
+        }
+        uint8_t consecutive_frame[] = {0x20 | (i & 0xf), i, i, i, i, i, i, i};
+        response = diagnostic_receive_can_frame(&SHIMS, handle, 0x7e8,
+                consecutive_frame, sizeof(consecutive_frame));
+    }
+    return response;
+}
+
+START_TEST (test_separation_time_encoding)
+{
+    ck_assert_int_eq(diagnostic_encode_separation_time(0), 0);
+    ck_assert_int_eq(diagnostic_encode_separation_time(100), 0xf1);
+    ck_assert_int_eq(diagnostic_encode_separation_time(150), 0xf2);
+    ck_assert_int_eq(diagnostic_encode_separation_time(900), 0xf9);
+    ck_assert_int_eq(diagnostic_encode_separation_time(901), 0x1);
+    ck_assert_int_eq(diagnostic_encode_separation_time(5000), 0x5);
+    ck_assert_int_eq(diagnostic_encode_separation_time(200000), 0x7f);
+
+    ck_assert_int_eq(diagnostic_decode_separation_time(0xa), 10000);
+    ck_assert_int_eq(diagnostic_decode_separation_time(0xf5), 500);
+    // reserved values mean the longest separation time
+    ck_assert_int_eq(diagnostic_decode_separation_time(0x80), 127000);
+    ck_assert_int_eq(diagnostic_decode_separation_time(0xfa), 127000);
+}
+END_TEST
+
+START_TEST (test_handle_flow_control)
+{
+    DiagnosticRequestHandle handle = request_vin(NULL, 0);
+    handle.flow_control.block_size = 4;
+    handle.flow_control.separation_time_us = 500;
+
+    const uint8_t first_frame[] = {0x10, 0x28, 0x62, 0xf1, 0x90, 0x1, 0x2,
+        0x3};
+    diagnostic_receive_can_frame(&SHIMS, &handle, 0x7e8, first_frame,
+            sizeof(first_frame));
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x30);
+    ck_assert_int_eq(last_can_payload_sent[1], 4);
+    ck_assert_int_eq(last_can_payload_sent[2], 0xf5);
+
+    for(uint8_t i = 1; i <= 4; i++) {
+        last_can_payload_sent[0] = 0;
+        uint8_t consecutive_frame[] = {0x20 | i, i, i, i, i, i, i, i};
+        DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+                &handle, 0x7e8, consecutive_frame, sizeof(consecutive_frame));
+        fail_if(response.completed);
+    }
+    // the next block is requested after 4 frames
+    ck_assert_int_eq(last_can_payload_sent[0], 0x30);
+    ck_assert_int_eq(last_can_payload_sent[1], 4);
+
+    const uint8_t last_frame[] = {0x25, 0x5, 0x5, 0x5, 0x5, 0x5, 0x5};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS, &handle,
+            0x7e8, last_frame, sizeof(last_frame));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    ck_assert_int_eq(response.full_payload_length, 37);
+}
+END_TEST
+
+START_TEST (test_profile_overrides_handle)
+{
+    DiagnosticFlowControlProfile profiles[2];
+    diagnostic_init_flow_control_profile(&profiles[0], 0x7e9, 8, 1000, false);
+    diagnostic_init_flow_control_profile(&profiles[1], 0x7e8, 0, 20000, false);
+    ck_assert(diagnostic_find_flow_control_profile(profiles, 2, 0x7e8) ==
+            &profiles[1]);
+    ck_assert(diagnostic_find_flow_control_profile(profiles, 2, 0x7ea) ==
+            NULL);
+
+    DiagnosticRequestHandle handle = request_vin(profiles, 2);
+    handle.flow_control.separation_time_us = 500;
+    DiagnosticResponse response = receive_response(&handle, 3, 0, 0);
+    fail_unless(response.completed);
+    ck_assert_int_eq(last_can_payload_sent[1], 0);
+    ck_assert_int_eq(last_can_payload_sent[2], 20);
+    // not auto-tuned
+    ck_assert_int_eq(profiles[1].tuned.separation_time_us, 20000);
+}
+END_TEST
+
+START_TEST (test_auto_tune_converges)
+{
+    DiagnosticFlowControlProfile profile;
+    diagnostic_init_flow_control_profile(&profile, 0x7e8, 0, 20000, true);
+
+    // the node can't send faster than every 1.5ms
+    uint32_t previous = profile.tuned.separation_time_us;
+    for(int i = 0; i < 20; i++) {
+        DiagnosticRequestHandle handle = request_vin(&profile, 1);
+        DiagnosticResponse response = receive_response(&handle, 10, 1500, 0);
+        fail_unless(response.completed);
+        fail_unless(response.success);
+        ck_assert_int_le(profile.tuned.separation_time_us, previous);
+        previous = profile.tuned.separation_time_us;
+    }
+
+    fail_unless(profile.converged);
+    ck_assert_int_lt(profile.tuned.separation_time_us, 1500);
+    ck_assert_int_ge(profile.frame_interval_us, 1500);
+    ck_assert_int_le(profile.frame_interval_us, 2000);
+}
+END_TEST
+
+START_TEST (test_auto_tune_backs_off_after_overrun)
+{
+    DiagnosticFlowControlProfile profile;
+    diagnostic_init_flow_control_profile(&profile, 0x7e8, 0, 8000, true);
+
+    DiagnosticRequestHandle handle = request_vin(&profile, 1);
+    receive_response(&handle, 10, 0, 0);
+    ck_assert_int_eq(profile.tuned.separation_time_us, 4000);
+
+    last_response_was_received = false;
+    handle = request_vin(&profile, 1);
+    receive_response(&handle, 10, 0, 5);
+    // the response is aborted at the gap, failing the request
+    fail_unless(handle.completed);
+    fail_if(handle.success);
+    fail_unless(last_response_was_received);
+    fail_if(last_response_received.success);
+    fail_unless(profile.has_failed);
+    // back to the last setting that worked
+    ck_assert_int_eq(profile.tuned.separation_time_us, 8000);
+
+    handle = request_vin(&profile, 1);
+    DiagnosticResponse response = receive_response(&handle, 10, 0, 0);
+    fail_unless(response.completed);
+    // and it stays there
+    ck_assert_int_eq(profile.tuned.separation_time_us, 8000);
+}
+END_TEST
+
+START_TEST (test_auto_tune_backoff_capped_at_configured)
+{
+    DiagnosticFlowControlProfile profile;
+    diagnostic_init_flow_control_profile(&profile, 0x7e8, 0, 8000, true);
+
+    // even the configured setting loses frames
+    DiagnosticRequestHandle handle = request_vin(&profile, 1);
+    receive_response(&handle, 10, 0, 5);
+    fail_unless(profile.has_failed);
+    ck_assert_int_eq(profile.tuned.separation_time_us, 8000);
+
+    handle = request_vin(&profile, 1);
+    receive_response(&handle, 10, 0, 5);
+    ck_assert_int_eq(profile.tuned.separation_time_us, 8000);
+    ck_assert_int_eq(profile.flow_control.separation_time_us, 8000);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("flow_control");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_clock, NULL);
+    tcase_add_test(tc_core, test_separation_time_encoding);
+    tcase_add_test(tc_core, test_handle_flow_control);
+    tcase_add_test(tc_core, test_profile_overrides_handle);
+    tcase_add_test(tc_core, test_auto_tune_converges);
+    tcase_add_test(tc_core, test_auto_tune_backs_off_after_overrun);
+    tcase_add_test(tc_core, test_auto_tune_backoff_capped_at_configured);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,151 @@
+#include <uds/uds.h>
+#include <uds/isotp_socket.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern DiagnosticResponse last_response_received;
+extern bool last_response_was_received;
+
+// a virtual CAN interface, e.g. from
+//      ip link add dev vcan0 type vcan && ip link set up vcan0
+// The tests that need it and the can-isotp module pass without them.
+#define TEST_INTERFACE "vcan0"
+#define TESTER_ID 0x7e0
+#define ECU_ID 0x7e8
+
+static void setup_isotp_socket() {
+    setup();
+}
+
+#ifdef __linux__
+
+static void response_received_handler(const DiagnosticResponse* response) {
+    last_response_was_received = true;
+    last_response_received = *response;
+}
+
+/* Private: Returns the lowest free file descriptor, to check that none leak.
+ */
+static int next_descriptor() {
+    int descriptor = dup(0);
+    if(descriptor >= 0) {
+        close(descriptor);
+    }
+    return descriptor;
+}
+
+START_TEST (test_unknown_interface)
+{
+    int before = next_descriptor();
+    ck_assert_int_eq(diagnostic_isotp_socket_open("uds-none0", TESTER_ID,
+                ECU_ID, true), -1);
+    ck_assert_int_eq(next_descriptor(), before);
+}
+END_TEST
+
+START_TEST (test_request_on_closed_socket)
+{
+    DiagnosticRequest request = {
+        arbitration_id: TESTER_ID,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190
+    };
+    DiagnosticRequestHandle handle = diagnostic_request_isotp_socket(&SHIMS,
+            -1, &request, response_received_handler);
+    fail_unless(handle.completed);
+    fail_if(handle.success);
+
+    uint8_t buffer[64];
+    DiagnosticResponse response = diagnostic_receive_isotp_socket(&SHIMS,
+            &handle, buffer, sizeof(buffer));
+    fail_if(response.completed);
+    fail_if(last_response_was_received);
+}
+END_TEST
+
+START_TEST (test_round_trip)
+{
+    int tester = diagnostic_isotp_socket_open(TEST_INTERFACE, TESTER_ID,
+            ECU_ID, true);
+    if(tester < 0) {
+        printf("Skipping ISO-TP socket round trip: no %s or can-isotp\n",
+                TEST_INTERFACE);
+        return;
+    }
+    int ecu = diagnostic_isotp_socket_open(TEST_INTERFACE, ECU_ID, TESTER_ID,
+            true);
+    fail_if(ecu < 0);
+
+    DiagnosticRequest request = {
+        arbitration_id: TESTER_ID,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        pid_length: 2
+    };
+    DiagnosticRequestHandle handle = diagnostic_request_isotp_socket(&SHIMS,
+            tester, &request, response_received_handler);
+    fail_if(handle.completed);
+
+    uint8_t received[8];
+    ck_assert_int_eq(read(ecu, received, sizeof(received)), 3);
+    ck_assert_int_eq(received[0], 0x22);
+    ck_assert_int_eq(received[1], 0xf1);
+    ck_assert_int_eq(received[2], 0x90);
+
+    // long enough that the kernel segments it and handles the flow control
+    uint8_t vin_response[20] = {0x62, 0xf1, 0x90};
+    memset(vin_response + 3, 'A', sizeof(vin_response) - 3);
+    ck_assert_int_eq(write(ecu, vin_response, sizeof(vin_response)),
+            sizeof(vin_response));
+
+    uint8_t buffer[4095];
+    DiagnosticResponse response = diagnostic_receive_isotp_socket(&SHIMS,
+            &handle, buffer, sizeof(buffer));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_unless(last_response_was_received);
+    ck_assert_int_eq(response.arbitration_id, ECU_ID);
+    ck_assert_int_eq(response.pid, 0xf190);
+    ck_assert_int_eq(response.full_payload_length, 17);
+    ck_assert_int_eq(response.full_payload[16], 'A');
+
+    diagnostic_isotp_socket_close(ecu);
+    diagnostic_isotp_socket_close(tester);
+}
+END_TEST
+
+#endif // __linux__
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("isotp_socket");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_isotp_socket, NULL);
+#ifdef __linux__
+    tcase_add_test(tc_core, test_unknown_interface);
+    tcase_add_test(tc_core, test_request_on_closed_socket);
+    tcase_add_test(tc_core, test_round_trip);
+#endif
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,326 @@
+#include <uds/uds.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern bool last_response_was_received;
+extern DiagnosticResponse last_response_received;
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern uint8_t last_can_payload_size;
+extern bool mock_send_can(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size);
+
+#define MAX_RECORDED_FRAMES 64
+
+static uint32_t current_time_us;
+static uint8_t sent_frames[MAX_RECORDED_FRAMES][CAN_FD_MESSAGE_BYTE_SIZE];
+static uint8_t sent_frame_count;
+static uint8_t transfer_data[100];
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static bool recording_send_can(const uint32_t arbitration_id,
+        const uint8_t* data, const uint8_t size) {
+    if(sent_frame_count < MAX_RECORDED_FRAMES) {
+        memcpy(sent_frames[sent_frame_count++], data, size);
+    }
+    return mock_send_can(arbitration_id, data, size);
+}
+
+static void response_received_handler(const DiagnosticResponse* response) {
+    last_response_was_received = true;
+    last_response_received = *response;
+}
+
+static void setup_transfer() {
+    setup();
+    SHIMS.send_can_message = recording_send_can;
+    current_time_us = 1000;
+    sent_frame_count = 0;
+    for(unsigned int i = 0; i < sizeof(transfer_data); i++) {
+        transfer_data[i] = i;
+    }
+}
+
+static DiagnosticRequestHandle request_transfer_data() {
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x36,
+        payload: {0x1},
+        payload_length: 1,
+        large_payload: transfer_data,
+        large_payload_length: sizeof(transfer_data)
+    };
+    return diagnostic_request(&SHIMS, &request, response_received_handler);
+}
+
+static void receive_flow_control(DiagnosticRequestHandle* handle,
+        uint8_t status, uint8_t block_size, uint8_t separation_time) {
+    const uint8_t can_data[] = {0x30 | status, block_size, separation_time};
+    diagnostic_receive_can_frame(&SHIMS, handle, 0x7e8, can_data,
+            sizeof(can_data));
+}
+
+START_TEST (test_sends_first_frame)
+{
+    DiagnosticRequestHandle handle = request_transfer_data();
+    fail_if(diagnostic_request_sent(&handle));
+    fail_if(handle.completed);
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    ck_assert_int_eq(last_can_payload_size, 8);
+    // 2 header bytes + 100 bytes of data
+    ck_assert_int_eq(last_can_payload_sent[0], 0x10);
+    ck_assert_int_eq(last_can_payload_sent[1], 102);
+    ck_assert_int_eq(last_can_payload_sent[2], 0x36);
+    ck_assert_int_eq(last_can_payload_sent[3], 0x1);
+    ck_assert_int_eq(last_can_payload_sent[4], 0);
+    ck_assert_int_eq(last_can_payload_sent[7], 3);
+}
+END_TEST
+
+START_TEST (test_flow_control_sends_whole_message)
+{
+    DiagnosticRequestHandle handle = request_transfer_data();
+    receive_flow_control(&handle, 0, 0, 0);
+    fail_unless(diagnostic_request_sent(&handle));
+    fail_if(handle.completed);
+
+    // 6 bytes in the first frame, then 96 in 7 byte consecutive frames
+    ck_assert_int_eq(sent_frame_count, 1 + 14);
+    ck_assert_int_eq(sent_frames[1][0], 0x21);
+    ck_assert_int_eq(sent_frames[1][1], 4);
+    ck_assert_int_eq(sent_frames[14][0], 0x2e);
+    ck_assert_int_eq(sent_frames[14][5], 99);
+
+    const uint8_t can_data[] = {0x2, 0x36 + 0x40, 0x1};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+            &handle, 0x7e8, can_data, sizeof(can_data));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_unless(last_response_was_received);
+}
+END_TEST
+
+START_TEST (test_flow_control_block_size)
+{
+    DiagnosticRequestHandle handle = request_transfer_data();
+    receive_flow_control(&handle, 0, 4, 0);
+    ck_assert_int_eq(sent_frame_count, 1 + 4);
+    fail_if(diagnostic_request_sent(&handle));
+
+    // frames aren't sent again until the next flow control
+    diagnostic_poll_request(&SHIMS, &handle);
+    ck_assert_int_eq(sent_frame_count, 1 + 4);
+
+    receive_flow_control(&handle, 0, 4, 0);
+    ck_assert_int_eq(sent_frame_count, 1 + 8);
+    ck_assert_int_eq(sent_frames[8][0], 0x28);
+}
+END_TEST
+
+START_TEST (test_flow_control_separation_time)
+{
+    SHIMS.get_time_us = mock_get_time;
+    DiagnosticRequestHandle handle = request_transfer_data();
+    receive_flow_control(&handle, 0, 0, 5);
+    ck_assert_int_eq(sent_frame_count, 2);
+
+    current_time_us += 4000;
+    diagnostic_poll_request(&SHIMS, &handle);
+    ck_assert_int_eq(sent_frame_count, 2);
+
+    current_time_us += 1000;
+    diagnostic_poll_request(&SHIMS, &handle);
+    ck_assert_int_eq(sent_frame_count, 3);
+    ck_assert_int_eq(sent_frames[2][0], 0x22);
+
+    while(!diagnostic_request_sent(&handle)) {
+        current_time_us += 5000;
+        diagnostic_poll_request(&SHIMS, &handle);
+    }
+    ck_assert_int_eq(sent_frame_count, 1 + 14);
+}
+END_TEST
+
+START_TEST (test_flow_control_wait)
+{
+    DiagnosticRequestHandle handle = request_transfer_data();
+    receive_flow_control(&handle, 1, 0, 0);
+    ck_assert_int_eq(sent_frame_count, 1);
+    fail_if(handle.completed);
+
+    receive_flow_control(&handle, 0, 0, 0);
+    fail_unless(diagnostic_request_sent(&handle));
+}
+END_TEST
+
+START_TEST (test_too_many_waits_aborts)
+{
+    DiagnosticRequestHandle handle = request_transfer_data();
+    for(int i = 0; i < 20; i++) {
+        receive_flow_control(&handle, 1, 0, 0);
+    }
+    fail_unless(handle.completed);
+    fail_if(handle.success);
+    ck_assert_int_eq(sent_frame_count, 1);
+}
+END_TEST
+
+START_TEST (test_flow_control_timeout_aborts)
+{
+    SHIMS.get_time_us = mock_get_time;
+    DiagnosticRequestHandle handle = request_transfer_data();
+    current_time_us += 900000;
+    receive_flow_control(&handle, 1, 0, 0);
+    current_time_us += 900000;
+    diagnostic_poll_request(&SHIMS, &handle);
+    fail_if(handle.completed);
+
+    current_time_us += 100000;
+    diagnostic_poll_request(&SHIMS, &handle);
+    fail_unless(handle.completed);
+    fail_if(handle.success);
+    ck_assert_int_eq(sent_frame_count, 1);
+}
+END_TEST
+
+START_TEST (test_overflow_aborts)
+{
+    DiagnosticRequestHandle handle = request_transfer_data();
+    receive_flow_control(&handle, 2, 0, 0);
+    fail_unless(handle.completed);
+    fail_if(handle.success);
+    ck_assert_int_eq(sent_frame_count, 1);
+}
+END_TEST
+
+START_TEST (test_fixed_payload_needs_multi_frame)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x2e,
+        has_pid: true,
+        pid: 0xf190,
+        payload: {1, 2, 3, 4, 5, 6, 7},
+        payload_length: 7
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x10);
+    ck_assert_int_eq(last_can_payload_sent[1], 10);
+
+    receive_flow_control(&handle, 0, 0, 0);
+    fail_unless(diagnostic_request_sent(&handle));
+    ck_assert_int_eq(last_can_payload_sent[0], 0x21);
+    ck_assert_int_eq(last_can_payload_sent[1], 4);
+    ck_assert_int_eq(last_can_payload_sent[4], 7);
+}
+END_TEST
+
+START_TEST (test_can_fd_large_payload)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x36,
+        payload: {0x1},
+        payload_length: 1,
+        large_payload: transfer_data,
+        large_payload_length: sizeof(transfer_data),
+        can_fd: true
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    ck_assert_int_eq(last_can_payload_size, 64);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x10);
+    ck_assert_int_eq(last_can_payload_sent[1], 102);
+
+    receive_flow_control(&handle, 0, 0, 0);
+    fail_unless(diagnostic_request_sent(&handle));
+    // 62 bytes in the first frame, 40 left for one consecutive frame padded
+    // to the next valid CAN FD length
+    ck_assert_int_eq(sent_frame_count, 2);
+    ck_assert_int_eq(last_can_payload_size, 48);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x21);
+    ck_assert_int_eq(last_can_payload_sent[1], 60);
+}
+END_TEST
+
+START_TEST (test_short_large_payload_single_frame)
+{
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x36,
+        payload: {0x1},
+        payload_length: 1,
+        large_payload: transfer_data,
+        large_payload_length: 4
+    };
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            response_received_handler);
+    fail_unless(diagnostic_request_sent(&handle));
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x6);
+    ck_assert_int_eq(last_can_payload_sent[2], 0x1);
+    ck_assert_int_eq(last_can_payload_sent[3], 0);
+    ck_assert_int_eq(last_can_payload_sent[6], 3);
+}
+END_TEST
+
+START_TEST (test_encode_large_payload)
+{
+    DiagnosticRequest request = {
+        mode: 0x36,
+        payload: {0x1},
+        payload_length: 1,
+        large_payload: transfer_data,
+        large_payload_length: sizeof(transfer_data)
+    };
+    uint8_t destination[MAX_DIAGNOSTIC_REQUEST_SIZE];
+    ck_assert_int_eq(diagnostic_encode_request(&request, destination,
+                sizeof(destination)), 102);
+    ck_assert_int_eq(destination[0], 0x36);
+    ck_assert_int_eq(destination[101], 99);
+    ck_assert_int_eq(diagnostic_encode_request(&request, destination, 50), 0);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("multi_frame_request");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_transfer, NULL);
+    tcase_add_test(tc_core, test_sends_first_frame);
+    tcase_add_test(tc_core, test_flow_control_sends_whole_message);
+    tcase_add_test(tc_core, test_flow_control_block_size);
+    tcase_add_test(tc_core, test_flow_control_separation_time);
+    tcase_add_test(tc_core, test_flow_control_wait);
+    tcase_add_test(tc_core, test_too_many_waits_aborts);
+    tcase_add_test(tc_core, test_flow_control_timeout_aborts);
+    tcase_add_test(tc_core, test_overflow_aborts);
+    tcase_add_test(tc_core, test_fixed_payload_needs_multi_frame);
+    tcase_add_test(tc_core, test_can_fd_large_payload);
+    tcase_add_test(tc_core, test_short_large_payload_single_frame);
+    tcase_add_test(tc_core, test_encode_large_payload);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
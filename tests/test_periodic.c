@@ -0,0 +1,271 @@
+#include <uds/uds.h>
+#include <uds/periodic.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern uint8_t last_can_payload_size;
+
+static DiagnosticPeriodicReceiver receiver;
+static uint16_t last_did;
+static uint8_t last_data[64];
+static uint8_t last_size;
+static int sample_count;
+
+static void sample_received(DiagnosticPeriodicReceiver* receiver,
+        uint16_t did, const uint8_t data[], uint8_t size) {
+    last_did = did;
+    memcpy(last_data, data, size);
+    last_size = size;
+    ++sample_count;
+}
+
+static void setup_periodic() {
+    setup();
+    diagnostic_init_periodic_receiver(&receiver, 0x7e8, 0x5e8);
+    last_did = 0;
+    last_size = 0;
+    sample_count = 0;
+}
+
+START_TEST (test_periodic_request)
+{
+    fail_unless(diagnostic_periodic_subscribe(&receiver, 0xf201,
+                DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received));
+    fail_unless(diagnostic_periodic_subscribe(&receiver, 0xf202,
+                DIAGNOSTIC_PERIODIC_RATE_SLOW, sample_received));
+    fail_unless(diagnostic_periodic_subscribe(&receiver, 0xf203,
+                DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received));
+
+    DiagnosticRequest request;
+    fail_unless(diagnostic_periodic_request(&receiver, 0x7e0,
+                DIAGNOSTIC_PERIODIC_RATE_FAST, &request));
+    DiagnosticRequestHandle handle = diagnostic_request(&SHIMS, &request,
+            NULL);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    const uint8_t expected[] = {0x4, 0x2a, 0x3, 0x1, 0x3};
+    fail_unless(!memcmp(last_can_payload_sent, expected, sizeof(expected)));
+
+    // the acknowledgement completes the request, and isn't a sample
+    const uint8_t acknowledgement[] = {0x1, 0x6a};
+    fail_if(diagnostic_periodic_receive_can_frame(&receiver, 0x7e8,
+                acknowledgement, sizeof(acknowledgement)));
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+            &handle, 0x7e8, acknowledgement, sizeof(acknowledgement));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+
+    fail_if(diagnostic_periodic_request(&receiver, 0x7e0,
+                DIAGNOSTIC_PERIODIC_RATE_MEDIUM, &request));
+}
+END_TEST
+
+START_TEST (test_many_periodic_dids)
+{
+    int i;
+    for(i = 0; i < 10; i++) {
+        diagnostic_periodic_subscribe(&receiver, 0xf210 + i,
+                DIAGNOSTIC_PERIODIC_RATE_MEDIUM, sample_received);
+    }
+    DiagnosticRequest request;
+    fail_unless(diagnostic_periodic_request(&receiver, 0x7e0,
+                DIAGNOSTIC_PERIODIC_RATE_MEDIUM, &request));
+    uint8_t payload[32];
+    ck_assert_int_eq(diagnostic_encode_request(&request, payload,
+                sizeof(payload)), 12);
+    ck_assert_int_eq(payload[0], 0x2a);
+    ck_assert_int_eq(payload[1], DIAGNOSTIC_PERIODIC_RATE_MEDIUM);
+    ck_assert_int_eq(payload[2], 0x10);
+    ck_assert_int_eq(payload[11], 0x19);
+}
+END_TEST
+
+START_TEST (test_stop_request)
+{
+    DiagnosticRequest request;
+    diagnostic_periodic_stop_request(0x7e0, 0xf201, &request);
+    uint8_t payload[8];
+    ck_assert_int_eq(diagnostic_encode_request(&request, payload,
+                sizeof(payload)), 3);
+    ck_assert_int_eq(payload[1], DIAGNOSTIC_PERIODIC_RATE_STOP);
+    ck_assert_int_eq(payload[2], 0x1);
+
+    diagnostic_periodic_stop_request(0x7e0, 0, &request);
+    ck_assert_int_eq(diagnostic_encode_request(&request, payload,
+                sizeof(payload)), 2);
+}
+END_TEST
+
+START_TEST (test_type_1_samples)
+{
+    diagnostic_periodic_subscribe(&receiver, 0xf201,
+            DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received);
+    const uint8_t frame[] = {0x01, 0x1a, 0xf8, 0x00, 0x00, 0x00, 0x00, 0x00};
+    fail_unless(diagnostic_periodic_receive_can_frame(&receiver, 0x5e8, frame,
+                sizeof(frame)));
+    ck_assert_int_eq(sample_count, 1);
+    ck_assert_int_eq(last_did, 0xf201);
+    ck_assert_int_eq(last_size, 7);
+    ck_assert_int_eq(last_data[0], 0x1a);
+    ck_assert_int_eq(last_data[1], 0xf8);
+    ck_assert_int_eq(receiver.sample_count, 1);
+
+    // other IDs aren't periodic frames
+    fail_if(diagnostic_periodic_receive_can_frame(&receiver, 0x5e9, frame,
+                sizeof(frame)));
+    ck_assert_int_eq(sample_count, 1);
+}
+END_TEST
+
+START_TEST (test_type_2_samples)
+{
+    diagnostic_periodic_subscribe(&receiver, 0xf201,
+            DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received);
+    diagnostic_periodic_subscribe(&receiver, 0xf202,
+            DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received);
+    const uint8_t frame[] = {0x04, 0x6a, 0x02, 0x12, 0x34, 0xaa, 0xaa, 0xaa};
+    fail_unless(diagnostic_periodic_receive_can_frame(&receiver, 0x7e8, frame,
+                sizeof(frame)));
+    ck_assert_int_eq(last_did, 0xf202);
+    ck_assert_int_eq(last_size, 2);
+    ck_assert_int_eq(last_data[1], 0x34);
+
+    // an ordinary response
+    const uint8_t response[] = {0x04, 0x62, 0xf1, 0x90, 0x01};
+    fail_if(diagnostic_periodic_receive_can_frame(&receiver, 0x7e8, response,
+                sizeof(response)));
+
+    // CAN FD single frame with the escape sequence
+    uint8_t fd_frame[12] = {0x00, 0x0a, 0x6a, 0x01};
+    fd_frame[11] = 0x99;
+    fail_unless(diagnostic_periodic_receive_can_frame(&receiver, 0x7e8,
+                fd_frame, sizeof(fd_frame)));
+    ck_assert_int_eq(last_did, 0xf201);
+    ck_assert_int_eq(last_size, 8);
+    ck_assert_int_eq(last_data[7], 0x99);
+    ck_assert_int_eq(sample_count, 2);
+}
+END_TEST
+
+START_TEST (test_unsubscribe)
+{
+    diagnostic_periodic_subscribe(&receiver, 0xf201,
+            DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received);
+    diagnostic_periodic_subscribe(&receiver, 0xf202,
+            DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received);
+    diagnostic_periodic_subscribe(&receiver, 0xf203,
+            DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received);
+    fail_unless(diagnostic_periodic_unsubscribe(&receiver, 0xf201));
+    fail_if(diagnostic_periodic_unsubscribe(&receiver, 0xf201));
+
+    const uint8_t first[] = {0x01, 0x1};
+    fail_unless(diagnostic_periodic_receive_can_frame(&receiver, 0x5e8, first,
+                sizeof(first)));
+    ck_assert_int_eq(sample_count, 0);
+    ck_assert_int_eq(receiver.unknown_sample_count, 1);
+
+    // the moved subscription still gets its samples
+    const uint8_t third[] = {0x03, 0x3};
+    diagnostic_periodic_receive_can_frame(&receiver, 0x5e8, third,
+            sizeof(third));
+    ck_assert_int_eq(last_did, 0xf203);
+    ck_assert_int_eq(sample_count, 1);
+}
+END_TEST
+
+START_TEST (test_subscribe_limits)
+{
+    fail_if(diagnostic_periodic_subscribe(&receiver, 0xf190,
+                DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received));
+    fail_if(diagnostic_periodic_subscribe(&receiver, 0xf201,
+                DIAGNOSTIC_PERIODIC_RATE_STOP, sample_received));
+    int i;
+    for(i = 0; i < MAX_PERIODIC_SUBSCRIPTIONS; i++) {
+        fail_unless(diagnostic_periodic_subscribe(&receiver, 0xf200 + i,
+                    DIAGNOSTIC_PERIODIC_RATE_SLOW, sample_received));
+    }
+    fail_if(diagnostic_periodic_subscribe(&receiver, 0xf2ff,
+                DIAGNOSTIC_PERIODIC_RATE_SLOW, sample_received));
+    // changing the rate of a subscription doesn't need room
+    fail_unless(diagnostic_periodic_subscribe(&receiver, 0xf200,
+                DIAGNOSTIC_PERIODIC_RATE_FAST, sample_received));
+}
+END_TEST
+
+START_TEST (test_define_dynamic_did)
+{
+    const DiagnosticDynamicDidSource sources[] = {
+        {source_did: 0xf40c, position: 1, size: 2},
+        {source_did: 0xf40d, position: 1, size: 1}
+    };
+    DiagnosticDynamicDidPayload payload;
+    DiagnosticRequest request;
+    fail_unless(diagnostic_define_dynamic_did_request(0x7e0, 0xf201, sources,
+                2, &payload, &request));
+    uint8_t encoded[32];
+    ck_assert_int_eq(diagnostic_encode_request(&request, encoded,
+                sizeof(encoded)), 12);
+    const uint8_t expected[] = {0x2c, 0x01, 0xf2, 0x01, 0xf4, 0x0c, 0x01, 0x02,
+        0xf4, 0x0d, 0x01, 0x01};
+    fail_unless(!memcmp(encoded, expected, sizeof(expected)));
+
+    DiagnosticRequestHandle handle = generate_diagnostic_request(&SHIMS,
+            &request, NULL);
+    const uint8_t positive[] = {0x6c, 0x01, 0xf2, 0x01};
+    DiagnosticResponse response = diagnostic_receive_pdu(&SHIMS, &handle,
+            0x7e8, positive, sizeof(positive));
+    fail_unless(response.completed);
+    fail_unless(response.success);
+
+    fail_if(diagnostic_define_dynamic_did_request(0x7e0, 0xf201, sources, 0,
+                &payload, &request));
+}
+END_TEST
+
+START_TEST (test_clear_dynamic_did)
+{
+    DiagnosticRequest request;
+    diagnostic_clear_dynamic_did_request(0x7e0, 0xf201, &request);
+    uint8_t encoded[8];
+    ck_assert_int_eq(diagnostic_encode_request(&request, encoded,
+                sizeof(encoded)), 4);
+    const uint8_t expected[] = {0x2c, 0x03, 0xf2, 0x01};
+    fail_unless(!memcmp(encoded, expected, sizeof(expected)));
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("periodic");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_periodic, NULL);
+    tcase_add_test(tc_core, test_periodic_request);
+    tcase_add_test(tc_core, test_many_periodic_dids);
+    tcase_add_test(tc_core, test_stop_request);
+    tcase_add_test(tc_core, test_type_1_samples);
+    tcase_add_test(tc_core, test_type_2_samples);
+    tcase_add_test(tc_core, test_unsubscribe);
+    tcase_add_test(tc_core, test_subscribe_limits);
+    tcase_add_test(tc_core, test_define_dynamic_did);
+    tcase_add_test(tc_core, test_clear_dynamic_did);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
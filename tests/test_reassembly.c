@@ -0,0 +1,294 @@
+#include <uds/uds.h>
+#include <uds/reassembly.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern bool can_frame_was_sent;
+
+#define ECU_COUNT 8
+#define STREAM_BUFFER_SIZE 256
+#define MAX_FRAMES 40
+// a classic frame with an 11-bit ID and 8 data bytes, back to back at 1Mbit/s
+#define FRAME_TIME_US 111
+
+typedef struct {
+    uint8_t message[STREAM_BUFFER_SIZE];
+    uint16_t size;
+    uint8_t frames[MAX_FRAMES][8];
+    uint8_t frame_count;
+    uint8_t next_frame;
+    bool received;
+} Ecu;
+
+static uint32_t current_time_us;
+static uint8_t buffer[ECU_COUNT * STREAM_BUFFER_SIZE];
+static DiagnosticReassembler reassembler;
+static DiagnosticRequestHandle handle;
+static Ecu ecus[ECU_COUNT];
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static void setup_reassembly() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    current_time_us = 1000;
+    diagnostic_init_reassembler(&reassembler, buffer, sizeof(buffer),
+            ECU_COUNT);
+
+    DiagnosticRequest request = {
+        arbitration_id: OBD2_FUNCTIONAL_BROADCAST_ID,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        pid_length: 2
+    };
+    handle = diagnostic_request(&SHIMS, &request, NULL);
+    handle.reassembler = &reassembler;
+}
+
+/* Split a positive ReadDataByIdentifier response of 'size' bytes in total
+ * into classic ISO-TP frames.
+ */
+static void prepare_response(Ecu* ecu, uint16_t size) {
+    ecu->message[0] = 0x62;
+    ecu->message[1] = 0xf1;
+    ecu->message[2] = 0x90;
+    for(uint16_t i = 3; i < size; i++) {
+        ecu->message[i] = rand();
+    }
+    ecu->size = size;
+    ecu->next_frame = 0;
+    ecu->received = false;
+
+    memset(ecu->frames, 0, sizeof(ecu->frames));
+    ecu->frames[0][0] = 0x10 | (size >> 8);
+    ecu->frames[0][1] = size;
+    memcpy(&ecu->frames[0][2], ecu->message, 6);
+    uint16_t sent = 6;
+    uint8_t count = 1;
+    while(sent < size) {
+        uint16_t chunk = size - sent > 7 ? 7 : size - sent;
+        ecu->frames[count][0] = 0x20 | (count & 0xf);
+        memcpy(&ecu->frames[count][1], &ecu->message[sent], chunk);
+        sent += chunk;
+        ++count;
+    }
+    ecu->frame_count = count;
+}
+
+static void receive(uint8_t ecu_index, const uint8_t frame[]) {
+    current_time_us += FRAME_TIME_US;
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+            &handle, 0x7e8 + ecu_index, frame, 8);
+    if(response.completed) {
+        Ecu* ecu = &ecus[ecu_index];
+        fail_unless(response.success);
+        ck_assert_int_eq(response.arbitration_id, 0x7e8 + ecu_index);
+        ck_assert_int_eq(response.full_payload_length, ecu->size - 3);
+        fail_unless(!memcmp(response.full_payload, &ecu->message[3],
+                    ecu->size - 3));
+        ecu->received = true;
+    }
+}
+
+static void send_next_frame(uint8_t ecu_index) {
+    Ecu* ecu = &ecus[ecu_index];
+    receive(ecu_index, ecu->frames[ecu->next_frame++]);
+}
+
+START_TEST (test_random_interleavings)
+{
+    srand(1);
+    for(int trial = 0; trial < 500; trial++) {
+        uint8_t remaining = ECU_COUNT;
+        for(uint8_t i = 0; i < ECU_COUNT; i++) {
+            prepare_response(&ecus[i], 8 + rand() % (STREAM_BUFFER_SIZE - 8));
+        }
+
+        // every ECU's frames stay in order, but the ECUs take turns at
+        // random, as they would when they all answer at full bus rate
+        while(remaining > 0) {
+            uint8_t ecu = rand() % ECU_COUNT;
+            if(ecus[ecu].next_frame == ecus[ecu].frame_count) {
+                continue;
+            }
+            send_next_frame(ecu);
+            if(ecus[ecu].next_frame == ecus[ecu].frame_count) {
+                --remaining;
+            }
+        }
+
+        for(uint8_t i = 0; i < ECU_COUNT; i++) {
+            fail_unless(ecus[i].received, "trial %d, ECU %d", trial, i);
+        }
+    }
+    ck_assert_int_eq(reassembler.completed_count, 500 * ECU_COUNT);
+    ck_assert_int_eq(reassembler.aborted_count, 0);
+    ck_assert_int_eq(reassembler.dropped_count, 0);
+}
+END_TEST
+
+START_TEST (test_sequence_gap_aborts)
+{
+    prepare_response(&ecus[0], 40);
+    prepare_response(&ecus[1], 40);
+    send_next_frame(0);
+    send_next_frame(1);
+    send_next_frame(0);
+    // ECU 1's first consecutive frame is lost
+    ++ecus[1].next_frame;
+    send_next_frame(1);
+    ck_assert_int_eq(reassembler.aborted_count, 1);
+
+    while(ecus[0].next_frame < ecus[0].frame_count) {
+        send_next_frame(0);
+        if(ecus[1].next_frame < ecus[1].frame_count) {
+            send_next_frame(1);
+        }
+    }
+    fail_unless(ecus[0].received);
+    fail_if(ecus[1].received);
+
+    // the ECU's next response starts cleanly
+    prepare_response(&ecus[1], 40);
+    while(ecus[1].next_frame < ecus[1].frame_count) {
+        send_next_frame(1);
+    }
+    fail_unless(ecus[1].received);
+    ck_assert_int_eq(reassembler.completed_count, 2);
+}
+END_TEST
+
+START_TEST (test_busy_streams_refuse)
+{
+    diagnostic_init_reassembler(&reassembler, buffer, sizeof(buffer), 2);
+    for(uint8_t i = 0; i < 3; i++) {
+        prepare_response(&ecus[i], 40);
+        can_frame_was_sent = false;
+        send_next_frame(i);
+        fail_unless(can_frame_was_sent);
+    }
+    // overflow flow control to the third ECU
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e2);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x32);
+    ck_assert_int_eq(reassembler.dropped_count, 1);
+
+    // its consecutive frames are ignored, the others complete
+    for(uint8_t frame = 1; frame < ecus[0].frame_count; frame++) {
+        for(uint8_t i = 0; i < 3; i++) {
+            send_next_frame(i);
+        }
+    }
+    fail_unless(ecus[0].received);
+    fail_unless(ecus[1].received);
+    fail_if(ecus[2].received);
+}
+END_TEST
+
+START_TEST (test_quiet_stream_reclaimed)
+{
+    diagnostic_init_reassembler(&reassembler, buffer, sizeof(buffer), 1);
+    prepare_response(&ecus[0], 40);
+    prepare_response(&ecus[1], 40);
+    send_next_frame(0);
+
+    send_next_frame(1);
+    ck_assert_int_eq(reassembler.dropped_count, 1);
+
+    current_time_us += 1000000;
+    ecus[1].next_frame = 0;
+    while(ecus[1].next_frame < ecus[1].frame_count) {
+        send_next_frame(1);
+    }
+    fail_unless(ecus[1].received);
+    ck_assert_int_eq(reassembler.aborted_count, 1);
+}
+END_TEST
+
+START_TEST (test_too_large_refused)
+{
+    diagnostic_init_reassembler(&reassembler, buffer, 8 * 64, 8);
+    prepare_response(&ecus[0], 65);
+    can_frame_was_sent = false;
+    send_next_frame(0);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x32);
+    ck_assert_int_eq(reassembler.dropped_count, 1);
+
+    prepare_response(&ecus[0], 64);
+    while(ecus[0].next_frame < ecus[0].frame_count) {
+        send_next_frame(0);
+    }
+    fail_unless(ecus[0].received);
+}
+END_TEST
+
+START_TEST (test_single_frames_need_no_stream)
+{
+    diagnostic_init_reassembler(&reassembler, buffer, sizeof(buffer), 1);
+    prepare_response(&ecus[0], 40);
+    send_next_frame(0);
+
+    const uint8_t single_frame[] = {0x05, 0x62, 0xf1, 0x90, 0x12, 0x34, 0x00,
+        0x00};
+    DiagnosticResponse response = diagnostic_receive_can_frame(&SHIMS,
+            &handle, 0x7e9, single_frame, sizeof(single_frame));
+    fail_unless(response.completed);
+    fail_if(response.multi_frame);
+    ck_assert_int_eq(response.payload[0], 0x12);
+
+    while(ecus[0].next_frame < ecus[0].frame_count) {
+        send_next_frame(0);
+    }
+    fail_unless(ecus[0].received);
+}
+END_TEST
+
+START_TEST (test_init_reassembler)
+{
+    fail_if(diagnostic_init_reassembler(&reassembler, buffer, sizeof(buffer),
+                0));
+    fail_if(diagnostic_init_reassembler(&reassembler, buffer, sizeof(buffer),
+                MAX_REASSEMBLY_STREAMS + 1));
+    fail_if(diagnostic_init_reassembler(&reassembler, buffer, 3, 4));
+    fail_unless(diagnostic_init_reassembler(&reassembler, buffer, 4, 4));
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("reassembly");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_reassembly, NULL);
+    tcase_add_test(tc_core, test_random_interleavings);
+    tcase_add_test(tc_core, test_sequence_gap_aborts);
+    tcase_add_test(tc_core, test_busy_streams_refuse);
+    tcase_add_test(tc_core, test_quiet_stream_reclaimed);
+    tcase_add_test(tc_core, test_too_large_refused);
+    tcase_add_test(tc_core, test_single_frames_need_no_stream);
+    tcase_add_test(tc_core, test_init_reassembler);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,327 @@
+#include <uds/uds.h>
+#include <uds/recorder.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+static DiagnosticRecorder recorder;
+static DiagnosticRecorderScan scan;
+static uint8_t log_buffer[65536];
+static size_t log_size;
+static bool fail_writes;
+
+static bool write_to_log(DiagnosticRecorder* recorder, const uint8_t data[],
+        uint16_t size) {
+    if(fail_writes || log_size + size > sizeof(log_buffer)) {
+        return false;
+    }
+    memcpy(&log_buffer[log_size], data, size);
+    log_size += size;
+    return true;
+}
+
+static void setup_recorder() {
+    log_size = 0;
+    fail_writes = false;
+    diagnostic_init_recorder(&recorder, write_to_log, NULL);
+}
+
+static DiagnosticResponse rpm_response(uint32_t arbitration_id,
+        uint16_t rpm) {
+    DiagnosticResponse response = {
+        completed: true,
+        success: true,
+        arbitration_id: arbitration_id,
+        mode: 0x1,
+        has_pid: true,
+        pid: 0xc,
+        payload: {(rpm * 4) >> 8, (rpm * 4) & 0xff},
+        payload_length: 2
+    };
+    return response;
+}
+
+START_TEST (test_round_trip)
+{
+    // jittered polling, a stall and timestamps from a faster poller
+    const uint64_t timestamps[] = {1000000, 1100003, 1199998, 1300000,
+        1300000, 1400000, 9400000, 9400100, 109400100, 109400101};
+    const uint16_t rpms[] = {800, 800, 812, 1530, 1530, 2047, 0, 16383, 16383,
+        900};
+    int i;
+    for(i = 0; i < 10; i++) {
+        DiagnosticResponse response = rpm_response(0x7e8, rpms[i]);
+        fail_unless(diagnostic_recorder_record(&recorder, &response,
+                    timestamps[i]));
+    }
+    ck_assert_int_eq(recorder.sample_count, 10);
+    ck_assert_int_eq(log_size, 0);
+    fail_unless(diagnostic_recorder_flush(&recorder));
+    ck_assert_int_eq(recorder.chunk_count, 1);
+    ck_assert_int_eq(log_buffer[0], 'U');
+    ck_assert_int_eq(log_buffer[1], 'C');
+    ck_assert_int_eq(log_buffer[2], DIAGNOSTIC_RECORDER_VERSION);
+    // smaller than the 12 bytes of a timestamp and value, even with this
+    // much jitter
+    fail_unless(log_size < DIAGNOSTIC_RECORDER_CHUNK_HEADER_SIZE + 10 * 12);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8, 0x1,
+            0xc, 0, UINT64_MAX);
+    uint64_t timestamp_us;
+    float value;
+    for(i = 0; i < 10; i++) {
+        fail_unless(diagnostic_recorder_next_sample(&scan, &timestamp_us,
+                    &value));
+        ck_assert_int_eq(timestamp_us, timestamps[i]);
+        ck_assert_int_eq(value, rpms[i]);
+    }
+    fail_if(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    fail_if(scan.malformed);
+}
+END_TEST
+
+START_TEST (test_range_scan)
+{
+    int i;
+    for(i = 0; i < 100; i++) {
+        DiagnosticResponse response = rpm_response(0x7e8, i);
+        diagnostic_recorder_record(&recorder, &response, i * 1000);
+    }
+    diagnostic_recorder_flush(&recorder);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8, 0x1,
+            0xc, 20000, 29000);
+    uint64_t timestamp_us;
+    float value;
+    int count = 0;
+    while(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value)) {
+        ck_assert_int_eq(timestamp_us, (20 + count) * 1000);
+        ck_assert_int_eq(value, 20 + count);
+        ++count;
+    }
+    ck_assert_int_eq(count, 10);
+    fail_if(scan.malformed);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8, 0x1,
+            0xc, 100000, 200000);
+    fail_if(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+}
+END_TEST
+
+START_TEST (test_series_are_separate)
+{
+    DiagnosticResponse engine = rpm_response(0x7e8, 1000);
+    DiagnosticResponse transmission = rpm_response(0x7e9, 2000);
+    DiagnosticResponse speed = {
+        completed: true,
+        success: true,
+        arbitration_id: 0x7e8,
+        mode: 0x1,
+        has_pid: true,
+        pid: 0xd,
+        payload: {88},
+        payload_length: 1
+    };
+    int i;
+    for(i = 0; i < 5; i++) {
+        diagnostic_recorder_record(&recorder, &engine, i);
+        diagnostic_recorder_record(&recorder, &transmission, i);
+        diagnostic_recorder_record(&recorder, &speed, i);
+    }
+    diagnostic_recorder_flush(&recorder);
+    ck_assert_int_eq(recorder.chunk_count, 3);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8, 0x1,
+            0xd, 0, UINT64_MAX);
+    uint64_t timestamp_us;
+    float value;
+    int count = 0;
+    while(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value)) {
+        ck_assert_int_eq(value, 88);
+        ++count;
+    }
+    ck_assert_int_eq(count, 5);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e9, 0x1,
+            0xc, 0, UINT64_MAX);
+    fail_unless(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    ck_assert_int_eq(value, 2000);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7ea, 0x1,
+            0xc, 0, UINT64_MAX);
+    fail_if(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    fail_if(scan.malformed);
+}
+END_TEST
+
+START_TEST (test_chunk_rollover)
+{
+    // values that never repeat, to fill chunks quickly
+    const int sample_count = 2000;
+    int i;
+    for(i = 0; i < sample_count; i++) {
+        DiagnosticResponse response = rpm_response(0x7e8, (i * 7919) % 16384);
+        diagnostic_recorder_record(&recorder, &response, i * 100 + i % 3);
+    }
+    fail_unless(recorder.chunk_count > 1);
+    diagnostic_recorder_flush(&recorder);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8, 0x1,
+            0xc, 0, UINT64_MAX);
+    uint64_t timestamp_us;
+    float value;
+    for(i = 0; i < sample_count; i++) {
+        fail_unless(diagnostic_recorder_next_sample(&scan, &timestamp_us,
+                    &value));
+        ck_assert_int_eq(timestamp_us, i * 100 + i % 3);
+        ck_assert_int_eq(value, (i * 7919) % 16384);
+    }
+    fail_if(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    fail_if(scan.malformed);
+}
+END_TEST
+
+START_TEST (test_recording_after_flush)
+{
+    DiagnosticResponse response = rpm_response(0x7e8, 1000);
+    diagnostic_recorder_record(&recorder, &response, 1);
+    diagnostic_recorder_flush(&recorder);
+    // nothing new to write
+    diagnostic_recorder_flush(&recorder);
+    ck_assert_int_eq(recorder.chunk_count, 1);
+
+    response = rpm_response(0x7e8, 2000);
+    diagnostic_recorder_record(&recorder, &response, 2);
+    diagnostic_recorder_flush(&recorder);
+    ck_assert_int_eq(recorder.chunk_count, 2);
+
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8, 0x1,
+            0xc, 0, UINT64_MAX);
+    uint64_t timestamp_us;
+    float value;
+    diagnostic_recorder_next_sample(&scan, &timestamp_us, &value);
+    ck_assert_int_eq(value, 1000);
+    fail_unless(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    ck_assert_int_eq(timestamp_us, 2);
+    ck_assert_int_eq(value, 2000);
+}
+END_TEST
+
+START_TEST (test_ignores_other_responses)
+{
+    DiagnosticResponse negative = {
+        completed: true,
+        success: false,
+        arbitration_id: 0x7e8,
+        mode: 0x1,
+        has_pid: true,
+        pid: 0xc,
+        negative_response_code: NRC_REQUEST_OUT_OF_RANGE
+    };
+    DiagnosticResponse no_pid = {
+        completed: true,
+        success: true,
+        arbitration_id: 0x7e8,
+        mode: 0x11
+    };
+    fail_if(diagnostic_recorder_record(&recorder, &negative, 0));
+    fail_if(diagnostic_recorder_record(&recorder, &no_pid, 0));
+    ck_assert_int_eq(recorder.sample_count, 0);
+    fail_unless(diagnostic_recorder_flush(&recorder));
+    ck_assert_int_eq(log_size, 0);
+}
+END_TEST
+
+START_TEST (test_series_table_full)
+{
+    int i;
+    for(i = 0; i < MAX_RECORDER_SERIES; i++) {
+        DiagnosticResponse response = rpm_response(0x18daf100 + i, 1000);
+        fail_unless(diagnostic_recorder_record(&recorder, &response, 0));
+    }
+    DiagnosticResponse response = rpm_response(0x7e8, 1000);
+    fail_if(diagnostic_recorder_record(&recorder, &response, 0));
+    // known series are still recorded
+    response = rpm_response(0x18daf100, 1000);
+    fail_unless(diagnostic_recorder_record(&recorder, &response, 1));
+    ck_assert_int_eq(recorder.sample_count, MAX_RECORDER_SERIES + 1);
+}
+END_TEST
+
+START_TEST (test_write_failure)
+{
+    DiagnosticResponse response = rpm_response(0x7e8, 1000);
+    diagnostic_recorder_record(&recorder, &response, 0);
+    fail_writes = true;
+    fail_if(diagnostic_recorder_flush(&recorder));
+    ck_assert_int_eq(recorder.dropped_chunk_count, 1);
+    ck_assert_int_eq(recorder.chunk_count, 0);
+
+    fail_writes = false;
+    diagnostic_recorder_record(&recorder, &response, 1);
+    fail_unless(diagnostic_recorder_flush(&recorder));
+    ck_assert_int_eq(recorder.chunk_count, 1);
+}
+END_TEST
+
+START_TEST (test_malformed_log)
+{
+    DiagnosticResponse response = rpm_response(0x7e8, 1000);
+    diagnostic_recorder_record(&recorder, &response, 0);
+    diagnostic_recorder_record(&recorder, &response, 1000);
+    diagnostic_recorder_flush(&recorder);
+
+    uint64_t timestamp_us;
+    float value;
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size - 1, 0x7e8,
+            0x1, 0xc, 0, UINT64_MAX);
+    fail_if(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    fail_unless(scan.malformed);
+
+    log_buffer[2] = DIAGNOSTIC_RECORDER_VERSION + 1;
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8,
+            0x1, 0xc, 0, UINT64_MAX);
+    fail_if(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    fail_unless(scan.malformed);
+    log_buffer[2] = DIAGNOSTIC_RECORDER_VERSION;
+
+    // more samples than the data holds
+    log_buffer[11] = 200;
+    diagnostic_recorder_start_scan(&scan, log_buffer, log_size, 0x7e8,
+            0x1, 0xc, 0, UINT64_MAX);
+    while(diagnostic_recorder_next_sample(&scan, &timestamp_us, &value));
+    fail_unless(scan.malformed);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("recorder");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_recorder, NULL);
+    tcase_add_test(tc_core, test_round_trip);
+    tcase_add_test(tc_core, test_range_scan);
+    tcase_add_test(tc_core, test_series_are_separate);
+    tcase_add_test(tc_core, test_chunk_rollover);
+    tcase_add_test(tc_core, test_recording_after_flush);
+    tcase_add_test(tc_core, test_ignores_other_responses);
+    tcase_add_test(tc_core, test_series_table_full);
+    tcase_add_test(tc_core, test_write_failure);
+    tcase_add_test(tc_core, test_malformed_log);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
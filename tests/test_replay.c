@@ -0,0 +1,249 @@
+#include <uds/uds.h>
+#include <uds/replay.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_RECORDED_TRANSACTIONS 4
+
+static DiagnosticReplay replay;
+static DiagnosticSnifferTransaction transactions[MAX_RECORDED_TRANSACTIONS];
+static int transaction_count;
+static int frame_count;
+static char trace[4096];
+
+static void transaction_completed(DiagnosticReplay* replay,
+        const DiagnosticSnifferTransaction* transaction) {
+    if(transaction_count < MAX_RECORDED_TRANSACTIONS) {
+        transactions[transaction_count] = *transaction;
+    }
+    ++transaction_count;
+}
+
+static void frame_received(DiagnosticReplay* replay,
+        const DiagnosticCanFrame* frame) {
+    ++frame_count;
+}
+
+static void setup_replay() {
+    transaction_count = 0;
+    frame_count = 0;
+    trace[0] = '\0';
+}
+
+static void start_replay() {
+    diagnostic_init_replay(&replay, trace, strlen(trace));
+    replay.transaction_completed = transaction_completed;
+    replay.frame_received = frame_received;
+}
+
+static bool parse(const char* line, DiagnosticCanFrame* frame) {
+    return diagnostic_parse_candump_line(line, strlen(line), frame);
+}
+
+START_TEST (test_parse_standard_frame)
+{
+    DiagnosticCanFrame frame;
+    fail_unless(parse("(1436509052.249713) can0 7E0#0201050000000000",
+                &frame));
+    ck_assert_int_eq(frame.timestamp_us, 1436509052249713ULL);
+    ck_assert_int_eq(frame.arbitration_id, 0x7e0);
+    fail_if(frame.can_fd);
+    ck_assert_int_eq(frame.size, 8);
+    ck_assert_int_eq(frame.data[0], 0x2);
+    ck_assert_int_eq(frame.data[2], 0x5);
+}
+END_TEST
+
+START_TEST (test_parse_extended_and_fd_frames)
+{
+    DiagnosticCanFrame frame;
+    fail_unless(parse("(0.5) vcan1 18DAF110#0341", &frame));
+    ck_assert_int_eq(frame.timestamp_us, 500000);
+    ck_assert_int_eq(frame.arbitration_id, 0x18daf110);
+    ck_assert_int_eq(frame.size, 2);
+
+    fail_unless(parse("(1.000001) can0 7e8##10562f19031\r", &frame));
+    fail_unless(frame.can_fd);
+    ck_assert_int_eq(frame.size, 5);
+    ck_assert_int_eq(frame.data[1], 0x62);
+    ck_assert_int_eq(frame.data[4], 0x31);
+
+    fail_unless(parse("(1.000001) can0 7E8#", &frame));
+    ck_assert_int_eq(frame.size, 0);
+}
+END_TEST
+
+START_TEST (test_parse_rejects_malformed_lines)
+{
+    DiagnosticCanFrame frame;
+    fail_if(parse("(1.0) can0 7E0#R", &frame));
+    fail_if(parse("(1.0) can0 7E0#0", &frame));
+    fail_if(parse("(1.0) can0 7E00#00", &frame));
+    fail_if(parse("1.0 can0 7E0#00", &frame));
+    fail_if(parse("(1.0 can0 7E0#00", &frame));
+    fail_if(parse("", &frame));
+}
+END_TEST
+
+START_TEST (test_matches_functional_request)
+{
+    strcat(trace,
+        "(100.000000) can0 7DF#02010C0000000000\n"
+        "(100.000100) can0 123#1122\n"
+        "(100.012000) can0 7E8#04410C1AF8000000\n");
+    start_replay();
+    diagnostic_replay_run(&replay);
+    ck_assert_int_eq(replay.frame_count, 3);
+    ck_assert_int_eq(frame_count, 3);
+    ck_assert_int_eq(replay.sniffer.request_count, 1);
+    ck_assert_int_eq(transaction_count, 1);
+    ck_assert_int_eq(transactions[0].request.arbitration_id, 0x7df);
+    fail_unless(transactions[0].response.success);
+    ck_assert_int_eq(transactions[0].response.arbitration_id, 0x7e8);
+    ck_assert_int_eq(transactions[0].response.pid, 0xc);
+    ck_assert_int_eq(transactions[0].response.payload_length, 2);
+    ck_assert_int_eq(transactions[0].response.payload[0], 0x1a);
+    ck_assert_int_eq(transactions[0].response_time_us -
+            transactions[0].request_time_us, 12000);
+}
+END_TEST
+
+START_TEST (test_negative_response)
+{
+    strcat(trace,
+        "(1.0) can0 7E0#0322F19000000000\n"
+        "(1.1) can0 7E8#037F223100000000\n");
+    start_replay();
+    diagnostic_replay_run(&replay);
+    ck_assert_int_eq(transaction_count, 1);
+    fail_if(transactions[0].response.success);
+    ck_assert_int_eq(transactions[0].request.pid, 0xf190);
+    ck_assert_int_eq(transactions[0].response.negative_response_code,
+            NRC_REQUEST_OUT_OF_RANGE);
+}
+END_TEST
+
+START_TEST (test_can_fd_multi_frame_response)
+{
+    char* line = trace + sprintf(trace,
+            "(2.0) can0 18DA10F1##10322F190\n"
+            "(2.1) can0 18DAF110##1" "1046" "62F190");
+    int i;
+    // 70 bytes: 0x62, the DID and 67 bytes of data, 59 in the first frame
+    for(i = 0; i < 59; i++) {
+        line += sprintf(line, "%02X", i);
+    }
+    line += sprintf(line, "\n(2.2) can0 18DA10F1##1300000\n"
+            "(2.3) can0 18DAF110##121");
+    for(i = 59; i < 67; i++) {
+        line += sprintf(line, "%02X", i);
+    }
+    sprintf(line, "000000\n");
+
+    start_replay();
+    diagnostic_replay_run(&replay);
+    ck_assert_int_eq(replay.malformed_line_count, 0);
+    ck_assert_int_eq(transaction_count, 1);
+    fail_unless(transactions[0].has_request);
+    fail_unless(transactions[0].response.success);
+    fail_unless(transactions[0].response.multi_frame);
+    ck_assert_int_eq(transactions[0].response.pid, 0xf190);
+    ck_assert_int_eq(transactions[0].response.full_payload_length, 67);
+    ck_assert_int_eq(transactions[0].response.full_payload[66], 66);
+}
+END_TEST
+
+START_TEST (test_unanswered_request_is_replaced)
+{
+    strcat(trace,
+        "(1.0) can0 7E0#023E000000000000\n"
+        "(2.0) can0 7E0#023E000000000000\n"
+        "(2.1) can0 7E8#027E000000000000\n"
+        "garbage\n"
+        "\n");
+    start_replay();
+    diagnostic_replay_run(&replay);
+    ck_assert_int_eq(replay.sniffer.request_count, 2);
+    ck_assert_int_eq(replay.malformed_line_count, 1);
+    ck_assert_int_eq(transaction_count, 1);
+    ck_assert_int_eq(transactions[0].request_time_us, 2000000);
+}
+END_TEST
+
+START_TEST (test_paced_replay)
+{
+    strcat(trace,
+        "(1.000) can0 7E0#023E000000000000\n"
+        "(1.040) can0 7E8#027E000000000000");
+    start_replay();
+    replay.speed = 2;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    diagnostic_replay_run(&replay);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_us = (end.tv_sec - start.tv_sec) * 1000000 +
+            (end.tv_nsec - start.tv_nsec) / 1000;
+    fail_unless(elapsed_us >= 20000);
+    ck_assert_int_eq(transaction_count, 1);
+}
+END_TEST
+
+START_TEST (test_map_trace)
+{
+    char path[] = "/tmp/uds-c-test-trace-XXXXXX";
+    int fd = mkstemp(path);
+    fail_if(fd < 0);
+    FILE* file = fdopen(fd, "w");
+    fputs("(1.0) can0 7E0#023E000000000000\n"
+            "(1.1) can0 7E8#027E000000000000\n", file);
+    fclose(file);
+
+    size_t size;
+    const char* mapped = diagnostic_replay_map_trace(path, &size);
+    fail_if(mapped == NULL);
+    diagnostic_init_replay(&replay, mapped, size);
+    replay.transaction_completed = transaction_completed;
+    diagnostic_replay_run(&replay);
+    ck_assert_int_eq(transaction_count, 1);
+    diagnostic_replay_unmap_trace(mapped, size);
+    remove(path);
+
+    fail_unless(diagnostic_replay_map_trace(path, &size) == NULL);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("replay");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_replay, NULL);
+    tcase_add_test(tc_core, test_parse_standard_frame);
+    tcase_add_test(tc_core, test_parse_extended_and_fd_frames);
+    tcase_add_test(tc_core, test_parse_rejects_malformed_lines);
+    tcase_add_test(tc_core, test_matches_functional_request);
+    tcase_add_test(tc_core, test_negative_response);
+    tcase_add_test(tc_core, test_can_fd_multi_frame_response);
+    tcase_add_test(tc_core, test_unanswered_request_is_replaced);
+    tcase_add_test(tc_core, test_paced_replay);
+    tcase_add_test(tc_core, test_map_trace);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
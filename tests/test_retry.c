@@ -0,0 +1,371 @@
+#include <uds/uds.h>
+#include <uds/retry.h>
+#include <uds/scheduler.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern bool can_frame_was_sent;
+extern bool mock_send_can(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size);
+
+static uint32_t current_time_us;
+static DiagnosticRetryPolicy policy;
+static DiagnosticCircuitBreakers breakers;
+static DiagnosticRequestScheduler scheduler;
+static DiagnosticResponse last_response;
+static uint8_t response_count;
+
+static const uint8_t POSITIVE_RESPONSE[] = {0x05, 0x62, 0xf1, 0x90, 0x12,
+    0x34, 0x00, 0x00};
+static const uint8_t BUSY_RESPONSE[] = {0x03, 0x7f, 0x22, 0x21, 0x00, 0x00,
+    0x00, 0x00};
+static const uint8_t OUT_OF_RANGE_RESPONSE[] = {0x03, 0x7f, 0x22, 0x31, 0x00,
+    0x00, 0x00, 0x00};
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static bool failing_send_can(const uint32_t arbitration_id,
+        const uint8_t* data, const uint8_t size) {
+    return false;
+}
+
+static void response_received(const DiagnosticResponse* response) {
+    last_response = *response;
+    ++response_count;
+}
+
+static void setup_retry() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    current_time_us = 1000;
+    response_count = 0;
+    diagnostic_init_retry_policy(&policy);
+    policy.jitter_percent = 0;
+    diagnostic_init_circuit_breakers(&breakers);
+    diagnostic_init_request_scheduler(&scheduler);
+    scheduler.retry_policy = &policy;
+    scheduler.circuit_breakers = &breakers;
+}
+
+static void schedule() {
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0xf190,
+        pid_length: 2
+    };
+    fail_if(diagnostic_schedule_request(&SHIMS, &scheduler, &request,
+                DIAGNOSTIC_PRIORITY_NORMAL, response_received) == NULL);
+}
+
+/* Returns true if polling the scheduler sent a request.
+ */
+static bool poll() {
+    can_frame_was_sent = false;
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    return can_frame_was_sent;
+}
+
+static void receive(const uint8_t data[]) {
+    diagnostic_scheduler_receive_can_frame(&SHIMS, &scheduler, 0x7e8, data,
+            8);
+}
+
+START_TEST (test_backoff_doubles_up_to_max)
+{
+    uint32_t random_state = 1;
+    ck_assert_int_eq(diagnostic_retry_backoff_us(&policy, 1, &random_state),
+            50000);
+    ck_assert_int_eq(diagnostic_retry_backoff_us(&policy, 2, &random_state),
+            100000);
+    ck_assert_int_eq(diagnostic_retry_backoff_us(&policy, 3, &random_state),
+            200000);
+    ck_assert_int_eq(diagnostic_retry_backoff_us(&policy, 6, &random_state),
+            1600000);
+    ck_assert_int_eq(diagnostic_retry_backoff_us(&policy, 7, &random_state),
+            2000000);
+    ck_assert_int_eq(diagnostic_retry_backoff_us(&policy, 255,
+                &random_state), 2000000);
+}
+END_TEST
+
+START_TEST (test_backoff_jitter)
+{
+    policy.jitter_percent = 50;
+    uint32_t random_state = 1;
+    uint32_t shortest = UINT32_MAX;
+    uint32_t longest = 0;
+    for(int i = 0; i < 1000; i++) {
+        uint32_t backoff_us = diagnostic_retry_backoff_us(&policy, 2,
+                &random_state);
+        fail_unless(backoff_us >= 50000 && backoff_us <= 100000);
+        shortest = backoff_us < shortest ? backoff_us : shortest;
+        longest = backoff_us > longest ? backoff_us : longest;
+    }
+    // spread across the range
+    fail_unless(shortest < 55000);
+    fail_unless(longest > 95000);
+}
+END_TEST
+
+START_TEST (test_retry_needed)
+{
+    DiagnosticResponse busy = {
+        completed: true,
+        success: false,
+        negative_response_code: NRC_BUSY_REPEAT_REQUEST
+    };
+    DiagnosticResponse out_of_range = busy;
+    out_of_range.negative_response_code = NRC_REQUEST_OUT_OF_RANGE;
+    DiagnosticResponse positive = {completed: true, success: true};
+
+    fail_unless(diagnostic_retry_needed(&policy, NULL, 1));
+    fail_unless(diagnostic_retry_needed(&policy, &busy, 2));
+    fail_if(diagnostic_retry_needed(&policy, &busy, 3));
+    fail_if(diagnostic_retry_needed(&policy, &out_of_range, 1));
+    fail_if(diagnostic_retry_needed(&policy, &positive, 1));
+
+    policy.retry_on_timeout = false;
+    fail_if(diagnostic_retry_needed(&policy, NULL, 1));
+
+    fail_unless(diagnostic_retry_on_nrc(&policy, NRC_REQUEST_OUT_OF_RANGE));
+    fail_unless(diagnostic_retry_needed(&policy, &out_of_range, 1));
+    while(policy.nrc_count < MAX_RETRY_NRCS) {
+        fail_unless(diagnostic_retry_on_nrc(&policy,
+                    NRC_REQUEST_SEQUENCE_ERROR));
+    }
+    fail_if(diagnostic_retry_on_nrc(&policy, NRC_GENERAL_REJECT));
+}
+END_TEST
+
+START_TEST (test_circuit_opens_and_probes)
+{
+    for(int i = 0; i < 3; i++) {
+        fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+        diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    }
+    DiagnosticCircuitBreaker* breaker = diagnostic_find_circuit_breaker(
+            &breakers, 0x7e0);
+    ck_assert_int_eq(breaker->state, DIAGNOSTIC_CIRCUIT_OPEN);
+    ck_assert_int_eq(breaker->opened_count, 1);
+    fail_if(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+    ck_assert_int_eq(breaker->refused_count, 1);
+    // other ECUs aren't affected
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e1));
+
+    DiagnosticDeadline deadline = {0};
+    diagnostic_circuit_next_deadline(&SHIMS, &breakers, &deadline);
+    ck_assert_int_eq(diagnostic_deadline_remaining_us(&deadline,
+                current_time_us), 5000000);
+
+    // one probe at a time
+    current_time_us += 5000000;
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+    ck_assert_int_eq(breaker->state, DIAGNOSTIC_CIRCUIT_HALF_OPEN);
+    fail_if(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+
+    // a failed probe opens the circuit for another interval
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    ck_assert_int_eq(breaker->state, DIAGNOSTIC_CIRCUIT_OPEN);
+    current_time_us += 4999999;
+    fail_if(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+    current_time_us += 1;
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, true);
+    ck_assert_int_eq(breaker->state, DIAGNOSTIC_CIRCUIT_CLOSED);
+    ck_assert_int_eq(breaker->failure_count, 0);
+    ck_assert_int_eq(breaker->opened_count, 1);
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+}
+END_TEST
+
+START_TEST (test_response_closes_circuit)
+{
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    // a negative response still shows the ECU is awake
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, true);
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    ck_assert_int_eq(diagnostic_find_circuit_breaker(&breakers, 0x7e0)->state,
+            DIAGNOSTIC_CIRCUIT_CLOSED);
+
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    fail_if(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+    diagnostic_circuit_reset(&breakers, 0x7e0);
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+}
+END_TEST
+
+START_TEST (test_scheduler_retries_busy_ecu)
+{
+    schedule();
+    fail_unless(poll());
+    receive(BUSY_RESPONSE);
+    ck_assert_int_eq(response_count, 0);
+
+    // not resent straight away
+    fail_if(poll());
+    DiagnosticDeadline deadline = {0};
+    diagnostic_scheduler_next_deadline(&SHIMS, &scheduler, &deadline);
+    ck_assert_int_eq(diagnostic_deadline_remaining_us(&deadline,
+                current_time_us), 50000);
+
+    current_time_us += 50000;
+    fail_unless(poll());
+    receive(POSITIVE_RESPONSE);
+    ck_assert_int_eq(response_count, 1);
+    fail_unless(last_response.success);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_NORMAL]
+            .retry_count, 1);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_NORMAL]
+            .completed_count, 1);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_NORMAL]
+            .total_latency_us, 50000);
+}
+END_TEST
+
+START_TEST (test_scheduler_gives_up)
+{
+    schedule();
+    fail_unless(poll());
+    receive(BUSY_RESPONSE);
+    current_time_us += 50000;
+    fail_unless(poll());
+    receive(BUSY_RESPONSE);
+    current_time_us += 99999;
+    fail_if(poll());
+    current_time_us += 1;
+    fail_unless(poll());
+    receive(BUSY_RESPONSE);
+
+    ck_assert_int_eq(response_count, 1);
+    fail_if(last_response.success);
+    ck_assert_int_eq(last_response.negative_response_code,
+            NRC_BUSY_REPEAT_REQUEST);
+    ck_assert_int_eq(diagnostic_scheduled_request_count(&scheduler), 0);
+}
+END_TEST
+
+START_TEST (test_scheduler_other_nrcs_not_retried)
+{
+    schedule();
+    poll();
+    receive(OUT_OF_RANGE_RESPONSE);
+    ck_assert_int_eq(response_count, 1);
+    ck_assert_int_eq(last_response.negative_response_code,
+            NRC_REQUEST_OUT_OF_RANGE);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_NORMAL]
+            .retry_count, 0);
+}
+END_TEST
+
+START_TEST (test_scheduler_stops_polling_unresponsive_ecu)
+{
+    schedule();
+    fail_unless(poll());
+    for(int attempt = 1; attempt < 3; attempt++) {
+        current_time_us += 1000000;
+        poll();
+        current_time_us += 50000 << (attempt - 1);
+        fail_unless(poll());
+    }
+    current_time_us += 1000000;
+    poll();
+    ck_assert_int_eq(response_count, 1);
+    fail_if(last_response.success);
+    ck_assert_int_eq(diagnostic_find_circuit_breaker(&breakers, 0x7e0)->state,
+            DIAGNOSTIC_CIRCUIT_OPEN);
+
+    // refused without touching the bus
+    schedule();
+    fail_if(poll());
+    ck_assert_int_eq(response_count, 2);
+    fail_if(last_response.success);
+
+    // until it's time for a probe
+    current_time_us += 5000000;
+    schedule();
+    fail_unless(poll());
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    receive(POSITIVE_RESPONSE);
+    ck_assert_int_eq(response_count, 3);
+    fail_unless(last_response.success);
+    ck_assert_int_eq(diagnostic_find_circuit_breaker(&breakers, 0x7e0)->state,
+            DIAGNOSTIC_CIRCUIT_CLOSED);
+}
+END_TEST
+
+START_TEST (test_scheduler_probe_not_sent)
+{
+    fail_unless(diagnostic_circuit_allows(&SHIMS, &breakers, 0x7e0));
+    for(int failure = 0; failure < 3; failure++) {
+        diagnostic_circuit_record(&SHIMS, &breakers, 0x7e0, false);
+    }
+
+    // the probe is let through but never makes it onto the bus
+    current_time_us += 5000000;
+    SHIMS.send_can_message = failing_send_can;
+    schedule();
+    poll();
+    ck_assert_int_eq(response_count, 1);
+    fail_if(last_response.success);
+    ck_assert_int_eq(diagnostic_find_circuit_breaker(&breakers, 0x7e0)->state,
+            DIAGNOSTIC_CIRCUIT_OPEN);
+
+    // so the circuit lets another one through later
+    SHIMS.send_can_message = mock_send_can;
+    schedule();
+    fail_if(poll());
+    current_time_us += 5000000;
+    schedule();
+    fail_unless(poll());
+    receive(POSITIVE_RESPONSE);
+    fail_unless(last_response.success);
+    ck_assert_int_eq(diagnostic_find_circuit_breaker(&breakers, 0x7e0)->state,
+            DIAGNOSTIC_CIRCUIT_CLOSED);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("retry");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_retry, NULL);
+    tcase_add_test(tc_core, test_backoff_doubles_up_to_max);
+    tcase_add_test(tc_core, test_backoff_jitter);
+    tcase_add_test(tc_core, test_retry_needed);
+    tcase_add_test(tc_core, test_circuit_opens_and_probes);
+    tcase_add_test(tc_core, test_response_closes_circuit);
+    tcase_add_test(tc_core, test_scheduler_retries_busy_ecu);
+    tcase_add_test(tc_core, test_scheduler_gives_up);
+    tcase_add_test(tc_core, test_scheduler_other_nrcs_not_retried);
+    tcase_add_test(tc_core, test_scheduler_stops_polling_unresponsive_ecu);
+    tcase_add_test(tc_core, test_scheduler_probe_not_sent);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
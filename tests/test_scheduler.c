@@ -0,0 +1,477 @@
+#include <uds/uds.h>
+#include <uds/scheduler.h>
+#include <uds/transport.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+
+#define MAX_SENT_FRAMES 32
+
+typedef struct {
+    uint32_t arbitration_id;
+    uint8_t data[8];
+} SentFrame;
+
+static uint32_t current_time_us;
+static DiagnosticRequestScheduler scheduler;
+static SentFrame sent_frames[MAX_SENT_FRAMES];
+static uint8_t sent_frame_count;
+static bool send_fails;
+static DiagnosticResponse responses[MAX_SENT_FRAMES];
+static uint8_t response_count;
+static uint8_t receive_buffer[128];
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static bool record_send(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    if(send_fails) {
+        return false;
+    }
+    if(sent_frame_count < MAX_SENT_FRAMES) {
+        sent_frames[sent_frame_count].arbitration_id = arbitration_id;
+        memset(sent_frames[sent_frame_count].data, 0, 8);
+        memcpy(sent_frames[sent_frame_count].data, data, size > 8 ? 8 : size);
+        ++sent_frame_count;
+    }
+    return true;
+}
+
+static void response_received(const DiagnosticResponse* response) {
+    responses[response_count++] = *response;
+}
+
+static void setup_scheduler() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    SHIMS.send_can_message = record_send;
+    current_time_us = 1000;
+    sent_frame_count = 0;
+    send_fails = false;
+    response_count = 0;
+    diagnostic_init_request_scheduler(&scheduler);
+}
+
+static DiagnosticRequestHandle* schedule(uint32_t arbitration_id,
+        uint16_t did, DiagnosticPriority priority) {
+    DiagnosticRequest request = {
+        arbitration_id: arbitration_id,
+        mode: 0x22,
+        has_pid: true,
+        pid: did,
+        pid_length: 2
+    };
+    return diagnostic_schedule_request(&SHIMS, &scheduler, &request, priority,
+            response_received);
+}
+
+static const SentFrame* last_frame() {
+    fail_unless(sent_frame_count > 0);
+    return &sent_frames[sent_frame_count - 1];
+}
+
+static uint16_t last_requested_did() {
+    const SentFrame* frame = last_frame();
+    ck_assert_int_eq(frame->data[1], 0x22);
+    return frame->data[2] << 8 | frame->data[3];
+}
+
+static void receive(uint32_t arbitration_id, const uint8_t data[]) {
+    diagnostic_scheduler_receive_can_frame(&SHIMS, &scheduler, arbitration_id,
+            data, 8);
+}
+
+static void answer(uint32_t arbitration_id, uint16_t did) {
+    const uint8_t frame[] = {0x05, 0x62, did >> 8, did & 0xff, 0x12, 0x34,
+        0x00, 0x00};
+    receive(arbitration_id, frame);
+}
+
+/* Start a 100 byte response to DID 0xf190 from 0x7e8.
+ */
+static void start_long_response() {
+    const uint8_t first_frame[] = {0x10, 100, 0x62, 0xf1, 0x90, 0x00, 0x01,
+        0x02};
+    receive(0x7e8, first_frame);
+}
+
+static void receive_consecutive_frames(uint8_t* sequence, uint8_t count) {
+    for(uint8_t i = 0; i < count; i++) {
+        uint8_t frame[8] = {0x20 | (*sequence & 0xf)};
+        memset(&frame[1], *sequence, 7);
+        receive(0x7e8, frame);
+        ++*sequence;
+    }
+}
+
+START_TEST (test_sent_by_priority)
+{
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_LOW);
+    schedule(0x7e0, 0x0002, DIAGNOSTIC_PRIORITY_NORMAL);
+    schedule(0x7e0, 0x0003, DIAGNOSTIC_PRIORITY_HIGH);
+    ck_assert_int_eq(sent_frame_count, 0);
+    ck_assert_int_eq(diagnostic_scheduled_request_count(&scheduler), 3);
+
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(last_requested_did(), 0x0003);
+
+    // one request in flight per ECU
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(sent_frame_count, 1);
+
+    answer(0x7e8, 0x0003);
+    ck_assert_int_eq(response_count, 1);
+    fail_unless(responses[0].success);
+    ck_assert_int_eq(responses[0].pid, 0x0003);
+    ck_assert_int_eq(last_requested_did(), 0x0002);
+
+    answer(0x7e8, 0x0002);
+    ck_assert_int_eq(last_requested_did(), 0x0001);
+    answer(0x7e8, 0x0001);
+    ck_assert_int_eq(response_count, 3);
+    ck_assert_int_eq(diagnostic_scheduled_request_count(&scheduler), 0);
+}
+END_TEST
+
+static void context_response_received(const DiagnosticResponse* response,
+        void* context) {
+    *(uint16_t*) context = response->pid;
+}
+
+START_TEST (test_context_callback)
+{
+    uint16_t answered_dids[2] = {0};
+    DiagnosticRequest request = {
+        arbitration_id: 0x7e0,
+        mode: 0x22,
+        has_pid: true,
+        pid: 0x0001,
+        pid_length: 2
+    };
+    fail_if(diagnostic_schedule_request_with_context(&SHIMS, &scheduler,
+                &request, DIAGNOSTIC_PRIORITY_NORMAL, context_response_received,
+                &answered_dids[0]) == NULL);
+    request.arbitration_id = 0x7e1;
+    request.pid = 0x0002;
+    fail_if(diagnostic_schedule_request_with_context(&SHIMS, &scheduler,
+                &request, DIAGNOSTIC_PRIORITY_NORMAL, context_response_received,
+                &answered_dids[1]) == NULL);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+
+    answer(0x7e9, 0x0002);
+    ck_assert_int_eq(answered_dids[0], 0);
+    ck_assert_int_eq(answered_dids[1], 0x0002);
+    answer(0x7e8, 0x0001);
+    ck_assert_int_eq(answered_dids[0], 0x0001);
+    ck_assert_int_eq(response_count, 0);
+}
+END_TEST
+
+START_TEST (test_first_come_first_served_within_class)
+{
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_NORMAL);
+    schedule(0x7e0, 0x0002, DIAGNOSTIC_PRIORITY_NORMAL);
+    schedule(0x7e0, 0x0003, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(last_requested_did(), 0x0001);
+    answer(0x7e8, 0x0001);
+    ck_assert_int_eq(last_requested_did(), 0x0002);
+
+    // a request scheduled later reuses the first slot, but still goes last
+    schedule(0x7e0, 0x0004, DIAGNOSTIC_PRIORITY_NORMAL);
+    answer(0x7e8, 0x0002);
+    ck_assert_int_eq(last_requested_did(), 0x0003);
+    answer(0x7e8, 0x0003);
+    ck_assert_int_eq(last_requested_did(), 0x0004);
+}
+END_TEST
+
+START_TEST (test_ecus_in_parallel)
+{
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_LOW);
+    schedule(0x7e1, 0x0002, DIAGNOSTIC_PRIORITY_HIGH);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(sent_frame_count, 2);
+    ck_assert_int_eq(sent_frames[0].arbitration_id, 0x7e1);
+    ck_assert_int_eq(sent_frames[1].arbitration_id, 0x7e0);
+
+    answer(0x7e8, 0x0001);
+    answer(0x7e9, 0x0002);
+    ck_assert_int_eq(response_count, 2);
+    ck_assert_int_eq(responses[0].arbitration_id, 0x7e8);
+    ck_assert_int_eq(responses[1].arbitration_id, 0x7e9);
+}
+END_TEST
+
+START_TEST (test_low_priority_response_preempted)
+{
+    DiagnosticRequestHandle* handle = schedule(0x7e0, 0xf190,
+            DIAGNOSTIC_PRIORITY_LOW);
+    handle->receive_buffer = receive_buffer;
+    handle->receive_buffer_size = sizeof(receive_buffer);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+
+    // asked for the response in blocks
+    start_long_response();
+    ck_assert_int_eq(last_frame()->arbitration_id, 0x7e0);
+    ck_assert_int_eq(last_frame()->data[0], 0x30);
+    ck_assert_int_eq(last_frame()->data[1], 8);
+
+    schedule(0x7e1, 0x0002, DIAGNOSTIC_PRIORITY_HIGH);
+    uint8_t sequence = 1;
+    receive_consecutive_frames(&sequence, 1);
+    ck_assert_int_eq(last_frame()->arbitration_id, 0x7e1);
+
+    // held with WAIT at the end of the block
+    receive_consecutive_frames(&sequence, 7);
+    ck_assert_int_eq(last_frame()->arbitration_id, 0x7e0);
+    ck_assert_int_eq(last_frame()->data[0], 0x31);
+
+    // and let go once the urgent request is answered
+    answer(0x7e9, 0x0002);
+    ck_assert_int_eq(response_count, 1);
+    ck_assert_int_eq(last_frame()->arbitration_id, 0x7e0);
+    ck_assert_int_eq(last_frame()->data[0], 0x30);
+
+    receive_consecutive_frames(&sequence, 6);
+    ck_assert_int_eq(response_count, 2);
+    fail_unless(responses[1].success);
+    ck_assert_int_eq(responses[1].full_payload_length, 97);
+}
+END_TEST
+
+START_TEST (test_same_ecu_not_preempted)
+{
+    DiagnosticRequestHandle* handle = schedule(0x7e0, 0xf190,
+            DIAGNOSTIC_PRIORITY_LOW);
+    handle->receive_buffer = receive_buffer;
+    handle->receive_buffer_size = sizeof(receive_buffer);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    start_long_response();
+
+    // the urgent request can't go until this response is in, so holding it
+    // would only slow both down
+    schedule(0x7e0, 0x0002, DIAGNOSTIC_PRIORITY_HIGH);
+    uint8_t sequence = 1;
+    receive_consecutive_frames(&sequence, 8);
+    ck_assert_int_eq(last_frame()->arbitration_id, 0x7e0);
+    ck_assert_int_eq(last_frame()->data[0], 0x30);
+
+    receive_consecutive_frames(&sequence, 6);
+    ck_assert_int_eq(response_count, 1);
+    fail_unless(responses[0].success);
+    // and then the urgent request is sent
+    ck_assert_int_eq(last_requested_did(), 0x0002);
+}
+END_TEST
+
+START_TEST (test_held_response_kept_waiting)
+{
+    scheduler.response_timeout_us = 10000000;
+    DiagnosticRequestHandle* handle = schedule(0x7e0, 0xf190,
+            DIAGNOSTIC_PRIORITY_LOW);
+    handle->receive_buffer = receive_buffer;
+    handle->receive_buffer_size = sizeof(receive_buffer);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    schedule(0x7e1, 0x0002, DIAGNOSTIC_PRIORITY_HIGH);
+    start_long_response();
+    uint8_t sequence = 1;
+    receive_consecutive_frames(&sequence, 8);
+    ck_assert_int_eq(last_frame()->data[0], 0x31);
+
+    // another WAIT every half second, then clear to send rather than let the
+    // ECU give up
+    uint8_t waits = 1;
+    for(int i = 0; i < 20; i++) {
+        sent_frame_count = 0;
+        current_time_us += DIAGNOSTIC_TRANSPORT_HOLD_INTERVAL_US;
+        diagnostic_scheduler_poll(&SHIMS, &scheduler);
+        if(sent_frame_count == 0) {
+            continue;
+        }
+        ck_assert_int_eq(last_frame()->arbitration_id, 0x7e0);
+        if(last_frame()->data[0] == 0x30) {
+            break;
+        }
+        ck_assert_int_eq(last_frame()->data[0], 0x31);
+        ++waits;
+    }
+    ck_assert_int_eq(waits, DIAGNOSTIC_TRANSPORT_MAX_HOLD_WAITS);
+    ck_assert_int_eq(last_frame()->data[0], 0x30);
+
+    // the held request didn't time out while it was waiting on us
+    ck_assert_int_eq(response_count, 0);
+    receive_consecutive_frames(&sequence, 6);
+    ck_assert_int_eq(response_count, 1);
+    fail_unless(responses[0].success);
+}
+END_TEST
+
+START_TEST (test_high_priority_not_preempted)
+{
+    DiagnosticRequestHandle* handle = schedule(0x7e0, 0xf190,
+            DIAGNOSTIC_PRIORITY_HIGH);
+    handle->receive_buffer = receive_buffer;
+    handle->receive_buffer_size = sizeof(receive_buffer);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    start_long_response();
+    ck_assert_int_eq(last_frame()->data[0], 0x30);
+    ck_assert_int_eq(last_frame()->data[1], 0);
+}
+END_TEST
+
+START_TEST (test_timeout)
+{
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_NORMAL);
+    schedule(0x7e0, 0x0002, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+
+    current_time_us += 999999;
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(response_count, 0);
+
+    current_time_us += 1;
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(response_count, 1);
+    fail_unless(responses[0].completed);
+    fail_if(responses[0].success);
+    ck_assert_int_eq(responses[0].arbitration_id, 0x7e0);
+    ck_assert_int_eq(responses[0].mode, 0x22);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_NORMAL]
+            .failed_count, 1);
+
+    // the next request goes out
+    ck_assert_int_eq(last_requested_did(), 0x0002);
+}
+END_TEST
+
+START_TEST (test_response_pending_extends_timeout)
+{
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    const uint8_t pending[] = {0x03, 0x7f, 0x22, 0x78, 0x00, 0x00, 0x00,
+        0x00};
+    receive(0x7e8, pending);
+
+    current_time_us += 4000000;
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(response_count, 0);
+
+    current_time_us += 1000000;
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(response_count, 1);
+    fail_if(responses[0].success);
+}
+END_TEST
+
+START_TEST (test_send_failure)
+{
+    send_fails = true;
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_HIGH);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    ck_assert_int_eq(response_count, 1);
+    fail_if(responses[0].success);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_HIGH]
+            .failed_count, 1);
+    ck_assert_int_eq(diagnostic_scheduled_request_count(&scheduler), 0);
+}
+END_TEST
+
+START_TEST (test_latency_statistics)
+{
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_LOW);
+    schedule(0x7e0, 0x0002, DIAGNOSTIC_PRIORITY_HIGH);
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    current_time_us += 2000;
+    answer(0x7e8, 0x0002);
+    current_time_us += 3000;
+    answer(0x7e8, 0x0001);
+
+    const DiagnosticPriorityStatistics* high =
+            &scheduler.statistics[DIAGNOSTIC_PRIORITY_HIGH];
+    const DiagnosticPriorityStatistics* low =
+            &scheduler.statistics[DIAGNOSTIC_PRIORITY_LOW];
+    ck_assert_int_eq(high->completed_count, 1);
+    ck_assert_int_eq(high->total_latency_us, 2000);
+    ck_assert_int_eq(high->max_latency_us, 2000);
+    // from when it was scheduled, including the time spent queued
+    ck_assert_int_eq(low->completed_count, 1);
+    ck_assert_int_eq(low->total_latency_us, 5000);
+    ck_assert_int_eq(scheduler.statistics[DIAGNOSTIC_PRIORITY_NORMAL]
+            .completed_count, 0);
+}
+END_TEST
+
+START_TEST (test_next_deadline)
+{
+    DiagnosticDeadline deadline = {0};
+    diagnostic_scheduler_next_deadline(&SHIMS, &scheduler, &deadline);
+    fail_if(deadline.pending);
+
+    schedule(0x7e0, 0x0001, DIAGNOSTIC_PRIORITY_NORMAL);
+    diagnostic_scheduler_next_deadline(&SHIMS, &scheduler, &deadline);
+    ck_assert_int_eq(diagnostic_deadline_remaining_us(&deadline,
+                current_time_us), 0);
+
+    diagnostic_scheduler_poll(&SHIMS, &scheduler);
+    current_time_us += 400000;
+    memset(&deadline, 0, sizeof(deadline));
+    diagnostic_scheduler_next_deadline(&SHIMS, &scheduler, &deadline);
+    ck_assert_int_eq(diagnostic_deadline_remaining_us(&deadline,
+                current_time_us), 600000);
+}
+END_TEST
+
+START_TEST (test_full)
+{
+    for(int i = 0; i < MAX_SCHEDULED_REQUESTS; i++) {
+        fail_if(schedule(0x7e0, i, DIAGNOSTIC_PRIORITY_NORMAL) == NULL);
+    }
+    fail_unless(schedule(0x7e0, 0xffff, DIAGNOSTIC_PRIORITY_HIGH) == NULL);
+    ck_assert_int_eq(diagnostic_scheduled_request_count(&scheduler),
+            MAX_SCHEDULED_REQUESTS);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("scheduler");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_scheduler, NULL);
+    tcase_add_test(tc_core, test_sent_by_priority);
+    tcase_add_test(tc_core, test_context_callback);
+    tcase_add_test(tc_core, test_first_come_first_served_within_class);
+    tcase_add_test(tc_core, test_ecus_in_parallel);
+    tcase_add_test(tc_core, test_low_priority_response_preempted);
+    tcase_add_test(tc_core, test_same_ecu_not_preempted);
+    tcase_add_test(tc_core, test_held_response_kept_waiting);
+    tcase_add_test(tc_core, test_high_priority_not_preempted);
+    tcase_add_test(tc_core, test_timeout);
+    tcase_add_test(tc_core, test_response_pending_extends_timeout);
+    tcase_add_test(tc_core, test_send_failure);
+    tcase_add_test(tc_core, test_latency_statistics);
+    tcase_add_test(tc_core, test_next_deadline);
+    tcase_add_test(tc_core, test_full);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
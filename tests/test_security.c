@@ -0,0 +1,302 @@
+#include <uds/uds.h>
+#include <uds/security.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern bool can_frame_was_sent;
+
+static DiagnosticSecurityAccess access;
+static uint32_t current_time_us;
+static int algorithm_calls;
+static uint8_t key_size;
+
+static const uint8_t SEED_RESPONSE[] = {0x06, 0x67, 0x01, 0x11, 0x22, 0x33,
+    0x44};
+static const uint8_t KEY_ACCEPTED[] = {0x02, 0x67, 0x02};
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static bool invert_seed(DiagnosticSecurityAccess* access, uint8_t level,
+        const uint8_t seed[], uint8_t seed_size, uint8_t key[],
+        uint8_t* size) {
+    ++algorithm_calls;
+    for(uint8_t i = 0; i < key_size; i++) {
+        key[i] = ~seed[i % seed_size];
+    }
+    *size = key_size;
+    return true;
+}
+
+static void setup_security() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    current_time_us = 1000;
+    algorithm_calls = 0;
+    key_size = 4;
+    diagnostic_init_security_access(&access, 0x7e0);
+    diagnostic_security_register_algorithm(&access, 1, invert_seed);
+}
+
+static void receive(const uint8_t data[], uint8_t size) {
+    can_frame_was_sent = false;
+    diagnostic_security_receive_can_frame(&SHIMS, &access, 0x7e8, data, size);
+}
+
+START_TEST (test_unlock)
+{
+    fail_unless(diagnostic_security_unlock(&SHIMS, &access, 1));
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    const uint8_t seed_request[] = {0x02, 0x27, 0x01};
+    fail_unless(!memcmp(last_can_payload_sent, seed_request,
+                sizeof(seed_request)));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_REQUESTING_SEED);
+
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    fail_unless(can_frame_was_sent);
+    const uint8_t key[] = {0x06, 0x27, 0x02, 0xee, 0xdd, 0xcc, 0xbb};
+    fail_unless(!memcmp(last_can_payload_sent, key, sizeof(key)));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_SENDING_KEY);
+
+    receive(KEY_ACCEPTED, sizeof(KEY_ACCEPTED));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_UNLOCKED);
+    ck_assert_int_eq(access.exchange_count, 2);
+
+    // nothing to do while it's unlocked
+    can_frame_was_sent = false;
+    fail_unless(diagnostic_security_unlock(&SHIMS, &access, 1));
+    fail_if(can_frame_was_sent);
+}
+END_TEST
+
+START_TEST (test_already_unlocked)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    const uint8_t zero_seed[] = {0x06, 0x67, 0x01, 0x00, 0x00, 0x00, 0x00};
+    receive(zero_seed, sizeof(zero_seed));
+    fail_if(can_frame_was_sent);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_UNLOCKED);
+    ck_assert_int_eq(access.exchange_count, 1);
+    ck_assert_int_eq(algorithm_calls, 0);
+}
+END_TEST
+
+START_TEST (test_delay_not_expired)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    const uint8_t delayed[] = {0x03, 0x7f, 0x27, 0x37};
+    receive(delayed, sizeof(delayed));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_DELAYED);
+    ck_assert_int_eq(access.negative_response_code,
+            NRC_TIME_DELAY_NOT_EXPIRED);
+
+    // no busy retries
+    current_time_us = 1000 + 9999999;
+    can_frame_was_sent = false;
+    diagnostic_security_poll(&SHIMS, &access);
+    fail_unless(diagnostic_security_unlock(&SHIMS, &access, 1));
+    fail_if(can_frame_was_sent);
+
+    current_time_us = 1000 + 10000000;
+    diagnostic_security_poll(&SHIMS, &access);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x27);
+    ck_assert_int_eq(last_can_payload_sent[2], 0x01);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_REQUESTING_SEED);
+}
+END_TEST
+
+START_TEST (test_too_many_attempts)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    const uint8_t locked_out[] = {0x03, 0x7f, 0x27, 0x36};
+    receive(locked_out, sizeof(locked_out));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_DELAYED);
+}
+END_TEST
+
+START_TEST (test_cached_key)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    receive(KEY_ACCEPTED, sizeof(KEY_ACCEPTED));
+    ck_assert_int_eq(algorithm_calls, 1);
+
+    // e.g. after a reset, with an ECU that always sends the same seed
+    diagnostic_security_lock(&access);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_LOCKED);
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_payload_sent[3], 0xee);
+    ck_assert_int_eq(algorithm_calls, 1);
+
+    // a new seed needs a new key
+    receive(KEY_ACCEPTED, sizeof(KEY_ACCEPTED));
+    diagnostic_security_lock(&access);
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    const uint8_t new_seed[] = {0x06, 0x67, 0x01, 0x55, 0x22, 0x33, 0x44};
+    receive(new_seed, sizeof(new_seed));
+    ck_assert_int_eq(algorithm_calls, 2);
+    ck_assert_int_eq(last_can_payload_sent[3], 0xaa);
+}
+END_TEST
+
+START_TEST (test_invalid_key)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    const uint8_t invalid[] = {0x03, 0x7f, 0x27, 0x35};
+    receive(invalid, sizeof(invalid));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_FAILED);
+    ck_assert_int_eq(access.negative_response_code, NRC_INVALID_KEY);
+    fail_if(can_frame_was_sent);
+
+    // the key isn't reused
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    ck_assert_int_eq(algorithm_calls, 2);
+}
+END_TEST
+
+START_TEST (test_long_key)
+{
+    key_size = 12;
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    const uint8_t first_frame[] = {0x10, 0x0e, 0x27, 0x02, 0xee, 0xdd, 0xcc,
+        0xbb};
+    fail_unless(!memcmp(last_can_payload_sent, first_frame,
+                sizeof(first_frame)));
+}
+END_TEST
+
+START_TEST (test_long_key_paced)
+{
+    key_size = 12;
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    const uint8_t flow_control[] = {0x30, 0x00, 0x05};
+    receive(flow_control, sizeof(flow_control));
+    ck_assert_int_eq(last_can_payload_sent[0], 0x21);
+
+    can_frame_was_sent = false;
+    current_time_us += 5000;
+    diagnostic_security_poll(&SHIMS, &access);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x22);
+}
+END_TEST
+
+START_TEST (test_security_timeout)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    current_time_us = 1000 + 999999;
+    diagnostic_security_poll(&SHIMS, &access);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_REQUESTING_SEED);
+    current_time_us = 1000 + 1000000;
+    diagnostic_security_poll(&SHIMS, &access);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_FAILED);
+}
+END_TEST
+
+START_TEST (test_response_pending_extends_timeout)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    receive(SEED_RESPONSE, sizeof(SEED_RESPONSE));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_SENDING_KEY);
+
+    // the ECU takes its time checking the key
+    current_time_us += 900000;
+    const uint8_t pending[] = {0x03, 0x7f, 0x27, NRC_RESPONSE_PENDING};
+    receive(pending, sizeof(pending));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_SENDING_KEY);
+
+    // P2* runs from the pending response, not P2 from the request
+    current_time_us += 4999999;
+    diagnostic_security_poll(&SHIMS, &access);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_SENDING_KEY);
+    DiagnosticDeadline deadline = {pending: false};
+    diagnostic_security_next_deadline(&SHIMS, &access, &deadline);
+    ck_assert_int_eq(diagnostic_deadline_remaining_us(&deadline,
+                current_time_us), 1);
+
+    // and starts over with each one
+    receive(pending, sizeof(pending));
+    current_time_us += 4999999;
+    diagnostic_security_poll(&SHIMS, &access);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_SENDING_KEY);
+    receive(KEY_ACCEPTED, sizeof(KEY_ACCEPTED));
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_UNLOCKED);
+}
+END_TEST
+
+START_TEST (test_response_pending_times_out)
+{
+    diagnostic_security_unlock(&SHIMS, &access, 1);
+    const uint8_t pending[] = {0x03, 0x7f, 0x27, NRC_RESPONSE_PENDING};
+    receive(pending, sizeof(pending));
+    current_time_us += 5000000;
+    diagnostic_security_poll(&SHIMS, &access);
+    ck_assert_int_eq(access.state, DIAGNOSTIC_SECURITY_FAILED);
+}
+END_TEST
+
+START_TEST (test_register_algorithm)
+{
+    fail_if(diagnostic_security_unlock(&SHIMS, &access, 2));
+    fail_if(can_frame_was_sent);
+    int i;
+    for(i = 2; i <= MAX_SECURITY_KEY_ALGORITHMS; i++) {
+        fail_unless(diagnostic_security_register_algorithm(&access, i,
+                    invert_seed));
+    }
+    fail_if(diagnostic_security_register_algorithm(&access, 0x11,
+                invert_seed));
+    fail_unless(diagnostic_security_register_algorithm(&access, 1, NULL));
+    fail_unless(diagnostic_security_unlock(&SHIMS, &access, 2));
+    ck_assert_int_eq(last_can_payload_sent[2], 0x03);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("security");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_security, NULL);
+    tcase_add_test(tc_core, test_unlock);
+    tcase_add_test(tc_core, test_already_unlocked);
+    tcase_add_test(tc_core, test_delay_not_expired);
+    tcase_add_test(tc_core, test_too_many_attempts);
+    tcase_add_test(tc_core, test_cached_key);
+    tcase_add_test(tc_core, test_invalid_key);
+    tcase_add_test(tc_core, test_long_key);
+    tcase_add_test(tc_core, test_long_key_paced);
+    tcase_add_test(tc_core, test_security_timeout);
+    tcase_add_test(tc_core, test_response_pending_extends_timeout);
+    tcase_add_test(tc_core, test_response_pending_times_out);
+    tcase_add_test(tc_core, test_register_algorithm);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,500 @@
+#include <uds/uds.h>
+#include <uds/server.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+
+#define MAX_RECORDED_FRAMES 16
+
+static DiagnosticServer server;
+static uint8_t sent_frames[MAX_RECORDED_FRAMES][CAN_FD_MESSAGE_BYTE_SIZE];
+static uint8_t sent_frame_sizes[MAX_RECORDED_FRAMES];
+static uint32_t sent_frame_ids[MAX_RECORDED_FRAMES];
+static uint8_t sent_frame_count;
+static uint8_t transmit_buffer[256];
+static uint8_t receive_buffer[256];
+static uint8_t written_value[8];
+static uint16_t written_size;
+static const uint8_t VIN[] = "1FMCU9J94HUA04524";
+
+static DiagnosticServerDtc dtcs[] = {
+    {0x012300, 0x08},
+    {0x045600, 0x04},
+    {0xc12300, 0x89}
+};
+
+static bool recording_send_can(const uint32_t arbitration_id,
+        const uint8_t* data, const uint8_t size) {
+    if(sent_frame_count < MAX_RECORDED_FRAMES) {
+        sent_frame_ids[sent_frame_count] = arbitration_id;
+        sent_frame_sizes[sent_frame_count] = size;
+        memcpy(sent_frames[sent_frame_count++], data, size);
+    }
+    return true;
+}
+
+static DiagnosticNegativeResponseCode read_vin(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    if(destination_length < sizeof(VIN) - 1) {
+        return NRC_RESPONSE_TOO_LONG;
+    }
+    memcpy(destination, VIN, sizeof(VIN) - 1);
+    *size = sizeof(VIN) - 1;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode read_version(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    destination[0] = 0x42;
+    *size = 1;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode write_value(DiagnosticServer* server,
+        uint16_t did, const uint8_t data[], uint16_t size) {
+    if(size > sizeof(written_value)) {
+        return NRC_INCORRECT_LENGTH_OR_FORMAT;
+    }
+    memcpy(written_value, data, size);
+    written_size = size;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode read_engine_speed(
+        DiagnosticServer* server, uint8_t mode, uint8_t pid,
+        uint8_t destination[], uint16_t destination_length, uint16_t* size) {
+    destination[0] = 0x1a;
+    destination[1] = 0xf8;
+    *size = 2;
+    return NRC_SUCCESS;
+}
+
+static DiagnosticNegativeResponseCode read_vehicle_speed(
+        DiagnosticServer* server, uint8_t mode, uint8_t pid,
+        uint8_t destination[], uint16_t destination_length, uint16_t* size) {
+    destination[0] = 88;
+    *size = 1;
+    return NRC_SUCCESS;
+}
+
+static bool generate_seed(DiagnosticServer* server, uint8_t level,
+        uint8_t seed[], uint8_t* size) {
+    if(level != 1) {
+        return false;
+    }
+    seed[0] = 0x12;
+    seed[1] = 0x34;
+    *size = 2;
+    return true;
+}
+
+static bool validate_key(DiagnosticServer* server, uint8_t level,
+        const uint8_t seed[], uint8_t seed_size, const uint8_t key[],
+        uint16_t key_size) {
+    return key_size == 2 && key[0] == (seed[0] ^ 0xff) &&
+        key[1] == (seed[1] ^ 0xff);
+}
+
+static const DiagnosticServerDid dids[] = {
+    {0xf190, read_vin, NULL, 0},
+    {0xf195, read_version, NULL, 0},
+    {0x0100, NULL, write_value, 0},
+    {0x0200, read_version, write_value, 1}
+};
+
+static const DiagnosticServerPid pids[] = {
+    {0x1, 0xc, read_engine_speed},
+    {0x1, 0xd, read_vehicle_speed},
+    {0x1, 0x21, read_vehicle_speed}
+};
+
+static void setup_server() {
+    setup();
+    SHIMS.send_can_message = recording_send_can;
+    sent_frame_count = 0;
+    written_size = 0;
+    dtcs[0].status = 0x08;
+    dtcs[1].status = 0x04;
+    dtcs[2].status = 0x89;
+
+    diagnostic_init_server(&server, 0x7e0, 0x7e8);
+    server.dids = dids;
+    server.did_count = sizeof(dids) / sizeof(dids[0]);
+    server.pids = pids;
+    server.pid_count = sizeof(pids) / sizeof(pids[0]);
+    server.dtcs = dtcs;
+    server.dtc_count = sizeof(dtcs) / sizeof(dtcs[0]);
+    server.seed_generator = generate_seed;
+    server.key_validator = validate_key;
+    server.transmit_buffer = transmit_buffer;
+    server.transmit_buffer_size = sizeof(transmit_buffer);
+    server.receive_buffer = receive_buffer;
+    server.receive_buffer_size = sizeof(receive_buffer);
+}
+
+static void send_request(uint32_t arbitration_id, const uint8_t request[],
+        uint8_t size) {
+    uint8_t frame[8] = {size};
+    memcpy(&frame[1], request, size);
+    diagnostic_server_receive_can_frame(&SHIMS, &server, arbitration_id,
+            frame, sizeof(frame));
+}
+
+static void assert_negative_response(uint8_t frame, uint8_t service,
+        uint8_t code) {
+    ck_assert_int_eq(sent_frames[frame][0], 0x3);
+    ck_assert_int_eq(sent_frames[frame][1], 0x7f);
+    ck_assert_int_eq(sent_frames[frame][2], service);
+    ck_assert_int_eq(sent_frames[frame][3], code);
+}
+
+START_TEST (test_unknown_service)
+{
+    const uint8_t request[] = {0x85, 0x2};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(sent_frame_ids[0], 0x7e8);
+    ck_assert_int_eq(sent_frame_sizes[0], 8);
+    assert_negative_response(0, 0x85, NRC_SERVICE_NOT_SUPPORTED);
+}
+END_TEST
+
+START_TEST (test_functional_unknown_service_is_silent)
+{
+    const uint8_t request[] = {0x85, 0x2};
+    send_request(0x7df, request, sizeof(request));
+    ck_assert_int_eq(sent_frame_count, 0);
+}
+END_TEST
+
+START_TEST (test_other_arbitration_id_ignored)
+{
+    const uint8_t request[] = {0x3e, 0x0};
+    uint8_t frame[8] = {sizeof(request), 0x3e, 0x0};
+    fail_if(diagnostic_server_receive_can_frame(&SHIMS, &server, 0x7e1,
+                frame, sizeof(frame)));
+    ck_assert_int_eq(sent_frame_count, 0);
+}
+END_TEST
+
+START_TEST (test_tester_present)
+{
+    const uint8_t request[] = {0x3e, 0x0};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(sent_frames[0][0], 0x2);
+    ck_assert_int_eq(sent_frames[0][1], 0x7e);
+    ck_assert_int_eq(sent_frames[0][2], 0x0);
+
+    const uint8_t suppressed[] = {0x3e, 0x80};
+    send_request(0x7e0, suppressed, sizeof(suppressed));
+    ck_assert_int_eq(sent_frame_count, 1);
+
+    const uint8_t wrong_length[] = {0x3e};
+    send_request(0x7e0, wrong_length, sizeof(wrong_length));
+    assert_negative_response(1, 0x3e, NRC_INCORRECT_LENGTH_OR_FORMAT);
+}
+END_TEST
+
+START_TEST (test_session_control)
+{
+    const uint8_t request[] = {0x10, 0x3};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(server.session, DIAGNOSTIC_EXTENDED_SESSION);
+    ck_assert_int_eq(sent_frames[0][0], 0x6);
+    ck_assert_int_eq(sent_frames[0][1], 0x50);
+    ck_assert_int_eq(sent_frames[0][2], 0x3);
+    ck_assert_int_eq(sent_frames[0][4], 50);
+    ck_assert_int_eq(sent_frames[0][5], 0x1);
+    ck_assert_int_eq(sent_frames[0][6], 0xf4);
+
+    const uint8_t unknown[] = {0x10, 0x7};
+    send_request(0x7e0, unknown, sizeof(unknown));
+    assert_negative_response(1, 0x10, NRC_SUB_FUNCTION_NOT_SUPPORTED);
+}
+END_TEST
+
+START_TEST (test_read_data_by_identifier)
+{
+    const uint8_t request[] = {0x22, 0xf1, 0x95};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(sent_frames[0][0], 0x4);
+    ck_assert_int_eq(sent_frames[0][1], 0x62);
+    ck_assert_int_eq(sent_frames[0][2], 0xf1);
+    ck_assert_int_eq(sent_frames[0][3], 0x95);
+    ck_assert_int_eq(sent_frames[0][4], 0x42);
+}
+END_TEST
+
+START_TEST (test_read_unknown_did)
+{
+    const uint8_t request[] = {0x22, 0x12, 0x34};
+    send_request(0x7e0, request, sizeof(request));
+    assert_negative_response(0, 0x22, NRC_REQUEST_OUT_OF_RANGE);
+
+    const uint8_t odd_length[] = {0x22, 0xf1, 0x95, 0x1};
+    send_request(0x7e0, odd_length, sizeof(odd_length));
+    assert_negative_response(1, 0x22, NRC_INCORRECT_LENGTH_OR_FORMAT);
+}
+END_TEST
+
+START_TEST (test_read_multi_frame_did)
+{
+    const uint8_t request[] = {0x22, 0xf1, 0x90, 0x12, 0x34, 0xf1, 0x95};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frame_count, 1);
+    // 0x62 + VIN DID + 17 bytes + version DID + 1 byte, the unknown DID
+    // skipped
+    ck_assert_int_eq(sent_frames[0][0], 0x10);
+    ck_assert_int_eq(sent_frames[0][1], 23);
+    ck_assert_int_eq(sent_frames[0][2], 0x62);
+    ck_assert_int_eq(sent_frames[0][3], 0xf1);
+    ck_assert_int_eq(sent_frames[0][4], 0x90);
+    ck_assert_int_eq(sent_frames[0][5], '1');
+
+    const uint8_t flow_control[] = {0x30, 0, 0};
+    diagnostic_server_receive_can_frame(&SHIMS, &server, 0x7e0,
+            flow_control, sizeof(flow_control));
+    ck_assert_int_eq(sent_frame_count, 4);
+    ck_assert_int_eq(sent_frames[1][0], 0x21);
+    ck_assert_int_eq(sent_frames[1][1], 'C');
+    ck_assert_int_eq(sent_frames[3][0], 0x23);
+    ck_assert_int_eq(sent_frames[3][1], 0xf1);
+    ck_assert_int_eq(sent_frames[3][2], 0x95);
+    ck_assert_int_eq(sent_frames[3][3], 0x42);
+}
+END_TEST
+
+START_TEST (test_write_needs_non_default_session)
+{
+    const uint8_t request[] = {0x2e, 0x01, 0x00, 0xaa, 0xbb};
+    send_request(0x7e0, request, sizeof(request));
+    assert_negative_response(0, 0x2e,
+            NRC_SERVICE_NOT_SUPPORTED_IN_ACTIVE_SESSION);
+    ck_assert_int_eq(written_size, 0);
+
+    server.session = DIAGNOSTIC_EXTENDED_SESSION;
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frames[1][0], 0x3);
+    ck_assert_int_eq(sent_frames[1][1], 0x6e);
+    ck_assert_int_eq(sent_frames[1][2], 0x01);
+    ck_assert_int_eq(sent_frames[1][3], 0x00);
+    ck_assert_int_eq(written_size, 2);
+    ck_assert_int_eq(written_value[1], 0xbb);
+}
+END_TEST
+
+START_TEST (test_multi_frame_write)
+{
+    server.session = DIAGNOSTIC_EXTENDED_SESSION;
+    const uint8_t first_frame[] = {0x10, 0xb, 0x2e, 0x01, 0x00, 1, 2, 3};
+    diagnostic_server_receive_can_frame(&SHIMS, &server, 0x7e0, first_frame,
+            sizeof(first_frame));
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(sent_frames[0][0], 0x30);
+
+    const uint8_t consecutive_frame[] = {0x21, 4, 5, 6, 7, 8, 0, 0};
+    diagnostic_server_receive_can_frame(&SHIMS, &server, 0x7e0,
+            consecutive_frame, sizeof(consecutive_frame));
+    ck_assert_int_eq(sent_frame_count, 2);
+    ck_assert_int_eq(sent_frames[1][1], 0x6e);
+    ck_assert_int_eq(written_size, 8);
+    ck_assert_int_eq(written_value[7], 8);
+}
+END_TEST
+
+START_TEST (test_security_access)
+{
+    server.session = DIAGNOSTIC_EXTENDED_SESSION;
+    const uint8_t protected_read[] = {0x22, 0x02, 0x00};
+    send_request(0x7e0, protected_read, sizeof(protected_read));
+    assert_negative_response(0, 0x22, NRC_SECURITY_ACCESS_DENIED);
+
+    const uint8_t key_first[] = {0x27, 0x2, 0xed, 0xcb};
+    send_request(0x7e0, key_first, sizeof(key_first));
+    assert_negative_response(1, 0x27, NRC_REQUEST_SEQUENCE_ERROR);
+
+    const uint8_t request_seed[] = {0x27, 0x1};
+    send_request(0x7e0, request_seed, sizeof(request_seed));
+    ck_assert_int_eq(sent_frames[2][0], 0x4);
+    ck_assert_int_eq(sent_frames[2][1], 0x67);
+    ck_assert_int_eq(sent_frames[2][2], 0x1);
+    ck_assert_int_eq(sent_frames[2][3], 0x12);
+    ck_assert_int_eq(sent_frames[2][4], 0x34);
+
+    send_request(0x7e0, key_first, sizeof(key_first));
+    ck_assert_int_eq(sent_frames[3][1], 0x67);
+    ck_assert_int_eq(sent_frames[3][2], 0x2);
+    ck_assert_int_eq(server.security_level, 1);
+
+    send_request(0x7e0, protected_read, sizeof(protected_read));
+    ck_assert_int_eq(sent_frames[4][1], 0x62);
+
+    // already unlocked, so the seed is zero
+    send_request(0x7e0, request_seed, sizeof(request_seed));
+    ck_assert_int_eq(sent_frames[5][3], 0);
+    ck_assert_int_eq(sent_frames[5][4], 0);
+
+    // changing session locks it again
+    const uint8_t session[] = {0x10, 0x3};
+    send_request(0x7e0, session, sizeof(session));
+    ck_assert_int_eq(server.security_level, 0);
+}
+END_TEST
+
+START_TEST (test_security_access_lockout)
+{
+    server.session = DIAGNOSTIC_EXTENDED_SESSION;
+    const uint8_t request_seed[] = {0x27, 0x1};
+    const uint8_t wrong_key[] = {0x27, 0x2, 0x00, 0x00};
+    send_request(0x7e0, request_seed, sizeof(request_seed));
+    send_request(0x7e0, wrong_key, sizeof(wrong_key));
+    assert_negative_response(1, 0x27, NRC_INVALID_KEY);
+    send_request(0x7e0, request_seed, sizeof(request_seed));
+    send_request(0x7e0, wrong_key, sizeof(wrong_key));
+    send_request(0x7e0, request_seed, sizeof(request_seed));
+    send_request(0x7e0, wrong_key, sizeof(wrong_key));
+    assert_negative_response(5, 0x27, NRC_TOO_MANY_ATTEMPS);
+
+    send_request(0x7e0, request_seed, sizeof(request_seed));
+    assert_negative_response(6, 0x27, NRC_TIME_DELAY_NOT_EXPIRED);
+}
+END_TEST
+
+START_TEST (test_obd2_pids)
+{
+    const uint8_t request[] = {0x1, 0xc, 0xd};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frames[0][0], 0x6);
+    ck_assert_int_eq(sent_frames[0][1], 0x41);
+    ck_assert_int_eq(sent_frames[0][2], 0xc);
+    ck_assert_int_eq(sent_frames[0][3], 0x1a);
+    ck_assert_int_eq(sent_frames[0][4], 0xf8);
+    ck_assert_int_eq(sent_frames[0][5], 0xd);
+    ck_assert_int_eq(sent_frames[0][6], 88);
+}
+END_TEST
+
+START_TEST (test_obd2_pids_supported)
+{
+    const uint8_t request[] = {0x1, 0x0};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frames[0][0], 0x6);
+    ck_assert_int_eq(sent_frames[0][1], 0x41);
+    ck_assert_int_eq(sent_frames[0][2], 0x0);
+    // PIDs 0xc, 0xd and 0x20 (more PIDs follow)
+    ck_assert_int_eq(sent_frames[0][3], 0x0);
+    ck_assert_int_eq(sent_frames[0][4], 0x18);
+    ck_assert_int_eq(sent_frames[0][5], 0x0);
+    ck_assert_int_eq(sent_frames[0][6], 0x1);
+
+    const uint8_t unsupported[] = {0x1, 0x40};
+    send_request(0x7e0, unsupported, sizeof(unsupported));
+    assert_negative_response(1, 0x1, NRC_REQUEST_OUT_OF_RANGE);
+}
+END_TEST
+
+START_TEST (test_obd2_dtcs)
+{
+    const uint8_t request[] = {0x3};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frames[0][0], 0x6);
+    ck_assert_int_eq(sent_frames[0][1], 0x43);
+    ck_assert_int_eq(sent_frames[0][2], 2);
+    ck_assert_int_eq(sent_frames[0][3], 0x01);
+    ck_assert_int_eq(sent_frames[0][4], 0x23);
+    ck_assert_int_eq(sent_frames[0][5], 0xc1);
+
+    const uint8_t clear[] = {0x4};
+    send_request(0x7e0, clear, sizeof(clear));
+    ck_assert_int_eq(sent_frames[1][1], 0x44);
+    ck_assert_int_eq(dtcs[0].status, 0);
+
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frames[2][0], 0x2);
+    ck_assert_int_eq(sent_frames[2][2], 0);
+}
+END_TEST
+
+START_TEST (test_read_dtc_information)
+{
+    const uint8_t count[] = {0x19, 0x1, 0x08};
+    send_request(0x7e0, count, sizeof(count));
+    ck_assert_int_eq(sent_frames[0][1], 0x59);
+    ck_assert_int_eq(sent_frames[0][2], 0x1);
+    ck_assert_int_eq(sent_frames[0][6], 2);
+
+    const uint8_t by_mask[] = {0x19, 0x2, 0x04};
+    send_request(0x7e0, by_mask, sizeof(by_mask));
+    ck_assert_int_eq(sent_frames[1][0], 0x7);
+    ck_assert_int_eq(sent_frames[1][3], 0xff);
+    ck_assert_int_eq(sent_frames[1][4], 0x04);
+    ck_assert_int_eq(sent_frames[1][5], 0x56);
+    ck_assert_int_eq(sent_frames[1][7], 0x04);
+
+    const uint8_t unsupported[] = {0x19, 0x42};
+    send_request(0x7e0, unsupported, sizeof(unsupported));
+    assert_negative_response(2, 0x19, NRC_SUB_FUNCTION_NOT_SUPPORTED);
+}
+END_TEST
+
+START_TEST (test_can_fd_single_frame_response)
+{
+    server.can_fd = true;
+    const uint8_t request[] = {0x22, 0xf1, 0x90};
+    send_request(0x7e0, request, sizeof(request));
+    ck_assert_int_eq(sent_frame_count, 1);
+    ck_assert_int_eq(sent_frame_sizes[0], 24);
+    ck_assert_int_eq(sent_frames[0][0], 0x0);
+    ck_assert_int_eq(sent_frames[0][1], 20);
+    ck_assert_int_eq(sent_frames[0][2], 0x62);
+    ck_assert_int_eq(sent_frames[0][21], '4');
+    ck_assert_int_eq(sent_frames[0][22], 0);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("server");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_server, NULL);
+    tcase_add_test(tc_core, test_unknown_service);
+    tcase_add_test(tc_core, test_functional_unknown_service_is_silent);
+    tcase_add_test(tc_core, test_other_arbitration_id_ignored);
+    tcase_add_test(tc_core, test_tester_present);
+    tcase_add_test(tc_core, test_session_control);
+    tcase_add_test(tc_core, test_read_data_by_identifier);
+    tcase_add_test(tc_core, test_read_unknown_did);
+    tcase_add_test(tc_core, test_read_multi_frame_did);
+    tcase_add_test(tc_core, test_write_needs_non_default_session);
+    tcase_add_test(tc_core, test_multi_frame_write);
+    tcase_add_test(tc_core, test_security_access);
+    tcase_add_test(tc_core, test_security_access_lockout);
+    tcase_add_test(tc_core, test_obd2_pids);
+    tcase_add_test(tc_core, test_obd2_pids_supported);
+    tcase_add_test(tc_core, test_obd2_dtcs);
+    tcase_add_test(tc_core, test_read_dtc_information);
+    tcase_add_test(tc_core, test_can_fd_single_frame_response);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,281 @@
+#include <uds/uds.h>
+#include <uds/session.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void setup();
+extern DiagnosticShims SHIMS;
+extern uint32_t last_can_frame_sent_arb_id;
+extern uint8_t last_can_payload_sent[CAN_FD_MESSAGE_BYTE_SIZE];
+extern bool can_frame_was_sent;
+
+static DiagnosticSessionManager manager;
+static uint32_t current_time_us;
+
+static const uint8_t EXTENDED_SESSION_RESPONSE[] = {0x06, 0x50, 0x03, 0x00,
+    0x32, 0x01, 0xf4, 0x00};
+
+static uint32_t mock_get_time(void) {
+    return current_time_us;
+}
+
+static void setup_session() {
+    setup();
+    SHIMS.get_time_us = mock_get_time;
+    current_time_us = 1000;
+    diagnostic_init_session_manager(&manager);
+}
+
+static void start_extended_session(uint32_t arbitration_id) {
+    fail_unless(diagnostic_session_start(&SHIMS, &manager, arbitration_id,
+                DIAGNOSTIC_EXTENDED_SESSION));
+    diagnostic_session_receive_can_frame(&SHIMS, &manager,
+            arbitration_id + 0x8, EXTENDED_SESSION_RESPONSE,
+            sizeof(EXTENDED_SESSION_RESPONSE));
+}
+
+static void poll_at(uint32_t time_us) {
+    current_time_us = time_us;
+    can_frame_was_sent = false;
+    diagnostic_session_poll(&SHIMS, &manager);
+}
+
+START_TEST (test_enter_session)
+{
+    fail_unless(diagnostic_session_start(&SHIMS, &manager, 0x7e0,
+                DIAGNOSTIC_EXTENDED_SESSION));
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x2);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x10);
+    ck_assert_int_eq(last_can_payload_sent[2], 0x3);
+    const DiagnosticSession* session = diagnostic_session_find(&manager,
+            0x7e0);
+    fail_if(session == NULL);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ENTERING);
+
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8,
+            EXTENDED_SESSION_RESPONSE, sizeof(EXTENDED_SESSION_RESPONSE));
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ACTIVE);
+    fail_unless(diagnostic_session_find(&manager, 0x7e1) == NULL);
+}
+END_TEST
+
+START_TEST (test_keep_alive)
+{
+    start_extended_session(0x7e0);
+    const DiagnosticSession* session = diagnostic_session_find(&manager,
+            0x7e0);
+
+    poll_at(1000 + 1999999);
+    fail_if(can_frame_was_sent);
+    poll_at(1000 + 2000000);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_frame_sent_arb_id, 0x7e0);
+    ck_assert_int_eq(last_can_payload_sent[0], 0x2);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x3e);
+    ck_assert_int_eq(last_can_payload_sent[2], 0x80);
+    ck_assert_int_eq(session->keep_alive_count, 1);
+
+    // other traffic with the ECU postpones the next one
+    current_time_us = 3000000;
+    const uint8_t response[] = {0x05, 0x62, 0xf1, 0x90, 0x01, 0x02};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, response,
+            sizeof(response));
+    poll_at(4500000);
+    fail_if(can_frame_was_sent);
+    poll_at(5000000);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(session->keep_alive_count, 2);
+
+    // so do requests to it from other code
+    current_time_us = 6000000;
+    const uint8_t request[] = {0x03, 0x22, 0xf1, 0x90};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e0, request,
+            sizeof(request));
+    poll_at(7500000);
+    fail_if(can_frame_was_sent);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ACTIVE);
+}
+END_TEST
+
+START_TEST (test_keep_alive_without_clock)
+{
+    start_extended_session(0x7e0);
+    SHIMS.get_time_us = NULL;
+    poll_at(0);
+    fail_unless(can_frame_was_sent);
+    poll_at(0);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(diagnostic_session_find(&manager,
+                0x7e0)->keep_alive_count, 2);
+}
+END_TEST
+
+START_TEST (test_reenter_after_reset)
+{
+    start_extended_session(0x7e0);
+    const DiagnosticSession* session = diagnostic_session_find(&manager,
+            0x7e0);
+    const uint8_t reset_response[] = {0x02, 0x51, 0x01};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8,
+            reset_response, sizeof(reset_response));
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_LOST);
+
+    poll_at(2000);
+    fail_unless(can_frame_was_sent);
+    ck_assert_int_eq(last_can_payload_sent[1], 0x10);
+    ck_assert_int_eq(last_can_payload_sent[2], 0x3);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ENTERING);
+    ck_assert_int_eq(session->reentry_count, 1);
+
+    // still booting, so it doesn't answer and is tried again
+    poll_at(2000 + 1000000);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_LOST);
+    poll_at(2000 + 1000001);
+    ck_assert_int_eq(session->reentry_count, 2);
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8,
+            EXTENDED_SESSION_RESPONSE, sizeof(EXTENDED_SESSION_RESPONSE));
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ACTIVE);
+
+    // a service that needs the session is refused after a silent reset
+    const uint8_t not_in_session[] = {0x03, 0x7f, 0x2e, 0x7f};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8,
+            not_in_session, sizeof(not_in_session));
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_LOST);
+
+    diagnostic_session_lost(&manager, 0x7e0);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_LOST);
+}
+END_TEST
+
+START_TEST (test_session_refused)
+{
+    diagnostic_session_start(&SHIMS, &manager, 0x7e0,
+            DIAGNOSTIC_PROGRAMMING_SESSION);
+    const uint8_t refused[] = {0x03, 0x7f, 0x10, 0x22};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, refused,
+            sizeof(refused));
+    const DiagnosticSession* session = diagnostic_session_find(&manager,
+            0x7e0);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_REFUSED);
+    ck_assert_int_eq(session->negative_response_code,
+            NRC_CONDITIONS_NOT_CORRECT);
+    poll_at(10000000);
+    fail_if(can_frame_was_sent);
+}
+END_TEST
+
+START_TEST (test_response_pending_extends_timeout)
+{
+    diagnostic_session_start(&SHIMS, &manager, 0x7e0,
+            DIAGNOSTIC_PROGRAMMING_SESSION);
+    const uint8_t pending[] = {0x03, 0x7f, 0x10, 0x78};
+    current_time_us = 501000;
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, pending,
+            sizeof(pending));
+    const DiagnosticSession* session = diagnostic_session_find(&manager,
+            0x7e0);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ENTERING);
+
+    // P2* runs from the response pending, not P2 from the request
+    DiagnosticDeadline deadline = {pending: false};
+    diagnostic_session_next_deadline(&SHIMS, &manager, &deadline);
+    fail_unless(deadline.pending);
+    ck_assert_int_eq(diagnostic_deadline_remaining_us(&deadline,
+                current_time_us), manager.extended_timeout_us);
+
+    poll_at(501000 + manager.extended_timeout_us - 1);
+    fail_if(can_frame_was_sent);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ENTERING);
+
+    const uint8_t entered[] = {0x06, 0x50, 0x02, 0x00, 0x32, 0x01, 0xf4};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, entered,
+            sizeof(entered));
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_ACTIVE);
+    ck_assert_int_eq(session->reentry_count, 0);
+}
+END_TEST
+
+START_TEST (test_response_pending_times_out)
+{
+    diagnostic_session_start(&SHIMS, &manager, 0x7e0,
+            DIAGNOSTIC_PROGRAMMING_SESSION);
+    const uint8_t pending[] = {0x03, 0x7f, 0x10, 0x78};
+    current_time_us = 501000;
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, pending,
+            sizeof(pending));
+    poll_at(501000 + manager.extended_timeout_us);
+    const DiagnosticSession* session = diagnostic_session_find(&manager,
+            0x7e0);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_LOST);
+
+    // entered again, with P2 for the new request
+    poll_at(current_time_us);
+    ck_assert_int_eq(session->reentry_count, 1);
+    poll_at(current_time_us + manager.response_timeout_us);
+    ck_assert_int_eq(session->state, DIAGNOSTIC_SESSION_LOST);
+}
+END_TEST
+
+START_TEST (test_return_to_default_session)
+{
+    start_extended_session(0x7e0);
+    fail_unless(diagnostic_session_start(&SHIMS, &manager, 0x7e0,
+                DIAGNOSTIC_DEFAULT_SESSION));
+    ck_assert_int_eq(last_can_payload_sent[2], 0x1);
+    const uint8_t response[] = {0x06, 0x50, 0x01, 0x00, 0x32, 0x01, 0xf4};
+    diagnostic_session_receive_can_frame(&SHIMS, &manager, 0x7e8, response,
+            sizeof(response));
+    ck_assert_int_eq(diagnostic_session_find(&manager, 0x7e0)->state,
+            DIAGNOSTIC_SESSION_DEFAULT);
+    poll_at(10000000);
+    fail_if(can_frame_was_sent);
+}
+END_TEST
+
+START_TEST (test_session_table_full)
+{
+    int i;
+    for(i = 0; i < MAX_SESSION_ECUS; i++) {
+        start_extended_session(0x7e0 + i);
+    }
+    fail_if(diagnostic_session_start(&SHIMS, &manager, 0x700,
+                DIAGNOSTIC_EXTENDED_SESSION));
+    // the ECUs that have one can still change it
+    fail_unless(diagnostic_session_start(&SHIMS, &manager, 0x7e3,
+                DIAGNOSTIC_PROGRAMMING_SESSION));
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("session");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_session, NULL);
+    tcase_add_test(tc_core, test_enter_session);
+    tcase_add_test(tc_core, test_keep_alive);
+    tcase_add_test(tc_core, test_keep_alive_without_clock);
+    tcase_add_test(tc_core, test_reenter_after_reset);
+    tcase_add_test(tc_core, test_session_refused);
+    tcase_add_test(tc_core, test_response_pending_extends_timeout);
+    tcase_add_test(tc_core, test_response_pending_times_out);
+    tcase_add_test(tc_core, test_return_to_default_session);
+    tcase_add_test(tc_core, test_session_table_full);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
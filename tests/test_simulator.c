@@ -0,0 +1,238 @@
+#include <uds/uds.h>
+#include <uds/simulator.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern void debug(const char* format, ...);
+
+#define ECU_COUNT 2
+#define EVENT_CAPACITY 32
+
+static DiagnosticSimulator simulator;
+static DiagnosticVirtualEcu ecus[ECU_COUNT];
+static DiagnosticSimulatorEvent events[EVENT_CAPACITY];
+static DiagnosticShims shims;
+static DiagnosticRequestHandle handle;
+static uint8_t receive_buffer[64];
+static uint8_t transmit_buffer[64];
+static DiagnosticResponse last_response;
+static bool response_received;
+static uint64_t response_time_us;
+static uint32_t expired_timers[4];
+static int expired_timer_count;
+
+static DiagnosticNegativeResponseCode read_value(DiagnosticServer* server,
+        uint16_t did, uint8_t destination[], uint16_t destination_length,
+        uint16_t* size) {
+    *size = did & 0xff;
+    memset(destination, 0x5a, *size);
+    return NRC_SUCCESS;
+}
+
+static const DiagnosticServerDid dids[] = {
+    {0x0002, read_value, NULL, 0},
+    {0x0020, read_value, NULL, 0}
+};
+
+static void tester_received(DiagnosticSimulator* simulator,
+        const uint32_t arbitration_id, const uint8_t data[],
+        const uint8_t size) {
+    DiagnosticResponse response = diagnostic_receive_can_frame(&shims,
+            &handle, arbitration_id, data, size);
+    if(response.completed) {
+        response_received = true;
+        last_response = response;
+        response_time_us = diagnostic_simulator_time_us(simulator);
+    }
+}
+
+static void timer_expired(DiagnosticSimulator* simulator, uint32_t timer_id) {
+    if(expired_timer_count < 4) {
+        expired_timers[expired_timer_count] = timer_id;
+    }
+    ++expired_timer_count;
+}
+
+static void setup_simulator() {
+    int i;
+    for(i = 0; i < ECU_COUNT; i++) {
+        diagnostic_init_virtual_ecu(&ecus[i], 0x7e0 + i, 0x7e8 + i);
+        ecus[i].server.dids = dids;
+        ecus[i].server.did_count = sizeof(dids) / sizeof(dids[0]);
+    }
+    ecus[0].server.transmit_buffer = transmit_buffer;
+    ecus[0].server.transmit_buffer_size = sizeof(transmit_buffer);
+
+    diagnostic_init_simulator(&simulator, ecus, ECU_COUNT, events,
+            EVENT_CAPACITY, 1);
+    simulator.tester = tester_received;
+    simulator.timer_expired = timer_expired;
+    shims = diagnostic_simulator_shims(&simulator, debug);
+    response_received = false;
+    expired_timer_count = 0;
+}
+
+static void request_did(uint32_t arbitration_id, uint16_t did) {
+    DiagnosticRequest request = {
+        arbitration_id: arbitration_id,
+        mode: OBD2_MODE_ENHANCED_DIAGNOSTIC_REQUEST,
+        has_pid: true,
+        pid: did,
+        pid_length: 2
+    };
+    handle = generate_diagnostic_request(&shims, &request, NULL);
+    handle.receive_buffer = receive_buffer;
+    handle.receive_buffer_size = sizeof(receive_buffer);
+    // the library's own transport, which reassembles into receive_buffer
+    handle.flow_control.block_size = 8;
+    start_diagnostic_request(&shims, &handle);
+}
+
+static void run() {
+    while(diagnostic_simulator_step(&shims, &simulator));
+}
+
+START_TEST (test_request_response)
+{
+    request_did(0x7e1, 0x0002);
+    run();
+    fail_unless(response_received);
+    fail_unless(last_response.success);
+    ck_assert_int_eq(last_response.pid, 0x0002);
+    ck_assert_int_eq(last_response.payload_length, 2);
+    ck_assert_int_eq(simulator.delivered_frame_count, 2);
+    ck_assert_int_eq(ecus[1].request_count, 1);
+    ck_assert_int_eq(ecus[0].request_count, 0);
+    ck_assert_int_eq(response_time_us, 0);
+}
+END_TEST
+
+START_TEST (test_multi_frame_response)
+{
+    request_did(0x7e0, 0x0020);
+    run();
+    fail_unless(response_received);
+    fail_unless(last_response.success);
+    ck_assert_int_eq(last_response.full_payload_length, 0x20);
+    // request, first frame, flow control and 5 consecutive frames
+    ck_assert_int_eq(simulator.delivered_frame_count, 8);
+}
+END_TEST
+
+START_TEST (test_bus_time_and_response_delay)
+{
+    simulator.bitrate = 500000;
+    ecus[1].response_delay_us = 1000;
+    request_did(0x7e1, 0x0002);
+    run();
+    fail_unless(response_received);
+    // two 111 bit frames at 500 kbit/s and the ECU's delay
+    ck_assert_int_eq(response_time_us, 222 + 1000 + 222);
+    ck_assert_int_eq(simulator.bus_busy_us, 444);
+}
+END_TEST
+
+START_TEST (test_injected_negative_response)
+{
+    ecus[1].negative_response_rate = 1;
+    request_did(0x7e1, 0x0002);
+    run();
+    fail_unless(response_received);
+    fail_if(last_response.success);
+    ck_assert_int_eq(last_response.negative_response_code,
+            NRC_BUSY_REPEAT_REQUEST);
+    ck_assert_int_eq(ecus[1].negative_response_count, 1);
+}
+END_TEST
+
+START_TEST (test_dropped_frames)
+{
+    ecus[1].drop_rate = 1;
+    request_did(0x7e1, 0x0002);
+    run();
+    fail_if(response_received);
+    ck_assert_int_eq(simulator.dropped_frame_count, 1);
+    ck_assert_int_eq(ecus[1].request_count, 0);
+}
+END_TEST
+
+START_TEST (test_lost_flow_control_frees_ecu)
+{
+    request_did(0x7e0, 0x0020);
+    // the request and the first frame of the response go through, then the
+    // tester's flow control is lost
+    diagnostic_simulator_step(&shims, &simulator);
+    diagnostic_simulator_step(&shims, &simulator);
+    ecus[0].drop_rate = 1;
+    run();
+    ck_assert_int_eq(simulator.dropped_frame_count, 1);
+    fail_if(response_received);
+    fail_if(ecus[0].server.sender.active);
+    ck_assert_int_eq(diagnostic_simulator_time_us(&simulator),
+            DIAGNOSTIC_TRANSPORT_FLOW_CONTROL_TIMEOUT_US);
+
+    ecus[0].drop_rate = 0;
+    request_did(0x7e0, 0x0002);
+    run();
+    fail_unless(response_received);
+    fail_unless(last_response.success);
+}
+END_TEST
+
+START_TEST (test_timers)
+{
+    diagnostic_simulator_start_timer(&simulator, 2, 2000);
+    diagnostic_simulator_start_timer(&simulator, 1, 1000);
+    diagnostic_simulator_start_timer(&simulator, 3, 2000);
+    run();
+    ck_assert_int_eq(expired_timer_count, 3);
+    ck_assert_int_eq(expired_timers[0], 1);
+    ck_assert_int_eq(expired_timers[1], 2);
+    ck_assert_int_eq(expired_timers[2], 3);
+    ck_assert_int_eq(diagnostic_simulator_time_us(&simulator), 2000);
+}
+END_TEST
+
+START_TEST (test_event_overflow)
+{
+    int i;
+    for(i = 0; i < EVENT_CAPACITY + 2; i++) {
+        diagnostic_simulator_start_timer(&simulator, i, i);
+    }
+    ck_assert_int_eq(simulator.overflowed_event_count, 2);
+    run();
+    ck_assert_int_eq(expired_timer_count, EVENT_CAPACITY);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("simulator");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_simulator, NULL);
+    tcase_add_test(tc_core, test_request_response);
+    tcase_add_test(tc_core, test_multi_frame_response);
+    tcase_add_test(tc_core, test_bus_time_and_response_delay);
+    tcase_add_test(tc_core, test_injected_negative_response);
+    tcase_add_test(tc_core, test_dropped_frames);
+    tcase_add_test(tc_core, test_lost_flow_control_frees_ecu);
+    tcase_add_test(tc_core, test_timers);
+    tcase_add_test(tc_core, test_event_overflow);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
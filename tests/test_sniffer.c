@@ -0,0 +1,256 @@
+#include <uds/uds.h>
+#include <uds/sniffer.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MAX_RECORDED_TRANSACTIONS 4
+
+static DiagnosticSniffer sniffer;
+static DiagnosticSnifferTransaction transactions[MAX_RECORDED_TRANSACTIONS];
+static uint8_t payloads[MAX_RECORDED_TRANSACTIONS][64];
+static int transaction_count;
+
+static void transaction_completed(DiagnosticSniffer* sniffer,
+        const DiagnosticSnifferTransaction* transaction) {
+    if(transaction_count < MAX_RECORDED_TRANSACTIONS) {
+        transactions[transaction_count] = *transaction;
+        // the full payload is only valid inside the callback
+        if(transaction->response.full_payload != NULL) {
+            memcpy(payloads[transaction_count],
+                    transaction->response.full_payload,
+                    transaction->response.full_payload_length);
+        }
+    }
+    ++transaction_count;
+}
+
+static void setup_sniffer() {
+    transaction_count = 0;
+    diagnostic_init_sniffer(&sniffer);
+    sniffer.transaction_completed = transaction_completed;
+}
+
+static bool receive(uint32_t arbitration_id, const uint8_t data[],
+        uint8_t size, uint64_t timestamp_us) {
+    return diagnostic_sniffer_receive_can_frame(&sniffer, arbitration_id,
+            data, size, timestamp_us);
+}
+
+START_TEST (test_pairs_single_frames)
+{
+    const uint8_t request[] = {0x2, 0x1, 0xc, 0, 0, 0, 0, 0};
+    const uint8_t response[] = {0x4, 0x41, 0xc, 0x1a, 0xf8, 0, 0, 0};
+    fail_unless(receive(0x7e0, request, sizeof(request), 1000));
+    ck_assert_int_eq(transaction_count, 0);
+    fail_unless(receive(0x7e8, response, sizeof(response), 13000));
+
+    ck_assert_int_eq(transaction_count, 1);
+    fail_unless(transactions[0].has_request);
+    ck_assert_int_eq(transactions[0].request.arbitration_id, 0x7e0);
+    ck_assert_int_eq(transactions[0].request.mode, 0x1);
+    ck_assert_int_eq(transactions[0].request.pid, 0xc);
+    fail_unless(transactions[0].response.success);
+    fail_if(transactions[0].response.multi_frame);
+    ck_assert_int_eq(transactions[0].response.arbitration_id, 0x7e8);
+    ck_assert_int_eq(transactions[0].response.pid, 0xc);
+    ck_assert_int_eq(transactions[0].response.payload_length, 2);
+    ck_assert_int_eq(transactions[0].response.payload[0], 0x1a);
+    ck_assert_int_eq(transactions[0].request_time_us, 1000);
+    ck_assert_int_eq(transactions[0].response_time_us, 13000);
+    ck_assert_int_eq(sniffer.request_count, 1);
+    ck_assert_int_eq(sniffer.transaction_count, 1);
+}
+END_TEST
+
+START_TEST (test_ignores_other_traffic)
+{
+    const uint8_t data[] = {0x2, 0x1, 0xc};
+    fail_if(receive(0x123, data, sizeof(data), 0));
+    fail_if(receive(0x7f0, data, sizeof(data), 0));
+    // another tester's 29-bit traffic
+    fail_if(receive(0x18da10f2, data, sizeof(data), 0));
+    fail_if(receive(0x18daf210, data, sizeof(data), 0));
+    ck_assert_int_eq(sniffer.frame_count, 0);
+
+    sniffer.tester_address = 0xf2;
+    fail_unless(receive(0x18da10f2, data, sizeof(data), 0));
+}
+END_TEST
+
+START_TEST (test_multi_frame_request_and_response)
+{
+    // WriteDataByIdentifier 0xf190 with 9 bytes, answered with its DID, then
+    // a ReadDataByIdentifier answered with 10 bytes
+    const uint8_t write_first[] = {0x10, 0xc, 0x2e, 0xf1, 0x90, 1, 2, 3};
+    const uint8_t flow_control[] = {0x30, 0, 0, 0, 0, 0, 0, 0};
+    const uint8_t write_consecutive[] = {0x21, 4, 5, 6, 7, 8, 9, 0};
+    const uint8_t write_response[] = {0x3, 0x6e, 0xf1, 0x90, 0, 0, 0, 0};
+    const uint8_t read[] = {0x3, 0x22, 0xf1, 0x90, 0, 0, 0, 0};
+    const uint8_t read_first[] = {0x10, 0xd, 0x62, 0xf1, 0x90, 'a', 'b',
+        'c'};
+    const uint8_t read_consecutive[] = {0x21, 'd', 'e', 'f', 'g', 'h', 'i',
+        'j'};
+
+    receive(0x18da10f1, write_first, sizeof(write_first), 0);
+    receive(0x18daf110, flow_control, sizeof(flow_control), 100);
+    receive(0x18da10f1, write_consecutive, sizeof(write_consecutive), 200);
+    ck_assert_int_eq(sniffer.request_count, 1);
+    receive(0x18daf110, write_response, sizeof(write_response), 300);
+    receive(0x18da10f1, read, sizeof(read), 400);
+    receive(0x18daf110, read_first, sizeof(read_first), 500);
+    receive(0x18da10f1, flow_control, sizeof(flow_control), 600);
+    receive(0x18daf110, read_consecutive, sizeof(read_consecutive), 700);
+
+    ck_assert_int_eq(transaction_count, 2);
+    ck_assert_int_eq(transactions[0].request.mode, 0x2e);
+    ck_assert_int_eq(transactions[0].request.pid, 0xf190);
+    ck_assert_int_eq(transactions[0].request.large_payload_length, 9);
+    ck_assert_int_eq(transactions[0].request_time_us, 200);
+    fail_unless(transactions[0].response.success);
+
+    ck_assert_int_eq(transactions[1].request.mode, 0x22);
+    ck_assert_int_eq(transactions[1].request.addressing,
+            DIAGNOSTIC_ADDRESSING_NORMAL_FIXED);
+    fail_unless(transactions[1].response.success);
+    fail_unless(transactions[1].response.multi_frame);
+    ck_assert_int_eq(transactions[1].response.full_payload_length, 10);
+    fail_unless(!memcmp(payloads[1], "abcdefghij", 10));
+    ck_assert_int_eq(sniffer.error_count, 0);
+}
+END_TEST
+
+START_TEST (test_functional_request_answered_by_several_ecus)
+{
+    const uint8_t request[] = {0x2, 0x1, 0x0, 0, 0, 0, 0, 0};
+    const uint8_t response[] = {0x6, 0x41, 0x0, 0xbe, 0x1f, 0xa8, 0x13, 0};
+    receive(0x7df, request, sizeof(request), 0);
+    receive(0x7e8, response, sizeof(response), 1000);
+    receive(0x7e9, response, sizeof(response), 2000);
+    // answered once per ECU, so a repeat has no request
+    receive(0x7e9, response, sizeof(response), 3000);
+
+    ck_assert_int_eq(transaction_count, 3);
+    fail_unless(transactions[0].has_request);
+    ck_assert_int_eq(transactions[0].request.arbitration_id, 0x7df);
+    ck_assert_int_eq(transactions[0].response.arbitration_id, 0x7e8);
+    fail_unless(transactions[1].has_request);
+    ck_assert_int_eq(transactions[1].response.arbitration_id, 0x7e9);
+    ck_assert_int_eq(transactions[1].request_time_us, 0);
+    fail_if(transactions[2].has_request);
+    ck_assert_int_eq(sniffer.unsolicited_response_count, 1);
+}
+END_TEST
+
+START_TEST (test_response_pending)
+{
+    const uint8_t request[] = {0x2, 0x31, 0x1, 0, 0, 0, 0, 0};
+    const uint8_t pending[] = {0x3, 0x7f, 0x31, 0x78, 0, 0, 0, 0};
+    const uint8_t response[] = {0x2, 0x71, 0x1, 0, 0, 0, 0, 0};
+    receive(0x7e1, request, sizeof(request), 0);
+    receive(0x7e9, pending, sizeof(pending), 50000);
+    receive(0x7e9, pending, sizeof(pending), 100000);
+    ck_assert_int_eq(transaction_count, 0);
+    receive(0x7e9, response, sizeof(response), 150000);
+
+    ck_assert_int_eq(transaction_count, 1);
+    fail_unless(transactions[0].has_request);
+    fail_unless(transactions[0].response.success);
+    ck_assert_int_eq(transactions[0].response_time_us, 150000);
+}
+END_TEST
+
+START_TEST (test_negative_response)
+{
+    const uint8_t request[] = {0x3, 0x22, 0xf1, 0x90, 0, 0, 0, 0};
+    const uint8_t response[] = {0x3, 0x7f, 0x22, 0x31, 0, 0, 0, 0};
+    receive(0x7e0, request, sizeof(request), 0);
+    receive(0x7e8, response, sizeof(response), 1000);
+
+    ck_assert_int_eq(transaction_count, 1);
+    fail_unless(transactions[0].has_request);
+    fail_if(transactions[0].response.success);
+    ck_assert_int_eq(transactions[0].response.mode, 0x22);
+    ck_assert_int_eq(transactions[0].response.negative_response_code,
+            NRC_REQUEST_OUT_OF_RANGE);
+}
+END_TEST
+
+START_TEST (test_unsolicited_response)
+{
+    const uint8_t response[] = {0x5, 0x62, 0xf1, 0x90, 0x12, 0x34, 0, 0};
+    receive(0x7e8, response, sizeof(response), 0);
+
+    ck_assert_int_eq(transaction_count, 1);
+    fail_if(transactions[0].has_request);
+    ck_assert_int_eq(transactions[0].request.mode, 0x22);
+    fail_unless(transactions[0].response.success);
+    ck_assert_int_eq(transactions[0].response.pid, 0xf190);
+    ck_assert_int_eq(transactions[0].response.payload_length, 2);
+    ck_assert_int_eq(sniffer.unsolicited_response_count, 1);
+    ck_assert_int_eq(sniffer.transaction_count, 0);
+}
+END_TEST
+
+START_TEST (test_sequence_error)
+{
+    const uint8_t first[] = {0x10, 0x14, 0x62, 0xf1, 0x90, 1, 2, 3};
+    const uint8_t wrong[] = {0x22, 4, 5, 6, 7, 8, 9, 10};
+    receive(0x7e8, first, sizeof(first), 0);
+    receive(0x7e8, wrong, sizeof(wrong), 100);
+    ck_assert_int_eq(sniffer.error_count, 1);
+    ck_assert_int_eq(transaction_count, 0);
+}
+END_TEST
+
+START_TEST (test_least_recently_active_session_is_forgotten)
+{
+    uint8_t request[] = {0x2, 0x3e, 0x0, 0, 0, 0, 0, 0};
+    uint8_t response[] = {0x2, 0x7e, 0x0, 0, 0, 0, 0, 0};
+    int i;
+    for(i = 0; i <= MAX_SNIFFER_SESSIONS; i++) {
+        receive(DIAGNOSTIC_NORMAL_FIXED_ID(i, 0xf1), request, sizeof(request),
+                i);
+    }
+    // the first ECU was forgotten to follow the last one
+    for(i = MAX_SNIFFER_SESSIONS; i >= 0; i--) {
+        receive(0x18daf100 | i, response, sizeof(response), 100 + i);
+    }
+
+    ck_assert_int_eq(sniffer.request_count, MAX_SNIFFER_SESSIONS + 1);
+    ck_assert_int_eq(sniffer.transaction_count, MAX_SNIFFER_SESSIONS);
+    ck_assert_int_eq(sniffer.unsolicited_response_count, 1);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("sniffer");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_sniffer, NULL);
+    tcase_add_test(tc_core, test_pairs_single_frames);
+    tcase_add_test(tc_core, test_ignores_other_traffic);
+    tcase_add_test(tc_core, test_multi_frame_request_and_response);
+    tcase_add_test(tc_core, test_functional_request_answered_by_several_ecus);
+    tcase_add_test(tc_core, test_response_pending);
+    tcase_add_test(tc_core, test_negative_response);
+    tcase_add_test(tc_core, test_unsolicited_response);
+    tcase_add_test(tc_core, test_sequence_error);
+    tcase_add_test(tc_core, test_least_recently_active_session_is_forgotten);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
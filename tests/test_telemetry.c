@@ -0,0 +1,283 @@
+#include <uds/uds.h>
+#include <uds/telemetry.h>
+#include <check.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+static DiagnosticTelemetryEncoder encoder;
+static DiagnosticTelemetryDecoder decoder;
+static uint8_t batch[512];
+
+static void setup_telemetry() {
+    memset(batch, 0, sizeof(batch));
+    diagnostic_telemetry_start_batch(&encoder, batch, sizeof(batch));
+}
+
+static DiagnosticResponse pid_response(uint32_t arbitration_id, uint16_t pid,
+        uint8_t value) {
+    DiagnosticResponse response = {
+        completed: true,
+        success: true,
+        arbitration_id: arbitration_id,
+        mode: 0x1,
+        has_pid: true,
+        pid: pid,
+        payload: {value},
+        payload_length: 1
+    };
+    return response;
+}
+
+START_TEST (test_round_trip)
+{
+    DiagnosticResponse original = pid_response(0x7e8, 0xc, 0x42);
+    fail_unless(diagnostic_telemetry_encode(&encoder, &original,
+                1436509052249713ULL));
+    uint32_t length = diagnostic_telemetry_finish_batch(&encoder);
+    ck_assert_int_eq(length, encoder.length);
+    ck_assert_int_eq(batch[0], 'U');
+    ck_assert_int_eq(batch[1], 'D');
+    ck_assert_int_eq(batch[2], DIAGNOSTIC_TELEMETRY_VERSION);
+
+    ck_assert_int_eq(diagnostic_telemetry_start_decoding(&decoder, batch,
+                sizeof(batch)), length);
+    ck_assert_int_eq(decoder.record_count, 1);
+    DiagnosticResponse response;
+    uint64_t timestamp_us;
+    fail_unless(diagnostic_telemetry_decode(&decoder, &response,
+                &timestamp_us));
+    ck_assert_int_eq(timestamp_us, 1436509052249713ULL);
+    fail_unless(response.completed);
+    fail_unless(response.success);
+    fail_if(response.multi_frame);
+    ck_assert_int_eq(response.arbitration_id, 0x7e8);
+    ck_assert_int_eq(response.mode, 0x1);
+    fail_unless(response.has_pid);
+    ck_assert_int_eq(response.pid, 0xc);
+    ck_assert_int_eq(response.payload_length, 1);
+    ck_assert_int_eq(response.payload[0], 0x42);
+
+    fail_if(diagnostic_telemetry_decode(&decoder, &response, &timestamp_us));
+    fail_if(decoder.malformed);
+}
+END_TEST
+
+START_TEST (test_deltas_and_wide_pids)
+{
+    DiagnosticResponse first = pid_response(0x18daf110, 0xf190, 1);
+    DiagnosticResponse second = pid_response(0x7e9, 0xd, 2);
+    DiagnosticResponse third = pid_response(0x7e8, 0xd, 3);
+    uint32_t start = encoder.length;
+    diagnostic_telemetry_encode(&encoder, &first, 5000000);
+    diagnostic_telemetry_encode(&encoder, &second, 5100000);
+    uint32_t before_third = encoder.length;
+    // timestamps may go backwards, e.g. from two buses
+    diagnostic_telemetry_encode(&encoder, &third, 5099000);
+    ck_assert_int_eq(encoder.record_count, 3);
+    // 2 byte timestamp delta, 1 byte ID delta, flags, mode, PID, length and
+    // the payload
+    ck_assert_int_eq(encoder.length - before_third, 8);
+    fail_unless(encoder.length - start < 40);
+    diagnostic_telemetry_finish_batch(&encoder);
+
+    diagnostic_telemetry_start_decoding(&decoder, batch, sizeof(batch));
+    DiagnosticResponse response;
+    uint64_t timestamp_us;
+    diagnostic_telemetry_decode(&decoder, &response, &timestamp_us);
+    ck_assert_int_eq(response.arbitration_id, 0x18daf110);
+    ck_assert_int_eq(response.pid, 0xf190);
+    diagnostic_telemetry_decode(&decoder, &response, &timestamp_us);
+    ck_assert_int_eq(response.arbitration_id, 0x7e9);
+    ck_assert_int_eq(timestamp_us, 5100000);
+    fail_unless(diagnostic_telemetry_decode(&decoder, &response,
+                &timestamp_us));
+    ck_assert_int_eq(response.arbitration_id, 0x7e8);
+    ck_assert_int_eq(response.pid, 0xd);
+    ck_assert_int_eq(response.payload[0], 3);
+    ck_assert_int_eq(timestamp_us, 5099000);
+}
+END_TEST
+
+START_TEST (test_negative_response)
+{
+    DiagnosticResponse original = {
+        completed: true,
+        success: false,
+        arbitration_id: 0x7e8,
+        mode: 0x22,
+        negative_response_code: NRC_REQUEST_OUT_OF_RANGE
+    };
+    diagnostic_telemetry_encode(&encoder, &original, 0);
+    diagnostic_telemetry_finish_batch(&encoder);
+
+    diagnostic_telemetry_start_decoding(&decoder, batch, sizeof(batch));
+    DiagnosticResponse response;
+    uint64_t timestamp_us;
+    fail_unless(diagnostic_telemetry_decode(&decoder, &response,
+                &timestamp_us));
+    fail_if(response.success);
+    fail_if(response.has_pid);
+    ck_assert_int_eq(response.mode, 0x22);
+    ck_assert_int_eq(response.negative_response_code,
+            NRC_REQUEST_OUT_OF_RANGE);
+    ck_assert_int_eq(response.payload_length, 0);
+    fail_unless(response.full_payload == NULL);
+}
+END_TEST
+
+START_TEST (test_full_payload)
+{
+    uint8_t vin[100];
+    int i;
+    for(i = 0; i < (int) sizeof(vin); i++) {
+        vin[i] = i;
+    }
+    DiagnosticResponse original = pid_response(0x7e8, 0xf190, 0);
+    original.multi_frame = true;
+    original.full_payload = vin;
+    original.full_payload_length = sizeof(vin);
+    diagnostic_telemetry_encode(&encoder, &original, 0);
+    diagnostic_telemetry_finish_batch(&encoder);
+
+    diagnostic_telemetry_start_decoding(&decoder, batch, sizeof(batch));
+    DiagnosticResponse response;
+    uint64_t timestamp_us;
+    fail_unless(diagnostic_telemetry_decode(&decoder, &response,
+                &timestamp_us));
+    fail_unless(response.multi_frame);
+    ck_assert_int_eq(response.full_payload_length, sizeof(vin));
+    fail_unless(!memcmp(response.full_payload, vin, sizeof(vin)));
+    ck_assert_int_eq(response.payload_length,
+            MAX_UDS_RESPONSE_PAYLOAD_LENGTH);
+    ck_assert_int_eq(response.payload[1], 1);
+}
+END_TEST
+
+START_TEST (test_full_buffer)
+{
+    uint8_t small[DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE +
+        DIAGNOSTIC_TELEMETRY_MAX_RECORD_OVERHEAD + 1];
+    diagnostic_telemetry_start_batch(&encoder, small, sizeof(small));
+    DiagnosticResponse response = pid_response(0x7e8, 0xc, 0x42);
+    fail_unless(diagnostic_telemetry_encode(&encoder, &response, 0));
+    uint32_t length = encoder.length;
+    fail_if(diagnostic_telemetry_encode(&encoder, &response, 0));
+    ck_assert_int_eq(encoder.length, length);
+    ck_assert_int_eq(encoder.record_count, 1);
+}
+END_TEST
+
+START_TEST (test_buffer_smaller_than_header)
+{
+    uint8_t tiny[DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE + 1];
+    memset(tiny, 0xaa, sizeof(tiny));
+    fail_if(diagnostic_telemetry_start_batch(&encoder, tiny,
+                DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE - 1));
+    DiagnosticResponse response = pid_response(0x7e8, 0xc, 0x42);
+    fail_if(diagnostic_telemetry_encode(&encoder, &response, 0));
+    ck_assert_int_eq(diagnostic_telemetry_finish_batch(&encoder), 0);
+    // not a byte written
+    ck_assert_int_eq(tiny[0], 0xaa);
+    ck_assert_int_eq(tiny[DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE - 1], 0xaa);
+
+    fail_unless(diagnostic_telemetry_start_batch(&encoder, tiny,
+                DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE));
+    ck_assert_int_eq(diagnostic_telemetry_finish_batch(&encoder),
+            DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE);
+}
+END_TEST
+
+START_TEST (test_stream_of_batches)
+{
+    DiagnosticResponse response = pid_response(0x7e8, 0xc, 0x42);
+    diagnostic_telemetry_encode(&encoder, &response, 100);
+    uint32_t first_length = diagnostic_telemetry_finish_batch(&encoder);
+    diagnostic_telemetry_start_batch(&encoder, &batch[first_length],
+            sizeof(batch) - first_length);
+    diagnostic_telemetry_encode(&encoder, &response, 200);
+    diagnostic_telemetry_encode(&encoder, &response, 300);
+    uint32_t stream_length = first_length +
+            diagnostic_telemetry_finish_batch(&encoder);
+
+    uint32_t offset = 0;
+    int batch_count = 0, record_count = 0;
+    uint32_t length;
+    while((length = diagnostic_telemetry_start_decoding(&decoder,
+                    &batch[offset], stream_length - offset)) > 0) {
+        uint64_t timestamp_us;
+        while(diagnostic_telemetry_decode(&decoder, &response,
+                    &timestamp_us)) {
+            ++record_count;
+        }
+        ++batch_count;
+        offset += length;
+    }
+    ck_assert_int_eq(batch_count, 2);
+    ck_assert_int_eq(record_count, 3);
+    ck_assert_int_eq(offset, stream_length);
+}
+END_TEST
+
+START_TEST (test_malformed_batches)
+{
+    DiagnosticResponse response = pid_response(0x7e8, 0xc, 0x42);
+    diagnostic_telemetry_encode(&encoder, &response, 100);
+    uint32_t length = diagnostic_telemetry_finish_batch(&encoder);
+
+    ck_assert_int_eq(diagnostic_telemetry_start_decoding(&decoder, batch,
+                length - 1), 0);
+    ck_assert_int_eq(diagnostic_telemetry_start_decoding(&decoder, batch,
+                DIAGNOSTIC_TELEMETRY_BATCH_HEADER_SIZE - 1), 0);
+    batch[2] = DIAGNOSTIC_TELEMETRY_VERSION + 1;
+    ck_assert_int_eq(diagnostic_telemetry_start_decoding(&decoder, batch,
+                length), 0);
+    batch[2] = DIAGNOSTIC_TELEMETRY_VERSION;
+
+    // a record count larger than the body
+    batch[5] = 2;
+    diagnostic_telemetry_start_decoding(&decoder, batch, length);
+    uint64_t timestamp_us;
+    fail_unless(diagnostic_telemetry_decode(&decoder, &response,
+                &timestamp_us));
+    fail_if(diagnostic_telemetry_decode(&decoder, &response, &timestamp_us));
+    fail_unless(decoder.malformed);
+
+    // a payload running past the body
+    batch[5] = 1;
+    batch[length - 2] = 0x7f;
+    diagnostic_telemetry_start_decoding(&decoder, batch, length);
+    fail_if(diagnostic_telemetry_decode(&decoder, &response, &timestamp_us));
+    fail_unless(decoder.malformed);
+}
+END_TEST
+
+Suite* testSuite(void) {
+    Suite* s = suite_create("telemetry");
+    TCase *tc_core = tcase_create("core");
+    tcase_add_checked_fixture(tc_core, setup_telemetry, NULL);
+    tcase_add_test(tc_core, test_round_trip);
+    tcase_add_test(tc_core, test_deltas_and_wide_pids);
+    tcase_add_test(tc_core, test_negative_response);
+    tcase_add_test(tc_core, test_full_payload);
+    tcase_add_test(tc_core, test_full_buffer);
+    tcase_add_test(tc_core, test_buffer_smaller_than_header);
+    tcase_add_test(tc_core, test_stream_of_batches);
+    tcase_add_test(tc_core, test_malformed_batches);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void) {
+    int numberFailed;
+    Suite* s = testSuite();
+    SRunner *sr = srunner_create(s);
+    // Don't fork so we can actually use gdb
+    srunner_set_fork_status(sr, CK_NOFORK);
+    srunner_run_all(sr, CK_NORMAL);
+    numberFailed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (numberFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+/* uds-daemon - own a SocketCAN interface and send it the requests of the
+ * processes attached to a shared memory segment (see uds/ipc.h).
+ *
+ *     uds-daemon [-s] interface [segment]
+ *
+ * interface - the CAN interface, e.g. can0, or vcan0 for testing on localhost.
+ * segment - the name of the shared memory segment, "/uds" by default.
+ * -s - spin instead of sleeping between polls of the rings, for the lowest
+ *      round trip at the cost of a CPU.
+ */
+#define _GNU_SOURCE
+#include <uds/uds.h>
+#include <uds/daemon.h>
+#include <uds/ipc.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+#define DEFAULT_SEGMENT_NAME "/uds"
+// how long to sleep between polls of the rings when nothing is happening
+#define IDLE_POLL_INTERVAL_US 100
+
+static int can_socket = -1;
+static volatile sig_atomic_t stopping;
+static DiagnosticDaemon daemon_state;
+
+static void log_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+static bool send_can(const uint32_t arbitration_id, const uint8_t* data,
+        const uint8_t size) {
+    struct canfd_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.can_id = arbitration_id > CAN_SFF_MASK ?
+            (arbitration_id | CAN_EFF_FLAG) : arbitration_id;
+    frame.len = size;
+    memcpy(frame.data, data, size);
+    size_t frame_size = size > CAN_MAX_DLEN ? CANFD_MTU : CAN_MTU;
+    return write(can_socket, &frame, frame_size) == (ssize_t) frame_size;
+}
+
+static uint32_t get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int open_can_socket(const char* interface) {
+    int fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK, CAN_RAW);
+    if(fd < 0) {
+        return -1;
+    }
+    int enable = 1;
+    setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable));
+
+    struct sockaddr_can address;
+    memset(&address, 0, sizeof(address));
+    address.can_family = AF_CAN;
+    address.can_ifindex = if_nametoindex(interface);
+    if(address.can_ifindex == 0 ||
+            bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void receive_frames(DiagnosticShims* shims) {
+    struct canfd_frame frame;
+    ssize_t size;
+    while((size = read(can_socket, &frame, sizeof(frame))) > 0) {
+        if(frame.can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) {
+            continue;
+        }
+        diagnostic_daemon_receive_can_frame(shims, &daemon_state,
+                frame.can_id & CAN_EFF_MASK, frame.data, frame.len);
+    }
+}
+
+static void stop(int signal_number) {
+    stopping = 1;
+}
+
+int main(int argc, char** argv) {
+    bool spin = argc > 1 && strcmp(argv[1], "-s") == 0;
+    int first_argument = spin ? 2 : 1;
+    if(argc <= first_argument || argc > first_argument + 2) {
+        fprintf(stderr, "usage: %s [-s] interface [segment]\n", argv[0]);
+        return 2;
+    }
+    const char* interface = argv[first_argument];
+    const char* segment_name = argc > first_argument + 1 ?
+            argv[first_argument + 1] : DEFAULT_SEGMENT_NAME;
+
+    can_socket = open_can_socket(interface);
+    if(can_socket < 0) {
+        fprintf(stderr, "Unable to open CAN interface %s: %s\n", interface,
+                strerror(errno));
+        return 1;
+    }
+    DiagnosticIpcSegment* segment = diagnostic_ipc_open_segment(segment_name,
+            true);
+    if(segment == NULL) {
+        fprintf(stderr, "Unable to create shared memory segment %s: %s\n",
+                segment_name, strerror(errno));
+        close(can_socket);
+        return 1;
+    }
+
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+    DiagnosticShims shims = diagnostic_init_shims(log_message, send_can, NULL);
+    shims.get_time_us = get_time;
+    diagnostic_init_daemon(&daemon_state, segment);
+
+    struct pollfd can_poll = {fd: can_socket, events: POLLIN};
+    struct timespec idle = {tv_sec: 0, tv_nsec: IDLE_POLL_INTERVAL_US * 1000};
+    while(!stopping) {
+        receive_frames(&shims);
+        diagnostic_daemon_poll(&shims, &daemon_state);
+        if(!spin) {
+            // wake up for frames at once, and for client requests soon
+            ppoll(&can_poll, 1, &idle, NULL);
+        }
+    }
+
+    diagnostic_ipc_close_segment(segment);
+    shm_unlink(segment_name);
+    close(can_socket);
+    return 0;
+}